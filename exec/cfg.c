@@ -278,6 +278,7 @@ struct corosync_service_engine cfg_service_engine = {
 	.private_data_size			= sizeof(struct cfg_info),
 	.flow_control				= CS_LIB_FLOW_CONTROL_NOT_REQUIRED,
 	.allow_inquorate			= CS_LIB_ALLOW_INQUORATE,
+	.mcast_prio				= CS_MCAST_PRIO_CONTROL,
 	.lib_init_fn				= cfg_lib_init_fn,
 	.lib_exit_fn				= cfg_lib_exit_fn,
 	.lib_engine				= cfg_lib_engine,
@@ -644,6 +645,8 @@ static void remove_ro_entries(icmap_map_t temp_map)
 	delete_and_notify_if_changed(temp_map, "quorum.provider");
 	delete_and_notify_if_changed(temp_map, "system.move_to_root_cgroup");
 	delete_and_notify_if_changed(temp_map, "system.allow_knet_handle_fallback");
+	delete_and_notify_if_changed(temp_map, "system.delivery_thread");
+	delete_and_notify_if_changed(temp_map, "system.stats_shm");
 	delete_and_notify_if_changed(temp_map, "system.sched_rr");
 	delete_and_notify_if_changed(temp_map, "system.priority");
 	delete_and_notify_if_changed(temp_map, "system.qb_ipc_type");
@@ -132,6 +132,21 @@ struct cmap_conn_info {
 typedef uint64_t cmap_iter_handle_t;
 typedef uint64_t cmap_track_handle_t;
 
+/*
+ * pending_key is a key already returned by map_iter_next which didn't
+ * fit into the last batch response, it is sent first in the next one
+ */
+struct cmap_iter {
+	icmap_iter_t iter;
+	char pending_key[ICMAP_KEYNAME_MAXLEN + 1];
+};
+
+/*
+ * Upper bound of the batch response buffer, values which don't fit on
+ * their own are left out and have to be fetched by cmap_get
+ */
+#define CMAP_BATCH_RES_SIZE_MAX		(64 * 1024)
+
 struct cmap_track_user_data {
 	void *conn;
 	cmap_track_handle_t track_handle;
@@ -162,6 +177,7 @@ static void message_handler_req_lib_cmap_adjust_int(void *conn, const void *mess
 static void message_handler_req_lib_cmap_iter_init(void *conn, const void *message);
 static void message_handler_req_lib_cmap_iter_next(void *conn, const void *message);
 static void message_handler_req_lib_cmap_iter_finalize(void *conn, const void *message);
+static void message_handler_req_lib_cmap_iter_next_batch(void *conn, const void *message);
 static void message_handler_req_lib_cmap_track_add(void *conn, const void *message);
 static void message_handler_req_lib_cmap_track_delete(void *conn, const void *message);
 static void message_handler_req_lib_cmap_set_current_map(void *conn, const void *message);
@@ -250,6 +266,10 @@ static struct corosync_lib_handler cmap_lib_engine[] =
 		.lib_handler_fn				= message_handler_req_lib_cmap_set_current_map,
 		.flow_control				= CS_LIB_FLOW_CONTROL_NOT_REQUIRED
 	},
+	{ /* 10 */
+		.lib_handler_fn				= message_handler_req_lib_cmap_iter_next_batch,
+		.flow_control				= CS_LIB_FLOW_CONTROL_NOT_REQUIRED
+	},
 };
 
 static struct corosync_exec_handler cmap_exec_engine[] =
@@ -267,6 +287,7 @@ struct corosync_service_engine cmap_service_engine = {
 	.private_data_size			= sizeof(struct cmap_conn_info),
 	.flow_control				= CS_LIB_FLOW_CONTROL_NOT_REQUIRED,
 	.allow_inquorate			= CS_LIB_ALLOW_INQUORATE,
+	.mcast_prio				= CS_MCAST_PRIO_CONTROL,
 	.lib_init_fn				= cmap_lib_init_fn,
 	.lib_exit_fn				= cmap_lib_exit_fn,
 	.lib_engine				= cmap_lib_engine,
@@ -386,7 +407,7 @@ static int cmap_lib_exit_fn (void *conn)
 {
 	struct cmap_conn_info *conn_info = (struct cmap_conn_info *)api->ipc_private_data_get (conn);
 	hdb_handle_t iter_handle = 0;
-	icmap_iter_t *iter;
+	struct cmap_iter *iter;
 	hdb_handle_t track_handle = 0;
 	icmap_track_t *track;
 
@@ -396,7 +417,7 @@ static int cmap_lib_exit_fn (void *conn)
         while (hdb_iterator_next(&conn_info->iter_db,
                 (void*)&iter, &iter_handle) == 0) {
 
-		conn_info->map_fns.map_iter_finalize(*iter);
+		conn_info->map_fns.map_iter_finalize(iter->iter);
 
 		(void)hdb_handle_put (&conn_info->iter_db, iter_handle);
         }
@@ -617,7 +638,7 @@ static void message_handler_req_lib_cmap_iter_init(void *conn, const void *messa
 	struct res_lib_cmap_iter_init res_lib_cmap_iter_init;
 	cs_error_t ret;
 	icmap_iter_t iter;
-	icmap_iter_t *hdb_iter;
+	struct cmap_iter *hdb_iter;
 	cmap_iter_handle_t handle = 0ULL;
 	const char *prefix;
 	struct cmap_conn_info *conn_info = (struct cmap_conn_info *)api->ipc_private_data_get (conn);
@@ -634,7 +655,7 @@ static void message_handler_req_lib_cmap_iter_init(void *conn, const void *messa
 		goto reply_send;
 	}
 
-	ret = hdb_error_to_cs(hdb_handle_create(&conn_info->iter_db, sizeof(iter), &handle));
+	ret = hdb_error_to_cs(hdb_handle_create(&conn_info->iter_db, sizeof(*hdb_iter), &handle));
 	if (ret != CS_OK) {
 		goto reply_send;
 	}
@@ -644,7 +665,8 @@ static void message_handler_req_lib_cmap_iter_init(void *conn, const void *messa
 		goto reply_send;
 	}
 
-	*hdb_iter = iter;
+	hdb_iter->iter = iter;
+	hdb_iter->pending_key[0] = '\0';
 
 	(void)hdb_handle_put (&conn_info->iter_db, handle);
 
@@ -663,7 +685,7 @@ static void message_handler_req_lib_cmap_iter_next(void *conn, const void *messa
 	const struct req_lib_cmap_iter_next *req_lib_cmap_iter_next = message;
 	struct res_lib_cmap_iter_next res_lib_cmap_iter_next;
 	cs_error_t ret;
-	icmap_iter_t *iter;
+	struct cmap_iter *iter;
 	size_t value_len = 0;
 	icmap_value_types_t type = 0;
 	const char *res = NULL;
@@ -675,7 +697,7 @@ static void message_handler_req_lib_cmap_iter_next(void *conn, const void *messa
 		goto reply_send;
 	}
 
-	res = conn_info->map_fns.map_iter_next(*iter, &value_len, &type);
+	res = conn_info->map_fns.map_iter_next(iter->iter, &value_len, &type);
 	if (res == NULL) {
 		ret = CS_ERR_NO_SECTIONS;
 	}
@@ -706,7 +728,7 @@ static void message_handler_req_lib_cmap_iter_finalize(void *conn, const void *m
 	const struct req_lib_cmap_iter_finalize *req_lib_cmap_iter_finalize = message;
 	struct res_lib_cmap_iter_finalize res_lib_cmap_iter_finalize;
 	cs_error_t ret;
-	icmap_iter_t *iter;
+	struct cmap_iter *iter;
 	struct cmap_conn_info *conn_info = (struct cmap_conn_info *)api->ipc_private_data_get (conn);
 
 	ret = hdb_error_to_cs(hdb_handle_get(&conn_info->iter_db,
@@ -715,7 +737,7 @@ static void message_handler_req_lib_cmap_iter_finalize(void *conn, const void *m
 		goto reply_send;
 	}
 
-	conn_info->map_fns.map_iter_finalize(*iter);
+	conn_info->map_fns.map_iter_finalize(iter->iter);
 
 	(void)hdb_handle_destroy(&conn_info->iter_db, req_lib_cmap_iter_finalize->iter_handle);
 
@@ -730,6 +752,161 @@ reply_send:
 	api->ipc_response_send(conn, &res_lib_cmap_iter_finalize, sizeof(res_lib_cmap_iter_finalize));
 }
 
+/*
+ * Fill res with as many keys of iter (together with their values) as fit
+ * into res_size bytes. Returns number of keys added, *end is set when the
+ * iteration is exhausted.
+ */
+static uint32_t cmap_iter_batch_fill(
+	struct cmap_conn_info *conn_info,
+	struct cmap_iter *iter,
+	struct res_lib_cmap_iter_next_batch *res,
+	size_t res_size,
+	uint32_t max_entries,
+	int *end)
+{
+	struct res_lib_cmap_batch_entry *entry;
+	const char *key_name;
+	size_t key_len;
+	size_t value_len;
+	size_t entry_size;
+	size_t pos;
+	icmap_value_types_t type;
+	uint32_t entries = 0;
+
+	*end = 0;
+	pos = sizeof(*res);
+
+	while (entries < max_entries) {
+		if (iter->pending_key[0] != '\0') {
+			key_name = iter->pending_key;
+		} else {
+			key_name = conn_info->map_fns.map_iter_next(iter->iter, NULL, NULL);
+			if (key_name == NULL) {
+				*end = 1;
+				break;
+			}
+		}
+
+		if (conn_info->map_fns.map_get(key_name, NULL, &value_len, &type) != CS_OK) {
+			/*
+			 * Pending key was deleted in the meantime
+			 */
+			iter->pending_key[0] = '\0';
+			continue;
+		}
+
+		key_len = strlen(key_name);
+		entry_size = sizeof(*entry) + CMAP_BATCH_ALIGNED(key_len + 1);
+		entry = (struct res_lib_cmap_batch_entry *)((char *)res + pos);
+
+		if (pos + entry_size + CMAP_BATCH_ALIGNED(value_len) <= res_size) {
+			if (conn_info->map_fns.map_get(key_name, (char *)entry + entry_size,
+			    &value_len, &type) != CS_OK) {
+				iter->pending_key[0] = '\0';
+				continue;
+			}
+			entry->flags = CMAP_BATCH_ENTRY_VALUE_INCLUDED;
+			entry_size += CMAP_BATCH_ALIGNED(value_len);
+		} else if (entries > 0) {
+			/*
+			 * Send it in the next batch
+			 */
+			if (key_name != iter->pending_key) {
+				assert(key_len < sizeof(iter->pending_key));
+				memcpy(iter->pending_key, key_name, key_len + 1);
+			}
+			break;
+		} else {
+			/*
+			 * Value doesn't fit even into an empty response
+			 */
+			entry->flags = 0;
+		}
+
+		entry->key_len = key_len;
+		entry->type = type;
+		entry->value_len = value_len;
+		memcpy((char *)entry + sizeof(*entry), key_name, key_len + 1);
+
+		iter->pending_key[0] = '\0';
+		pos += entry_size;
+		entries++;
+	}
+
+	res->header.size = pos;
+
+	return (entries);
+}
+
+static void message_handler_req_lib_cmap_iter_next_batch(void *conn, const void *message)
+{
+	const struct req_lib_cmap_iter_next_batch *req_lib_cmap_iter_next_batch = message;
+	struct res_lib_cmap_iter_next_batch *res_lib_cmap_iter_next_batch;
+	struct res_lib_cmap_iter_next_batch error_res_lib_cmap_iter_next_batch;
+	struct cmap_conn_info *conn_info = (struct cmap_conn_info *)api->ipc_private_data_get (conn);
+	struct cmap_iter *iter;
+	size_t res_size;
+	uint32_t entries;
+	int end;
+	cs_error_t ret;
+
+	res_size = req_lib_cmap_iter_next_batch->max_size;
+	if (res_size > CMAP_BATCH_RES_SIZE_MAX) {
+		res_size = CMAP_BATCH_RES_SIZE_MAX;
+	}
+	if (res_size < sizeof(*res_lib_cmap_iter_next_batch) +
+	    sizeof(struct res_lib_cmap_batch_entry) + CMAP_BATCH_ALIGNED(ICMAP_KEYNAME_MAXLEN + 1) ||
+	    req_lib_cmap_iter_next_batch->max_entries == 0) {
+		ret = CS_ERR_INVALID_PARAM;
+		goto error_exit;
+	}
+
+	ret = hdb_error_to_cs(hdb_handle_get(&conn_info->iter_db,
+				req_lib_cmap_iter_next_batch->iter_handle, (void *)&iter));
+	if (ret != CS_OK) {
+		goto error_exit;
+	}
+
+	res_lib_cmap_iter_next_batch = malloc(res_size);
+	if (res_lib_cmap_iter_next_batch == NULL) {
+		(void)hdb_handle_put (&conn_info->iter_db, req_lib_cmap_iter_next_batch->iter_handle);
+		ret = CS_ERR_NO_MEMORY;
+		goto error_exit;
+	}
+	memset(res_lib_cmap_iter_next_batch, 0, res_size);
+
+	entries = cmap_iter_batch_fill(conn_info, iter, res_lib_cmap_iter_next_batch,
+		res_size, req_lib_cmap_iter_next_batch->max_entries, &end);
+
+	(void)hdb_handle_put (&conn_info->iter_db, req_lib_cmap_iter_next_batch->iter_handle);
+
+	if (entries == 0 && end) {
+		free(res_lib_cmap_iter_next_batch);
+		ret = CS_ERR_NO_SECTIONS;
+		goto error_exit;
+	}
+
+	res_lib_cmap_iter_next_batch->header.id = MESSAGE_RES_CMAP_ITER_NEXT_BATCH;
+	res_lib_cmap_iter_next_batch->header.error = CS_OK;
+	res_lib_cmap_iter_next_batch->entries = entries;
+
+	api->ipc_response_send(conn, res_lib_cmap_iter_next_batch,
+		res_lib_cmap_iter_next_batch->header.size);
+	free(res_lib_cmap_iter_next_batch);
+
+	return ;
+
+error_exit:
+	memset(&error_res_lib_cmap_iter_next_batch, 0, sizeof(error_res_lib_cmap_iter_next_batch));
+	error_res_lib_cmap_iter_next_batch.header.size = sizeof(error_res_lib_cmap_iter_next_batch);
+	error_res_lib_cmap_iter_next_batch.header.id = MESSAGE_RES_CMAP_ITER_NEXT_BATCH;
+	error_res_lib_cmap_iter_next_batch.header.error = ret;
+
+	api->ipc_response_send(conn, &error_res_lib_cmap_iter_next_batch,
+		sizeof(error_res_lib_cmap_iter_next_batch));
+}
+
 static void cmap_notify_fn(int32_t event,
 		const char *key_name,
 		struct icmap_notify_value new_val,
@@ -881,7 +1058,7 @@ static void message_handler_req_lib_cmap_set_current_map(void *conn, const void
 	struct cmap_conn_info *conn_info = (struct cmap_conn_info *)api->ipc_private_data_get (conn);
 	int handles_open = 0;
 	hdb_handle_t iter_handle = 0;
-	icmap_iter_t *iter;
+	struct cmap_iter *iter;
 	hdb_handle_t track_handle = 0;
 	icmap_track_t *track;
 
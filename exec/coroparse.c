@@ -818,6 +818,7 @@ static int main_config_parser_cb(const char *path,
 			    (strcmp(path, "totem.max_network_delay") == 0) ||
 			    (strcmp(path, "totem.window_size") == 0) ||
 			    (strcmp(path, "totem.max_messages") == 0) ||
+			    (strcmp(path, "totem.mcast_control_share") == 0) ||
 			    (strcmp(path, "totem.miss_count_const") == 0) ||
 			    (strcmp(path, "totem.knet_pmtud_interval") == 0) ||
 			    (strcmp(path, "totem.knet_mtu") == 0) ||
@@ -923,6 +924,41 @@ static int main_config_parser_cb(const char *path,
 					return (0);
 				}
 			}
+			if (strcmp(path, "system.delivery_thread") == 0) {
+				if ((strcmp(value, "yes") != 0) &&
+				    (strcmp(value, "no") != 0)) {
+					*error_string = "Invalid system.delivery_thread value";
+
+					return (0);
+				}
+			}
+			if (strcmp(path, "system.ipc_fair_share") == 0) {
+				if ((strcmp(value, "yes") != 0) &&
+				    (strcmp(value, "no") != 0)) {
+					*error_string = "Invalid system.ipc_fair_share value";
+
+					return (0);
+				}
+			}
+			if (strcmp(path, "system.ipc_outq_max") == 0 ||
+			    strcmp(path, "system.ipc_fair_share_weight") == 0) {
+				val_type = ICMAP_VALUETYPE_UINT32;
+				if (safe_atoq(value, &val, val_type) != 0) {
+					goto safe_atoq_error;
+				}
+				if ((cs_err = icmap_set_uint32_r(config_map, path, val)) != CS_OK) {
+					goto icmap_set_error;
+				}
+				add_as_string = 0;
+			}
+			if (strcmp(path, "system.stats_shm") == 0) {
+				if ((strcmp(value, "yes") != 0) &&
+				    (strcmp(value, "no") != 0)) {
+					*error_string = "Invalid system.stats_shm value";
+
+					return (0);
+				}
+			}
 			if (strcmp(path, "system.allow_knet_handle_fallback") == 0) {
 				if ((strcmp(value, "yes") != 0) &&
 				    (strcmp(value, "no") != 0)) {
@@ -53,6 +53,7 @@
 #include <assert.h>
 #include <arpa/inet.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <qb/qblist.h>
 #include <qb/qbmap.h>
@@ -62,6 +63,7 @@
 #include <corosync/corodefs.h>
 #include <corosync/logsys.h>
 #include <corosync/coroapi.h>
+#include <corosync/icmap.h>
 
 #include <corosync/cpg.h>
 #include <corosync/ipc_cpg.h>
@@ -74,7 +76,12 @@
 
 LOGSYS_DECLARE_SUBSYS ("CPG");
 
-#define GROUP_HASH_SIZE 32
+#define GROUP_HASH_SIZE 256
+
+/*
+ * Maximum size of one coalesced deliver event (CPG_MODEL_V1_DELIVER_COALESCE)
+ */
+#define CPG_DELIVER_BATCH_SIZE	(16 * 1024)
 
 enum cpg_message_req_types {
 	MESSAGE_REQ_EXEC_CPG_PROCJOIN = 0,
@@ -137,6 +144,12 @@ enum cpg_sync_state {
 
 static struct qb_list_head joinlist_messages_head;
 
+/*
+ * Coalesced deliveries are flushed from a zero timeout timer, which only
+ * makes sense when deliveries run in the main loop
+ */
+static int cpg_deliver_coalesce_allowed = 1;
+
 struct cpg_pd {
 	void *conn;
  	mar_cpg_name_t group_name;
@@ -146,8 +159,18 @@ struct cpg_pd {
 	int initial_totem_conf_sent;
 	uint64_t transition_counter; /* These two are used when sending fragmented messages */
 	uint64_t initial_transition_counter;
+	uint32_t partial_frag_count; /* These two are used by windowed fragmented send */
+	cs_error_t partial_error;
 	struct qb_list_head list;
 	struct qb_list_head iteration_instance_list_head;
+	struct qb_list_head zcb_mapped_list_head;
+	unsigned int zcb_mapped_count;
+	struct cpg_group *cpg_group; /* set while joined to group_name */
+	struct qb_list_head group_list; /* on the cpg_group cpd list */
+	char *batch_buf; /* coalesced deliveries not yet dispatched */
+	size_t batch_len;
+	uint32_t batch_entries;
+	corosync_timer_handle_t batch_flush_timer;
 };
 
 struct cpg_iteration_instance {
@@ -157,6 +180,12 @@ struct cpg_iteration_instance {
 	struct qb_list_head *current_pointer;
 };
 
+struct zcb_mapped {
+	struct qb_list_head list;
+	void *addr;
+	size_t size;
+};
+
 DECLARE_HDB_DATABASE(cpg_iteration_handle_t_db,NULL);
 
 QB_LIST_DECLARE (cpg_pd_list_head);
@@ -180,9 +209,26 @@ struct process_info {
 	uint32_t pid;
 	mar_cpg_name_t group;
 	struct qb_list_head list; /* on the group_info members list */
+	struct cpg_group *cpg_group;
+	struct qb_list_head group_list; /* on the cpg_group pi list */
 };
 QB_LIST_DECLARE (process_info_list_head);
 
+/*
+ * Index of processes and local connections by group name. Delivery and
+ * membership lookups only walk members of a single group instead of
+ * whole cpg_pd and process_info lists. Entry lives as long as any of
+ * its lists is not empty.
+ */
+struct cpg_group {
+	mar_cpg_name_t name;
+	struct qb_list_head hash_list;
+	struct qb_list_head cpd_list_head; /* cpg_pd joined to the group */
+	struct qb_list_head pi_list_head; /* process_info sorted by nodeid, pid */
+};
+
+static struct qb_list_head cpg_group_hash[GROUP_HASH_SIZE];
+
 struct join_list_entry {
 	uint32_t pid;
 	mar_cpg_name_t group_name;
@@ -194,6 +240,92 @@ struct join_list_confchg_data {
 	int join_list_entries;
 };
 
+static unsigned int cpg_group_hash_bucket (const mar_cpg_name_t *name)
+{
+	uint32_t hash = 2166136261U;
+	uint32_t length;
+	uint32_t i;
+
+	length = name->length;
+	if (length > sizeof (name->value)) {
+		length = sizeof (name->value);
+	}
+
+	/*
+	 * FNV-1a
+	 */
+	for (i = 0; i < length; i++) {
+		hash ^= (unsigned char)name->value[i];
+		hash *= 16777619U;
+	}
+
+	return (hash % GROUP_HASH_SIZE);
+}
+
+static struct cpg_group *cpg_group_find (const mar_cpg_name_t *name)
+{
+	struct qb_list_head *iter;
+	struct cpg_group *group;
+
+	qb_list_for_each(iter, &cpg_group_hash[cpg_group_hash_bucket (name)]) {
+		group = qb_list_entry (iter, struct cpg_group, hash_list);
+
+		if (mar_name_compare (&group->name, name) == 0) {
+			return (group);
+		}
+	}
+
+	return (NULL);
+}
+
+static struct cpg_group *cpg_group_get (const mar_cpg_name_t *name)
+{
+	struct cpg_group *group;
+
+	group = cpg_group_find (name);
+	if (group != NULL) {
+		return (group);
+	}
+
+	group = malloc (sizeof (struct cpg_group));
+	if (group == NULL) {
+		return (NULL);
+	}
+	memcpy (&group->name, name, sizeof (*name));
+	qb_list_init (&group->cpd_list_head);
+	qb_list_init (&group->pi_list_head);
+	qb_list_add (&group->hash_list, &cpg_group_hash[cpg_group_hash_bucket (name)]);
+
+	return (group);
+}
+
+static void cpg_group_put (struct cpg_group *group)
+{
+	if (qb_list_empty (&group->cpd_list_head) &&
+	    qb_list_empty (&group->pi_list_head)) {
+		qb_list_del (&group->hash_list);
+		free (group);
+	}
+}
+
+static void cpd_group_unlink (struct cpg_pd *cpd)
+{
+	if (cpd->cpg_group != NULL) {
+		qb_list_del (&cpd->group_list);
+		qb_list_init (&cpd->group_list);
+		cpg_group_put (cpd->cpg_group);
+		cpd->cpg_group = NULL;
+	}
+}
+
+static void process_info_free (struct process_info *pi)
+{
+	qb_list_del (&pi->list);
+	qb_list_del (&pi->group_list);
+	cpg_group_put (pi->cpg_group);
+	free (pi);
+}
+
 /*
  * Service Interfaces required by service_message_handler struct
  */
@@ -243,7 +375,11 @@ static void exec_cpg_downlist_endian_convert_old (void *msg);
 
 static void exec_cpg_downlist_endian_convert (void *msg);
 
-static void message_handler_req_lib_cpg_null (void *conn, const void *message);
+static void message_handler_req_lib_cpg_zc_alloc (void *conn, const void *message);
+
+static void message_handler_req_lib_cpg_zc_free (void *conn, const void *message);
+
+static void message_handler_req_lib_cpg_zc_execute (void *conn, const void *message);
 
 static void message_handler_req_lib_cpg_join (void *conn, const void *message);
 
@@ -255,6 +391,13 @@ static void message_handler_req_lib_cpg_mcast (void *conn, const void *message);
 
 static void message_handler_req_lib_cpg_partial_mcast (void *conn, const void *message);
 
+static void message_handler_req_lib_cpg_partial_mcast_windowed (void *conn, const void *message);
+
+static void message_handler_req_lib_cpg_partial_mcast_windowed_reject (
+	void *conn,
+	const void *message,
+	cs_error_t error);
+
 static void message_handler_req_lib_cpg_membership (void *conn,
 						    const void *message);
 
@@ -360,22 +503,27 @@ static struct corosync_lib_handler cpg_lib_engine[] =
 		.lib_handler_fn				= message_handler_req_lib_cpg_finalize,
 		.flow_control				= CS_LIB_FLOW_CONTROL_REQUIRED
 	},
-	{ /* 9 ZCB handers do nothing now, but we can't remove them from this list */
-		.lib_handler_fn				= message_handler_req_lib_cpg_null,
-		.flow_control				= CS_LIB_FLOW_CONTROL_REQUIRED
+	{ /* 9 - MESSAGE_REQ_CPG_ZC_ALLOC */
+		.lib_handler_fn				= message_handler_req_lib_cpg_zc_alloc,
+		.flow_control				= CS_LIB_FLOW_CONTROL_NOT_REQUIRED
 	},
-	{ /* 10 */
-		.lib_handler_fn				= message_handler_req_lib_cpg_null,
-		.flow_control				= CS_LIB_FLOW_CONTROL_REQUIRED
+	{ /* 10 - MESSAGE_REQ_CPG_ZC_FREE */
+		.lib_handler_fn				= message_handler_req_lib_cpg_zc_free,
+		.flow_control				= CS_LIB_FLOW_CONTROL_NOT_REQUIRED
 	},
-	{ /* 11 */
-		.lib_handler_fn				= message_handler_req_lib_cpg_null,
+	{ /* 11 - MESSAGE_REQ_CPG_ZC_EXECUTE */
+		.lib_handler_fn				= message_handler_req_lib_cpg_zc_execute,
 		.flow_control				= CS_LIB_FLOW_CONTROL_REQUIRED
 	},
-	{ /* 12 */
+	{ /* 12 - MESSAGE_REQ_CPG_PARTIAL_MCAST */
 		.lib_handler_fn				= message_handler_req_lib_cpg_partial_mcast,
 		.flow_control				= CS_LIB_FLOW_CONTROL_REQUIRED
 	},
+	{ /* 13 - MESSAGE_REQ_CPG_PARTIAL_MCAST_WINDOWED */
+		.lib_handler_fn				= message_handler_req_lib_cpg_partial_mcast_windowed,
+		.flow_control				= CS_LIB_FLOW_CONTROL_REQUIRED,
+		.lib_reject_fn				= message_handler_req_lib_cpg_partial_mcast_windowed_reject
+	},
 
 };
 
@@ -596,6 +744,124 @@ static void cpg_sync_abort (void)
 	joinlist_messages_delete ();
 }
 
+/*
+ * Send whatever deliveries are coalesced for cpd. Called from the flush timer
+ * and before any other dispatch to the same client, so ordering is kept.
+ */
+static void cpg_deliver_batch_flush (struct cpg_pd *cpd)
+{
+	struct res_lib_cpg_deliver_batch_callback *res;
+	const struct qb_ipc_response_header *record;
+
+	if (cpd->batch_flush_timer != 0) {
+		api->timer_delete (cpd->batch_flush_timer);
+		cpd->batch_flush_timer = 0;
+	}
+
+	if (cpd->batch_entries == 0) {
+		return ;
+	}
+
+	res = (struct res_lib_cpg_deliver_batch_callback *)cpd->batch_buf;
+
+	if (cpd->batch_entries == 1) {
+		/*
+		 * Single delivery, no reason to wrap it
+		 */
+		record = (const struct qb_ipc_response_header *)res->records;
+		api->ipc_dispatch_send (cpd->conn, record, record->size);
+	} else {
+		res->header.id = MESSAGE_RES_CPG_DELIVER_BATCH_CALLBACK;
+		res->header.size = cpd->batch_len;
+		res->header.error = CS_OK;
+		res->entries = cpd->batch_entries;
+
+		api->ipc_dispatch_send (cpd->conn, cpd->batch_buf, cpd->batch_len);
+	}
+
+	cpd->batch_len = sizeof (struct res_lib_cpg_deliver_batch_callback);
+	cpd->batch_entries = 0;
+}
+
+static void cpg_deliver_batch_flush_timer_fn (void *data)
+{
+	struct cpg_pd *cpd = (struct cpg_pd *)data;
+
+	cpd->batch_flush_timer = 0;
+	cpg_deliver_batch_flush (cpd);
+}
+
+/*
+ * Append one delivery to the cpd batch. Batch is sent when full or from
+ * zero timeout timer, which runs once all deliveries of current totem
+ * event are processed.
+ */
+static void cpg_deliver_batch_add (
+	struct cpg_pd *cpd,
+	const struct res_lib_cpg_deliver_callback *res_lib_cpg_mcast,
+	const void *msg,
+	size_t msglen)
+{
+	struct res_lib_cpg_deliver_callback *record;
+	struct iovec iovec[2];
+	size_t record_len;
+
+	record_len = CPG_DELIVER_BATCH_ALIGN(sizeof (struct res_lib_cpg_deliver_callback) + msglen);
+
+	if (cpd->batch_buf == NULL) {
+		cpd->batch_buf = malloc (CPG_DELIVER_BATCH_SIZE);
+		cpd->batch_len = sizeof (struct res_lib_cpg_deliver_batch_callback);
+		cpd->batch_entries = 0;
+	}
+
+	if (cpd->batch_buf == NULL ||
+	    sizeof (struct res_lib_cpg_deliver_batch_callback) + record_len > CPG_DELIVER_BATCH_SIZE) {
+		cpg_deliver_batch_flush (cpd);
+
+		iovec[0].iov_base = (void *)res_lib_cpg_mcast;
+		iovec[0].iov_len = sizeof (struct res_lib_cpg_deliver_callback);
+		iovec[1].iov_base = (void *)msg;
+		iovec[1].iov_len = msglen;
+		api->ipc_dispatch_iov_send (cpd->conn, iovec, 2);
+		return ;
+	}
+
+	if (cpd->batch_len + record_len > CPG_DELIVER_BATCH_SIZE) {
+		cpg_deliver_batch_flush (cpd);
+	}
+
+	record = (struct res_lib_cpg_deliver_callback *)(cpd->batch_buf + cpd->batch_len);
+	memcpy (record, res_lib_cpg_mcast, sizeof (struct res_lib_cpg_deliver_callback));
+	record->header.size = record_len;
+	memcpy (record->message, msg, msglen);
+	memset (record->message + msglen, 0,
+	    record_len - sizeof (struct res_lib_cpg_deliver_callback) - msglen);
+
+	cpd->batch_len += record_len;
+	cpd->batch_entries++;
+
+	if (cpd->batch_flush_timer == 0 &&
+	    api->timer_add_duration (0, cpd, cpg_deliver_batch_flush_timer_fn,
+	    &cpd->batch_flush_timer) != 0) {
+		cpd->batch_flush_timer = 0;
+		cpg_deliver_batch_flush (cpd);
+	}
+}
+
+static void cpg_deliver_batch_free (struct cpg_pd *cpd)
+{
+
+	if (cpd->batch_flush_timer != 0) {
+		api->timer_delete (cpd->batch_flush_timer);
+		cpd->batch_flush_timer = 0;
+	}
+
+	free (cpd->batch_buf);
+	cpd->batch_buf = NULL;
+	cpd->batch_len = 0;
+	cpd->batch_entries = 0;
+}
+
 static int notify_lib_totem_membership (
 	void *conn,
 	int member_list_entries,
@@ -624,9 +890,11 @@ static int notify_lib_totem_membership (
 	if (conn == NULL) {
 		qb_list_for_each(iter, &cpg_pd_list_head) {
 			struct cpg_pd *cpg_pd = qb_list_entry (iter, struct cpg_pd, list);
+			cpg_deliver_batch_flush (cpg_pd);
 			api->ipc_dispatch_send (cpg_pd->conn, buf, size);
 		}
 	} else {
+		cpg_deliver_batch_flush ((struct cpg_pd *)api->ipc_private_data_get (conn));
 		api->ipc_dispatch_send (conn, buf, size);
 	}
 
@@ -649,36 +917,39 @@ static void notify_lib_joinlist_fill_member_list(
 	mar_cpg_address_t **member_list)
 {
 	struct qb_list_head *iter;
+	struct cpg_group *group;
 	int i;
 
 	if (member_list_entries != NULL) {
 		*member_list_entries = 0;
 	}
 
-	qb_list_for_each(iter, &process_info_list_head) {
-		struct process_info *pi = qb_list_entry (iter, struct process_info, list);
+	group = cpg_group_find (group_name);
+	if (group == NULL) {
+		return ;
+	}
 
-		if (mar_name_compare (&pi->group, group_name) == 0) {
-			int in_left_list = 0;
+	qb_list_for_each(iter, &group->pi_list_head) {
+		struct process_info *pi = qb_list_entry (iter, struct process_info, group_list);
+		int in_left_list = 0;
 
-			for (i = 0; i < left_list_entries; i++) {
-				if (left_list[i].nodeid == pi->nodeid && left_list[i].pid == pi->pid) {
-					in_left_list = 1;
-					break ;
-				}
+		for (i = 0; i < left_list_entries; i++) {
+			if (left_list[i].nodeid == pi->nodeid && left_list[i].pid == pi->pid) {
+				in_left_list = 1;
+				break ;
 			}
+		}
 
-			if (!in_left_list) {
-				if (member_list_entries != NULL) {
-					(*member_list_entries)++;
-				}
+		if (!in_left_list) {
+			if (member_list_entries != NULL) {
+				(*member_list_entries)++;
+			}
 
-				if (member_list != NULL) {
-					(*member_list)->nodeid = pi->nodeid;
-					(*member_list)->pid = pi->pid;
-					(*member_list)->reason = CPG_REASON_UNDEFINED;
-					(*member_list)++;
-				}
+			if (member_list != NULL) {
+				(*member_list)->nodeid = pi->nodeid;
+				(*member_list)->pid = pi->pid;
+				(*member_list)->reason = CPG_REASON_UNDEFINED;
+				(*member_list)++;
 			}
 		}
 	}
@@ -695,6 +966,7 @@ static int notify_lib_joinlist(
 	int size;
 	char *buf;
 	struct qb_list_head *iter;
+	struct cpg_group *group;
 	int member_list_entries;
 	struct res_lib_cpg_confchg_callback *res;
 	mar_cpg_address_t *retgi;
@@ -736,6 +1008,8 @@ static int notify_lib_joinlist(
 		retgi += left_list_entries;
 	}
 
+	group = cpg_group_find (group_name);
+
 	if (joined_list_entries) {
 		/*
 		 * Fill res->joined_list
@@ -746,12 +1020,11 @@ static int notify_lib_joinlist(
 		/*
 		 * Update cpd_state for all local joined processes in group
 		 */
-		for (i = 0; i < joined_list_entries; i++) {
+		for (i = 0; i < joined_list_entries && group != NULL; i++) {
 			if (joined_list[i].nodeid == api->totem_nodeid_get()) {
-				qb_list_for_each(iter, &cpg_pd_list_head) {
-					struct cpg_pd *cpd = qb_list_entry (iter, struct cpg_pd, list);
-					if (joined_list[i].pid == cpd->pid &&
-					    mar_name_compare (&cpd->group_name, group_name) == 0) {
+				qb_list_for_each(iter, &group->cpd_list_head) {
+					struct cpg_pd *cpd = qb_list_entry (iter, struct cpg_pd, group_list);
+					if (joined_list[i].pid == cpd->pid) {
 						cpd->cpd_state = CPD_STATE_JOIN_COMPLETED;
 					}
 				}
@@ -762,12 +1035,13 @@ static int notify_lib_joinlist(
 	/*
 	 * Send notification to all ipc clients joined in group_name
 	 */
-	qb_list_for_each(iter, &cpg_pd_list_head) {
-		struct cpg_pd *cpd = qb_list_entry (iter, struct cpg_pd, list);
-		if (mar_name_compare (&cpd->group_name, group_name) == 0) {
+	if (group != NULL) {
+		qb_list_for_each(iter, &group->cpd_list_head) {
+			struct cpg_pd *cpd = qb_list_entry (iter, struct cpg_pd, group_list);
 			if (cpd->cpd_state == CPD_STATE_JOIN_COMPLETED ||
 				cpd->cpd_state == CPD_STATE_LEAVE_STARTED) {
 
+				cpg_deliver_batch_flush (cpd);
 				api->ipc_dispatch_send (cpd->conn, buf, size);
 				cpd->transition_counter++;
 			}
@@ -781,18 +1055,23 @@ static int notify_lib_joinlist(
 		 *  contains exactly one process running on local node or more items
 		 *  but none of them is running on local node)
 		 */
-		for (i = 0; i < joined_list_entries; i++) {
+		for (i = 0; i < joined_list_entries && group != NULL; i++) {
 			if (left_list[i].nodeid == api->totem_nodeid_get() &&
 			    left_list[i].reason == CONFCHG_CPG_REASON_LEAVE) {
-				qb_list_for_each(iter, &cpg_pd_list_head) {
-					struct cpg_pd *cpd = qb_list_entry (iter, struct cpg_pd, list);
-					if (left_list[i].pid == cpd->pid &&
-					    mar_name_compare (&cpd->group_name, group_name) == 0) {
+				qb_list_for_each(iter, &group->cpd_list_head) {
+					struct cpg_pd *cpd = qb_list_entry (iter, struct cpg_pd, group_list);
+					if (left_list[i].pid == cpd->pid) {
 						cpd->pid = 0;
 						memset (&cpd->group_name, 0, sizeof(cpd->group_name));
 						cpd->cpd_state = CPD_STATE_UNJOINED;
+						cpd_group_unlink (cpd);
+						break ;
 					}
 				}
+				/*
+				 * Unlink of last member frees the group
+				 */
+				group = cpg_group_find (group_name);
 			}
 		}
 	}
@@ -874,8 +1153,7 @@ static void downlist_inform_clients (void)
 			pcd->left_list[size].pid = left_pi->pid;
 			pcd->left_list[size].reason = CONFCHG_CPG_REASON_NODEDOWN;
 			pcd->left_list_entries++;
-			qb_list_del (&left_pi->list);
-			free (left_pi);
+			process_info_free (left_pi);
 		}
 	}
 
@@ -1009,7 +1287,20 @@ static void joinlist_messages_delete (void)
 
 static char *cpg_exec_init_fn (struct corosync_api_v1 *corosync_api)
 {
+	char *str;
+	int i;
+
+	if (icmap_get_string ("system.delivery_thread", &str) == CS_OK) {
+		if (strcmp (str, "yes") == 0) {
+			cpg_deliver_coalesce_allowed = 0;
+		}
+		free (str);
+	}
+
 	qb_list_init (&joinlist_messages_head);
+	for (i = 0; i < GROUP_HASH_SIZE; i++) {
+		qb_list_init (&cpg_group_hash[i]);
+	}
 	api = corosync_api;
 	return (NULL);
 }
@@ -1029,17 +1320,196 @@ static void cpg_iteration_instance_finalize (struct cpg_iteration_instance *cpg_
 	hdb_handle_destroy (&cpg_iteration_handle_t_db, cpg_iteration_instance->handle);
 }
 
+/*
+ * Zero copy buffer is memfd created and sealed by the library. Descriptor
+ * is reopened through /proc/<pid>/fd of the (already authenticated) client,
+ * so nothing is ever looked up or unlinked by a client supplied path.
+ * Seals guarantee client can't shrink the file under our mapping (SIGBUS).
+ */
+static int
+memory_map (
+	pid_t pid,
+	uid_t owner,
+	uint32_t client_fd,
+	size_t bytes,
+	void **buf)
+{
+#ifdef F_GET_SEALS
+	char fd_dir[32];
+	char fd_name[16];
+	int32_t dir_fd;
+	int32_t fd;
+	void *addr;
+	struct stat st;
+	int32_t res;
+	int seals;
+
+	snprintf (fd_dir, sizeof (fd_dir), "/proc/%ld/fd", (long)pid);
+	snprintf (fd_name, sizeof (fd_name), "%u", client_fd);
+
+	dir_fd = open (fd_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd == -1) {
+		return (-1);
+	}
+
+	/*
+	 * Corosync runs as root, so without this check a client could make
+	 * us map file descriptor of another user's process.
+	 */
+	res = fstat (dir_fd, &st);
+	if (res == -1 || st.st_uid != owner) {
+		close (dir_fd);
+		return (-1);
+	}
+
+	fd = openat (dir_fd, fd_name, O_RDONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	close (dir_fd);
+	if (fd == -1) {
+		return (-1);
+	}
+
+	res = fstat (fd, &st);
+	if (res == -1 || !S_ISREG (st.st_mode) ||
+	    st.st_size < 0 || (size_t)st.st_size != bytes) {
+		goto error_close;
+	}
+
+	seals = fcntl (fd, F_GET_SEALS);
+	if (seals == -1 ||
+	    (seals & (F_SEAL_SHRINK | F_SEAL_GROW)) != (F_SEAL_SHRINK | F_SEAL_GROW)) {
+		log_printf(LOGSYS_LEVEL_WARNING,
+		    "Refusing to map unsealed zero copy buffer of pid %ld",
+		    (long)pid);
+		goto error_close;
+	}
+
+	addr = mmap (NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (addr == MAP_FAILED) {
+		goto error_close;
+	}
+#ifdef MADV_NOSYNC
+	madvise(addr, bytes, MADV_NOSYNC);
+#endif
+
+	res = close (fd);
+	if (res) {
+		munmap (addr, bytes);
+		return (-1);
+	}
+	*buf = addr;
+	return (0);
+
+error_close:
+	close (fd);
+	return (-1);
+#else
+	return (-1);
+#endif
+}
+
+static inline cs_error_t zcb_alloc (
+	void *conn,
+	struct cpg_pd *cpd,
+	uint32_t client_fd,
+	size_t size,
+	void **addr)
+{
+	struct zcb_mapped *zcb_mapped;
+	pid_t pid;
+	uid_t euid;
+	gid_t egid;
+	int res;
+
+	if (size < sizeof (struct cpg_zc_header) + sizeof (struct req_lib_cpg_mcast)) {
+		return (CS_ERR_INVALID_PARAM);
+	}
+
+	if (cpd->zcb_mapped_count >= CPG_ZC_MAPPINGS_MAX) {
+		return (CS_ERR_NO_RESOURCES);
+	}
+
+	zcb_mapped = malloc (sizeof (struct zcb_mapped));
+	if (zcb_mapped == NULL) {
+		return (CS_ERR_NO_MEMORY);
+	}
+
+	api->ipc_credentials_get (conn, &pid, &euid, &egid);
+
+	res = memory_map (
+		pid,
+		euid,
+		client_fd,
+		size,
+		addr);
+	if (res == -1) {
+		free (zcb_mapped);
+		return (CS_ERR_INVALID_PARAM);
+	}
+
+	qb_list_init (&zcb_mapped->list);
+	zcb_mapped->addr = *addr;
+	zcb_mapped->size = size;
+	qb_list_add_tail (&zcb_mapped->list, &cpd->zcb_mapped_list_head);
+	cpd->zcb_mapped_count++;
+	return (CS_OK);
+}
+
+static struct zcb_mapped *zcb_find_by_addr (struct cpg_pd *cpd, uint64_t server_address)
+{
+	struct qb_list_head *iter;
+	struct zcb_mapped *zcb_mapped;
+
+	qb_list_for_each(iter, &(cpd->zcb_mapped_list_head)) {
+		zcb_mapped = qb_list_entry (iter, struct zcb_mapped, list);
+
+		if ((uint64_t)(uintptr_t)zcb_mapped->addr == server_address) {
+			return (zcb_mapped);
+		}
+	}
+
+	return (NULL);
+}
+
+static inline int zcb_free (struct cpg_pd *cpd, struct zcb_mapped *zcb_mapped)
+{
+	int res;
+
+	res = munmap (zcb_mapped->addr, zcb_mapped->size);
+	qb_list_del (&zcb_mapped->list);
+	free (zcb_mapped);
+	cpd->zcb_mapped_count--;
+	return (res);
+}
+
+static inline void zcb_all_free (struct cpg_pd *cpd)
+{
+	struct qb_list_head *iter, *tmp_iter;
+	struct zcb_mapped *zcb_mapped;
+
+	qb_list_for_each_safe(iter, tmp_iter, &(cpd->zcb_mapped_list_head)) {
+		zcb_mapped = qb_list_entry (iter, struct zcb_mapped, list);
+
+		zcb_free (cpd, zcb_mapped);
+	}
+}
+
 static void cpg_pd_finalize (struct cpg_pd *cpd)
 {
 	struct qb_list_head *iter, *tmp_iter;
 	struct cpg_iteration_instance *cpii;
 
+	zcb_all_free (cpd);
+
+	cpg_deliver_batch_free (cpd);
+
 	qb_list_for_each_safe(iter, tmp_iter, &(cpd->iteration_instance_list_head)) {
 		cpii = qb_list_entry (iter, struct cpg_iteration_instance, list);
 
 		cpg_iteration_instance_finalize (cpii);
 	}
 
+	cpd_group_unlink (cpd);
 	qb_list_del (&cpd->list);
 }
 
@@ -1152,19 +1622,48 @@ static void exec_cpg_partial_mcast_endian_convert (void *msg)
 
 static struct process_info *process_info_find(const mar_cpg_name_t *group_name, uint32_t pid, unsigned int nodeid) {
 	struct qb_list_head *iter;
+	struct cpg_group *group;
 
-	qb_list_for_each(iter, &process_info_list_head) {
-		struct process_info *pi = qb_list_entry (iter, struct process_info, list);
+	group = cpg_group_find (group_name);
+	if (group == NULL) {
+		return NULL;
+	}
 
-		if (pi->pid == pid && pi->nodeid == nodeid &&
-			mar_name_compare (&pi->group, group_name) == 0) {
-				return pi;
+	qb_list_for_each(iter, &group->pi_list_head) {
+		struct process_info *pi = qb_list_entry (iter, struct process_info, group_list);
+
+		if (pi->nodeid > nodeid) {
+			break;
+		}
+		if (pi->pid == pid && pi->nodeid == nodeid) {
+			return pi;
 		}
 	}
 
 	return NULL;
 }
 
+/*
+ * Group members are sorted by nodeid, so lookup can stop at the first
+ * higher one
+ */
+static int process_info_node_known(const struct cpg_group *group, unsigned int nodeid) {
+	struct qb_list_head *iter;
+
+	qb_list_for_each(iter, &group->pi_list_head) {
+		struct process_info *pi = qb_list_entry (iter, struct process_info, group_list);
+
+		if (pi->nodeid == nodeid) {
+			return 1;
+		}
+		if (pi->nodeid > nodeid) {
+			break;
+		}
+	}
+
+	return 0;
+}
+
 static void do_proc_join(
 	const mar_cpg_name_t *name,
 	uint32_t pid,
@@ -1174,6 +1673,7 @@ static void do_proc_join(
 {
 	struct process_info *pi;
 	struct process_info *pi_entry;
+	struct cpg_group *group;
 	mar_cpg_address_t notify_info;
 	struct qb_list_head *list;
 	struct qb_list_head *list_to_add = NULL;
@@ -1187,10 +1687,18 @@ static void do_proc_join(
 		log_printf(LOGSYS_LEVEL_WARNING, "Unable to allocate process_info struct");
 		return;
 	}
+	group = cpg_group_get (name);
+	if (group == NULL) {
+		log_printf(LOGSYS_LEVEL_WARNING, "Unable to allocate cpg_group struct");
+		free (pi);
+		return;
+	}
 	pi->nodeid = nodeid;
 	pi->pid = pid;
 	memcpy(&pi->group, name, sizeof(*name));
 	qb_list_init(&pi->list);
+	pi->cpg_group = group;
+	qb_list_init(&pi->group_list);
 
 	/*
 	 * Insert new process in sorted order so synchronization works properly
@@ -1207,6 +1715,21 @@ static void do_proc_join(
 	}
 	qb_list_add (&pi->list, list_to_add);
 
+	/*
+	 * Same order is kept in group index
+	 */
+	list_to_add = &group->pi_list_head;
+	qb_list_for_each(list, &group->pi_list_head) {
+		pi_entry = qb_list_entry(list, struct process_info, group_list);
+		if (pi_entry->nodeid > pi->nodeid ||
+			(pi_entry->nodeid == pi->nodeid && pi_entry->pid > pi->pid)) {
+
+			break;
+		}
+		list_to_add = list;
+	}
+	qb_list_add (&pi->group_list, list_to_add);
+
 	notify_info.pid = pi->pid;
 	notify_info.nodeid = nodeid;
 	notify_info.reason = reason;
@@ -1238,7 +1761,6 @@ static void do_proc_leave(
 	int reason)
 {
 	struct process_info *pi;
-	struct qb_list_head *iter, *tmp_iter;
 	mar_cpg_address_t notify_info;
 
 	notify_info.pid = pid;
@@ -1250,14 +1772,9 @@ static void do_proc_leave(
 		1, &notify_info,
 		MESSAGE_RES_CPG_CONFCHG_CALLBACK);
 
-	qb_list_for_each_safe(iter, tmp_iter, &process_info_list_head) {
-		pi = qb_list_entry(iter, struct process_info, list);
-
-		if (pi->pid == pid && pi->nodeid == nodeid &&
-			mar_name_compare (&pi->group, name)==0) {
-			qb_list_del (&pi->list);
-			free (pi);
-		}
+	pi = process_info_find (name, pid, nodeid);
+	if (pi != NULL) {
+		process_info_free (pi);
 	}
 }
 
@@ -1345,10 +1862,12 @@ static void message_handler_req_exec_cpg_mcast (
 	const struct req_exec_cpg_mcast *req_exec_cpg_mcast = message;
 	struct res_lib_cpg_deliver_callback res_lib_cpg_mcast;
 	int msglen = req_exec_cpg_mcast->msglen;
-	struct qb_list_head *iter, *pi_iter, *tmp_iter;
+	struct qb_list_head *iter, *tmp_iter;
 	struct cpg_pd *cpd;
+	struct cpg_group *group;
 	struct iovec iovec[2];
 	int known_node = 0;
+	void *payload = NULL;
 
 	res_lib_cpg_mcast.header.id = MESSAGE_RES_CPG_DELIVER_CALLBACK;
 	res_lib_cpg_mcast.header.size = sizeof(res_lib_cpg_mcast) + msglen;
@@ -1364,32 +1883,35 @@ static void message_handler_req_exec_cpg_mcast (
 	iovec[1].iov_base = (char*)message+sizeof(*req_exec_cpg_mcast);
 	iovec[1].iov_len = msglen;
 
-	qb_list_for_each_safe(iter, tmp_iter, &cpg_pd_list_head) {
-		cpd = qb_list_entry(iter, struct cpg_pd, list);
-		if ((cpd->cpd_state == CPD_STATE_LEAVE_STARTED || cpd->cpd_state == CPD_STATE_JOIN_COMPLETED)
-			&& (mar_name_compare (&cpd->group_name, &req_exec_cpg_mcast->group_name) == 0)) {
+	group = cpg_group_find (&req_exec_cpg_mcast->group_name);
+	if (group == NULL) {
+		return ;
+	}
+
+	qb_list_for_each_safe(iter, tmp_iter, &group->cpd_list_head) {
+		cpd = qb_list_entry(iter, struct cpg_pd, group_list);
+		if (cpd->cpd_state == CPD_STATE_LEAVE_STARTED || cpd->cpd_state == CPD_STATE_JOIN_COMPLETED) {
 
 			if (!known_node) {
 				/* Try to find, if we know the node */
-				qb_list_for_each(pi_iter, &process_info_list_head) {
-					struct process_info *pi = qb_list_entry (pi_iter, struct process_info, list);
-
-					if (pi->nodeid == nodeid &&
-						mar_name_compare (&pi->group, &req_exec_cpg_mcast->group_name) == 0) {
-						known_node = 1;
-						break;
-					}
-				}
+				known_node = process_info_node_known (group, nodeid);
 			}
 
 			if (!known_node) {
 				log_printf(LOGSYS_LEVEL_WARNING, "Unknown node -> we will not deliver message");
-				return ;
+				break ;
 			}
 
-			api->ipc_dispatch_iov_send (cpd->conn, iovec, 2);
+			if ((cpd->flags & CPG_MODEL_V1_DELIVER_COALESCE) &&
+			    cpg_deliver_coalesce_allowed) {
+				cpg_deliver_batch_add (cpd, &res_lib_cpg_mcast,
+				    iovec[1].iov_base, msglen);
+			} else {
+				api->ipc_dispatch_iov_send_shared (cpd->conn, iovec, 2, &payload);
+			}
 		}
 	}
+	api->ipc_dispatch_payload_put (payload);
 }
 
 static void message_handler_req_exec_cpg_partial_mcast (
@@ -1399,10 +1921,12 @@ static void message_handler_req_exec_cpg_partial_mcast (
 	const struct req_exec_cpg_partial_mcast *req_exec_cpg_mcast = message;
 	struct res_lib_cpg_partial_deliver_callback res_lib_cpg_mcast;
 	int msglen = req_exec_cpg_mcast->fraglen;
-	struct qb_list_head *iter, *pi_iter, *tmp_iter;
+	struct qb_list_head *iter, *tmp_iter;
 	struct cpg_pd *cpd;
+	struct cpg_group *group;
 	struct iovec iovec[2];
 	int known_node = 0;
+	void *payload = NULL;
 
 	log_printf(LOGSYS_LEVEL_DEBUG, "Got fragmented message from node " CS_PRI_NODE_ID ", size = %d bytes\n", nodeid, msglen);
 
@@ -1422,33 +1946,31 @@ static void message_handler_req_exec_cpg_partial_mcast (
 	iovec[1].iov_base = (char*)message+sizeof(*req_exec_cpg_mcast);
 	iovec[1].iov_len = msglen;
 
-	qb_list_for_each_safe(iter, tmp_iter, &cpg_pd_list_head) {
-		cpd = qb_list_entry(iter, struct cpg_pd, list);
+	group = cpg_group_find (&req_exec_cpg_mcast->group_name);
+	if (group == NULL) {
+		return ;
+	}
+
+	qb_list_for_each_safe(iter, tmp_iter, &group->cpd_list_head) {
+		cpd = qb_list_entry(iter, struct cpg_pd, group_list);
 
-		if ((cpd->cpd_state == CPD_STATE_LEAVE_STARTED || cpd->cpd_state == CPD_STATE_JOIN_COMPLETED)
-		    && (mar_name_compare (&cpd->group_name, &req_exec_cpg_mcast->group_name) == 0)) {
+		if (cpd->cpd_state == CPD_STATE_LEAVE_STARTED || cpd->cpd_state == CPD_STATE_JOIN_COMPLETED) {
 
 			if (!known_node) {
 				/* Try to find, if we know the node */
-				qb_list_for_each(pi_iter, &process_info_list_head) {
-					struct process_info *pi = qb_list_entry (pi_iter, struct process_info, list);
-
-					if (pi->nodeid == nodeid &&
-					    mar_name_compare (&pi->group, &req_exec_cpg_mcast->group_name) == 0) {
-						known_node = 1;
-						break;
-					}
-				}
+				known_node = process_info_node_known (group, nodeid);
 			}
 
 			if (!known_node) {
 				log_printf(LOGSYS_LEVEL_WARNING, "Unknown node -> we will not deliver message");
-				return ;
+				break ;
 			}
 
-			api->ipc_dispatch_iov_send (cpd->conn, iovec, 2);
+			cpg_deliver_batch_flush (cpd);
+			api->ipc_dispatch_iov_send_shared (cpd->conn, iovec, 2, &payload);
 		}
 	}
+	api->ipc_dispatch_payload_put (payload);
 }
 
 
@@ -1525,8 +2047,10 @@ static int cpg_lib_init_fn (void *conn)
 	memset (cpd, 0, sizeof(struct cpg_pd));
 	cpd->conn = conn;
 	qb_list_add (&cpd->list, &cpg_pd_list_head);
+	qb_list_init (&cpd->group_list);
 
 	qb_list_init (&cpd->iteration_instance_list_head);
+	qb_list_init (&cpd->zcb_mapped_list_head);
 
 	api->ipc_refcnt_inc (conn);
 	log_printf(LOGSYS_LEVEL_DEBUG, "lib_init_fn: conn=%p, cpd=%p", conn, cpd);
@@ -1534,15 +2058,53 @@ static int cpg_lib_init_fn (void *conn)
 }
 
 
-/* NULL message so old zcb clients don't crash us */
-static void message_handler_req_lib_cpg_null (void *conn, const void *message)
+static void message_handler_req_lib_cpg_zc_alloc (
+	void *conn,
+	const void *message)
 {
-	struct res_lib_cpg_null res_lib_cpg_null;
+	const struct req_lib_cpg_zc_alloc *req_lib_cpg_zc_alloc = message;
+	struct res_lib_cpg_zc_alloc res_lib_cpg_zc_alloc;
+	struct cpg_pd *cpd = (struct cpg_pd *)api->ipc_private_data_get (conn);
+	void *addr = NULL;
+	cs_error_t error;
+
+	log_printf(LOGSYS_LEVEL_DEBUG, "zcb alloc fd: %u", req_lib_cpg_zc_alloc->fd);
 
-	res_lib_cpg_null.header.size = sizeof(res_lib_cpg_null);
-	res_lib_cpg_null.header.id = MESSAGE_RES_CPG_NULL;
-	res_lib_cpg_null.header.error = CS_ERR_NOT_SUPPORTED;
-	api->ipc_response_send (conn, &res_lib_cpg_null, sizeof(res_lib_cpg_null));
+	error = zcb_alloc (conn, cpd, req_lib_cpg_zc_alloc->fd,
+	    req_lib_cpg_zc_alloc->map_size, &addr);
+
+	res_lib_cpg_zc_alloc.header.size = sizeof (res_lib_cpg_zc_alloc);
+	res_lib_cpg_zc_alloc.header.id = MESSAGE_RES_CPG_ZC_ALLOC;
+	res_lib_cpg_zc_alloc.header.error = error;
+	res_lib_cpg_zc_alloc.server_address = (uint64_t)(uintptr_t)addr;
+
+	api->ipc_response_send (conn, &res_lib_cpg_zc_alloc,
+		sizeof (res_lib_cpg_zc_alloc));
+}
+
+static void message_handler_req_lib_cpg_zc_free (
+	void *conn,
+	const void *message)
+{
+	const struct req_lib_cpg_zc_free *req_lib_cpg_zc_free = message;
+	struct res_lib_cpg_zc_free res_lib_cpg_zc_free;
+	struct cpg_pd *cpd = (struct cpg_pd *)api->ipc_private_data_get (conn);
+	struct zcb_mapped *zcb_mapped;
+	cs_error_t error = CS_OK;
+
+	zcb_mapped = zcb_find_by_addr (cpd, req_lib_cpg_zc_free->server_address);
+	if (zcb_mapped == NULL) {
+		error = CS_ERR_NOT_EXIST;
+	} else if (zcb_free (cpd, zcb_mapped) != 0) {
+		error = CS_ERR_LIBRARY;
+	}
+
+	res_lib_cpg_zc_free.header.size = sizeof (res_lib_cpg_zc_free);
+	res_lib_cpg_zc_free.header.id = MESSAGE_RES_CPG_ZC_FREE;
+	res_lib_cpg_zc_free.header.error = error;
+
+	api->ipc_response_send (conn, &res_lib_cpg_zc_free,
+		sizeof (res_lib_cpg_zc_free));
 }
 
 /* Join message from the library */
@@ -1553,17 +2115,19 @@ static void message_handler_req_lib_cpg_join (void *conn, const void *message)
 	struct res_lib_cpg_join res_lib_cpg_join;
 	cs_error_t error = CS_OK;
 	struct qb_list_head *iter;
+	struct cpg_group *group;
 
 	/* Test, if we don't have same pid and group name joined */
-	qb_list_for_each(iter, &cpg_pd_list_head) {
-		struct cpg_pd *cpd_item = qb_list_entry (iter, struct cpg_pd, list);
-
-		if (cpd_item->pid == req_lib_cpg_join->pid &&
-			mar_name_compare(&req_lib_cpg_join->group_name, &cpd_item->group_name) == 0) {
-
-			/* We have same pid and group name joined -> return error */
-			error = CS_ERR_EXIST;
-			goto response_send;
+	group = cpg_group_find (&req_lib_cpg_join->group_name);
+	if (group != NULL) {
+		qb_list_for_each(iter, &group->cpd_list_head) {
+			struct cpg_pd *cpd_item = qb_list_entry (iter, struct cpg_pd, group_list);
+
+			if (cpd_item->pid == req_lib_cpg_join->pid) {
+				/* We have same pid and group name joined -> return error */
+				error = CS_ERR_EXIST;
+				goto response_send;
+			}
 		}
 	}
 
@@ -1571,15 +2135,11 @@ static void message_handler_req_lib_cpg_join (void *conn, const void *message)
 	 * Same check must be done in process info list, because there may be not yet delivered
 	 * leave of client.
 	 */
-	qb_list_for_each(iter, &process_info_list_head) {
-		struct process_info *pi = qb_list_entry (iter, struct process_info, list);
-
-		if (pi->nodeid == api->totem_nodeid_get () && pi->pid == req_lib_cpg_join->pid &&
-		    mar_name_compare(&req_lib_cpg_join->group_name, &pi->group) == 0) {
-			/* We have same pid and group name joined -> return error */
-			error = CS_ERR_TRY_AGAIN;
-			goto response_send;
-		}
+	if (process_info_find (&req_lib_cpg_join->group_name, req_lib_cpg_join->pid,
+	    api->totem_nodeid_get ()) != NULL) {
+		/* We have same pid and group name joined -> return error */
+		error = CS_ERR_TRY_AGAIN;
+		goto response_send;
 	}
 
 	if (req_lib_cpg_join->group_name.length > CPG_MAX_NAME_LENGTH) {
@@ -1589,12 +2149,19 @@ static void message_handler_req_lib_cpg_join (void *conn, const void *message)
 
 	switch (cpd->cpd_state) {
 	case CPD_STATE_UNJOINED:
+		group = cpg_group_get (&req_lib_cpg_join->group_name);
+		if (group == NULL) {
+			error = CS_ERR_NO_MEMORY;
+			break;
+		}
 		error = CS_OK;
 		cpd->cpd_state = CPD_STATE_JOIN_STARTED;
 		cpd->pid = req_lib_cpg_join->pid;
 		cpd->flags = req_lib_cpg_join->flags;
 		memcpy (&cpd->group_name, &req_lib_cpg_join->group_name,
 			sizeof (cpd->group_name));
+		cpd->cpg_group = group;
+		qb_list_add_tail (&cpd->group_list, &group->cpd_list_head);
 
 		cpg_node_joinleave_send (req_lib_cpg_join->pid,
 			&req_lib_cpg_join->group_name,
@@ -1672,6 +2239,7 @@ static void message_handler_req_lib_cpg_finalize (
 	 */
 	qb_list_del (&cpd->list);
 	qb_list_init (&cpd->list);
+	cpd_group_unlink (cpd);
 
 	res_lib_cpg_finalize.header.size = sizeof (res_lib_cpg_finalize);
 	res_lib_cpg_finalize.header.id = MESSAGE_RES_CPG_FINALIZE;
@@ -1683,20 +2251,22 @@ static void message_handler_req_lib_cpg_finalize (
 
 
 /* Fragmented mcast message from the library */
-static void message_handler_req_lib_cpg_partial_mcast (void *conn, const void *message)
+/*
+ * Send one fragment of message to the group connection is joined to
+ */
+static cs_error_t cpg_lib_partial_mcast_send (
+	void *conn,
+	const struct req_lib_cpg_partial_mcast *req_lib_cpg_mcast)
 {
-	const struct req_lib_cpg_partial_mcast *req_lib_cpg_mcast = message;
 	struct cpg_pd *cpd = (struct cpg_pd *)api->ipc_private_data_get (conn);
 	mar_cpg_name_t group_name = cpd->group_name;
 
 	struct iovec req_exec_cpg_iovec[2];
 	struct req_exec_cpg_partial_mcast req_exec_cpg_mcast;
-	struct res_lib_cpg_partial_send res_lib_cpg_partial_send;
 	int msglen = req_lib_cpg_mcast->fraglen;
 	int result;
 	cs_error_t error = CS_ERR_NOT_EXIST;
 
-	log_printf(LOGSYS_LEVEL_TRACE, "got fragmented mcast request on %p", conn);
 	log_printf(LOGSYS_LEVEL_DEBUG, "Sending fragmented message size = %d bytes\n", msglen);
 
 	switch (cpd->cpd_state) {
@@ -1714,9 +2284,6 @@ static void message_handler_req_lib_cpg_partial_mcast (void *conn, const void *m
 		break;
 	}
 
-	res_lib_cpg_partial_send.header.size = sizeof(res_lib_cpg_partial_send);
-	res_lib_cpg_partial_send.header.id = MESSAGE_RES_CPG_PARTIAL_SEND;
-
 	if (req_lib_cpg_mcast->type == LIBCPG_PARTIAL_FIRST) {
 		cpd->initial_transition_counter = cpd->transition_counter;
 	}
@@ -1748,26 +2315,112 @@ static void message_handler_req_lib_cpg_partial_mcast (void *conn, const void *m
 			   conn, group_name.value, cpd->cpd_state, error);
 	}
 
-	res_lib_cpg_partial_send.header.error = error;
+	return (error);
+}
+
+static void message_handler_req_lib_cpg_partial_mcast (void *conn, const void *message)
+{
+	const struct req_lib_cpg_partial_mcast *req_lib_cpg_mcast = message;
+	struct res_lib_cpg_partial_send res_lib_cpg_partial_send;
+
+	log_printf(LOGSYS_LEVEL_TRACE, "got fragmented mcast request on %p", conn);
+
+	res_lib_cpg_partial_send.header.size = sizeof(res_lib_cpg_partial_send);
+	res_lib_cpg_partial_send.header.id = MESSAGE_RES_CPG_PARTIAL_SEND;
+	res_lib_cpg_partial_send.header.error = cpg_lib_partial_mcast_send (conn, req_lib_cpg_mcast);
+
 	api->ipc_response_send (conn, &res_lib_cpg_partial_send,
 				sizeof (res_lib_cpg_partial_send));
 }
 
-/* Mcast message from the library */
-static void message_handler_req_lib_cpg_mcast (void *conn, const void *message)
+/*
+ * Same as above, but library streams fragments and only every
+ * CPG_PARTIAL_MCAST_ACK_WINDOW-th and the last one is acknowledged.
+ * After first error rest of the message is dropped, receivers throw away
+ * incomplete message when next one starts.
+ *
+ * Fragments rejected by ipc_glue (error != CS_OK) are counted too, so the
+ * acknowledgements stay in step with the library and carry the error.
+ */
+static void cpg_partial_mcast_windowed_process (
+	void *conn,
+	const struct req_lib_cpg_partial_mcast *req_lib_cpg_mcast,
+	cs_error_t error)
+{
+	struct cpg_pd *cpd = (struct cpg_pd *)api->ipc_private_data_get (conn);
+	struct res_lib_cpg_partial_send res_lib_cpg_partial_send;
+
+	res_lib_cpg_partial_send.header.size = sizeof(res_lib_cpg_partial_send);
+	res_lib_cpg_partial_send.header.id = MESSAGE_RES_CPG_PARTIAL_SEND;
+
+	/*
+	 * Library only asks whether windowed send is supported
+	 */
+	if (req_lib_cpg_mcast->type == LIBCPG_PARTIAL_PROBE) {
+		res_lib_cpg_partial_send.header.error = CS_OK;
+		api->ipc_response_send (conn, &res_lib_cpg_partial_send,
+					sizeof (res_lib_cpg_partial_send));
+		return;
+	}
+
+	if (req_lib_cpg_mcast->type == LIBCPG_PARTIAL_FIRST) {
+		cpd->partial_frag_count = 0;
+		cpd->partial_error = CS_OK;
+	}
+
+	if (cpd->partial_error == CS_OK) {
+		if (error == CS_OK) {
+			cpd->partial_error = cpg_lib_partial_mcast_send (conn, req_lib_cpg_mcast);
+		} else {
+			cpd->partial_error = error;
+		}
+	}
+	cpd->partial_frag_count++;
+
+	if (cpd->partial_frag_count % CPG_PARTIAL_MCAST_ACK_WINDOW == 0 ||
+	    req_lib_cpg_mcast->type == LIBCPG_PARTIAL_LAST) {
+		res_lib_cpg_partial_send.header.error = cpd->partial_error;
+
+		api->ipc_response_send (conn, &res_lib_cpg_partial_send,
+					sizeof (res_lib_cpg_partial_send));
+	}
+}
+
+static void message_handler_req_lib_cpg_partial_mcast_windowed (void *conn, const void *message)
+{
+	log_printf(LOGSYS_LEVEL_TRACE, "got windowed fragmented mcast request on %p", conn);
+
+	cpg_partial_mcast_windowed_process (conn, message, CS_OK);
+}
+
+static void message_handler_req_lib_cpg_partial_mcast_windowed_reject (
+	void *conn,
+	const void *message,
+	cs_error_t error)
+{
+	log_printf(LOGSYS_LEVEL_TRACE, "windowed fragmented mcast request on %p rejected: %d",
+		conn, error);
+
+	cpg_partial_mcast_windowed_process (conn, message, error);
+}
+
+/*
+ * Send message to the group connection is joined to. Caller is responsible
+ * for checking that msglen fits into memory msg lives in.
+ */
+static cs_error_t cpg_lib_mcast_send (
+	void *conn,
+	const void *msg,
+	size_t msglen)
 {
-	const struct req_lib_cpg_mcast *req_lib_cpg_mcast = message;
 	struct cpg_pd *cpd = (struct cpg_pd *)api->ipc_private_data_get (conn);
 	mar_cpg_name_t group_name = cpd->group_name;
 
 	struct iovec req_exec_cpg_iovec[2];
 	struct req_exec_cpg_mcast req_exec_cpg_mcast;
-	int msglen = req_lib_cpg_mcast->msglen;
 	int result;
 	cs_error_t error = CS_ERR_NOT_EXIST;
 
-	log_printf(LOGSYS_LEVEL_TRACE, "got mcast request on %p", conn);
-
 	switch (cpd->cpd_state) {
 	case CPD_STATE_UNJOINED:
 		error = CS_ERR_NOT_EXIST;
@@ -1797,7 +2450,7 @@ static void message_handler_req_lib_cpg_mcast (void *conn, const void *message)
 
 		req_exec_cpg_iovec[0].iov_base = (char *)&req_exec_cpg_mcast;
 		req_exec_cpg_iovec[0].iov_len = sizeof(req_exec_cpg_mcast);
-		req_exec_cpg_iovec[1].iov_base = (char *)&req_lib_cpg_mcast->message;
+		req_exec_cpg_iovec[1].iov_base = (char *)msg;
 		req_exec_cpg_iovec[1].iov_len = msglen;
 
 		result = api->totem_mcast (req_exec_cpg_iovec, 2, TOTEM_AGREED);
@@ -1806,6 +2459,69 @@ static void message_handler_req_lib_cpg_mcast (void *conn, const void *message)
 		log_printf(LOGSYS_LEVEL_ERROR, "*** %p can't mcast to group %s state:%d, error:%d",
 			conn, group_name.value, cpd->cpd_state, error);
 	}
+
+	return (error);
+}
+
+/* Mcast message from the library */
+static void message_handler_req_lib_cpg_mcast (void *conn, const void *message)
+{
+	const struct req_lib_cpg_mcast *req_lib_cpg_mcast = message;
+
+	log_printf(LOGSYS_LEVEL_TRACE, "got mcast request on %p", conn);
+
+	(void)cpg_lib_mcast_send (conn, &req_lib_cpg_mcast->message, req_lib_cpg_mcast->msglen);
+}
+
+/*
+ * Mcast message placed by the library directly into zero copy buffer.
+ * Totem reads payload straight from the shared mapping so it never
+ * passes through IPC ring.
+ */
+static void message_handler_req_lib_cpg_zc_execute (
+	void *conn,
+	const void *message)
+{
+	const struct req_lib_cpg_zc_execute *req_lib_cpg_zc_execute = message;
+	struct res_lib_cpg_zc_execute res_lib_cpg_zc_execute;
+	struct cpg_pd *cpd = (struct cpg_pd *)api->ipc_private_data_get (conn);
+	const struct req_lib_cpg_mcast *req_lib_cpg_mcast;
+	struct zcb_mapped *zcb_mapped;
+	size_t max_msglen;
+	size_t msglen;
+	cs_error_t error;
+
+	log_printf(LOGSYS_LEVEL_TRACE, "got zc mcast request on %p", conn);
+
+	zcb_mapped = zcb_find_by_addr (cpd, req_lib_cpg_zc_execute->server_address);
+	if (zcb_mapped == NULL) {
+		error = CS_ERR_NOT_EXIST;
+		goto response_send;
+	}
+
+	req_lib_cpg_mcast = (const struct req_lib_cpg_mcast *)((const char *)zcb_mapped->addr +
+	    sizeof (struct cpg_zc_header));
+
+	/*
+	 * Buffer is shared with client, so length must be read only once
+	 */
+	msglen = *(volatile const mar_uint32_t *)&req_lib_cpg_mcast->msglen;
+	max_msglen = zcb_mapped->size - sizeof (struct cpg_zc_header) -
+	    sizeof (struct req_lib_cpg_mcast);
+	if (msglen > max_msglen) {
+		error = CS_ERR_INVALID_PARAM;
+		goto response_send;
+	}
+
+	error = cpg_lib_mcast_send (conn, &req_lib_cpg_mcast->message, msglen);
+
+response_send:
+	res_lib_cpg_zc_execute.header.size = sizeof (res_lib_cpg_zc_execute);
+	res_lib_cpg_zc_execute.header.id = MESSAGE_RES_CPG_ZC_EXECUTE;
+	res_lib_cpg_zc_execute.header.error = error;
+
+	api->ipc_response_send (conn, &res_lib_cpg_zc_execute,
+		sizeof (res_lib_cpg_zc_execute));
 }
 
 static void message_handler_req_lib_cpg_membership (void *conn,
@@ -1815,6 +2531,7 @@ static void message_handler_req_lib_cpg_membership (void *conn,
 		(struct req_lib_cpg_membership_get *)message;
 	struct res_lib_cpg_membership_get res_lib_cpg_membership_get;
 	struct qb_list_head *iter;
+	struct cpg_group *group;
 	int member_count = 0;
 
 	res_lib_cpg_membership_get.header.id = MESSAGE_RES_CPG_MEMBERSHIP;
@@ -1822,9 +2539,11 @@ static void message_handler_req_lib_cpg_membership (void *conn,
 	res_lib_cpg_membership_get.header.size =
 		sizeof (struct res_lib_cpg_membership_get);
 
-	qb_list_for_each(iter, &process_info_list_head) {
-		struct process_info *pi = qb_list_entry (iter, struct process_info, list);
-		if (mar_name_compare (&pi->group, &req_lib_cpg_membership_get->group_name) == 0) {
+	group = cpg_group_find (&req_lib_cpg_membership_get->group_name);
+	if (group != NULL) {
+		qb_list_for_each(iter, &group->pi_list_head) {
+			struct process_info *pi = qb_list_entry (iter, struct process_info, group_list);
+
 			res_lib_cpg_membership_get.member_list[member_count].nodeid = pi->nodeid;
 			res_lib_cpg_membership_get.member_list[member_count].pid = pi->pid;
 			member_count += 1;
@@ -74,6 +74,18 @@ static inline int cs_queue_init (struct cs_queue *cs_queue, size_t cs_queue_item
 	return (0);
 }
 
+/*
+ * Turn on locking of a queue created in single threaded mode. Must be called
+ * before the queue is accessed from another thread.
+ */
+static inline void cs_queue_threaded_mode_enable (struct cs_queue *cs_queue)
+{
+	if (!cs_queue->threaded_mode_enabled) {
+		pthread_mutex_init (&cs_queue->mutex, NULL);
+		cs_queue->threaded_mode_enabled = 1;
+	}
+}
+
 static inline int cs_queue_reinit (struct cs_queue *cs_queue)
 {
 	if (cs_queue->threaded_mode_enabled) {
@@ -38,6 +38,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <assert.h>
+#include <limits.h>
 #include <sys/uio.h>
 #include <string.h>
 
@@ -53,6 +54,8 @@
 #include <corosync/totem/totempg.h>
 #include <corosync/logsys.h>
 #include <corosync/icmap.h>
+#include <corosync/cpg.h>
+#include <corosync/ipc_cpg.h>
 
 #include "sync.h"
 #include "timer.h"
@@ -80,14 +83,44 @@ struct cs_ipcs_mapper {
 	char name[CS_IPCS_MAPPER_SERV_NAME];
 };
 
-struct outq_item {
-	void *msg;
+#define IPC_OUTQ_INITIAL_SIZE		64
+/*
+ * Queue grown to this many messages is logged, client is most likely stuck
+ */
+#define IPC_OUTQ_WARN_SIZE		65536
+
+#define IPC_FAIR_SHARE_WEIGHT_DEFAULT	1
+
+/*
+ * Message queued for a client which is not reading its events. A message
+ * dispatched to several slow clients (e.g. CPG delivery) is stored once
+ * and referenced from each of their queues, see
+ * cs_ipcs_dispatch_iov_send_shared.
+ */
+struct outq_payload {
+	uint32_t refcount;
 	size_t mlen;
-	struct qb_list_head list;
+	char msg[];
 };
 
 static struct cs_ipcs_mapper ipcs_mapper[SERVICES_COUNT_MAX];
 
+/*
+ * Fair share of totem send queue between connections. Each received token
+ * starts new epoch. Room free in the queue at that time is split between
+ * connections which sent flow controlled requests in this or previous epoch,
+ * according to their weight.
+ */
+static uint32_t fair_share_epoch = 1;
+static uint32_t fair_share_budget;
+/* Weight of connections active in previous epoch */
+static uint64_t fair_share_weight_prev;
+/* Weight of connections active in this epoch */
+static uint64_t fair_share_weight_cur;
+/* Weight of connections active in this epoch but not in previous one */
+static uint64_t fair_share_weight_new;
+static void *fair_share_token_handle;
+
 static int32_t cs_ipcs_job_add(enum qb_loop_priority p,	void *data, qb_loop_job_dispatch_fn fn);
 static int32_t cs_ipcs_dispatch_add(enum qb_loop_priority p, int32_t fd, int32_t events,
 	void *data, qb_ipcs_dispatch_fn_t fn);
@@ -111,12 +144,19 @@ static int32_t cs_ipcs_msg_process(qb_ipcs_connection_t *c,
 static int32_t cs_ipcs_connection_closed (qb_ipcs_connection_t *c);
 static void cs_ipcs_connection_destroyed (qb_ipcs_connection_t *c);
 
+static int32_t cs_ipcs_serialized_connection_accept (qb_ipcs_connection_t *c, uid_t euid, gid_t egid);
+static void cs_ipcs_serialized_connection_created(qb_ipcs_connection_t *c);
+static int32_t cs_ipcs_serialized_msg_process(qb_ipcs_connection_t *c,
+		void *data, size_t size);
+static int32_t cs_ipcs_serialized_connection_closed (qb_ipcs_connection_t *c);
+static void cs_ipcs_serialized_connection_destroyed (qb_ipcs_connection_t *c);
+
 static struct qb_ipcs_service_handlers corosync_service_funcs = {
-	.connection_accept	= cs_ipcs_connection_accept,
-	.connection_created	= cs_ipcs_connection_created,
-	.msg_process		= cs_ipcs_msg_process,
-	.connection_closed	= cs_ipcs_connection_closed,
-	.connection_destroyed	= cs_ipcs_connection_destroyed,
+	.connection_accept	= cs_ipcs_serialized_connection_accept,
+	.connection_created	= cs_ipcs_serialized_connection_created,
+	.msg_process		= cs_ipcs_serialized_msg_process,
+	.connection_closed	= cs_ipcs_serialized_connection_closed,
+	.connection_destroyed	= cs_ipcs_serialized_connection_destroyed,
 };
 
 static struct ipcs_global_stats global_stats;
@@ -170,12 +210,39 @@ int32_t cs_ipcs_service_destroy(int32_t service_id)
 	return 0;
 }
 
-static int32_t cs_ipcs_connection_accept (qb_ipcs_connection_t *c, uid_t euid, gid_t egid)
+static int cs_ipcs_uidgid_is_allowed (uid_t euid, gid_t egid)
 {
-	int32_t service = qb_ipcs_service_id_get(c);
 	uint8_t u8;
 	char key_name[ICMAP_KEYNAME_MAXLEN];
 
+	if (euid == 0 || egid == 0) {
+		return 1;
+	}
+
+	snprintf(key_name, ICMAP_KEYNAME_MAXLEN, "uidgid.uid.%u", euid);
+	if (icmap_get_uint8(key_name, &u8) == CS_OK && u8 == 1)
+		return 1;
+
+	snprintf(key_name, ICMAP_KEYNAME_MAXLEN, "uidgid.config.uid.%u", euid);
+	if (icmap_get_uint8(key_name, &u8) == CS_OK && u8 == 1)
+		return 1;
+
+	snprintf(key_name, ICMAP_KEYNAME_MAXLEN, "uidgid.gid.%u", egid);
+	if (icmap_get_uint8(key_name, &u8) == CS_OK && u8 == 1)
+		return 1;
+
+	snprintf(key_name, ICMAP_KEYNAME_MAXLEN, "uidgid.config.gid.%u", egid);
+	if (icmap_get_uint8(key_name, &u8) == CS_OK && u8 == 1)
+		return 1;
+
+	return 0;
+}
+
+static int32_t cs_ipcs_connection_accept (qb_ipcs_connection_t *c, uid_t euid, gid_t egid)
+{
+	int32_t service = qb_ipcs_service_id_get(c);
+	struct cs_ipcs_conn_context *context;
+
 	if (!ipc_allow_connections) {
 		log_printf(LOGSYS_LEVEL_DEBUG, "Denied connection, corosync is not ready");
 		return -EAGAIN;
@@ -190,29 +257,25 @@ static int32_t cs_ipcs_connection_accept (qb_ipcs_connection_t *c, uid_t euid, g
 		return -EMFILE;
 	}
 
-	if (euid == 0 || egid == 0) {
-		return 0;
+	if (!cs_ipcs_uidgid_is_allowed(euid, egid)) {
+		log_printf(LOGSYS_LEVEL_ERROR, "Denied connection attempt from %d:%d", euid, egid);
+		return -EACCES;
 	}
 
-	snprintf(key_name, ICMAP_KEYNAME_MAXLEN, "uidgid.uid.%u", euid);
-	if (icmap_get_uint8(key_name, &u8) == CS_OK && u8 == 1)
-		return 0;
-
-	snprintf(key_name, ICMAP_KEYNAME_MAXLEN, "uidgid.config.uid.%u", euid);
-	if (icmap_get_uint8(key_name, &u8) == CS_OK && u8 == 1)
-		return 0;
-
-	snprintf(key_name, ICMAP_KEYNAME_MAXLEN, "uidgid.gid.%u", egid);
-	if (icmap_get_uint8(key_name, &u8) == CS_OK && u8 == 1)
-		return 0;
-
-	snprintf(key_name, ICMAP_KEYNAME_MAXLEN, "uidgid.config.gid.%u", egid);
-	if (icmap_get_uint8(key_name, &u8) == CS_OK && u8 == 1)
-		return 0;
-
-	log_printf(LOGSYS_LEVEL_ERROR, "Denied connection attempt from %d:%d", euid, egid);
+	/*
+	 * Context is allocated here, because credentials of the client
+	 * are not available later. It's freed in connection_destroyed.
+	 */
+	context = calloc(1, sizeof(struct cs_ipcs_conn_context) +
+	    corosync_service[service]->private_data_size);
+	if (context == NULL) {
+		return -ENOMEM;
+	}
+	context->client_euid = euid;
+	context->client_egid = egid;
+	qb_ipcs_context_set(c, context);
 
-	return -EACCES;
+	return 0;
 }
 
 static char * pid_to_name (pid_t pid, char *out_name, size_t name_len)
@@ -259,31 +322,173 @@ static char * pid_to_name (pid_t pid, char *out_name, size_t name_len)
 	return out_name;
 }
 
+/*
+ * Weight of new connection, 0 when fair share is not used
+ */
+static uint32_t cs_ipcs_fair_share_weight_get(const char *proc_name)
+{
+	char key_name[ICMAP_KEYNAME_MAXLEN];
+	char *str;
+	int enabled = 0;
+	uint32_t weight;
+
+	if (icmap_get_string("system.ipc_fair_share", &str) == CS_OK) {
+		enabled = (strcmp(str, "yes") == 0);
+		free(str);
+	}
+	if (!enabled) {
+		return 0;
+	}
+
+	if (proc_name[0] != '\0') {
+		snprintf(key_name, ICMAP_KEYNAME_MAXLEN, "system.ipc_fair_share_weight.%s", proc_name);
+		if (icmap_get_uint32(key_name, &weight) == CS_OK && weight > 0) {
+			return weight;
+		}
+	}
+
+	if (icmap_get_uint32("system.ipc_fair_share_weight", &weight) != CS_OK ||
+	    weight == 0) {
+		weight = IPC_FAIR_SHARE_WEIGHT_DEFAULT;
+	}
+
+	return weight;
+}
+
+static int cs_ipcs_fair_share_token_fn(enum totem_callback_token_type type, const void *data)
+{
+	fair_share_epoch++;
+	fair_share_weight_prev = fair_share_weight_cur;
+	fair_share_weight_cur = 0;
+	fair_share_weight_new = 0;
+	fair_share_budget = totempg_queue_avail_get();
+
+	return 0;
+}
+
+/*
+ * Account msg_count messages reserved by the connection. Returns 0 when the
+ * connection already used its share of this epoch. The first request in
+ * an epoch is always allowed, so large messages are not starved, but the
+ * part above the share is kept as debt and paid from the following epochs
+ * before the connection may send again.
+ */
+static int cs_ipcs_fair_share_check(struct cs_ipcs_conn_context *cnx, int msg_count)
+{
+	uint64_t weight;
+	uint64_t share;
+	uint64_t paid;
+	uint32_t epochs;
+
+	if (cnx->fair_share_weight == 0) {
+		return 1;
+	}
+
+	weight = fair_share_weight_prev + fair_share_weight_new;
+	share = fair_share_budget;
+	if (weight > cnx->fair_share_weight) {
+		share = share * cnx->fair_share_weight / weight;
+	}
+
+	if (cnx->fair_share_epoch != fair_share_epoch) {
+		if (cnx->fair_share_epoch == 0 || cnx->fair_share_epoch != fair_share_epoch - 1) {
+			fair_share_weight_new += cnx->fair_share_weight;
+		}
+		fair_share_weight_cur += cnx->fair_share_weight;
+
+		/*
+		 * Every epoch passed since the last request pays one share
+		 * of the debt, the current one included
+		 */
+		epochs = fair_share_epoch - cnx->fair_share_epoch;
+		if (cnx->fair_share_epoch == 0 || share == 0 ||
+		    cnx->fair_share_debt / share < epochs) {
+			paid = cnx->fair_share_debt;
+		} else {
+			paid = share * epochs;
+		}
+		cnx->fair_share_debt -= paid;
+		cnx->fair_share_used = (paid > share ? share : paid);
+		cnx->fair_share_epoch = fair_share_epoch;
+	}
+
+	if (msg_count <= 0) {
+		return 1;
+	}
+
+	if (cnx->fair_share_used > 0 && cnx->fair_share_used + msg_count > share) {
+		cnx->fair_share_throttled++;
+		return 0;
+	}
+
+	if (cnx->fair_share_used + msg_count > share) {
+		cnx->fair_share_debt += cnx->fair_share_used + msg_count - share;
+		cnx->fair_share_used = share;
+	} else {
+		cnx->fair_share_used += msg_count;
+	}
+
+	return 1;
+}
+
+/*
+ * Number of messages a request is charged by the fair share check.
+ * Windowed CPG fragments are streamed without waiting for a reply and a
+ * rejected one makes the library restart the whole message, so the whole
+ * message is charged at its first fragment and the others pass. What
+ * doesn't fit the share of the epoch is carried over as debt.
+ */
+static int cs_ipcs_fair_share_msg_count(int32_t service,
+	const struct qb_ipc_request_header *request_pt, int msg_count)
+{
+	const struct req_lib_cpg_partial_mcast *req_lib_cpg_mcast;
+	uint64_t count;
+
+	if (service != CPG_SERVICE ||
+	    request_pt->id != MESSAGE_REQ_CPG_PARTIAL_MCAST_WINDOWED) {
+		return msg_count;
+	}
+
+	req_lib_cpg_mcast = (const struct req_lib_cpg_partial_mcast *)request_pt;
+	if (req_lib_cpg_mcast->type != LIBCPG_PARTIAL_FIRST) {
+		return 0;
+	}
+	if (req_lib_cpg_mcast->fraglen == 0 || msg_count <= 0) {
+		return msg_count;
+	}
+
+	count = ((uint64_t)req_lib_cpg_mcast->msglen + req_lib_cpg_mcast->fraglen - 1) /
+		req_lib_cpg_mcast->fraglen * msg_count;
+
+	return (count > INT_MAX ? INT_MAX : count);
+}
+
 static void cs_ipcs_connection_created(qb_ipcs_connection_t *c)
 {
 	int32_t service = 0;
 	struct cs_ipcs_conn_context *context;
 	struct qb_ipcs_connection_stats stats;
-	size_t size = sizeof(struct cs_ipcs_conn_context);
 
 	log_printf(LOG_DEBUG, "connection created");
 
 	service = qb_ipcs_service_id_get(c);
 
-	size += corosync_service[service]->private_data_size;
-	context = calloc(1, size);
+	context = qb_ipcs_context_get(c);
 	if (context == NULL) {
 		qb_ipcs_disconnect(c);
 		return;
 	}
 
-	qb_list_init(&context->outq_head);
+	context->outq = NULL;
+	context->outq_size = 0;
+	context->outq_head = 0;
+	if (icmap_get_uint32("system.ipc_outq_max", &context->outq_max) != CS_OK) {
+		context->outq_max = 0;
+	}
 	context->queuing = QB_FALSE;
 	context->queued = 0;
 	context->sent = 0;
 
-	qb_ipcs_context_set(c, context);
-
 	if (corosync_service[service]->lib_init_fn(c) != 0) {
 		log_printf(LOG_ERR, "lib_init_fn failed, disconnecting");
 		qb_ipcs_disconnect(c);
@@ -295,6 +500,7 @@ static void cs_ipcs_connection_created(qb_ipcs_connection_t *c)
 	if (!pid_to_name (stats.client_pid, context->proc_name, sizeof(context->proc_name))) {
 		context->proc_name[0] = '\0';
 	}
+	context->fair_share_weight = cs_ipcs_fair_share_weight_get(context->proc_name);
 	stats_ipcs_add_connection(service, stats.client_pid, c);
 	global_stats.active++;
 }
@@ -316,23 +522,136 @@ void *cs_ipcs_private_data_get(void *conn)
 	return &cnx->data[0];
 }
 
+void cs_ipcs_credentials_get(void *conn, pid_t *pid, uid_t *euid, gid_t *egid)
+{
+	struct cs_ipcs_conn_context *cnx;
+	struct qb_ipcs_connection_stats stats;
+
+	cnx = qb_ipcs_context_get(conn);
+	qb_ipcs_connection_stats_get(conn, &stats, QB_FALSE);
+	*pid = stats.client_pid;
+	*euid = cnx->client_euid;
+	*egid = cnx->client_egid;
+}
+
+static void outq_payload_put (struct outq_payload *payload)
+{
+	if (--payload->refcount > 0) {
+		return;
+	}
+
+	free (payload);
+}
+
+/*
+ * Return payload holding message in iov. When shared is not NULL, payload
+ * is created once, stored in *shared and referenced by every queue the
+ * same message goes to.
+ */
+static struct outq_payload *outq_payload_get (
+	const struct iovec *iov,
+	uint32_t iov_len,
+	size_t bytes_msg,
+	struct outq_payload **shared)
+{
+	struct outq_payload *payload;
+	char *write_buf;
+	uint32_t i;
+
+	if (shared != NULL && *shared != NULL) {
+		(*shared)->refcount++;
+		return (*shared);
+	}
+
+	payload = malloc (sizeof (struct outq_payload) + bytes_msg);
+	if (payload == NULL) {
+		return (NULL);
+	}
+
+	write_buf = payload->msg;
+	for (i = 0; i < iov_len; i++) {
+		memcpy (write_buf, iov[i].iov_base, iov[i].iov_len);
+		write_buf += iov[i].iov_len;
+	}
+	payload->mlen = bytes_msg;
+	payload->refcount = 1;
+
+	if (shared != NULL) {
+		/*
+		 * One more reference is held by the dispatcher until
+		 * cs_ipcs_dispatch_payload_put
+		 */
+		payload->refcount++;
+		*shared = payload;
+	}
+
+	return (payload);
+}
+
+/*
+ * Make room for one more message in the connection outq. Ring is allocated
+ * when the client first falls behind and grows up to outq_max (unbounded
+ * when 0), then it is kept for the rest of the connection lifetime.
+ */
+static int outq_reserve (struct cs_ipcs_conn_context *context)
+{
+	struct outq_payload **new_outq;
+	uint32_t new_size;
+	uint32_t i;
+
+	if (context->queued < context->outq_size) {
+		return (0);
+	}
+
+	if ((context->outq_max != 0 && context->outq_size >= context->outq_max) ||
+	    context->outq_size > UINT32_MAX / 2) {
+		return (-1);
+	}
+
+	new_size = context->outq_size * 2;
+	if (new_size < IPC_OUTQ_INITIAL_SIZE) {
+		new_size = IPC_OUTQ_INITIAL_SIZE;
+	}
+	if (context->outq_max != 0 && new_size > context->outq_max) {
+		new_size = context->outq_max;
+	}
+
+	if (new_size >= IPC_OUTQ_WARN_SIZE) {
+		log_printf(LOGSYS_LEVEL_WARNING,
+			"Outq of %s grows to %u messages, client doesn't read its events",
+			context->proc_name, new_size);
+	}
+
+	new_outq = malloc (new_size * sizeof (struct outq_payload *));
+	if (new_outq == NULL) {
+		return (-1);
+	}
+
+	for (i = 0; i < context->queued; i++) {
+		new_outq[i] = context->outq[(context->outq_head + i) % context->outq_size];
+	}
+	free (context->outq);
+
+	context->outq = new_outq;
+	context->outq_size = new_size;
+	context->outq_head = 0;
+
+	return (0);
+}
+
 static void cs_ipcs_connection_destroyed (qb_ipcs_connection_t *c)
 {
 	struct cs_ipcs_conn_context *context;
-	struct qb_list_head *list, *tmp_iter;
-	struct outq_item *outq_item;
+	uint32_t i;
 
 	log_printf(LOG_DEBUG, "%s() ", __func__);
 
 	context = qb_ipcs_context_get(c);
 	if (context) {
-		qb_list_for_each_safe(list, tmp_iter, &(context->outq_head)) {
-			outq_item = qb_list_entry (list, struct outq_item, list);
-
-			qb_list_del (list);
-			free (outq_item->msg);
-			free (outq_item);
+		for (i = 0; i < context->queued; i++) {
+			outq_payload_put (context->outq[(context->outq_head + i) % context->outq_size]);
 		}
+		free(context->outq);
 		free(context);
 	}
 }
@@ -342,6 +661,7 @@ static int32_t cs_ipcs_connection_closed (qb_ipcs_connection_t *c)
 	int32_t res = 0;
 	int32_t service = qb_ipcs_service_id_get(c);
 	struct qb_ipcs_connection_stats stats;
+	struct cs_ipcs_conn_context *cnx;
 
 	log_printf(LOG_DEBUG, "%s() ", __func__);
 	res = corosync_service[service]->lib_exit_fn(c);
@@ -351,6 +671,9 @@ static int32_t cs_ipcs_connection_closed (qb_ipcs_connection_t *c)
 
 	qb_loop_job_del(cs_poll_handle_get(), QB_LOOP_HIGH, c, outq_flush);
 
+	cnx = qb_ipcs_context_get(c);
+	cnx->closed = QB_TRUE;
+
 	qb_ipcs_connection_stats_get(c, &stats, QB_FALSE);
 
 	stats_ipcs_del_connection(service, stats.client_pid, c);
@@ -360,11 +683,104 @@ static int32_t cs_ipcs_connection_closed (qb_ipcs_connection_t *c)
 	return 0;
 }
 
+/*
+ * libqb IPC can only be used from the main loop. Requests coming from the
+ * delivery thread are copied and passed to the main loop, holding
+ * a connection reference until they are done.
+ */
+struct deferred_response {
+	qb_ipcs_connection_t *conn;
+	size_t mlen;
+	char msg[];
+};
+
+static void deferred_response_send (void *data)
+{
+	struct deferred_response *response = data;
+	int32_t rc;
+
+	rc = qb_ipcs_response_send(response->conn, response->msg, response->mlen);
+	if (rc < 0 && rc != -ENOTCONN) {
+		errno = -rc;
+		qb_perror(LOG_ERR, "qb_ipcs_response_send");
+	}
+
+	cs_serialize_lock();
+	qb_ipcs_connection_unref(response->conn);
+	cs_serialize_unlock();
+	free(response);
+}
+
+static int deferred_response_add (void *conn,
+	const struct iovec *iov,
+	unsigned int iov_len)
+{
+	struct deferred_response *response;
+	size_t mlen = 0;
+	char *msg;
+	unsigned int i;
+
+	for (i = 0; i < iov_len; i++) {
+		mlen += iov[i].iov_len;
+	}
+
+	response = malloc(sizeof(struct deferred_response) + mlen);
+	if (response == NULL) {
+		return -ENOMEM;
+	}
+	response->conn = conn;
+	response->mlen = mlen;
+	msg = response->msg;
+	for (i = 0; i < iov_len; i++) {
+		memcpy(msg, iov[i].iov_base, iov[i].iov_len);
+		msg += iov[i].iov_len;
+	}
+
+	qb_ipcs_connection_ref(conn);
+	if (cs_main_loop_work_add(deferred_response_send, response) != 0) {
+		qb_ipcs_connection_unref(conn);
+		free(response);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void deferred_disconnect (void *data)
+{
+	qb_ipcs_connection_t *conn = data;
+
+	cs_serialize_lock();
+	qb_ipcs_disconnect(conn);
+	qb_ipcs_connection_unref(conn);
+	cs_serialize_unlock();
+}
+
+static void cs_ipcs_disconnect (qb_ipcs_connection_t *conn)
+{
+	if (cs_main_thread_is_current()) {
+		qb_ipcs_disconnect(conn);
+		return;
+	}
+
+	qb_ipcs_connection_ref(conn);
+	if (cs_main_loop_work_add(deferred_disconnect, conn) != 0) {
+		log_printf(LOGSYS_LEVEL_ERROR, "Can't schedule disconnect of client");
+		qb_ipcs_connection_unref(conn);
+	}
+}
+
 int cs_ipcs_response_iov_send (void *conn,
 	const struct iovec *iov,
 	unsigned int iov_len)
 {
-	int32_t rc = qb_ipcs_response_sendv(conn, iov, iov_len);
+	int32_t rc;
+
+	if (!cs_main_thread_is_current()) {
+		return deferred_response_add(conn, iov, iov_len);
+	}
+
+	rc = qb_ipcs_response_sendv(conn, iov, iov_len);
 	if (rc >= 0) {
 		return 0;
 	}
@@ -373,7 +789,16 @@ int cs_ipcs_response_iov_send (void *conn,
 
 int cs_ipcs_response_send(void *conn, const void *msg, size_t mlen)
 {
-	int32_t rc = qb_ipcs_response_send(conn, msg, mlen);
+	struct iovec iov;
+	int32_t rc;
+
+	if (!cs_main_thread_is_current()) {
+		iov.iov_base = (void *)msg;
+		iov.iov_len = mlen;
+		return deferred_response_add(conn, &iov, 1);
+	}
+
+	rc = qb_ipcs_response_send(conn, msg, mlen);
 	if (rc >= 0) {
 		return 0;
 	}
@@ -383,31 +808,34 @@ int cs_ipcs_response_send(void *conn, const void *msg, size_t mlen)
 static void outq_flush (void *data)
 {
 	qb_ipcs_connection_t *conn = data;
-	struct qb_list_head *list, *tmp_iter;
-	struct outq_item *outq_item;
+	struct outq_payload *payload;
 	int32_t rc;
-	struct cs_ipcs_conn_context *context = qb_ipcs_context_get(conn);
+	struct cs_ipcs_conn_context *context;
+
+	cs_serialize_lock();
+	context = qb_ipcs_context_get(conn);
 
-	qb_list_for_each_safe(list, tmp_iter, &(context->outq_head)) {
-		outq_item = qb_list_entry (list, struct outq_item, list);
+	while (context->queued > 0) {
+		payload = context->outq[context->outq_head];
 
-		rc = qb_ipcs_event_send(conn, outq_item->msg, outq_item->mlen);
+		rc = qb_ipcs_event_send(conn, payload->msg, payload->mlen);
 		if (rc < 0 && rc != -EAGAIN) {
 			errno = -rc;
 			qb_perror(LOG_ERR, "qb_ipcs_event_send");
+			cs_serialize_unlock();
 			return;
 		} else if (rc == -EAGAIN) {
 			break;
 		}
-		assert(rc == outq_item->mlen);
+		assert(rc == payload->mlen);
 		context->sent++;
 		context->queued--;
 
-		qb_list_del (list);
-		free (outq_item->msg);
-		free (outq_item);
+		context->outq[context->outq_head] = NULL;
+		context->outq_head = (context->outq_head + 1) % context->outq_size;
+		outq_payload_put (payload);
 	}
-	if (qb_list_empty (&context->outq_head)) {
+	if (context->queued == 0) {
 		context->queuing = QB_FALSE;
 		log_printf(LOGSYS_LEVEL_INFO, "Q empty, queued:%d sent:%d.",
 			context->queued, context->sent);
@@ -416,15 +844,45 @@ static void outq_flush (void *data)
 	} else {
 		qb_loop_job_add(cs_poll_handle_get(), QB_LOOP_HIGH, conn, outq_flush);
 	}
+	cs_serialize_unlock();
+}
+
+static void outq_flush_deferred (void *data)
+{
+	qb_ipcs_connection_t *conn = data;
+	struct cs_ipcs_conn_context *context;
+
+	cs_serialize_lock();
+	context = qb_ipcs_context_get(conn);
+	if (!context->closed) {
+		outq_flush(conn);
+	}
+	qb_ipcs_connection_unref(conn);
+	cs_serialize_unlock();
+}
+
+static void outq_flush_schedule (qb_ipcs_connection_t *conn)
+{
+	if (cs_main_thread_is_current()) {
+		qb_loop_job_add(cs_poll_handle_get(), QB_LOOP_HIGH, conn, outq_flush);
+		return;
+	}
+
+	qb_ipcs_connection_ref(conn);
+	if (cs_main_loop_work_add(outq_flush_deferred, conn) != 0) {
+		log_printf(LOGSYS_LEVEL_ERROR, "Can't schedule outq flush, disconnecting client");
+		qb_ipcs_connection_unref(conn);
+		cs_ipcs_disconnect(conn);
+	}
 }
 
-static void msg_send_or_queue(qb_ipcs_connection_t *conn, const struct iovec *iov, uint32_t iov_len)
+static void msg_send_or_queue(qb_ipcs_connection_t *conn, const struct iovec *iov, uint32_t iov_len,
+	struct outq_payload **shared)
 {
 	int32_t rc = 0;
 	int32_t i;
 	int32_t bytes_msg = 0;
-	struct outq_item *outq_item;
-	char *write_buf = 0;
+	struct outq_payload *payload;
 	struct cs_ipcs_conn_context *context = qb_ipcs_context_get(conn);
 
 	for (i = 0; i < iov_len; i++) {
@@ -432,43 +890,51 @@ static void msg_send_or_queue(qb_ipcs_connection_t *conn, const struct iovec *io
 	}
 
 	if (!context->queuing) {
-		assert(qb_list_empty (&context->outq_head));
-		rc = qb_ipcs_event_sendv(conn, iov, iov_len);
-		if (rc == bytes_msg) {
-			context->sent++;
-			return;
-		}
-		if (rc == -EAGAIN) {
-			context->queued = 0;
-			context->sent = 0;
-			context->queuing = QB_TRUE;
-			qb_loop_job_add(cs_poll_handle_get(), QB_LOOP_HIGH, conn, outq_flush);
-		} else {
-			log_printf(LOGSYS_LEVEL_ERROR, "event_send retuned %d, expected %d!", rc, bytes_msg);
-			return;
+		assert(context->queued == 0);
+		/*
+		 * In the delivery thread message is always queued and sent
+		 * by the main loop
+		 */
+		if (cs_main_thread_is_current()) {
+			rc = qb_ipcs_event_sendv(conn, iov, iov_len);
+			if (rc == bytes_msg) {
+				context->sent++;
+				return;
+			}
+			if (rc != -EAGAIN) {
+				log_printf(LOGSYS_LEVEL_ERROR, "event_send retuned %d, expected %d!", rc, bytes_msg);
+				return;
+			}
 		}
+		context->queued = 0;
+		context->sent = 0;
+		context->queuing = QB_TRUE;
+		outq_flush_schedule(conn);
 	}
-	outq_item = malloc (sizeof (struct outq_item));
-	if (outq_item == NULL) {
-		qb_ipcs_disconnect(conn);
+	if (outq_reserve (context) != 0) {
+		if (context->queue_full++ == 0) {
+			log_printf(LOGSYS_LEVEL_WARNING,
+				"Outq of %s full (%u messages), disconnecting client",
+				context->proc_name, context->queued);
+		}
+		cs_ipcs_disconnect(conn);
 		return;
 	}
-	outq_item->msg = malloc (bytes_msg);
-	if (outq_item->msg == NULL) {
-		free (outq_item);
-		qb_ipcs_disconnect(conn);
+
+	if (shared != NULL && *shared != NULL) {
+		context->queued_shared++;
+	}
+	payload = outq_payload_get (iov, iov_len, bytes_msg, shared);
+	if (payload == NULL) {
+		cs_ipcs_disconnect(conn);
 		return;
 	}
 
-	write_buf = outq_item->msg;
-	for (i = 0; i < iov_len; i++) {
-		memcpy (write_buf, iov[i].iov_base, iov[i].iov_len);
-		write_buf += iov[i].iov_len;
-	}
-	outq_item->mlen = bytes_msg;
-	qb_list_init (&outq_item->list);
-	qb_list_add_tail (&outq_item->list, &context->outq_head);
+	context->outq[(context->outq_head + context->queued) % context->outq_size] = payload;
 	context->queued++;
+	if (context->queued > context->queued_max) {
+		context->queued_max = context->queued;
+	}
 }
 
 int cs_ipcs_dispatch_send(void *conn, const void *msg, size_t mlen)
@@ -476,7 +942,7 @@ int cs_ipcs_dispatch_send(void *conn, const void *msg, size_t mlen)
 	struct iovec iov;
 	iov.iov_base = (void *)msg;
 	iov.iov_len = mlen;
-	msg_send_or_queue (conn, &iov, 1);
+	msg_send_or_queue (conn, &iov, 1, NULL);
 	return 0;
 }
 
@@ -484,10 +950,46 @@ int cs_ipcs_dispatch_iov_send (void *conn,
 	const struct iovec *iov,
 	unsigned int iov_len)
 {
-	msg_send_or_queue(conn, iov, iov_len);
+	msg_send_or_queue(conn, iov, iov_len, NULL);
+	return 0;
+}
+
+/*
+ * Same as cs_ipcs_dispatch_iov_send, for a message dispatched to many
+ * connections. *payload must be NULL for the first connection. If the
+ * message has to be queued, it is copied once into *payload and the
+ * following connections reference the same copy. Dispatcher releases it
+ * with cs_ipcs_dispatch_payload_put when done.
+ */
+int cs_ipcs_dispatch_iov_send_shared (void *conn,
+	const struct iovec *iov,
+	unsigned int iov_len,
+	void **payload)
+{
+	msg_send_or_queue(conn, iov, iov_len, (struct outq_payload **)payload);
 	return 0;
 }
 
+void cs_ipcs_dispatch_payload_put (void *payload)
+{
+	if (payload != NULL) {
+		outq_payload_put (payload);
+	}
+}
+
+/*
+ * Request id comes from the client, so it is checked before it is used to
+ * look up the handler
+ */
+static struct corosync_lib_handler *cs_ipcs_lib_handler_get(int32_t service, int32_t id)
+{
+	if (id < 0 || id >= corosync_service[service]->lib_engine_count) {
+		return NULL;
+	}
+
+	return &corosync_service[service]->lib_engine[id];
+}
+
 static int32_t cs_ipcs_msg_process(qb_ipcs_connection_t *c,
 		void *data, size_t size)
 {
@@ -496,9 +998,12 @@ static int32_t cs_ipcs_msg_process(qb_ipcs_connection_t *c,
 	int32_t service = qb_ipcs_service_id_get(c);
 	int32_t send_ok = 0;
 	int32_t is_async_call = QB_FALSE;
+	int32_t fair_share_backoff = QB_FALSE;
+	int32_t fair_share_rejected = QB_FALSE;
 	ssize_t res = -1;
 	int sending_allowed_private_data;
 	struct cs_ipcs_conn_context *cnx;
+	struct corosync_lib_handler *lib_handler;
 
 	send_ok = corosync_sending_allowed (service,
 			request_pt->id,
@@ -507,6 +1012,28 @@ static int32_t cs_ipcs_msg_process(qb_ipcs_connection_t *c,
 
 	is_async_call = (service == CPG_SERVICE && request_pt->id == 2);
 
+	if (send_ok > 0 &&
+	    corosync_service[service]->lib_engine[request_pt->id].flow_control == CS_LIB_FLOW_CONTROL_REQUIRED) {
+		cnx = qb_ipcs_context_get(c);
+		if (cnx && !cs_ipcs_fair_share_check(cnx,
+		    cs_ipcs_fair_share_msg_count(service, request_pt, sending_allowed_private_data))) {
+			if (is_async_call) {
+				/*
+				 * There is no way to ask the client to retry, so the
+				 * request is processed. Returning error makes libqb
+				 * back off reading further requests of the connection.
+				 */
+				fair_share_backoff = QB_TRUE;
+			} else {
+				/*
+				 * Counted in fair_share_throttled only
+				 */
+				fair_share_rejected = QB_TRUE;
+				send_ok = -ENOBUFS;
+			}
+		}
+	}
+
 	/*
 	 * This happens when the message contains some kind of invalid
 	 * parameter, such as an invalid size
@@ -521,7 +1048,10 @@ static int32_t cs_ipcs_msg_process(qb_ipcs_connection_t *c,
 			cnx->invalid_request++;
 		}
 
-		if (is_async_call) {
+		lib_handler = cs_ipcs_lib_handler_get(service, request_pt->id);
+		if (lib_handler && lib_handler->lib_reject_fn) {
+			lib_handler->lib_reject_fn(c, request_pt, CS_ERR_INVALID_PARAM);
+		} else if (is_async_call) {
 			log_printf(LOGSYS_LEVEL_INFO, "*** %s() invalid message! size:%d error:%d",
 				__func__, response.size, response.error);
 		} else {
@@ -532,10 +1062,17 @@ static int32_t cs_ipcs_msg_process(qb_ipcs_connection_t *c,
 		res = -EINVAL;
 	} else if (send_ok < 0) {
 		cnx = qb_ipcs_context_get(c);
-		if (cnx) {
+		if (cnx && !fair_share_rejected) {
 			cnx->overload++;
 		}
-		if (!is_async_call) {
+		lib_handler = cs_ipcs_lib_handler_get(service, request_pt->id);
+		if (lib_handler && lib_handler->lib_reject_fn) {
+			/*
+			 * Service replies itself (e.g. as part of a windowed
+			 * acknowledgement)
+			 */
+			lib_handler->lib_reject_fn(c, request_pt, CS_ERR_TRY_AGAIN);
+		} else if (!is_async_call) {
 			/*
 			 * Overload, tell library to retry
 			 */
@@ -556,12 +1093,64 @@ static int32_t cs_ipcs_msg_process(qb_ipcs_connection_t *c,
 
 	if (send_ok >= 0) {
 		corosync_service[service]->lib_engine[request_pt->id].lib_handler_fn(c, request_pt);
-		res = 0;
+		res = fair_share_backoff ? -ENOBUFS : 0;
 	}
 	corosync_sending_allowed_release (&sending_allowed_private_data);
 	return res;
 }
 
+/*
+ * With the delivery thread enabled, service callbacks run outside of the
+ * main loop. IPC handlers enter the same services, so take the serialize
+ * lock around them.
+ */
+static int32_t cs_ipcs_serialized_connection_accept (qb_ipcs_connection_t *c, uid_t euid, gid_t egid)
+{
+	int32_t res;
+
+	cs_serialize_lock();
+	res = cs_ipcs_connection_accept(c, euid, egid);
+	cs_serialize_unlock();
+
+	return res;
+}
+
+static void cs_ipcs_serialized_connection_created(qb_ipcs_connection_t *c)
+{
+	cs_serialize_lock();
+	cs_ipcs_connection_created(c);
+	cs_serialize_unlock();
+}
+
+static int32_t cs_ipcs_serialized_msg_process(qb_ipcs_connection_t *c,
+		void *data, size_t size)
+{
+	int32_t res;
+
+	cs_serialize_lock();
+	res = cs_ipcs_msg_process(c, data, size);
+	cs_serialize_unlock();
+
+	return res;
+}
+
+static int32_t cs_ipcs_serialized_connection_closed (qb_ipcs_connection_t *c)
+{
+	int32_t res;
+
+	cs_serialize_lock();
+	res = cs_ipcs_connection_closed(c);
+	cs_serialize_unlock();
+
+	return res;
+}
+
+static void cs_ipcs_serialized_connection_destroyed (qb_ipcs_connection_t *c)
+{
+	cs_serialize_lock();
+	cs_ipcs_connection_destroyed(c);
+	cs_serialize_unlock();
+}
 
 static int32_t cs_ipcs_job_add(enum qb_loop_priority p,	void *data, qb_loop_job_dispatch_fn fn)
 {
@@ -604,11 +1193,35 @@ int32_t cs_ipcs_q_level_get(void)
 }
 
 static qb_loop_timer_handle ipcs_check_for_flow_control_timer;
+static int32_t ipcs_check_for_flow_control_pending;
+
+static void cs_ipcs_check_for_flow_control(void);
+
+static void cs_ipcs_check_for_flow_control_deferred(void *data)
+{
+	cs_serialize_lock();
+	ipcs_check_for_flow_control_pending = QB_FALSE;
+	cs_ipcs_check_for_flow_control();
+	cs_serialize_unlock();
+}
+
 static void cs_ipcs_check_for_flow_control(void)
 {
 	int32_t i;
 	int32_t fc_enabled;
 
+	/*
+	 * Quorum, sync and queue level changes may be reported from the
+	 * delivery thread, but libqb has to be called from the main loop
+	 */
+	if (!cs_main_thread_is_current()) {
+		if (!ipcs_check_for_flow_control_pending &&
+		    cs_main_loop_work_add(cs_ipcs_check_for_flow_control_deferred, NULL) == 0) {
+			ipcs_check_for_flow_control_pending = QB_TRUE;
+		}
+		return;
+	}
+
 	for (i = 0; i < SERVICES_COUNT_MAX; i++) {
 		if (corosync_service[i] == NULL || ipcs_mapper[i].inst == NULL) {
 			continue;
@@ -733,6 +1346,10 @@ void cs_ipcs_clear_stats(void)
 			cnx->invalid_request = 0;
 			cnx->overload = 0;
 			cnx->sent = 0;
+			cnx->queued_max = 0;
+			cnx->queued_shared = 0;
+			cnx->queue_full = 0;
+			cnx->fair_share_throttled = 0;
 
 		}
 	}
@@ -824,6 +1441,9 @@ void cs_ipcs_init(void)
 	api->quorum_register_callback (cs_ipcs_fc_quorum_changed, NULL);
 	totempg_queue_level_register_callback (cs_ipcs_totem_queue_level_changed);
 
+	api->totem_callback_token_create (&fair_share_token_handle,
+		TOTEM_CALLBACK_TOKEN_RECEIVED, 0, cs_ipcs_fair_share_token_fn, NULL);
+
 	global_stats.active = 0;
 	global_stats.closed = 0;
 }
@@ -32,13 +32,29 @@
  * THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+struct outq_payload;
+
 struct cs_ipcs_conn_context {
-	struct qb_list_head outq_head;
+	struct outq_payload **outq;
+	uint32_t outq_size;
+	uint32_t outq_max;
+	uint32_t outq_head;
 	int32_t queuing;
+	int32_t closed;
 	uint32_t queued;
+	uint32_t queued_max;
+	uint64_t queued_shared;
+	uint64_t queue_full;
 	uint64_t invalid_request;
 	uint64_t overload;
 	uint32_t sent;
+	uint32_t fair_share_weight;
+	uint32_t fair_share_epoch;
+	uint32_t fair_share_used;
+	uint64_t fair_share_debt;
+	uint64_t fair_share_throttled;
+	uid_t client_euid;
+	gid_t client_egid;
 	char proc_name[32];
 	char data[1];
 };
@@ -101,6 +101,7 @@
 #endif
 
 #include <qb/qbdefs.h>
+#include <qb/qblist.h>
 #include <qb/qblog.h>
 #include <qb/qbloop.h>
 #include <qb/qbutil.h>
@@ -169,6 +170,29 @@ static char corosync_config_file[PATH_MAX + 1] = COROSYSCONFDIR "/corosync.conf"
 
 static int lockfile_fd = -1;
 
+static int delivery_thread_enabled = 0;
+
+static pthread_mutex_t serialize_mutex;
+
+static pthread_t main_thread;
+
+/*
+ * Work passed to the main loop from the delivery thread. libqb loop and IPC
+ * functions are not thread safe, so the delivery thread queues the call and
+ * wakes up the main loop through main_loop_work_pipe.
+ */
+struct main_loop_work {
+	struct qb_list_head list;
+	void (*work_fn) (void *data);
+	void *data;
+};
+
+static pthread_mutex_t main_loop_work_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static QB_LIST_DECLARE (main_loop_work_list_head);
+
+static int main_loop_work_pipe[2] = { -1, -1 };
+
 enum move_to_root_cgroup_mode {
 	MOVE_TO_ROOT_CGROUP_MODE_OFF = 0,
 	MOVE_TO_ROOT_CGROUP_MODE_ON = 1,
@@ -251,8 +275,8 @@ static void corosync_blackbox_write_to_file (void)
 static void unlink_all_completed (void)
 {
 	api->timer_delete (corosync_stats_timer_handle);
+	stats_shm_finalize();
 	qb_loop_stop (corosync_poll_handle);
-	icmap_fini();
 }
 
 void corosync_shutdown_request (void)
@@ -290,12 +314,121 @@ static struct totempg_group corosync_group = {
 	.group_len	= 1
 };
 
-static void serialize_lock (void)
+/*
+ * Serializes service code when application callbacks are delivered in
+ * delivery thread. Main loop handlers calling into services take the lock
+ * too. Without delivery thread everything runs in main thread and these
+ * are no-ops.
+ */
+void cs_serialize_lock (void)
+{
+	if (delivery_thread_enabled) {
+		pthread_mutex_lock (&serialize_mutex);
+	}
+}
+
+void cs_serialize_unlock (void)
 {
+	if (delivery_thread_enabled) {
+		pthread_mutex_unlock (&serialize_mutex);
+	}
 }
 
-static void serialize_unlock (void)
+int cs_main_thread_is_current (void)
 {
+	return (!delivery_thread_enabled ||
+	    pthread_equal (pthread_self (), main_thread));
+}
+
+/*
+ * Run work_fn from the main loop. Called from the main thread this is plain
+ * qb_loop_job_add, otherwise the call is queued for main_loop_work_dispatch.
+ * work_fn must take the serialize lock itself if it enters service code.
+ */
+int cs_main_loop_work_add (void (*work_fn) (void *data), void *data)
+{
+	struct main_loop_work *work;
+	int was_empty;
+	char c = 0;
+
+	if (cs_main_thread_is_current ()) {
+		return (qb_loop_job_add (corosync_poll_handle, QB_LOOP_HIGH,
+		    data, work_fn));
+	}
+
+	work = malloc (sizeof (struct main_loop_work));
+	if (work == NULL) {
+		return (-ENOMEM);
+	}
+	qb_list_init (&work->list);
+	work->work_fn = work_fn;
+	work->data = data;
+
+	pthread_mutex_lock (&main_loop_work_mutex);
+	was_empty = qb_list_empty (&main_loop_work_list_head);
+	qb_list_add_tail (&work->list, &main_loop_work_list_head);
+	pthread_mutex_unlock (&main_loop_work_mutex);
+
+	/*
+	 * Pipe is written only when the list was empty, so it never fills up
+	 */
+	if (was_empty && write (main_loop_work_pipe[1], &c, 1) != 1) {
+		LOGSYS_PERROR (errno, LOGSYS_LEVEL_ERROR, "Can't wake up main loop");
+	}
+
+	return (0);
+}
+
+static int32_t main_loop_work_dispatch (int fd, int revents, void *data)
+{
+	struct main_loop_work *work;
+	char buf[64];
+
+	while (read (fd, buf, sizeof (buf)) > 0) {
+		;
+	}
+
+	for (;;) {
+		pthread_mutex_lock (&main_loop_work_mutex);
+		if (qb_list_empty (&main_loop_work_list_head)) {
+			pthread_mutex_unlock (&main_loop_work_mutex);
+			break;
+		}
+		work = qb_list_entry (main_loop_work_list_head.next,
+		    struct main_loop_work, list);
+		qb_list_del (&work->list);
+		pthread_mutex_unlock (&main_loop_work_mutex);
+
+		work->work_fn (work->data);
+		free (work);
+	}
+
+	return (0);
+}
+
+static int main_loop_work_init (void)
+{
+	int i;
+
+	main_thread = pthread_self ();
+
+	if (pipe (main_loop_work_pipe) != 0) {
+		return (-1);
+	}
+	for (i = 0; i < 2; i++) {
+		if (fcntl (main_loop_work_pipe[i], F_SETFL, O_NONBLOCK) == -1 ||
+		    fcntl (main_loop_work_pipe[i], F_SETFD, FD_CLOEXEC) == -1) {
+			return (-1);
+		}
+	}
+
+	return (qb_loop_poll_add (corosync_poll_handle, QB_LOOP_HIGH,
+	    main_loop_work_pipe[0], POLLIN, NULL, main_loop_work_dispatch));
+}
+
+static void corosync_trans_ack_work (void *data)
+{
+	totempg_trans_ack();
 }
 
 static void corosync_sync_completed (void)
@@ -307,9 +440,16 @@ static void corosync_sync_completed (void)
 	cs_ipcs_sync_state_changed(sync_in_process);
 	cs_ipc_allow_connections(1);
 	/*
-	 * Inform totem to start using new message queue again
+	 * Inform totem to start using new message queue again. Totem state
+	 * belongs to the main thread, sync completes in the delivery thread
+	 * when it is enabled.
 	 */
-	totempg_trans_ack();
+	if (cs_main_thread_is_current ()) {
+		totempg_trans_ack();
+	} else if (cs_main_loop_work_add (corosync_trans_ack_work, NULL) != 0) {
+		log_printf (LOGSYS_LEVEL_CRIT, "Can't pass transitional ack to main thread");
+		corosync_exit_error (COROSYNC_DONE_FATAL_ERR);
+	}
 
 #ifdef HAVE_LIBSYSTEMD
 	sd_notify (0, "READY=1");
@@ -564,7 +704,9 @@ static void corosync_totem_stats_updater (void *data)
 	stats->srp->time_since_token_last_received = qb_util_nano_current_get () / QB_TIME_NS_IN_MSEC -
 		stats->srp->token[stats->srp->latest_token].rx;
 
+	corosync_service_stats_update();
 	stats_trigger_trackers();
+	stats_shm_update();
 
 	api->timer_add_duration (1500 * MILLI_2_NANO_SECONDS, NULL,
 		corosync_totem_stats_updater,
@@ -573,6 +715,15 @@ static void corosync_totem_stats_updater (void *data)
 
 static void corosync_totem_stats_init (void)
 {
+	char *tmp_str;
+
+	if (icmap_get_string("system.stats_shm", &tmp_str) == CS_OK) {
+		if (strcmp(tmp_str, "yes") == 0) {
+			stats_shm_init();
+		}
+		free(tmp_str);
+	}
+
 	/* start stats timer */
 	api->timer_add_duration (1500 * MILLI_2_NANO_SECONDS, NULL,
 		corosync_totem_stats_updater,
@@ -612,7 +763,7 @@ static void deliver_fn (
 		return;
 	}
 
-	icmap_fast_inc(service_stats_rx[service][fn_id]);
+	service_stats[service][fn_id].rx++;
 
 	if (endian_conversion_required) {
 		assert(corosync_service[service]->exec_engine[fn_id].exec_endian_convert_fn != NULL);
@@ -632,15 +783,22 @@ int main_mcast (
 	const struct qb_ipc_request_header *req = (struct qb_ipc_request_header *)iovec->iov_base;
 	int32_t service;
 	int32_t fn_id;
+	unsigned int prio = TOTEM_MCAST_PRIO_BULK;
 
 	service = req->id >> 16;
 	fn_id = req->id & 0xffff;
 
-	if (corosync_service[service]) {
-		icmap_fast_inc(service_stats_tx[service][fn_id]);
+	if (corosync_service[service] &&
+	    fn_id < corosync_service[service]->exec_engine_count) {
+		service_stats[service][fn_id].tx++;
+	}
+
+	if (corosync_service[service] &&
+	    corosync_service[service]->mcast_prio == CS_MCAST_PRIO_CONTROL) {
+		prio = TOTEM_MCAST_PRIO_CONTROL;
 	}
 
-	return (totempg_groups_mcast_joined (corosync_group_handle, iovec, iov_len, guarantee));
+	return (totempg_groups_mcast_joined_prio (corosync_group_handle, iovec, iov_len, guarantee, prio));
 }
 
 static void corosync_ring_id_create_or_load (
@@ -722,11 +880,13 @@ static void corosync_ring_id_store (
 static qb_loop_timer_handle recheck_the_q_level_timer;
 void corosync_recheck_the_q_level(void *data)
 {
+	cs_serialize_lock();
 	totempg_check_q_level(corosync_group_handle);
 	if (cs_ipcs_q_level_get() == TOTEM_Q_LEVEL_CRITICAL) {
 		qb_loop_timer_add(cs_poll_handle_get(), QB_LOOP_MED, 1*QB_TIME_NS_IN_MSEC,
 			NULL, corosync_recheck_the_q_level, &recheck_the_q_level_timer);
 	}
+	cs_serialize_unlock();
 }
 
 struct sending_allowed_private_data_struct {
@@ -1081,6 +1241,8 @@ static void main_service_ready (void)
 {
 	int res;
 
+	cs_serialize_lock ();
+
 	/*
 	 * This must occur after totempg is initialized because "this_ip" must be set
 	 */
@@ -1097,6 +1259,8 @@ static void main_service_ready (void)
 	sync_init (
 		corosync_sync_callbacks_retrieve,
 		corosync_sync_completed);
+
+	cs_serialize_unlock ();
 }
 
 static enum e_corosync_done corosync_flock (const char *lockfile, pid_t pid)
@@ -1495,6 +1659,13 @@ int main (int argc, char **argv, char **envp)
 		free(tmp_str);
 	}
 
+	if (icmap_get_string("system.delivery_thread", &tmp_str) == CS_OK) {
+		if (strcmp(tmp_str, "yes") == 0) {
+			delivery_thread_enabled = 1;
+		}
+		free(tmp_str);
+	}
+
 	prio = 0;
 	if (icmap_get_string("system.priority", &tmp_str) == CS_OK) {
 		if (strcmp(tmp_str, "max") == 0) {
@@ -1655,8 +1826,32 @@ int main (int argc, char **argv, char **envp)
 	priv_drop ();
 
 	schedwrk_init (
-		serialize_lock,
-		serialize_unlock);
+		cs_serialize_lock,
+		cs_serialize_unlock);
+
+	if (delivery_thread_enabled) {
+		pthread_mutexattr_t mutexattr;
+
+		/*
+		 * Main loop handlers may nest (e.g. q level recheck called
+		 * from IPC dispatch)
+		 */
+		pthread_mutexattr_init (&mutexattr);
+		pthread_mutexattr_settype (&mutexattr, PTHREAD_MUTEX_RECURSIVE);
+		pthread_mutex_init (&serialize_mutex, &mutexattr);
+		pthread_mutexattr_destroy (&mutexattr);
+
+		if (main_loop_work_init () != 0) {
+			LOGSYS_PERROR (errno, LOGSYS_LEVEL_ERROR, "Can't create main loop work pipe");
+			corosync_exit_error (COROSYNC_DONE_FATAL_ERR);
+		}
+
+		if (totempg_delivery_thread_start (cs_serialize_lock,
+		    cs_serialize_unlock) != 0) {
+			log_printf (LOGSYS_LEVEL_ERROR, "Can't start delivery thread");
+			corosync_exit_error (COROSYNC_DONE_FATAL_ERR);
+		}
+	}
 
 	/*
 	 * Start main processing loop
@@ -1664,7 +1859,8 @@ int main (int argc, char **argv, char **envp)
 	qb_loop_run (corosync_poll_handle);
 
 	/*
-	 * Exit was requested
+	 * Exit was requested. Services may still run in the delivery thread
+	 * until totempg_finalize stops it, so icmap is freed after that.
 	 */
 	totempg_finalize ();
 
@@ -1676,6 +1872,7 @@ int main (int argc, char **argv, char **envp)
 	/*
 	 * free up the icmap 
 	 */
+	icmap_fini();
 
 	/*
 	 * Remove pid lock file
@@ -68,6 +68,14 @@ extern void corosync_state_dump (void);
 
 extern qb_loop_t *cs_poll_handle_get (void);
 
+extern void cs_serialize_lock (void);
+
+extern void cs_serialize_unlock (void);
+
+extern int cs_main_thread_is_current (void);
+
+extern int cs_main_loop_work_add (void (*work_fn) (void *data), void *data);
+
 extern int cs_poll_dispatch_add (qb_loop_t * handle,
 		int fd,
 		int events,
@@ -106,6 +114,11 @@ extern int cs_ipcs_dispatch_send(void *conn, const void *msg, size_t mlen);
 extern int cs_ipcs_dispatch_iov_send (void *conn,
 	const struct iovec *iov,
 	unsigned int iov_len);
+extern int cs_ipcs_dispatch_iov_send_shared (void *conn,
+	const struct iovec *iov,
+	unsigned int iov_len,
+	void **payload);
+extern void cs_ipcs_dispatch_payload_put (void *payload);
 
 extern int cs_ipcs_response_send(void *conn, const void *msg, size_t mlen);
 extern int cs_ipcs_response_iov_send (void *conn,
@@ -116,6 +129,8 @@ extern void cs_ipcs_sync_state_changed(int32_t sync_in_process);
 
 extern void *cs_ipcs_private_data_get(void *conn);
 
+extern void cs_ipcs_credentials_get(void *conn, pid_t *pid, uid_t *euid, gid_t *egid);
+
 extern void cs_ipc_refcnt_inc(void *conn);
 
 extern void cs_ipc_refcnt_dec(void *conn);
@@ -55,6 +55,9 @@
 #include <qb/qbipcs.h>
 #include <qb/qbloop.h>
 
+#include "ipcs_stats.h"
+#include "stats.h"
+
 LOGSYS_DECLARE_SUBSYS ("SERV");
 
 static struct default_service default_services[] = {
@@ -109,20 +112,49 @@ struct seus_handler_data {
 
 struct corosync_service_engine *corosync_service[SERVICES_COUNT_MAX];
 
-const char *service_stats_rx[SERVICES_COUNT_MAX][SERVICE_HANDLER_MAXIMUM_COUNT];
-const char *service_stats_tx[SERVICES_COUNT_MAX][SERVICE_HANDLER_MAXIMUM_COUNT];
+struct service_stats service_stats[SERVICES_COUNT_MAX][SERVICE_HANDLER_MAXIMUM_COUNT];
+
+/*
+ * Deprecated runtime.services.SERVICE.EXEC_CALL.rx/tx keys, kept as read
+ * only copies of service_stats for one release
+ */
+static const char *service_stats_rx[SERVICES_COUNT_MAX][SERVICE_HANDLER_MAXIMUM_COUNT];
+static const char *service_stats_tx[SERVICES_COUNT_MAX][SERVICE_HANDLER_MAXIMUM_COUNT];
 
 static void (*service_unlink_all_complete) (void) = NULL;
 
+void corosync_service_stats_update (void)
+{
+	int service_id;
+	int fn;
+
+	for (service_id = 0; service_id < SERVICES_COUNT_MAX; service_id++) {
+		if (corosync_service[service_id] == NULL) {
+			continue;
+		}
+
+		for (fn = 0; fn < corosync_service[service_id]->exec_engine_count; fn++) {
+			if (service_stats_tx[service_id][fn] != NULL) {
+				icmap_set_uint64(service_stats_tx[service_id][fn],
+					service_stats[service_id][fn].tx);
+			}
+			if (service_stats_rx[service_id][fn] != NULL) {
+				icmap_set_uint64(service_stats_rx[service_id][fn],
+					service_stats[service_id][fn].rx);
+			}
+		}
+	}
+}
+
 char *corosync_service_link_and_init (
 	struct corosync_api_v1 *corosync_api,
 	struct default_service *service)
 {
 	struct corosync_service_engine *service_engine;
-	int fn;
 	const char *name_sufix;
 	char key_name[ICMAP_KEYNAME_MAXLEN];
 	char *init_result;
+	int fn;
 
 	/*
 	 * Initialize service
@@ -160,14 +192,25 @@ char *corosync_service_link_and_init (
 	snprintf(key_name, ICMAP_KEYNAME_MAXLEN, "runtime.services.%s.service_id", name_sufix);
 	icmap_set_uint16(key_name, service_engine->id);
 
+	memset(service_stats[service_engine->id], 0, sizeof(service_stats[service_engine->id]));
+	stats_add_service(service_engine->id, name_sufix, service_engine->exec_engine_count);
+
 	for (fn = 0; fn < service_engine->exec_engine_count; fn++) {
-		snprintf(key_name, ICMAP_KEYNAME_MAXLEN, "runtime.services.%s.%d.tx", name_sufix, fn);
-		icmap_set_uint64(key_name, 0);
-		service_stats_tx[service_engine->id][fn] = strdup(key_name);
+		if (service_stats_tx[service_engine->id][fn] == NULL) {
+			snprintf(key_name, ICMAP_KEYNAME_MAXLEN, "runtime.services.%s.%d.tx", name_sufix, fn);
+			service_stats_tx[service_engine->id][fn] = strdup(key_name);
+		}
+		if (service_stats_tx[service_engine->id][fn] != NULL) {
+			icmap_set_uint64(service_stats_tx[service_engine->id][fn], 0);
+		}
 
-		snprintf(key_name, ICMAP_KEYNAME_MAXLEN, "runtime.services.%s.%d.rx", name_sufix, fn);
-		icmap_set_uint64(key_name, 0);
-		service_stats_rx[service_engine->id][fn] = strdup(key_name);
+		if (service_stats_rx[service_engine->id][fn] == NULL) {
+			snprintf(key_name, ICMAP_KEYNAME_MAXLEN, "runtime.services.%s.%d.rx", name_sufix, fn);
+			service_stats_rx[service_engine->id][fn] = strdup(key_name);
+		}
+		if (service_stats_rx[service_engine->id][fn] != NULL) {
+			icmap_set_uint64(service_stats_rx[service_engine->id][fn], 0);
+		}
 	}
 
 	log_printf (LOGSYS_LEVEL_NOTICE,
@@ -368,6 +411,8 @@ static void service_exit_schedwrk_handler (void *data) {
 	struct seus_handler_data *cb_data = (struct seus_handler_data *)data;
 	struct corosync_api_v1 *api = (struct corosync_api_v1 *)cb_data->api;
 
+	cs_serialize_lock();
+
 	if (called == 0) {
 		log_printf(LOGSYS_LEVEL_NOTICE,
 			"Unloading all Corosync service engines.");
@@ -382,6 +427,7 @@ static void service_exit_schedwrk_handler (void *data) {
 		&current_service_engine);
 	if (res == 0) {
 		service_unlink_all_complete();
+		cs_serialize_unlock();
 		return;
 	}
 
@@ -389,6 +435,8 @@ static void service_exit_schedwrk_handler (void *data) {
 		QB_LOOP_HIGH,
 		data,
 		service_exit_schedwrk_handler);
+
+	cs_serialize_unlock();
 }
 
 void corosync_service_unlink_all (
@@ -411,10 +459,10 @@ void corosync_service_unlink_all (
 
 	cb_data.api = api;
 
-	qb_loop_job_add(cs_poll_handle_get(),
-		QB_LOOP_HIGH,
-		&cb_data,
-		service_exit_schedwrk_handler);
+	/*
+	 * May be requested by a service running in the delivery thread
+	 */
+	cs_main_loop_work_add(service_exit_schedwrk_handler, &cb_data);
 }
 
 struct service_unlink_and_exit_data {
@@ -430,10 +478,12 @@ static void service_unlink_and_exit_schedwrk_handler (void *data)
 		data;
 	int res;
 
+	cs_serialize_lock();
 	res = service_unlink_and_exit (
 		service_unlink_and_exit_data->api,
 		service_unlink_and_exit_data->name,
 		service_unlink_and_exit_data->ver);
+	cs_serialize_unlock();
 
 	if (res == 0) {
 		free (service_unlink_and_exit_data);
@@ -460,9 +510,7 @@ unsigned int corosync_service_unlink_and_exit (
 	service_unlink_and_exit_data->name = strdup (service_name);
 	service_unlink_and_exit_data->ver = service_ver;
 
-	qb_loop_job_add(cs_poll_handle_get(),
-		QB_LOOP_HIGH,
-		service_unlink_and_exit_data,
-		service_unlink_and_exit_schedwrk_handler);
+	cs_main_loop_work_add(service_unlink_and_exit_schedwrk_handler,
+		service_unlink_and_exit_data);
 	return (0);
 }
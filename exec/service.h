@@ -75,8 +75,22 @@ extern unsigned int corosync_service_defaults_link_and_init (
 
 extern struct corosync_service_engine *corosync_service[];
 
-extern const char *service_stats_rx[SERVICES_COUNT_MAX][SERVICE_HANDLER_MAXIMUM_COUNT];
-extern const char *service_stats_tx[SERVICES_COUNT_MAX][SERVICE_HANDLER_MAXIMUM_COUNT];
+/*
+ * Number of messages received and sent per service exec call. Exported
+ * through stats map as stats.services.SERVICE.EXEC_CALL.rx/tx
+ */
+struct service_stats {
+	uint64_t rx;
+	uint64_t tx;
+};
+
+extern struct service_stats service_stats[SERVICES_COUNT_MAX][SERVICE_HANDLER_MAXIMUM_COUNT];
+
+/**
+ * Copy service_stats to the deprecated runtime.services.SERVICE.EXEC_CALL.rx/tx
+ * keys. Called periodically by the stats updater.
+ */
+extern void corosync_service_stats_update (void);
 
 struct corosync_service_engine *votequorum_get_service_engine_ver0 (void);
 struct corosync_service_engine *vsf_quorum_get_service_engine_ver0 (void);
@@ -36,7 +36,10 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <unistd.h>
@@ -45,21 +48,32 @@
 #include <qb/qblist.h>
 #include <qb/qbipcs.h>
 #include <qb/qbipc_common.h>
+#include <qb/qbutil.h>
 
 #include <corosync/corodefs.h>
 #include <corosync/coroapi.h>
 #include <corosync/logsys.h>
 #include <corosync/icmap.h>
+#include <corosync/ipc_cmap.h>
 #include <corosync/totem/totemstats.h>
 
 #include "util.h"
 #include "ipcs_stats.h"
 #include "stats.h"
+#include "service.h"
 
 LOGSYS_DECLARE_SUBSYS ("STATS");
 
 static qb_map_t *stats_map;
 
+/* Incremented every time a key is added to or removed from stats_map */
+static uint64_t stats_generation = 1;
+
+/* Shared memory copy of stats_map, see ipc_cmap.h */
+static struct cmap_stats_shm_header *stats_shm;
+static int stats_shm_fd = -1;
+static char stats_shm_path[PATH_MAX];
+
 /* Structure of an element in the schedmiss array */
 struct schedmiss_entry {
 	uint64_t timestamp;
@@ -73,7 +87,7 @@ static unsigned int highest_schedmiss_event;
 
 /* Convert iterator number to text and a stats pointer */
 struct cs_stats_conv {
-	enum {STAT_PG, STAT_SRP, STAT_KNET, STAT_KNET_HANDLE, STAT_IPCSC, STAT_IPCSG, STAT_SCHEDMISS} type;
+	enum {STAT_PG, STAT_PG_NODE, STAT_SRP, STAT_SRP_HISTOGRAM, STAT_KNET, STAT_KNET_HANDLE, STAT_IPCSC, STAT_IPCSG, STAT_SCHEDMISS, STAT_SERVICE} type;
 	const char *name;
 	const size_t offset;
 	const icmap_value_types_t value_type;
@@ -83,6 +97,10 @@ struct cs_stats_conv cs_pg_stats[] = {
 	{ STAT_PG, "msg_queue_avail",         offsetof(totempg_stats_t, msg_queue_avail),         ICMAP_VALUETYPE_UINT32},
 	{ STAT_PG, "msg_reserved",            offsetof(totempg_stats_t, msg_reserved),            ICMAP_VALUETYPE_UINT32},
 };
+struct cs_stats_conv cs_pg_node_stats[] = {
+	{ STAT_PG_NODE, "assembly_bytes_copied",   offsetof(totempg_node_stats_t, assembly_bytes_copied),   ICMAP_VALUETYPE_UINT64},
+	{ STAT_PG_NODE, "assembly_bytes_in_place", offsetof(totempg_node_stats_t, assembly_bytes_in_place), ICMAP_VALUETYPE_UINT64},
+};
 struct cs_stats_conv cs_srp_stats[] = {
 	{ STAT_SRP, "orf_token_tx",           offsetof(totemsrp_stats_t, orf_token_tx),           ICMAP_VALUETYPE_UINT64},
 	{ STAT_SRP, "orf_token_rx",           offsetof(totemsrp_stats_t, orf_token_rx),           ICMAP_VALUETYPE_UINT64},
@@ -107,6 +125,9 @@ struct cs_stats_conv cs_srp_stats[] = {
 	{ STAT_SRP, "recovery_token_lost",    offsetof(totemsrp_stats_t, recovery_token_lost),    ICMAP_VALUETYPE_UINT64},
 	{ STAT_SRP, "consensus_timeouts",     offsetof(totemsrp_stats_t, consensus_timeouts),     ICMAP_VALUETYPE_UINT64},
 	{ STAT_SRP, "rx_msg_dropped",         offsetof(totemsrp_stats_t, rx_msg_dropped),         ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "frame_pool_hit",         offsetof(totemsrp_stats_t, frame_pool_hit),         ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "frame_pool_miss",        offsetof(totemsrp_stats_t, frame_pool_miss),        ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "mcast_tx_syscalls_saved", offsetof(totemsrp_stats_t, mcast_tx_syscalls_saved), ICMAP_VALUETYPE_UINT64},
 	{ STAT_SRP, "time_since_token_last_received", offsetof(totemsrp_stats_t, time_since_token_last_received), ICMAP_VALUETYPE_UINT64},
 	{ STAT_SRP, "continuous_gather",      offsetof(totemsrp_stats_t, continuous_gather),      ICMAP_VALUETYPE_UINT32},
 	{ STAT_SRP, "continuous_sendmsg_failures", offsetof(totemsrp_stats_t, continuous_sendmsg_failures), ICMAP_VALUETYPE_UINT32},
@@ -114,8 +135,39 @@ struct cs_stats_conv cs_srp_stats[] = {
 	{ STAT_SRP, "mtt_rx_token",           offsetof(totemsrp_stats_t, mtt_rx_token),           ICMAP_VALUETYPE_UINT32},
 	{ STAT_SRP, "avg_token_workload",     offsetof(totemsrp_stats_t, avg_token_workload),     ICMAP_VALUETYPE_UINT32},
 	{ STAT_SRP, "avg_backlog_calc",       offsetof(totemsrp_stats_t, avg_backlog_calc),       ICMAP_VALUETYPE_UINT32},
+	{ STAT_SRP, "recovery_duration",      offsetof(totemsrp_stats_t, recovery_duration),      ICMAP_VALUETYPE_UINT32},
+	{ STAT_SRP, "recovery_duration_max",  offsetof(totemsrp_stats_t, recovery_duration_max),  ICMAP_VALUETYPE_UINT32},
+	{ STAT_SRP, "fcc_max_messages",       offsetof(totemsrp_stats_t, fcc_max_messages),       ICMAP_VALUETYPE_UINT32},
+	{ STAT_SRP, "fcc_window_size",        offsetof(totemsrp_stats_t, fcc_window_size),        ICMAP_VALUETYPE_UINT32},
+	{ STAT_SRP, "fcc_decreases",          offsetof(totemsrp_stats_t, fcc_decreases),          ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "fcc_increases",          offsetof(totemsrp_stats_t, fcc_increases),          ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP, "mcast_queue_depth_control", offsetof(totemsrp_stats_t, mcast_queue_depth_control), ICMAP_VALUETYPE_UINT32},
+	{ STAT_SRP, "mcast_queue_depth_bulk", offsetof(totemsrp_stats_t, mcast_queue_depth_bulk), ICMAP_VALUETYPE_UINT32},
 };
 
+struct cs_stats_conv cs_srp_histograms[] = {
+	{ STAT_SRP_HISTOGRAM, "token_rotation", offsetof(totemsrp_stats_t, token_rotation_histogram), ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP_HISTOGRAM, "token_hold",     offsetof(totemsrp_stats_t, token_hold_histogram),     ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP_HISTOGRAM, "mcast_latency",  offsetof(totemsrp_stats_t, mcast_latency_histogram),  ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP_HISTOGRAM, "token_tx",       offsetof(totemsrp_stats_t, token_tx_histogram),       ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP_HISTOGRAM, "mcast_queue_wait_control", offsetof(totemsrp_stats_t, mcast_queue_wait_control_histogram), ICMAP_VALUETYPE_UINT64},
+	{ STAT_SRP_HISTOGRAM, "mcast_queue_wait_bulk", offsetof(totemsrp_stats_t, mcast_queue_wait_bulk_histogram), ICMAP_VALUETYPE_UINT64},
+};
+
+/* Values computed from each histogram, permille 0 is not a percentile */
+static const struct {
+	const char *name;
+	unsigned int permille;
+} srp_histogram_values[] = {
+	{ "count", 0 },
+	{ "min", 0 },
+	{ "max", 0 },
+	{ "mean", 0 },
+	{ "p50", 500 },
+	{ "p90", 900 },
+	{ "p99", 990 },
+	{ "p999", 999 },
+};
 struct cs_stats_conv cs_knet_stats[] = {
 	{ STAT_KNET, "enabled",          offsetof(struct knet_link_status, enabled),                ICMAP_VALUETYPE_UINT8},
 	{ STAT_KNET, "connected",        offsetof(struct knet_link_status, connected),              ICMAP_VALUETYPE_UINT8},
@@ -185,9 +237,14 @@ struct cs_stats_conv cs_knet_handle_stats[] = {
 struct cs_stats_conv cs_ipcs_conn_stats[] = {
 	{ STAT_IPCSC, "queueing",        offsetof(struct ipcs_conn_stats, cnx.queuing),          ICMAP_VALUETYPE_INT32},
 	{ STAT_IPCSC, "queued",          offsetof(struct ipcs_conn_stats, cnx.queued),           ICMAP_VALUETYPE_UINT32},
+	{ STAT_IPCSC, "queued_max",      offsetof(struct ipcs_conn_stats, cnx.queued_max),       ICMAP_VALUETYPE_UINT32},
+	{ STAT_IPCSC, "queued_shared",   offsetof(struct ipcs_conn_stats, cnx.queued_shared),    ICMAP_VALUETYPE_UINT64},
+	{ STAT_IPCSC, "queue_full",      offsetof(struct ipcs_conn_stats, cnx.queue_full),       ICMAP_VALUETYPE_UINT64},
 	{ STAT_IPCSC, "invalid_request", offsetof(struct ipcs_conn_stats, cnx.invalid_request),  ICMAP_VALUETYPE_UINT64},
 	{ STAT_IPCSC, "overload",        offsetof(struct ipcs_conn_stats, cnx.overload),         ICMAP_VALUETYPE_UINT64},
 	{ STAT_IPCSC, "sent",            offsetof(struct ipcs_conn_stats, cnx.sent),             ICMAP_VALUETYPE_UINT32},
+	{ STAT_IPCSC, "fair_share_weight", offsetof(struct ipcs_conn_stats, cnx.fair_share_weight), ICMAP_VALUETYPE_UINT32},
+	{ STAT_IPCSC, "fair_share_throttled", offsetof(struct ipcs_conn_stats, cnx.fair_share_throttled), ICMAP_VALUETYPE_UINT64},
 	{ STAT_IPCSC, "procname",        offsetof(struct ipcs_conn_stats, cnx.proc_name),        ICMAP_VALUETYPE_STRING},
 	{ STAT_IPCSC, "requests",        offsetof(struct ipcs_conn_stats, conn.requests),        ICMAP_VALUETYPE_UINT64},
 	{ STAT_IPCSC, "responses",       offsetof(struct ipcs_conn_stats, conn.responses),       ICMAP_VALUETYPE_UINT64},
@@ -205,21 +262,58 @@ struct cs_stats_conv cs_schedmiss_stats[] = {
 	{ STAT_SCHEDMISS, "timestamp",    offsetof(struct schedmiss_entry, timestamp), ICMAP_VALUETYPE_UINT64},
 	{ STAT_SCHEDMISS, "delay",        offsetof(struct schedmiss_entry, delay),     ICMAP_VALUETYPE_FLOAT},
 };
+struct cs_stats_conv cs_service_stats[] = {
+	{ STAT_SERVICE, "tx",             offsetof(struct service_stats, tx),          ICMAP_VALUETYPE_UINT64},
+	{ STAT_SERVICE, "rx",             offsetof(struct service_stats, rx),          ICMAP_VALUETYPE_UINT64},
+};
 
 #define NUM_PG_STATS (sizeof(cs_pg_stats) / sizeof(struct cs_stats_conv))
+#define NUM_PG_NODE_STATS (sizeof(cs_pg_node_stats) / sizeof(struct cs_stats_conv))
 #define NUM_SRP_STATS (sizeof(cs_srp_stats) / sizeof(struct cs_stats_conv))
+#define NUM_SRP_HISTOGRAMS (sizeof(cs_srp_histograms) / sizeof(struct cs_stats_conv))
+#define NUM_SRP_HISTOGRAM_VALUES (sizeof(srp_histogram_values) / sizeof(srp_histogram_values[0]))
 #define NUM_KNET_STATS (sizeof(cs_knet_stats) / sizeof(struct cs_stats_conv))
 #define NUM_KNET_HANDLE_STATS (sizeof(cs_knet_handle_stats) / sizeof(struct cs_stats_conv))
 #define NUM_IPCSC_STATS (sizeof(cs_ipcs_conn_stats) / sizeof(struct cs_stats_conv))
 #define NUM_IPCSG_STATS (sizeof(cs_ipcs_global_stats) / sizeof(struct cs_stats_conv))
+#define NUM_SERVICE_STATS (sizeof(cs_service_stats) / sizeof(struct cs_stats_conv))
+#define NUM_SCHEDMISS_STATS (sizeof(cs_schedmiss_stats) / sizeof(struct cs_stats_conv))
+
+#define SERVICE_PREFIX "stats.services."
+
+/* Short service names (as in stats keys) indexed by service id */
+static char *service_stats_name[SERVICES_COUNT_MAX];
 
 /* What goes in the trie */
 struct stats_item {
 	char *key_name;
 	struct cs_stats_conv * cs_conv;
+	/* Parsed from the key name when the key is added, so reads don't have to */
+	union {
+		struct {
+			knet_node_id_t nodeid;
+			uint8_t link_no;
+		} knet;
+		struct {
+			int service_id;
+			uint32_t pid;
+			void *conn_ptr;
+		} ipcs;
+		struct {
+			int service_id;
+			int fn_id;
+		} service;
+		unsigned int pg_nodeid;
+		unsigned int schedmiss_event;
+		unsigned int histogram_value;
+	} id;
 };
 
-/* One of these per tracker */
+/*
+ * One of these per tracker. Key trackers are kept sorted by key name, so
+ * trackers of one knet link or ipc connection are next to each other.
+ * item is NULL while the tracked key doesn't exist.
+ */
 struct cs_stats_tracker
 {
 	char *key_name;
@@ -227,6 +321,7 @@ struct cs_stats_tracker
 	int32_t events;
 	icmap_notify_fn_t notify_fn;
 	uint64_t old_value;
+	struct stats_item *item;
 	struct qb_list_head list;
 };
 QB_LIST_DECLARE (stats_tracker_list_head);
@@ -254,15 +349,29 @@ static void stats_map_set_value(struct cs_stats_conv *conv,
 	}
 }
 
-static void stats_add_entry(const char *key, struct cs_stats_conv *cs_conv)
+static struct stats_item *stats_add_entry(const char *key, struct cs_stats_conv *cs_conv)
 {
 	struct stats_item *item = malloc(sizeof(struct stats_item));
+	struct cs_stats_tracker *tracker;
+	struct qb_list_head *iter;
 
 	if (item) {
+		memset(item, 0, sizeof(*item));
 		item->cs_conv = cs_conv;
 		item->key_name = strdup(key);
 		qb_map_put(stats_map, item->key_name, item);
+		stats_generation++;
+
+		qb_list_for_each(iter, &stats_tracker_list_head) {
+			tracker = qb_list_entry(iter, struct cs_stats_tracker, list);
+			if (tracker->key_name && !(tracker->events & ICMAP_TRACK_PREFIX) &&
+			    strcmp(tracker->key_name, key) == 0) {
+				tracker->item = item;
+			}
+		}
 	}
+
+	return (item);
 }
 static void stats_rm_entry(const char *key)
 {
@@ -271,6 +380,7 @@ static void stats_rm_entry(const char *key)
 	if (item) {
 		qb_map_rm(stats_map, item->key_name);
 		/* Structures freed in callback below */
+		stats_generation++;
 	}
 }
 
@@ -279,8 +389,16 @@ static void stats_map_free_cb(uint32_t event,
 			      void* value, void* user_data)
 {
 	struct stats_item *item = (struct stats_item *)old_value;
+	struct cs_stats_tracker *tracker;
+	struct qb_list_head *iter;
 
 	if (item) {
+		qb_list_for_each(iter, &stats_tracker_list_head) {
+			tracker = qb_list_entry(iter, struct cs_stats_tracker, list);
+			if (tracker->item == item) {
+				tracker->item = NULL;
+			}
+		}
 		free(item->key_name);
 		free(item);
 	}
@@ -288,7 +406,8 @@ static void stats_map_free_cb(uint32_t event,
 
 cs_error_t stats_map_init(const struct corosync_api_v1 *corosync_api)
 {
-	int i;
+	struct stats_item *item;
+	int i, j;
 	char param[ICMAP_KEYNAME_MAXLEN];
 	int32_t err;
 
@@ -308,6 +427,16 @@ cs_error_t stats_map_init(const struct corosync_api_v1 *corosync_api)
 		sprintf(param, "stats.srp.%s", cs_srp_stats[i].name);
 		stats_add_entry(param, &cs_srp_stats[i]);
 	}
+	for (i = 0; i<NUM_SRP_HISTOGRAMS; i++) {
+		for (j = 0; j<NUM_SRP_HISTOGRAM_VALUES; j++) {
+			sprintf(param, "stats.srp.histogram.%s.%s", cs_srp_histograms[i].name,
+				srp_histogram_values[j].name);
+			item = stats_add_entry(param, &cs_srp_histograms[i]);
+			if (item) {
+				item->id.histogram_value = j;
+			}
+		}
+	}
 	for (i = 0; i<NUM_IPCSG_STATS; i++) {
 		sprintf(param, "stats.ipcs.%s", cs_ipcs_global_stats[i].name);
 		stats_add_entry(param, &cs_ipcs_global_stats[i]);
@@ -322,31 +451,74 @@ cs_error_t stats_map_init(const struct corosync_api_v1 *corosync_api)
 	return (qb_to_cs_error(err));
 }
 
-cs_error_t stats_map_get(const char *key_name,
-			 void *value,
-			 size_t *value_len,
-			 icmap_value_types_t *type)
+static cs_error_t stats_srp_histogram_value(unsigned int i,
+				      const totem_histogram_t *histogram,
+				      void *value,
+				      size_t *value_len,
+				      icmap_value_types_t *type)
+{
+	const char *value_name;
+	uint64_t res = 0;
+
+	if (i >= NUM_SRP_HISTOGRAM_VALUES) {
+		return CS_ERR_NOT_EXIST;
+	}
+	value_name = srp_histogram_values[i].name;
+
+	if (srp_histogram_values[i].permille != 0) {
+		res = totem_histogram_permille(histogram, srp_histogram_values[i].permille);
+	} else if (strcmp(value_name, "count") == 0) {
+		res = histogram->count;
+	} else if (strcmp(value_name, "min") == 0) {
+		res = histogram->min;
+	} else if (strcmp(value_name, "max") == 0) {
+		res = histogram->max;
+	} else if (histogram->count) {
+		res = histogram->sum / histogram->count;
+	}
+
+	if (value_len) {
+		*value_len = sizeof(uint64_t);
+	}
+	if (type) {
+		*type = ICMAP_VALUETYPE_UINT64;
+	}
+	if (value) {
+		memcpy(value, &res, sizeof(uint64_t));
+	}
+
+	return CS_OK;
+}
+
+static cs_error_t stats_knet_link_get(struct stats_item *item, struct knet_link_status *link_status)
+{
+	/* Always get the latest stats */
+	if (totemknet_link_get_status(item->id.knet.nodeid, item->id.knet.link_no, link_status) != CS_OK) {
+		return CS_ERR_LIBRARY;
+	}
+
+	return CS_OK;
+}
+
+static cs_error_t stats_ipcs_conn_get(struct stats_item *item, struct ipcs_conn_stats *ipcs_conn_stats)
+{
+	return (cs_ipcs_get_conn_stats(item->id.ipcs.service_id, item->id.ipcs.pid,
+	    item->id.ipcs.conn_ptr, ipcs_conn_stats));
+}
+
+static cs_error_t stats_item_get(struct stats_item *item,
+				 void *value,
+				 size_t *value_len,
+				 icmap_value_types_t *type)
 {
 	struct cs_stats_conv *statinfo;
-	struct stats_item *item;
 	totempg_stats_t *pg_stats;
+	totempg_node_stats_t pg_node_stats;
 	struct knet_link_status link_status;
 	struct ipcs_conn_stats ipcs_conn_stats;
 	struct ipcs_global_stats ipcs_global_stats;
 	struct knet_handle_stats knet_handle_stats;
 	int res;
-	int nodeid;
-	int link_no;
-	int service_id;
-	uint32_t pid;
-	unsigned int sm_event;
-	const char *sm_type;
-	void *conn_ptr;
-
-	item = qb_map_get(stats_map, key_name);
-	if (!item) {
-		return CS_ERR_NOT_EXIST;
-	}
 
 	statinfo = item->cs_conv;
 	switch (statinfo->type) {
@@ -354,10 +526,25 @@ cs_error_t stats_map_get(const char *key_name,
 			pg_stats = api->totem_get_stats();
 			stats_map_set_value(statinfo, pg_stats, value, value_len, type);
 			break;
+		case STAT_PG_NODE:
+			if (totempg_get_node_stats(item->id.pg_nodeid, &pg_node_stats) != 0) {
+				return CS_ERR_NOT_EXIST;
+			}
+			stats_map_set_value(statinfo, &pg_node_stats, value, value_len, type);
+			break;
 		case STAT_SRP:
 			pg_stats = api->totem_get_stats();
 			stats_map_set_value(statinfo, pg_stats->srp, value, value_len, type);
 			break;
+		case STAT_SRP_HISTOGRAM:
+			pg_stats = api->totem_get_stats();
+			res = stats_srp_histogram_value(item->id.histogram_value,
+				(const totem_histogram_t *)((const char *)pg_stats->srp + statinfo->offset),
+				value, value_len, type);
+			if (res != CS_OK) {
+				return res;
+			}
+			break;
 		case STAT_KNET_HANDLE:
 			res = totemknet_handle_get_stats(&knet_handle_stats);
 			if (res != CS_OK) {
@@ -366,28 +553,14 @@ cs_error_t stats_map_get(const char *key_name,
 			stats_map_set_value(statinfo, &knet_handle_stats, value, value_len, type);
 			break;
 		case STAT_KNET:
-			if (sscanf(key_name, "stats.knet.node%d.link%d", &nodeid, &link_no) != 2) {
-				return CS_ERR_NOT_EXIST;
-			}
-
-			/* Validate node & link IDs */
-			if (nodeid <= 0 || nodeid > KNET_MAX_HOST ||
-			    link_no < 0 || link_no > KNET_MAX_LINK) {
-				return CS_ERR_NOT_EXIST;
-			}
-
-			/* Always get the latest stats */
-			res = totemknet_link_get_status((knet_node_id_t)nodeid, (uint8_t)link_no, &link_status);
+			res = stats_knet_link_get(item, &link_status);
 			if (res != CS_OK) {
-				return CS_ERR_LIBRARY;
+				return res;
 			}
 			stats_map_set_value(statinfo, &link_status, value, value_len, type);
 			break;
 		case STAT_IPCSC:
-			if (sscanf(key_name, "stats.ipcs.service%d.%d.%p", &service_id, &pid, &conn_ptr) != 3) {
-				return CS_ERR_NOT_EXIST;
-			}
-			res = cs_ipcs_get_conn_stats(service_id, pid, conn_ptr, &ipcs_conn_stats);
+			res = stats_ipcs_conn_get(item, &ipcs_conn_stats);
 			if (res != CS_OK) {
 				return res;
 			}
@@ -398,26 +571,13 @@ cs_error_t stats_map_get(const char *key_name,
 			stats_map_set_value(statinfo, &ipcs_global_stats, value, value_len, type);
 			break;
 		case STAT_SCHEDMISS:
-			if (sscanf(key_name, SCHEDMISS_PREFIX ".%d", &sm_event) != 1) {
-				return CS_ERR_NOT_EXIST;
-			}
-
-			sm_type = strrchr(key_name, '.');
-			if (sm_type == NULL) {
-				return CS_ERR_NOT_EXIST;
-			}
-			sm_type++;
-
-			if (strcmp(sm_type, "timestamp") == 0) {
-				memcpy(value, &schedmiss_event[sm_event].timestamp, sizeof(uint64_t));
-				*value_len = sizeof(uint64_t);
-				*type = ICMAP_VALUETYPE_UINT64;
-			}
-			if (strcmp(sm_type, "delay") == 0) {
-				memcpy(value, &schedmiss_event[sm_event].delay, sizeof(float));
-				*value_len = sizeof(float);
-				*type = ICMAP_VALUETYPE_FLOAT;
-			}
+			stats_map_set_value(statinfo, &schedmiss_event[item->id.schedmiss_event],
+			    value, value_len, type);
+			break;
+		case STAT_SERVICE:
+			stats_map_set_value(statinfo,
+			    &service_stats[item->id.service.service_id][item->id.service.fn_id],
+			    value, value_len, type);
 			break;
 		default:
 			return CS_ERR_LIBRARY;
@@ -425,6 +585,68 @@ cs_error_t stats_map_get(const char *key_name,
 	return CS_OK;
 }
 
+cs_error_t stats_map_get(const char *key_name,
+			 void *value,
+			 size_t *value_len,
+			 icmap_value_types_t *type)
+{
+	struct stats_item *item;
+
+	item = qb_map_get(stats_map, key_name);
+	if (!item) {
+		return CS_ERR_NOT_EXIST;
+	}
+
+	return (stats_item_get(item, value, value_len, type));
+}
+
+/*
+ * Keys of one knet link or ipc connection are next to each other both in
+ * the trie and in the tracker list, so when they are read one after another
+ * the link status / connection stats is fetched only once for all of them
+ */
+struct stats_group {
+	struct cs_stats_conv *cs_conv;
+	struct stats_item *item;
+	cs_error_t res;
+	union {
+		struct knet_link_status link_status;
+		struct ipcs_conn_stats ipcs_conn_stats;
+	} data;
+};
+
+static cs_error_t stats_group_item_get(struct stats_item *item,
+				       struct stats_group *group,
+				       void *value,
+				       size_t *value_len,
+				       icmap_value_types_t *type)
+{
+	struct cs_stats_conv *statinfo = item->cs_conv;
+
+	if (statinfo->type != STAT_KNET && statinfo->type != STAT_IPCSC) {
+		return (stats_item_get(item, value, value_len, type));
+	}
+
+	if (group->item == NULL || group->cs_conv->type != statinfo->type ||
+	    memcmp(&group->item->id, &item->id, sizeof(item->id)) != 0) {
+		if (statinfo->type == STAT_KNET) {
+			group->res = stats_knet_link_get(item, &group->data.link_status);
+		} else {
+			group->res = stats_ipcs_conn_get(item, &group->data.ipcs_conn_stats);
+		}
+		group->cs_conv = statinfo;
+	}
+	/* Item has to exist until the group is used for the last time */
+	group->item = item;
+
+	if (group->res != CS_OK) {
+		return (group->res);
+	}
+	stats_map_set_value(statinfo, &group->data, value, value_len, type);
+
+	return CS_OK;
+}
+
 static void schedmiss_clear_stats(void)
 {
 	int i;
@@ -446,6 +668,7 @@ static void schedmiss_clear_stats(void)
 /* Called from main.c */
 void stats_add_schedmiss_event(uint64_t timestamp, float delay)
 {
+	struct stats_item *item;
 	char param[ICMAP_KEYNAME_MAXLEN];
 	int i;
 
@@ -461,10 +684,14 @@ void stats_add_schedmiss_event(uint64_t timestamp, float delay)
 
 	/* If we've not run off the end then add an entry in the trie for the new 'end' one */
 	if (highest_schedmiss_event < MAX_SCHEDMISS_EVENTS) {
-		sprintf(param, SCHEDMISS_PREFIX ".%i.timestamp", highest_schedmiss_event);
-		stats_add_entry(param, &cs_schedmiss_stats[0]);
-		sprintf(param, SCHEDMISS_PREFIX ".%i.delay", highest_schedmiss_event);
-		stats_add_entry(param, &cs_schedmiss_stats[1]);
+		for (i = 0; i < NUM_SCHEDMISS_STATS; i++) {
+			sprintf(param, SCHEDMISS_PREFIX ".%i.%s", highest_schedmiss_event,
+			    cs_schedmiss_stats[i].name);
+			item = stats_add_entry(param, &cs_schedmiss_stats[i]);
+			if (item) {
+				item->id.schedmiss_event = highest_schedmiss_event;
+			}
+		}
 		highest_schedmiss_event++;
 	}
 	/* Notifications get sent by the stats_updater */
@@ -558,10 +785,16 @@ void stats_map_iter_finalize(icmap_iter_t iter)
 }
 
 
+/*
+ * Only trackers interested in modifications of an existing key are
+ * checked. They point directly to their item, so there is no lookup,
+ * and each knet link and ipc connection is only fetched once.
+ */
 void stats_trigger_trackers(void)
 {
 	struct cs_stats_tracker *tracker;
 	struct qb_list_head *iter;
+	struct stats_group group;
 	cs_error_t res;
 	size_t value_len;
 	icmap_value_types_t type;
@@ -569,14 +802,18 @@ void stats_trigger_trackers(void)
 	struct icmap_notify_value new_val;
 	struct icmap_notify_value old_val;
 
+	memset(&group, 0, sizeof(group));
+
 	qb_list_for_each(iter, &stats_tracker_list_head) {
 
 		tracker = qb_list_entry(iter, struct cs_stats_tracker, list);
-		if (tracker->events & ICMAP_TRACK_PREFIX || !tracker->key_name ) {
+		if (tracker->events & ICMAP_TRACK_PREFIX || !(tracker->events & ICMAP_TRACK_MODIFY) ||
+		    tracker->item == NULL ||
+		    tracker->item->cs_conv->value_type == ICMAP_VALUETYPE_STRING) {
 			continue;
 		}
 
-		res = stats_map_get(tracker->key_name,
+		res = stats_group_item_get(tracker->item, &group,
 				    &value, &value_len, &type);
 
 		/* Check if it has changed */
@@ -641,6 +878,8 @@ cs_error_t stats_map_track_add(const char *key_name,
 			       icmap_track_t *icmap_track)
 {
 	struct cs_stats_tracker *tracker;
+	struct cs_stats_tracker *next_tracker;
+	struct qb_list_head *iter;
 	size_t value_len;
 	icmap_value_types_t type;
 	cs_error_t err;
@@ -660,15 +899,21 @@ cs_error_t stats_map_track_add(const char *key_name,
 	tracker->notify_fn = notify_fn;
 	tracker->user_data = user_data;
 	tracker->events = track_type;
+	tracker->item = NULL;
+	tracker->old_value = 0ULL;
 	if (key_name) {
 		tracker->key_name = strdup(key_name);
 		if (!tracker->key_name) {
 			free(tracker);
 			return CS_ERR_NO_MEMORY;
 		}
-		/* Get initial value */
-		if (stats_map_get(tracker->key_name,
-				  &tracker->old_value, &value_len, &type) != CS_OK) {
+		if (!(track_type & ICMAP_TRACK_PREFIX)) {
+			tracker->item = qb_map_get(stats_map, key_name);
+		}
+		/* Get initial value, strings are not tracked for modification */
+		if (tracker->item != NULL &&
+		    tracker->item->cs_conv->value_type != ICMAP_VALUETYPE_STRING &&
+		    stats_item_get(tracker->item, &tracker->old_value, &value_len, &type) != CS_OK) {
 			tracker->old_value = 0ULL;
 		}
 	} else {
@@ -691,7 +936,15 @@ cs_error_t stats_map_track_add(const char *key_name,
 		}
 	}
 
-	qb_list_add (&tracker->list, &stats_tracker_list_head);
+	/* Keep trackers sorted by key name, see stats_trigger_trackers */
+	qb_list_for_each(iter, &stats_tracker_list_head) {
+		next_tracker = qb_list_entry(iter, struct cs_stats_tracker, list);
+		if (tracker->key_name == NULL || (next_tracker->key_name != NULL &&
+		    strcmp(next_tracker->key_name, tracker->key_name) > 0)) {
+			break;
+		}
+	}
+	qb_list_add_tail (&tracker->list, iter);
 
 	*icmap_track = (icmap_track_t)tracker;
 	return CS_OK;
@@ -729,12 +982,17 @@ void *stats_map_track_get_user_data(icmap_track_t icmap_track)
 /* Called from totemknet to add/remove keys from our map */
 void stats_knet_add_member(knet_node_id_t nodeid, uint8_t link_no)
 {
+	struct stats_item *item;
 	int i;
 	char param[ICMAP_KEYNAME_MAXLEN];
 
 	for (i = 0; i<NUM_KNET_STATS; i++) {
 		sprintf(param, "stats.knet.node%d.link%d.%s", nodeid, link_no, cs_knet_stats[i].name);
-		stats_add_entry(param, &cs_knet_stats[i]);
+		item = stats_add_entry(param, &cs_knet_stats[i]);
+		if (item) {
+			item->id.knet.nodeid = nodeid;
+			item->id.knet.link_no = link_no;
+		}
 	}
 }
 void stats_knet_del_member(knet_node_id_t nodeid, uint8_t link_no)
@@ -748,6 +1006,32 @@ void stats_knet_del_member(knet_node_id_t nodeid, uint8_t link_no)
 	}
 }
 
+/* Called from totempg when it first sees / loses a node */
+void stats_pg_add_node(unsigned int nodeid)
+{
+	struct stats_item *item;
+	int i;
+	char param[ICMAP_KEYNAME_MAXLEN];
+
+	for (i = 0; i<NUM_PG_NODE_STATS; i++) {
+		sprintf(param, "stats.pg.node%u.%s", nodeid, cs_pg_node_stats[i].name);
+		item = stats_add_entry(param, &cs_pg_node_stats[i]);
+		if (item) {
+			item->id.pg_nodeid = nodeid;
+		}
+	}
+}
+void stats_pg_del_node(unsigned int nodeid)
+{
+	int i;
+	char param[ICMAP_KEYNAME_MAXLEN];
+
+	for (i = 0; i<NUM_PG_NODE_STATS; i++) {
+		sprintf(param, "stats.pg.node%u.%s", nodeid, cs_pg_node_stats[i].name);
+		stats_rm_entry(param);
+	}
+}
+
 /* This is separated out from  stats_map_init() because we don't know whether
    knet is in use until much later in the startup */
 void stats_knet_add_handle(void)
@@ -764,12 +1048,18 @@ void stats_knet_add_handle(void)
 /* Called from ipc_glue to add/remove keys from our map */
 void stats_ipcs_add_connection(int service_id, uint32_t pid, void *ptr)
 {
+	struct stats_item *item;
 	int i;
 	char param[ICMAP_KEYNAME_MAXLEN];
 
 	for (i = 0; i<NUM_IPCSC_STATS; i++) {
 		sprintf(param, "stats.ipcs.service%d.%d.%p.%s", service_id, pid, ptr, cs_ipcs_conn_stats[i].name);
-		stats_add_entry(param, &cs_ipcs_conn_stats[i]);
+		item = stats_add_entry(param, &cs_ipcs_conn_stats[i]);
+		if (item) {
+			item->id.ipcs.service_id = service_id;
+			item->id.ipcs.pid = pid;
+			item->id.ipcs.conn_ptr = ptr;
+		}
 	}
 }
 void stats_ipcs_del_connection(int service_id, uint32_t pid, void *ptr)
@@ -782,3 +1072,178 @@ void stats_ipcs_del_connection(int service_id, uint32_t pid, void *ptr)
 		stats_rm_entry(param);
 	}
 }
+
+/* Called from service.c when service engine is loaded. Counters themselves
+   live in service_stats and are only read when a key is fetched */
+void stats_add_service(int service_id, const char *name, int exec_engine_count)
+{
+	struct stats_item *item;
+	int i, fn;
+	char param[ICMAP_KEYNAME_MAXLEN];
+
+	if (service_stats_name[service_id] == NULL) {
+		service_stats_name[service_id] = strdup(name);
+		if (service_stats_name[service_id] == NULL) {
+			return ;
+		}
+	}
+
+	for (fn = 0; fn < exec_engine_count; fn++) {
+		for (i = 0; i<NUM_SERVICE_STATS; i++) {
+			sprintf(param, SERVICE_PREFIX "%s.%d.%s", name, fn, cs_service_stats[i].name);
+			item = stats_add_entry(param, &cs_service_stats[i]);
+			if (item) {
+				item->id.service.service_id = service_id;
+				item->id.service.fn_id = fn;
+			}
+		}
+	}
+}
+
+static int stats_shm_resize(uint32_t entries_max)
+{
+	struct cmap_stats_shm_header *shm;
+
+	if (ftruncate(stats_shm_fd, CMAP_STATS_SHM_SIZE(entries_max)) == -1) {
+		return (-1);
+	}
+
+	shm = mmap(NULL, CMAP_STATS_SHM_SIZE(entries_max), PROT_READ | PROT_WRITE,
+	    MAP_SHARED, stats_shm_fd, 0);
+	if (shm == MAP_FAILED) {
+		return (-1);
+	}
+
+	if (stats_shm != NULL) {
+		munmap(stats_shm, CMAP_STATS_SHM_SIZE(stats_shm->entries_max));
+	}
+	stats_shm = shm;
+	/* File is already big enough, so readers can map it */
+	stats_shm->entries_max = entries_max;
+
+	return (0);
+}
+
+/* Called from main.c every time stats are updated */
+void stats_shm_update(void)
+{
+	struct stats_group group;
+	struct cmap_stats_shm_entry *entry;
+	struct stats_item *item;
+	qb_map_iter_t *iter;
+	const char *key_name;
+	uint64_t value[CMAP_STATS_SHM_VALUE_LEN / sizeof(uint64_t) + 1];
+	size_t value_len;
+	icmap_value_types_t type;
+	size_t entries;
+	uint32_t seq;
+	int update_names;
+
+	if (stats_shm == NULL) {
+		return ;
+	}
+
+	entries = qb_map_count_get(stats_map);
+	if (entries > stats_shm->entries_max &&
+	    stats_shm_resize(entries + entries / 2) != 0) {
+		LOGSYS_PERROR(errno, LOGSYS_LEVEL_WARNING,
+		    "Can't resize stats shared memory %s", stats_shm_path);
+		return ;
+	}
+	update_names = (stats_shm->generation != stats_generation);
+
+	/* Readers retry while seq is odd or if it changed under them */
+	seq = stats_shm->seq;
+	__atomic_store_n(&stats_shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memset(&group, 0, sizeof(group));
+	entries = 0;
+	iter = qb_map_iter_create(stats_map);
+	while ((key_name = qb_map_iter_next(iter, (void **)&item)) != NULL &&
+	    entries < stats_shm->entries_max) {
+		entry = &stats_shm->entry[entries++];
+		if (update_names) {
+			snprintf(entry->key_name, CMAP_STATS_SHM_KEY_LEN, "%s", key_name);
+		}
+
+		value_len = sizeof(value);
+		if (stats_group_item_get(item, &group, value, &value_len, &type) != CS_OK) {
+			type = item->cs_conv->value_type;
+			value_len = 0;
+		}
+		if (value_len > CMAP_STATS_SHM_VALUE_LEN) {
+			/* Only strings can be longer, keep them terminated */
+			value_len = CMAP_STATS_SHM_VALUE_LEN;
+			((char *)value)[value_len - 1] = '\0';
+		}
+		entry->type = type;
+		entry->value_len = value_len;
+		memcpy(entry->value, value, value_len);
+	}
+	qb_map_iter_free(iter);
+
+	stats_shm->entries = entries;
+	stats_shm->generation = stats_generation;
+	stats_shm->update_time = qb_util_nano_current_get();
+
+	__atomic_store_n(&stats_shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static int stats_shm_open(const char *dir)
+{
+	snprintf(stats_shm_path, sizeof(stats_shm_path), "%s/%s", dir, CMAP_STATS_SHM_FILE);
+
+	/* Leftover from previous run may be still mapped by readers, don't reuse it */
+	(void)unlink(stats_shm_path);
+
+	return (open(stats_shm_path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600));
+}
+
+void stats_shm_init(void)
+{
+	uint32_t entries_max;
+
+	stats_shm_fd = stats_shm_open("/dev/shm");
+	if (stats_shm_fd == -1) {
+		stats_shm_fd = stats_shm_open(LOCALSTATEDIR "/run");
+	}
+	if (stats_shm_fd == -1) {
+		LOGSYS_PERROR(errno, LOGSYS_LEVEL_WARNING,
+		    "Can't create stats shared memory %s", stats_shm_path);
+		return ;
+	}
+
+	entries_max = qb_map_count_get(stats_map) * 2;
+	if (stats_shm_resize(entries_max) != 0) {
+		LOGSYS_PERROR(errno, LOGSYS_LEVEL_WARNING,
+		    "Can't map stats shared memory %s", stats_shm_path);
+		close(stats_shm_fd);
+		stats_shm_fd = -1;
+		unlink(stats_shm_path);
+		return ;
+	}
+
+	stats_shm->version = CMAP_STATS_SHM_VERSION;
+	stats_shm->pid = getpid();
+	stats_shm_update();
+	/* Readers check magic last, header is complete now */
+	__atomic_store_n(&stats_shm->magic, CMAP_STATS_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	log_printf(LOGSYS_LEVEL_INFO, "Stats are published in %s", stats_shm_path);
+}
+
+void stats_shm_finalize(void)
+{
+	if (stats_shm == NULL) {
+		return ;
+	}
+
+	/* Tell readers which still have the segment mapped that it is gone */
+	__atomic_store_n(&stats_shm->magic, 0, __ATOMIC_RELEASE);
+	munmap(stats_shm, CMAP_STATS_SHM_SIZE(stats_shm->entries_max));
+	stats_shm = NULL;
+	close(stats_shm_fd);
+	stats_shm_fd = -1;
+	unlink(stats_shm_path);
+}
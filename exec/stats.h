@@ -65,9 +65,15 @@ void *stats_map_track_get_user_data(icmap_track_t icmap_track);
 
 void stats_trigger_trackers(void);
 
+void stats_shm_init(void);
+void stats_shm_update(void);
+void stats_shm_finalize(void);
+
 
 void stats_ipcs_add_connection(int service_id, uint32_t pid, void *ptr);
 void stats_ipcs_del_connection(int service_id, uint32_t pid, void *ptr);
 cs_error_t cs_ipcs_get_conn_stats(int service_id, uint32_t pid, void *conn_ptr, struct ipcs_conn_stats *ipcs_stats);
 
 void stats_add_schedmiss_event(uint64_t, float delay);
+
+void stats_add_service(int service_id, const char *name, int exec_engine_count);
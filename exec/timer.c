@@ -35,11 +35,160 @@
 
 #include <config.h>
 
+#include <corosync/hdb.h>
+#include <corosync/logsys.h>
+
 #include "timer.h"
 #include "main.h"
 #include <qb/qbdefs.h>
 #include <qb/qbutil.h>
 
+LOGSYS_DECLARE_SUBSYS ("MAIN");
+
+/*
+ * Service timers are dispatched with the serialize lock held, because
+ * service code may also run in delivery thread. Handle given to the
+ * service is a hdb handle, so deleting an already expired timer is safe.
+ *
+ * libqb timers can only be changed from the main loop. Timers added or
+ * deleted in the delivery thread are (dis)armed later by the main loop,
+ * which holds a reference to the instance until then.
+ */
+DECLARE_HDB_DATABASE (timer_instance_database,NULL);
+
+struct timer_instance {
+	void (*timer_fn) (void *data);
+	void *data;
+	hdb_handle_t handle;
+	qb_loop_timer_handle qb_handle;
+	uint64_t expire_time;
+	int armed;
+	int deleted;
+};
+
+static void timer_do (void *context)
+{
+	struct timer_instance *instance = (struct timer_instance *)context;
+	hdb_handle_t handle;
+
+	cs_serialize_lock ();
+	handle = instance->handle;
+	if (instance->deleted ||
+	    hdb_handle_get (&timer_instance_database, handle, (void *)&instance) != 0) {
+		cs_serialize_unlock ();
+		return;
+	}
+
+	instance->armed = 0;
+	instance->timer_fn (instance->data);
+
+	/*
+	 * timer_fn may have deleted the timer itself
+	 */
+	if (!instance->deleted) {
+		instance->deleted = 1;
+		hdb_handle_destroy (&timer_instance_database, handle);
+	}
+	hdb_handle_put (&timer_instance_database, handle);
+	cs_serialize_unlock ();
+}
+
+static int timer_arm (struct timer_instance *instance)
+{
+	uint64_t now = qb_util_nano_current_get ();
+	int res;
+
+	res = qb_loop_timer_add(cs_poll_handle_get(),
+				QB_LOOP_MED,
+				 instance->expire_time > now ? instance->expire_time - now : 0,
+				 instance,
+				 timer_do,
+				 &instance->qb_handle);
+	if (res == 0) {
+		instance->armed = 1;
+	}
+
+	return (res);
+}
+
+static void timer_arm_deferred (void *data)
+{
+	struct timer_instance *instance = (struct timer_instance *)data;
+	hdb_handle_t handle;
+
+	cs_serialize_lock ();
+	handle = instance->handle;
+	if (!instance->deleted && timer_arm (instance) != 0) {
+		log_printf (LOGSYS_LEVEL_ERROR, "Can't add service timer");
+		instance->deleted = 1;
+		hdb_handle_destroy (&timer_instance_database, handle);
+	}
+	hdb_handle_put (&timer_instance_database, handle);
+	cs_serialize_unlock ();
+}
+
+static void timer_disarm_deferred (void *data)
+{
+	struct timer_instance *instance = (struct timer_instance *)data;
+
+	cs_serialize_lock ();
+	if (instance->armed) {
+		qb_loop_timer_del(cs_poll_handle_get(), instance->qb_handle);
+	}
+	hdb_handle_put (&timer_instance_database, instance->handle);
+	cs_serialize_unlock ();
+}
+
+static int timer_add (
+	uint64_t nanosec_duration,
+	void *data,
+	void (*timer_fn) (void *data),
+	corosync_timer_handle_t *handle)
+{
+	struct timer_instance *instance;
+	hdb_handle_t timer_handle;
+	int res;
+
+	res = hdb_handle_create (&timer_instance_database,
+		sizeof (struct timer_instance), &timer_handle);
+	if (res != 0) {
+		return (res);
+	}
+	res = hdb_handle_get (&timer_instance_database, timer_handle,
+		(void *)&instance);
+	if (res != 0) {
+		hdb_handle_destroy (&timer_instance_database, timer_handle);
+		return (res);
+	}
+
+	instance->timer_fn = timer_fn;
+	instance->data = data;
+	instance->handle = timer_handle;
+	instance->expire_time = qb_util_nano_current_get () + nanosec_duration;
+	instance->armed = 0;
+	instance->deleted = 0;
+
+	if (cs_main_thread_is_current ()) {
+		res = timer_arm (instance);
+		hdb_handle_put (&timer_instance_database, timer_handle);
+	} else {
+		/*
+		 * Reference is kept by timer_arm_deferred
+		 */
+		res = cs_main_loop_work_add (timer_arm_deferred, instance);
+		if (res != 0) {
+			hdb_handle_put (&timer_instance_database, timer_handle);
+		}
+	}
+	if (res != 0) {
+		hdb_handle_destroy (&timer_instance_database, timer_handle);
+		return (res);
+	}
+
+	*handle = timer_handle;
+	return (0);
+}
+
 int corosync_timer_add_absolute (
 		unsigned long long nanosec_from_epoch,
 		void *data,
@@ -47,12 +196,7 @@ int corosync_timer_add_absolute (
 		corosync_timer_handle_t *handle)
 {
 	uint64_t expire_time = nanosec_from_epoch - qb_util_nano_current_get();
-	return qb_loop_timer_add(cs_poll_handle_get(),
-				QB_LOOP_MED,
-				 expire_time,
-				 data,
-				 timer_fn,
-				 handle);
+	return timer_add(expire_time, data, timer_fn, handle);
 }
 
 int corosync_timer_add_duration (
@@ -61,30 +205,61 @@ int corosync_timer_add_duration (
 	void (*timer_fn) (void *data),
 	corosync_timer_handle_t *handle)
 {
-	return qb_loop_timer_add(cs_poll_handle_get(),
-				QB_LOOP_MED,
-				 nanosec_duration,
-				 data,
-				 timer_fn,
-				 handle);
+	return timer_add(nanosec_duration, data, timer_fn, handle);
 }
 
 void corosync_timer_delete (
 	corosync_timer_handle_t th)
 {
-	qb_loop_timer_del(cs_poll_handle_get(), th);
+	struct timer_instance *instance;
+
+	if (hdb_handle_get (&timer_instance_database, th, (void *)&instance) != 0) {
+		return;
+	}
+	if (instance->deleted) {
+		hdb_handle_put (&timer_instance_database, th);
+		return;
+	}
+	instance->deleted = 1;
+
+	if (cs_main_thread_is_current ()) {
+		if (instance->armed) {
+			qb_loop_timer_del(cs_poll_handle_get(), instance->qb_handle);
+		}
+		hdb_handle_put (&timer_instance_database, th);
+	} else if (cs_main_loop_work_add (timer_disarm_deferred, instance) != 0) {
+		/*
+		 * Timer can't be disarmed, timer_do will find it deleted.
+		 * Instance is leaked rather than freed under the timer.
+		 */
+		log_printf (LOGSYS_LEVEL_ERROR, "Can't delete service timer");
+		return;
+	}
+
+	hdb_handle_destroy (&timer_instance_database, th);
 }
 
 unsigned long long corosync_timer_expire_time_get (
 	corosync_timer_handle_t th)
 {
+	struct timer_instance *instance;
 	uint64_t expire;
 
 	if (th == 0) {
 		return (0);
 	}
 
-	expire = qb_loop_timer_expire_time_get(cs_poll_handle_get(), th);
+	if (hdb_handle_get (&timer_instance_database, th, (void *)&instance) != 0) {
+		return (0);
+	}
+
+	if (cs_main_thread_is_current () && instance->armed) {
+		expire = qb_loop_timer_expire_time_get(cs_poll_handle_get(), instance->qb_handle);
+	} else {
+		expire = instance->expire_time;
+	}
+
+	hdb_handle_put (&timer_instance_database, th);
 
 	return (expire);
 }
@@ -82,6 +82,8 @@
 #define MISS_COUNT_CONST			5
 #define BLOCK_UNLISTED_IPS			1
 #define CANCEL_TOKEN_HOLD_ON_RETRANSMIT		0
+#define ADAPTIVE_FLOW_CONTROL			0
+#define MCAST_CONTROL_SHARE			50
 /* This constant is not used for knet */
 #define UDP_NETMTU                              1500
 
@@ -150,6 +152,10 @@ static void *totem_get_param_by_name(struct totem_config *totem_config, const ch
 		return &totem_config->block_unlisted_ips;
 	if (strcmp(param_name, "totem.cancel_token_hold_on_retransmit") == 0)
 		return &totem_config->cancel_token_hold_on_retransmit;
+	if (strcmp(param_name, "totem.adaptive_flow_control") == 0)
+		return &totem_config->adaptive_flow_control;
+	if (strcmp(param_name, "totem.mcast_control_share") == 0)
+		return &totem_config->mcast_control_share;
 
 	return NULL;
 }
@@ -375,6 +381,12 @@ void totem_volatile_config_read (struct totem_config *totem_config, icmap_map_t
 
 	totem_volatile_config_set_boolean_value(totem_config, temp_map, "totem.cancel_token_hold_on_retransmit",
 	    deleted_key, CANCEL_TOKEN_HOLD_ON_RETRANSMIT);
+
+	totem_volatile_config_set_boolean_value(totem_config, temp_map, "totem.adaptive_flow_control",
+	    deleted_key, ADAPTIVE_FLOW_CONTROL);
+
+	totem_volatile_config_set_uint32_value(totem_config, temp_map, "totem.mcast_control_share", deleted_key,
+	    MCAST_CONTROL_SHARE, 1);
 }
 
 int totem_volatile_config_validate (
@@ -413,6 +425,13 @@ int totem_volatile_config_validate (
 		goto parse_error;
 	}
 
+	if (totem_config->mcast_control_share > 100) {
+		snprintf (local_error_reason, sizeof(local_error_reason),
+			"The mcast_control_share parameter (%u%%) must be between 0 (disabled) and 100.",
+			totem_config->mcast_control_share);
+		goto parse_error;
+	}
+
 	if (totem_config->token_retransmit_timeout < MINIMUM_TIMEOUT) {
 		if (icmap_get_uint32_r(temp_map, "totem.token_retransmit", &tmp_config_value) == CS_OK) {
 			snprintf (local_error_reason, sizeof(local_error_reason),
@@ -2403,6 +2422,10 @@ static void debug_dump_totem_config(const struct totem_config *totem_config)
 	log_printf(LOGSYS_LEVEL_DEBUG,
 	    "window size per rotation (%d messages) maximum messages per rotation (%d messages)",
 	    totem_config->window_size, totem_config->max_messages);
+	log_printf(LOGSYS_LEVEL_DEBUG, "adaptive flow control (%s)",
+	    totem_config->adaptive_flow_control ? "yes" : "no");
+	log_printf(LOGSYS_LEVEL_DEBUG, "control messages share of token (%u%%)",
+	    totem_config->mcast_control_share);
 	log_printf(LOGSYS_LEVEL_DEBUG, "missed count const (%d messages)", totem_config->miss_count_const);
 	log_printf(LOGSYS_LEVEL_DEBUG, "heartbeat_failures_allowed (%d)",
 	    totem_config->heartbeat_failures_allowed);
@@ -71,6 +71,7 @@
 #include <corosync/icmap.h>
 #include <corosync/totem/totemip.h>
 #include "totemknet.h"
+#include "totemrecv.h"
 
 #include "main.h"
 #include "util.h"
@@ -153,7 +154,7 @@ struct totemknet_instance {
 
 	void *knet_context;
 
-	char iov_buffer[KNET_IOV_LEN_MAX];
+	struct totem_recv_batch recv_batch;
 
 	char *link_status[INTERFACE_MAX];
 
@@ -731,6 +732,8 @@ finalise_error:
 	 */
 	(void)pthread_mutex_destroy(&instance->log_mutex);
 
+	totem_recv_batch_free (&instance->recv_batch);
+
 	return (res);
 }
 
@@ -789,62 +792,59 @@ static int data_deliver_fn (
 	void *data)
 {
 	struct totemknet_instance *instance = (struct totemknet_instance *)data;
-	struct msghdr msg_hdr;
-	struct iovec iov_recv;
-	struct sockaddr_storage system_from;
-	ssize_t msg_len;
-	char *data_ptr = instance->iov_buffer;
-
-	iov_recv.iov_base = instance->iov_buffer;
-	iov_recv.iov_len = KNET_IOV_LEN_MAX;
-
-	memset(&msg_hdr, 0, sizeof(msg_hdr));
-	msg_hdr.msg_name = &system_from;
-	msg_hdr.msg_namelen = sizeof (struct sockaddr_storage);
-	msg_hdr.msg_iov = &iov_recv;
-	msg_hdr.msg_iovlen = 1;
-
-	msg_len = recvmsg (fd, &msg_hdr, MSG_NOSIGNAL | MSG_DONTWAIT);
-	if (msg_len <= 0) {
+	struct totem_recv_batch *batch = &instance->recv_batch;
+	struct sockaddr_storage *system_from;
+	void *msg;
+	unsigned int msg_len;
+	char *data_ptr;
+
+	if (totem_recv_batch_fill (batch, fd) <= 0) {
 		return (0);
 	}
 
-	if (msg_len >= KNET_IOV_LEN_MAX) {
+	while (totem_recv_batch_next (batch, &msg, &msg_len, &system_from) == 0) {
+		data_ptr = msg;
+
+		if (msg_len == 0) {
+			continue;
+		}
+
+		if (msg_len >= KNET_IOV_LEN_MAX) {
+			/*
+			 * It this happens it is real bug, because knet always sends packet with maximum size
+			 * of KNET_MAX_PACKET_SIZE.
+			 * If received packet is MAX_PACKET_SIZE + 1 it means packet was truncated
+			 * (receive buffers are intentionally KNET_IOV_LEN_MAX long).
+			 */
+			knet_log_printf(instance->totemknet_log_level_error,
+					"Received truncated packet. Please report this bug. Dropping packet.");
+			continue;
+		}
+
 		/*
-		 * It this happens it is real bug, because knet always sends packet with maximum size
-		 * of KNET_MAX_PACKET_SIZE.
-		 * If received packet is MAX_PACKET_SIZE + 1 it means packet was truncated
-		 * (iov_buffer size and iov_len are intentionally set to KNET_MAX_PACKET_SIZE + 1).
+		 * If it's from the knet fd then it will have the optional knet header on it
 		 */
-		knet_log_printf(instance->totemknet_log_level_error,
-				"Received truncated packet. Please report this bug. Dropping packet.");
-		return (0);
-	}
-
-	/*
-	 * If it's from the knet fd then it will have the optional knet header on it
-	 */
 #ifdef KNET_DATAFD_FLAG_RX_RETURN_INFO
-	if (fd == instance->knet_fd) {
-		struct knet_datafd_header *datafd_header = (struct knet_datafd_header *)data_ptr;
+		if (fd == instance->knet_fd) {
+			struct knet_datafd_header *datafd_header = (struct knet_datafd_header *)data_ptr;
 
-/* 		knet_log_printf (LOGSYS_LEVEL_DEBUG, "Packet from knet_fd nodeid: %d\n", datafd_header->src_nodeid); */
+/* 			knet_log_printf (LOGSYS_LEVEL_DEBUG, "Packet from knet_fd nodeid: %d\n", datafd_header->src_nodeid); */
 
-		/* Advance past the ACTUAL header size, not the size we think it might be */
-		data_ptr += datafd_header->size;
-		msg_len -= datafd_header->size;
-	}
+			/* Advance past the ACTUAL header size, not the size we think it might be */
+			data_ptr += datafd_header->size;
+			msg_len -= datafd_header->size;
+		}
 #endif
 
-
-	/*
-	 * Handle incoming message
-	 */
-	instance->totemknet_deliver_fn (
-		instance->context,
-		data_ptr,
-		msg_len,
-		&system_from);
+		/*
+		 * Handle incoming message
+		 */
+		instance->totemknet_deliver_fn (
+			instance->context,
+			data_ptr,
+			msg_len,
+			system_from);
+	}
 
 	return (0);
 }
@@ -1175,6 +1175,11 @@ int totemknet_initialize (
 
 	totemknet_instance_initialize (instance);
 
+	if (totem_recv_batch_init (&instance->recv_batch, KNET_IOV_LEN_MAX) == -1) {
+		free (instance);
+		return (-1);
+	}
+
 	instance->totem_config = totem_config;
 
 	/*
@@ -1413,7 +1418,7 @@ exit_error:
 void *totemknet_buffer_alloc (void)
 {
 	/* Need to have space for a message AND a struct mcast in case of encapsulated messages */
-	return malloc(KNET_MAX_PACKET_SIZE + 512);
+	return malloc(KNET_MAX_PACKET_SIZE + 512 + FRAME_HEADROOM_MAX);
 }
 
 void totemknet_buffer_release (void *ptr)
@@ -1512,29 +1517,25 @@ extern int totemknet_recv_mcast_empty (
 	void *knet_context)
 {
 	struct totemknet_instance *instance = (struct totemknet_instance *)knet_context;
-	unsigned int res;
-	struct sockaddr_storage system_from;
-	struct msghdr msg_hdr;
-	struct iovec iov_recv;
+	int res;
 	struct pollfd ufd;
 	int nfds;
 	int msg_processed = 0;
 
-	iov_recv.iov_base = instance->iov_buffer;
-	iov_recv.iov_len = KNET_MAX_PACKET_SIZE;
-
-	memset(&msg_hdr, 0, sizeof(msg_hdr));
-	msg_hdr.msg_name = &system_from;
-	msg_hdr.msg_namelen = sizeof (struct sockaddr_storage);
-	msg_hdr.msg_iov = &iov_recv;
-	msg_hdr.msg_iovlen = 1;
+	/*
+	 * Datagrams already received in the current batch are queued
+	 * entries as well
+	 */
+	if (totem_recv_batch_discard (&instance->recv_batch)) {
+		msg_processed = 1;
+	}
 
 	do {
 		ufd.fd = instance->knet_fd;
 		ufd.events = POLLIN;
 		nfds = poll (&ufd, 1, 0);
 		if (nfds == 1 && ufd.revents & POLLIN) {
-			res = recvmsg (instance->knet_fd, &msg_hdr, MSG_NOSIGNAL | MSG_DONTWAIT);
+			res = totem_recv_discard (instance->knet_fd);
 			if (res != -1) {
 				msg_processed = 1;
 			} else {
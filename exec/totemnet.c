@@ -36,6 +36,10 @@
 #include <config.h>
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #ifdef ENABLE_UDPU
 #include <totemudp.h>
@@ -257,9 +261,61 @@ struct transport transport_entries[] = {
 	}
 };
 
+/*
+ * Size of one frame in the frame pool.  It has to be big enough for
+ * the largest buffer any of the transports hands out.
+ */
+#define TOTEMNET_FRAME_SIZE	(FRAME_SIZE_MAX + 512 + FRAME_HEADROOM_MAX)
+
+#define TOTEMNET_FRAME_ALIGN	64
+
+/*
+ * Reference count of a frame is kept right after its TOTEMNET_FRAME_SIZE
+ * bytes. Frame returns to the pool when the last reference is released.
+ */
+#define TOTEMNET_FRAME_REFCOUNT_OFFSET	\
+	((TOTEMNET_FRAME_SIZE + sizeof (uint32_t) - 1) & ~(sizeof (uint32_t) - 1))
+
+#define TOTEMNET_FRAME_REFCOUNT(frame)	\
+	((uint32_t *)((char *)(frame) + TOTEMNET_FRAME_REFCOUNT_OFFSET))
+
+/*
+ * Frames stay in the totemsrp sort queue until the whole ring has seen
+ * them, which is bounded by the window size.  Preallocate frames for that
+ * many windows.
+ */
+#define TOTEMNET_FRAME_POOL_WINDOWS	2
+
+/*
+ * Frames of messages waiting in the new message queue are held as well, so
+ * under sustained load the pool needs up to MESSAGE_QUEUE_MAX more frames.
+ * Those are allocated on demand and kept on the free list after release
+ * instead of being freed, so only peak usage costs memory.
+ */
+
+/*
+ * Fixed size frame slab plus frames cached from the transport allocator.
+ * Free frames are kept on a LIFO stack so that the most recently released
+ * (and likely cache hot) frame is reused first.
+ */
+struct totemnet_frame_pool {
+	char *slab;
+	size_t frame_size;
+	unsigned int frame_count;
+	unsigned int free_count;
+	unsigned int free_max;
+	void **free_list;
+	int threaded_mode_enabled;
+	pthread_mutex_t mutex;
+};
+
 struct totemnet_instance {
 	void *transport_context;
 
+	struct totemnet_frame_pool frame_pool;
+
+	totemsrp_stats_t *stats;
+
 	struct transport *transport;
         void (*totemnet_log_printf) (
                 int level,
@@ -299,6 +355,91 @@ static void totemnet_instance_initialize (
 	instance->transport = &transport_entries[transport];
 }
 
+static void totemnet_frame_pool_init (
+	struct totemnet_instance *instance,
+	struct totem_config *totem_config)
+{
+	struct totemnet_frame_pool *pool = &instance->frame_pool;
+	unsigned int i;
+
+	memset (pool, 0, sizeof (struct totemnet_frame_pool));
+	pthread_mutex_init (&pool->mutex, NULL);
+
+	pool->frame_size = (TOTEMNET_FRAME_REFCOUNT_OFFSET + sizeof (uint32_t) +
+		TOTEMNET_FRAME_ALIGN - 1) & ~((size_t)TOTEMNET_FRAME_ALIGN - 1);
+	pool->frame_count = totem_config->window_size * TOTEMNET_FRAME_POOL_WINDOWS;
+	if (pool->frame_count == 0) {
+		return;
+	}
+	pool->free_max = pool->frame_count + MESSAGE_QUEUE_MAX;
+
+	pool->free_list = malloc (pool->free_max * sizeof (void *));
+	if (pool->free_list == NULL) {
+		goto error_exit;
+	}
+
+	if (posix_memalign ((void **)&pool->slab, TOTEMNET_FRAME_ALIGN,
+	    pool->frame_count * pool->frame_size) != 0) {
+		pool->slab = NULL;
+		goto error_exit;
+	}
+
+	/*
+	 * Touch the whole slab now, so it is resident (and locked when
+	 * corosync runs with mlockall) before the first message is sent
+	 */
+	memset (pool->slab, 0, pool->frame_count * pool->frame_size);
+
+	for (i = 0; i < pool->frame_count; i++) {
+		pool->free_list[i] = pool->slab +
+			(size_t)(pool->frame_count - 1 - i) * pool->frame_size;
+	}
+	pool->free_count = pool->frame_count;
+
+	log_printf (LOGSYS_LEVEL_DEBUG,
+		"Frame pool of %u frames (%zu bytes each) allocated, up to %u frames cached",
+		pool->frame_count, pool->frame_size, pool->free_max);
+
+	return;
+
+error_exit:
+	log_printf (LOGSYS_LEVEL_WARNING,
+		"Unable to allocate frame pool, using transport allocator");
+	free (pool->free_list);
+	pool->free_list = NULL;
+	pool->frame_count = 0;
+	pool->free_max = 0;
+}
+
+static inline int totemnet_frame_pool_owns (
+	const struct totemnet_frame_pool *pool,
+	const void *ptr)
+{
+	return ((const char *)ptr >= pool->slab &&
+		(const char *)ptr < pool->slab + (size_t)pool->frame_count * pool->frame_size);
+}
+
+static void totemnet_frame_pool_free (
+	struct totemnet_instance *instance)
+{
+	struct totemnet_frame_pool *pool = &instance->frame_pool;
+	unsigned int i;
+
+	for (i = 0; i < pool->free_count; i++) {
+		if (!totemnet_frame_pool_owns (pool, pool->free_list[i])) {
+			free (pool->free_list[i]);
+		}
+	}
+
+	free (pool->slab);
+	free (pool->free_list);
+	pool->slab = NULL;
+	pool->free_list = NULL;
+	pool->frame_count = 0;
+	pool->free_count = 0;
+	pool->free_max = 0;
+}
+
 int totemnet_crypto_set (
 	void *net_context,
 	const char *cipher_type,
@@ -321,6 +462,8 @@ int totemnet_finalize (
 
 	res = instance->transport->finalize (instance->transport_context);
 
+	totemnet_frame_pool_free (instance);
+
 	return (res);
 }
 
@@ -357,6 +500,8 @@ int totemnet_initialize (
 		return (-1);
 	}
 	totemnet_instance_initialize (instance, totem_config);
+	instance->stats = stats;
+	totemnet_frame_pool_init (instance, totem_config);
 
 	res = instance->transport->initialize (loop_pt,
 		&instance->transport_context, totem_config, stats,
@@ -370,6 +515,7 @@ int totemnet_initialize (
 	return (0);
 
 error_destroy:
+	totemnet_frame_pool_free (instance);
 	free (instance);
 	return (-1);
 }
@@ -377,17 +523,82 @@ error_destroy:
 void *totemnet_buffer_alloc (void *net_context)
 {
 	struct totemnet_instance *instance = net_context;
+	struct totemnet_frame_pool *pool;
+	void *ptr = NULL;
+
 	assert (instance != NULL);
 	assert (instance->transport != NULL);
-	return instance->transport->buffer_alloc();
+
+	pool = &instance->frame_pool;
+	if (pool->threaded_mode_enabled) {
+		pthread_mutex_lock (&pool->mutex);
+	}
+	if (pool->free_count > 0) {
+		ptr = pool->free_list[--pool->free_count];
+		instance->stats->frame_pool_hit++;
+	} else {
+		instance->stats->frame_pool_miss++;
+	}
+	if (pool->threaded_mode_enabled) {
+		pthread_mutex_unlock (&pool->mutex);
+	}
+
+	if (ptr == NULL &&
+	    posix_memalign (&ptr, TOTEMNET_FRAME_ALIGN, pool->frame_size) != 0) {
+		return (NULL);
+	}
+	*TOTEMNET_FRAME_REFCOUNT (ptr) = 1;
+
+	return (ptr);
+}
+
+/*
+ * Take another reference to frame, it is then recycled only after
+ * totemnet_buffer_release is called once more
+ */
+void totemnet_buffer_ref (void *net_context, void *ptr)
+{
+	__atomic_add_fetch (TOTEMNET_FRAME_REFCOUNT (ptr), 1, __ATOMIC_RELAXED);
 }
 
 void totemnet_buffer_release (void *net_context, void *ptr)
 {
 	struct totemnet_instance *instance = net_context;
+	struct totemnet_frame_pool *pool;
+
 	assert (instance != NULL);
 	assert (instance->transport != NULL);
-	instance->transport->buffer_release (ptr);
+
+	pool = &instance->frame_pool;
+	if (ptr == NULL) {
+		return;
+	}
+
+	if (__atomic_sub_fetch (TOTEMNET_FRAME_REFCOUNT (ptr), 1, __ATOMIC_ACQ_REL) != 0) {
+		return;
+	}
+
+	if (pool->threaded_mode_enabled) {
+		pthread_mutex_lock (&pool->mutex);
+	}
+	if (pool->free_count < pool->free_max) {
+		pool->free_list[pool->free_count++] = ptr;
+		ptr = NULL;
+	} else {
+		assert (!totemnet_frame_pool_owns (pool, ptr));
+	}
+	if (pool->threaded_mode_enabled) {
+		pthread_mutex_unlock (&pool->mutex);
+	}
+
+	free (ptr);
+}
+
+void totemnet_threaded_mode_enable (void *net_context)
+{
+	struct totemnet_instance *instance = net_context;
+
+	instance->frame_pool.threaded_mode_enabled = 1;
 }
 
 int totemnet_processor_count_set (
@@ -81,8 +81,12 @@ extern int totemnet_initialize (
 
 extern void *totemnet_buffer_alloc (void *net_context);
 
+extern void totemnet_buffer_ref (void *net_context, void *ptr);
+
 extern void totemnet_buffer_release (void *net_context, void *ptr);
 
+extern void totemnet_threaded_mode_enable (void *net_context);
+
 extern int totemnet_processor_count_set (
 	void *net_context,
 	int processor_count);
@@ -153,13 +153,31 @@ struct totempg_mcast {
 #define TOTEMPG_PACKET_SIZE (totempg_totem_config->net_mtu - \
 	sizeof (struct totempg_mcast))
 
+/*
+ * Maximum number of messages packed into one frame.  The length table
+ * of the packed messages is written into the frame headroom on send.
+ */
+#define TOTEMPG_PACKED_MSG_MAX ((int)(FRAME_HEADROOM_MAX / sizeof (unsigned short)))
+
+/*
+ * Room reserved in front of the packed data for the totempg_mcast header
+ * and the length table
+ */
+#define TOTEMPG_FRAME_HEADROOM (sizeof (struct totempg_mcast) + FRAME_HEADROOM_MAX)
+
 /*
  * Local variables used for packing small messages
  */
-static unsigned short mcast_packed_msg_lens[FRAME_SIZE_MAX];
+static unsigned short mcast_packed_msg_lens[TOTEMPG_PACKED_MSG_MAX];
 
 static int mcast_packed_msg_count = 0;
 
+/*
+ * A control message was packed with bulk ones and may not be sent yet,
+ * later control messages follow it through the bulk lane until it drains
+ */
+static int mcast_control_in_bulk_lane = 0;
+
 static int totempg_reserved = 1;
 
 static unsigned int totempg_size_limit;
@@ -191,6 +209,14 @@ struct totem_config *totempg_totem_config;
 
 static totempg_stats_t totempg_stats;
 
+struct totempg_node_stats {
+	unsigned int nodeid;
+	totempg_node_stats_t stats;
+	struct qb_list_head list;
+};
+
+QB_LIST_DECLARE(totempg_node_stats_list);
+
 enum throw_away_mode {
 	THROW_AWAY_INACTIVE,
 	THROW_AWAY_ACTIVE
@@ -230,7 +256,12 @@ QB_LIST_DECLARE(totempg_groups_list);
  * the size of message data and where to place new message data.
  * fragment_contuation indicates whether the first packed message in
  * the buffer is a continuation of a previously packed fragment.
+ *
+ * The buffer is the payload of a totemsrp frame (fragmentation_frame), so
+ * once it is full the very same memory is queued and sent on the wire.
  */
+static void *fragmentation_frame;
+
 static unsigned char *fragmentation_data;
 
 static int fragment_size = 0;
@@ -349,6 +380,68 @@ static void assembly_deref (struct assembly *assembly)
 	qb_list_add (&assembly->list, &assembly_list_free);
 }
 
+static totempg_node_stats_t *totempg_node_stats_get (unsigned int nodeid)
+{
+	struct totempg_node_stats *node_stats;
+	struct qb_list_head *list;
+
+	qb_list_for_each(list, &totempg_node_stats_list) {
+		node_stats = qb_list_entry (list, struct totempg_node_stats, list);
+
+		if (nodeid == node_stats->nodeid) {
+			return (&node_stats->stats);
+		}
+	}
+
+	node_stats = malloc (sizeof (struct totempg_node_stats));
+	if (node_stats == NULL) {
+		return (NULL);
+	}
+	memset (node_stats, 0, sizeof (struct totempg_node_stats));
+	node_stats->nodeid = nodeid;
+	qb_list_init (&node_stats->list);
+	qb_list_add (&node_stats->list, &totempg_node_stats_list);
+
+	stats_pg_add_node (nodeid);
+
+	return (&node_stats->stats);
+}
+
+static void totempg_node_stats_del (unsigned int nodeid)
+{
+	struct totempg_node_stats *node_stats;
+	struct qb_list_head *list, *tmp_iter;
+
+	qb_list_for_each_safe(list, tmp_iter, &totempg_node_stats_list) {
+		node_stats = qb_list_entry (list, struct totempg_node_stats, list);
+
+		if (nodeid == node_stats->nodeid) {
+			stats_pg_del_node (nodeid);
+			qb_list_del (&node_stats->list);
+			free (node_stats);
+		}
+	}
+}
+
+int totempg_get_node_stats (
+	unsigned int nodeid,
+	totempg_node_stats_t *stats)
+{
+	struct totempg_node_stats *node_stats;
+	struct qb_list_head *list;
+
+	qb_list_for_each(list, &totempg_node_stats_list) {
+		node_stats = qb_list_entry (list, struct totempg_node_stats, list);
+
+		if (nodeid == node_stats->nodeid) {
+			memcpy (stats, &node_stats->stats, sizeof (totempg_node_stats_t));
+			return (0);
+		}
+	}
+
+	return (-1);
+}
+
 static void assembly_deref_from_normal_and_trans (int nodeid)
 {
 	int j;
@@ -393,6 +486,7 @@ static inline void app_confchg_fn (
 	 */
 	for (i = 0; i < left_list_entries; i++) {
 		assembly_deref_from_normal_and_trans (left_list[i]);
+		totempg_node_stats_del (left_list[i]);
 	}
 
 	qb_list_for_each(list, &totempg_groups_list) {
@@ -586,6 +680,68 @@ static void totempg_confchg_fn (
 		ring_id);
 }
 
+/*
+ * Deliver complete messages straight out of the received frame. Only a
+ * message spanning frames is staged in the assembly buffer.
+ */
+static void totempg_deliver_in_place (
+	unsigned int nodeid,
+	struct assembly *assembly,
+	const struct totempg_mcast *mcast,
+	const unsigned short *msg_lens,
+	int msg_count,
+	const char *payload,
+	totempg_node_stats_t *node_stats)
+{
+	size_t offset = 0;
+	uint64_t bytes_copied = 0;
+	uint64_t bytes_in_place = 0;
+	int i = 0;
+
+	assembly->last_frag_num = mcast->fragmented;
+
+	if (assembly->index > 0 && msg_count > 0) {
+		/*
+		 * First packed message completes the one staged from previous frames
+		 */
+		assert ((assembly->index + msg_lens[0]) < sizeof (assembly->data));
+		memcpy (&assembly->data[assembly->index], payload, msg_lens[0]);
+		app_deliver_fn (nodeid, assembly->data, assembly->index + msg_lens[0], 0);
+		bytes_copied += msg_lens[0];
+		offset += msg_lens[0];
+		assembly->index = 0;
+		i = 1;
+	}
+
+	for (; i < msg_count; i++) {
+		app_deliver_fn (nodeid, (void *)(payload + offset), msg_lens[i], 0);
+		bytes_in_place += msg_lens[i];
+		offset += msg_lens[i];
+	}
+
+	if (mcast->fragmented == 0) {
+		/*
+		 * End of messages, dereference assembly struct
+		 */
+		assembly->last_frag_num = 0;
+		assembly->index = 0;
+		assembly_deref (assembly);
+	} else {
+		/*
+		 * Stage the beginning (or next part) of message continuing in next frame
+		 */
+		assert ((assembly->index + msg_lens[msg_count]) < sizeof (assembly->data));
+		memcpy (&assembly->data[assembly->index], payload + offset, msg_lens[msg_count]);
+		assembly->index += msg_lens[msg_count];
+		bytes_copied += msg_lens[msg_count];
+	}
+
+	if (node_stats) {
+		node_stats->assembly_bytes_copied += bytes_copied;
+		node_stats->assembly_bytes_in_place += bytes_in_place;
+	}
+}
+
 static void totempg_deliver_fn (
 	unsigned int nodeid,
 	const void *msg,
@@ -604,6 +760,7 @@ static void totempg_deliver_fn (
 	int datasize;
 	struct iovec iov_delv;
 	size_t expected_msg_len;
+	totempg_node_stats_t *node_stats;
 
 	assembly = assembly_ref (nodeid);
 	assert (assembly);
@@ -659,10 +816,6 @@ static void totempg_deliver_fn (
 		return ;
 	}
 
-	assert((assembly->index+msg_len) < sizeof(assembly->data));
-	memcpy (&assembly->data[assembly->index], &data[datasize],
-		msg_len - datasize);
-
 	/*
 	 * If the last message in the buffer is a fragment, then we
 	 * can't deliver it.  We'll first deliver the full messages
@@ -671,6 +824,28 @@ static void totempg_deliver_fn (
 	 */
 	msg_count = mcast->fragmented ? mcast->msg_count - 1 : mcast->msg_count;
 	continuation = mcast->continuation;
+
+	node_stats = totempg_node_stats_get (nodeid);
+
+	/*
+	 * Messages needing endian conversion are converted in place, so they
+	 * are always copied. So is everything while recovering from a lost
+	 * fragment.
+	 */
+	if (endian_conversion_required == 0 &&
+	    assembly->throw_away_mode == THROW_AWAY_INACTIVE &&
+	    continuation == assembly->last_frag_num) {
+		totempg_deliver_in_place (nodeid, assembly, mcast, msg_lens, msg_count,
+			&data[datasize], node_stats);
+		return ;
+	}
+
+	assert((assembly->index+msg_len) < sizeof(assembly->data));
+	memcpy (&assembly->data[assembly->index], &data[datasize],
+		msg_len - datasize);
+	if (node_stats) {
+		node_stats->assembly_bytes_copied += msg_len - datasize;
+	}
 	iov_delv.iov_base = (void *)&assembly->data[0];
 	iov_delv.iov_len = assembly->index + msg_lens[0];
 
@@ -745,27 +920,113 @@ static void totempg_deliver_fn (
 
 void *callback_token_received_handle;
 
-int callback_token_received_fn (enum totem_callback_token_type type,
-				const void *data)
+/*
+ * Make sure there is a frame to pack message data into
+ */
+static int packed_frame_get (void)
+{
+	if (fragmentation_frame != NULL) {
+		return (0);
+	}
+
+	fragmentation_frame = totemsrp_mcast_frame_alloc (totemsrp_context,
+		TOTEMPG_FRAME_HEADROOM, &fragmentation_data);
+	if (fragmentation_frame == NULL) {
+		fragmentation_data = NULL;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Write the totempg header and the length table directly in front of the
+ * data_len bytes packed in the frame and hand the frame over to totemsrp
+ */
+static int packed_frame_send (
+	const struct totempg_mcast *mcast,
+	unsigned int data_len,
+	int guarantee)
+{
+	unsigned char *frame_start;
+	unsigned int lens_len;
+	int res;
+
+	lens_len = mcast->msg_count * sizeof (unsigned short);
+	assert (mcast->msg_count <= TOTEMPG_PACKED_MSG_MAX);
+
+	frame_start = fragmentation_data - lens_len - sizeof (struct totempg_mcast);
+	memcpy (frame_start, mcast, sizeof (struct totempg_mcast));
+	memcpy (frame_start + sizeof (struct totempg_mcast),
+		mcast_packed_msg_lens, lens_len);
+
+	res = totemsrp_mcast_frame_commit (totemsrp_context, fragmentation_frame,
+		frame_start, sizeof (struct totempg_mcast) + lens_len + data_len,
+		guarantee, TOTEM_MCAST_PRIO_BULK, mcast->fragmented != 0);
+	if (res == 0) {
+		fragmentation_frame = NULL;
+		fragmentation_data = NULL;
+	}
+
+	return (res);
+}
+
+/*
+ * Send a control message in a frame of its own, so totemsrp can send it
+ * before bulk messages queued earlier. data_len must fit into one frame.
+ */
+static int control_frame_send (
+	const struct iovec *iovec,
+	unsigned int iov_len,
+	unsigned int data_len,
+	int guarantee)
 {
 	struct totempg_mcast mcast;
-	struct iovec iovecs[3];
+	unsigned short msg_len;
+	unsigned char *data;
+	unsigned char *frame_start;
+	void *frame;
+	unsigned int copied = 0;
+	int i;
+	int res;
 
-	if (totempg_threaded_mode == 1) {
-		pthread_mutex_lock (&mcast_msg_mutex);
+	frame = totemsrp_mcast_frame_alloc (totemsrp_context,
+		TOTEMPG_FRAME_HEADROOM, &data);
+	if (frame == NULL) {
+		return (-1);
 	}
-	if (mcast_packed_msg_count == 0) {
-		if (totempg_threaded_mode == 1) {
-			pthread_mutex_unlock (&mcast_msg_mutex);
-		}
-		return (0);
+
+	for (i = 0; i < iov_len; i++) {
+		memcpy (&data[copied], iovec[i].iov_base, iovec[i].iov_len);
+		copied += iovec[i].iov_len;
 	}
-	if (totemsrp_avail(totemsrp_context) == 0) {
-		if (totempg_threaded_mode == 1) {
-			pthread_mutex_unlock (&mcast_msg_mutex);
-		}
-		return (0);
+
+	memset (&mcast, 0, sizeof (mcast));
+	mcast.msg_count = 1;
+	msg_len = data_len;
+
+	frame_start = data - sizeof (unsigned short) - sizeof (struct totempg_mcast);
+	memcpy (frame_start, &mcast, sizeof (struct totempg_mcast));
+	memcpy (frame_start + sizeof (struct totempg_mcast), &msg_len, sizeof (unsigned short));
+
+	res = totemsrp_mcast_frame_commit (totemsrp_context, frame, frame_start,
+		sizeof (struct totempg_mcast) + sizeof (unsigned short) + data_len,
+		guarantee, TOTEM_MCAST_PRIO_CONTROL, 0);
+	if (res == -1) {
+		totemsrp_mcast_frame_release (totemsrp_context, frame);
 	}
+
+	return (res);
+}
+
+/*
+ * Send the messages packed so far
+ */
+static int packed_frame_flush (void)
+{
+	struct totempg_mcast mcast;
+	int res;
+
 	mcast.header.version = 0;
 	mcast.header.type = 0;
 	mcast.fragmented = 0;
@@ -779,17 +1040,35 @@ int callback_token_received_fn (enum totem_callback_token_type type,
 
 	mcast.msg_count = mcast_packed_msg_count;
 
-	iovecs[0].iov_base = (void *)&mcast;
-	iovecs[0].iov_len = sizeof (struct totempg_mcast);
-	iovecs[1].iov_base = (void *)mcast_packed_msg_lens;
-	iovecs[1].iov_len = mcast_packed_msg_count * sizeof (unsigned short);
-	iovecs[2].iov_base = (void *)&fragmentation_data[0];
-	iovecs[2].iov_len = fragment_size;
-	(void)totemsrp_mcast (totemsrp_context, iovecs, 3, 0);
+	res = packed_frame_send (&mcast, fragment_size, 0);
 
 	mcast_packed_msg_count = 0;
 	fragment_size = 0;
 
+	return (res);
+}
+
+int callback_token_received_fn (enum totem_callback_token_type type,
+				const void *data)
+{
+	if (totempg_threaded_mode == 1) {
+		pthread_mutex_lock (&mcast_msg_mutex);
+	}
+	if (mcast_packed_msg_count == 0) {
+		if (totempg_threaded_mode == 1) {
+			pthread_mutex_unlock (&mcast_msg_mutex);
+		}
+		return (0);
+	}
+	if (totemsrp_avail(totemsrp_context) == 0) {
+		if (totempg_threaded_mode == 1) {
+			pthread_mutex_unlock (&mcast_msg_mutex);
+		}
+		return (0);
+	}
+
+	(void)packed_frame_flush ();
+
 	if (totempg_threaded_mode == 1) {
 		pthread_mutex_unlock (&mcast_msg_mutex);
 	}
@@ -814,11 +1093,6 @@ int totempg_initialize (
 	totempg_log_printf = totem_config->totem_logging_configuration.log_printf;
 	totempg_subsys_id = totem_config->totem_logging_configuration.log_subsys_id;
 
-	fragmentation_data = malloc (TOTEMPG_PACKET_SIZE);
-	if (fragmentation_data == 0) {
-		return (-1);
-	}
-
 	totemsrp_net_mtu_adjust (totem_config);
 
 	res = totemsrp_initialize (
@@ -857,6 +1131,11 @@ void totempg_finalize (void)
 	if (totempg_threaded_mode == 1) {
 		pthread_mutex_lock (&totempg_mutex);
 	}
+	if (fragmentation_frame != NULL) {
+		totemsrp_mcast_frame_release (totemsrp_context, fragmentation_frame);
+		fragmentation_frame = NULL;
+		fragmentation_data = NULL;
+	}
 	// coverity[SLEEP:SUPPRESS] sleep is not a problem because it is shutdown
 	totemsrp_finalize (totemsrp_context);
 	if (totempg_threaded_mode == 1) {
@@ -870,11 +1149,11 @@ void totempg_finalize (void)
 static int mcast_msg (
 	struct iovec *iovec_in,
 	unsigned int iov_len,
-	int guarantee)
+	int guarantee,
+	unsigned int prio)
 {
 	int res = 0;
 	struct totempg_mcast mcast;
-	struct iovec iovecs[3];
 	struct iovec iovec[64];
 	int i;
 	int dest, src;
@@ -900,6 +1179,66 @@ static int mcast_msg (
 	}
 	iov_len = dest;
 
+	for (i = 0; i < iov_len; i++) {
+		total_size += iovec[i].iov_len;
+	}
+
+	/*
+	 * Control messages skip the packing buffer when priority lanes are
+	 * enabled. While waiting for transitional configuration ack totemsrp
+	 * sends everything in order, so they are packed as any other message
+	 * not to overtake messages already in the buffer. Control messages
+	 * stay in the lane of the previous one until that lane drains, so
+	 * they are never reordered between each other.
+	 */
+	if (prio == TOTEM_MCAST_PRIO_CONTROL) {
+		if (mcast_control_in_bulk_lane && mcast_packed_msg_count == 0 &&
+		    totemsrp_mcast_lane_is_empty (totemsrp_context, TOTEM_MCAST_PRIO_BULK)) {
+			mcast_control_in_bulk_lane = 0;
+		}
+
+		if (mcast_control_in_bulk_lane == 0 &&
+		    totempg_totem_config->mcast_control_share > 0 &&
+		    totempg_waiting_transack == 0 &&
+		    total_size <= TOTEMPG_PACKET_SIZE - sizeof (unsigned short)) {
+			res = control_frame_send (iovec, iov_len, total_size, guarantee);
+			goto error_exit;
+		}
+
+		/*
+		 * Control frames queued earlier must go out first. Close the
+		 * pending frame so this message starts a frame of its own and
+		 * totemsrp can send them before it.
+		 */
+		if (!totemsrp_mcast_lane_is_empty (totemsrp_context, TOTEM_MCAST_PRIO_CONTROL)) {
+			if (mcast_packed_msg_count > 0 &&
+			    (totemsrp_avail (totemsrp_context) == 0 ||
+			     packed_frame_flush () == -1)) {
+
+				if (totempg_threaded_mode == 1) {
+					pthread_mutex_unlock (&mcast_msg_mutex);
+				}
+				return (-1);
+			}
+			totemsrp_mcast_control_drain (totemsrp_context);
+		}
+		mcast_control_in_bulk_lane = 1;
+	}
+
+	/*
+	 * Send out the pending frame if its length table is full
+	 */
+	if (mcast_packed_msg_count == TOTEMPG_PACKED_MSG_MAX) {
+		if (totemsrp_avail (totemsrp_context) == 0 ||
+		    packed_frame_flush () == -1) {
+
+			if (totempg_threaded_mode == 1) {
+				pthread_mutex_unlock (&mcast_msg_mutex);
+			}
+			return (-1);
+		}
+	}
+
 	max_packet_size = TOTEMPG_PACKET_SIZE -
 		(sizeof (unsigned short) * (mcast_packed_msg_count + 1));
 
@@ -908,10 +1247,6 @@ static int mcast_msg (
 	/*
 	 * Check if we would overwrite new message queue
 	 */
-	for (i = 0; i < iov_len; i++) {
-		total_size += iovec[i].iov_len;
-	}
-
 	if (byte_count_send_ok (total_size + sizeof(unsigned short) *
 		(mcast_packed_msg_count)) == 0) {
 
@@ -925,6 +1260,11 @@ static int mcast_msg (
 
 	mcast.header.version = 0;
 	for (i = 0; i < iov_len; ) {
+		if (packed_frame_get () == -1) {
+			res = -1;
+			goto error_exit;
+		}
+
 		mcast.fragmented = 0;
 		mcast.continuation = fragment_continuation;
 		copy_len = iovec[i].iov_len - copy_base;
@@ -953,14 +1293,7 @@ static int mcast_msg (
 		 * If it just fits or is too big, then send out what fits.
 		 */
 		} else {
-			unsigned char *data_ptr;
-
 			copy_len = min(copy_len, max_packet_size - fragment_size);
-			if( copy_len == max_packet_size )
-				data_ptr = (unsigned char *)iovec[i].iov_base + copy_base;
-			else {
-				data_ptr = fragmentation_data;
-			}
 
 			memcpy (&fragmentation_data[fragment_size],
 				(unsigned char *)iovec[i].iov_base + copy_base, copy_len);
@@ -985,18 +1318,12 @@ static int mcast_msg (
 			}
 
 			/*
-			 * assemble the message and send it
+			 * assemble the message in place and send it
 			 */
 			mcast.msg_count = ++mcast_packed_msg_count;
-			iovecs[0].iov_base = (void *)&mcast;
-			iovecs[0].iov_len = sizeof(struct totempg_mcast);
-			iovecs[1].iov_base = (void *)mcast_packed_msg_lens;
-			iovecs[1].iov_len = mcast_packed_msg_count *
-				sizeof(unsigned short);
-			iovecs[2].iov_base = (void *)data_ptr;
-			iovecs[2].iov_len = fragment_size + copy_len;
 			assert (totemsrp_avail(totemsrp_context) > 0);
-			res = totemsrp_mcast (totemsrp_context, iovecs, 3, guarantee);
+			res = packed_frame_send (&mcast, fragment_size + copy_len,
+				guarantee);
 			if (res == -1) {
 				goto error_exit;
 			}
@@ -1237,6 +1564,17 @@ int totempg_groups_mcast_joined (
 	const struct iovec *iovec,
 	unsigned int iov_len,
 	int guarantee)
+{
+	return (totempg_groups_mcast_joined_prio (totempg_groups_instance,
+		iovec, iov_len, guarantee, TOTEM_MCAST_PRIO_BULK));
+}
+
+int totempg_groups_mcast_joined_prio (
+	void *totempg_groups_instance,
+	const struct iovec *iovec,
+	unsigned int iov_len,
+	int guarantee,
+	unsigned int prio)
 {
 	struct totempg_group_instance *instance = (struct totempg_group_instance *)totempg_groups_instance;
 	unsigned short group_len[MAX_GROUPS_PER_MSG + 1];
@@ -1264,7 +1602,7 @@ int totempg_groups_mcast_joined (
 		iovec_mcast[i + instance->groups_cnt + 1].iov_base = iovec[i].iov_base;
 	}
 
-	res = mcast_msg (iovec_mcast, iov_len + instance->groups_cnt + 1, guarantee);
+	res = mcast_msg (iovec_mcast, iov_len + instance->groups_cnt + 1, guarantee, prio);
 
 	if (totempg_threaded_mode == 1) {
 		pthread_mutex_unlock (&totempg_mutex);
@@ -1393,7 +1731,8 @@ int totempg_groups_mcast_groups (
 		iovec_mcast[i + groups_cnt + 1].iov_base = iovec[i].iov_base;
 	}
 
-	res = mcast_msg (iovec_mcast, iov_len + groups_cnt + 1, guarantee);
+	res = mcast_msg (iovec_mcast, iov_len + groups_cnt + 1, guarantee,
+		TOTEM_MCAST_PRIO_BULK);
 
 	if (totempg_threaded_mode == 1) {
 		pthread_mutex_unlock (&totempg_mutex);
@@ -1489,6 +1828,15 @@ void* totempg_get_stats (void)
 	return &totempg_stats;
 }
 
+int totempg_queue_avail_get (void)
+{
+	int avail;
+
+	avail = totemsrp_avail (totemsrp_context) - totempg_reserved;
+
+	return (avail > 0 ? avail : 0);
+}
+
 int totempg_crypto_set (
 	const char *cipher_type,
 	const char *hash_type)
@@ -1578,9 +1926,17 @@ extern int totempg_crypto_reconfigure_phase (cfg_message_crypto_reconfig_phase_t
 
 extern void totempg_stats_clear (int flags)
 {
+	struct totempg_node_stats *node_stats;
+	struct qb_list_head *list;
+
 	if (flags & TOTEMPG_STATS_CLEAR_TOTEM) {
 		totempg_stats.msg_reserved = 0;
 		totempg_stats.msg_queue_avail = 0;
+
+		qb_list_for_each(list, &totempg_node_stats_list) {
+			node_stats = qb_list_entry (list, struct totempg_node_stats, list);
+			memset (&node_stats->stats, 0, sizeof (totempg_node_stats_t));
+		}
 	}
 	return totemsrp_stats_clear (totemsrp_context, flags);
 }
@@ -1591,6 +1947,20 @@ void totempg_threaded_mode_enable (void)
 	totemsrp_threaded_mode_enable (totemsrp_context);
 }
 
+/*
+ * Application callbacks then run in delivery thread, which also sends
+ * messages, so threaded mode is required
+ */
+int totempg_delivery_thread_start (
+	void (*serialize_lock) (void),
+	void (*serialize_unlock) (void))
+{
+	totempg_threaded_mode_enable ();
+
+	return (totemsrp_delivery_thread_start (totemsrp_context,
+		serialize_lock, serialize_unlock));
+}
+
 void totempg_trans_ack (void)
 {
 	totemsrp_trans_ack (totemsrp_context);
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2026 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * This software licensed under BSD license, the text of which follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * - Neither the name of the MontaVista Software, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived from this
+ *   software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TOTEMRECV_H_DEFINED
+#define TOTEMRECV_H_DEFINED
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ * Batched datagram receive shared by the totem transports.
+ *
+ * One poll wakeup drains up to TOTEM_RECV_BATCH_MAX datagrams with a single
+ * recvmmsg() call into a ring of preallocated buffers.  The transport then
+ * walks the ring with totem_recv_batch_next() and delivers every datagram
+ * to totemsrp in one pass.
+ */
+#define TOTEM_RECV_BATCH_MAX	8
+
+#if defined(HAVE_RECVMMSG) || defined(HAVE_SENDMMSG)
+typedef struct mmsghdr totem_mmsghdr_t;
+#else
+typedef struct {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+} totem_mmsghdr_t;
+#endif
+
+struct totem_recv_batch {
+	unsigned int count;
+	unsigned int next;
+	size_t buffer_size;
+	char *buffers;
+	struct iovec iov[TOTEM_RECV_BATCH_MAX];
+	struct sockaddr_storage system_from[TOTEM_RECV_BATCH_MAX];
+	totem_mmsghdr_t msgs[TOTEM_RECV_BATCH_MAX];
+};
+
+static inline int totem_recv_batch_init (
+	struct totem_recv_batch *batch,
+	size_t buffer_size)
+{
+	memset (batch, 0, sizeof (struct totem_recv_batch));
+
+	batch->buffers = malloc (buffer_size * TOTEM_RECV_BATCH_MAX);
+	if (batch->buffers == NULL) {
+		return (-1);
+	}
+	batch->buffer_size = buffer_size;
+
+	return (0);
+}
+
+static inline void totem_recv_batch_free (struct totem_recv_batch *batch)
+{
+	free (batch->buffers);
+	batch->buffers = NULL;
+	batch->count = 0;
+	batch->next = 0;
+}
+
+/*
+ * Receive as many datagrams as are queued on fd, up to TOTEM_RECV_BATCH_MAX.
+ * Any datagrams of the previous batch which were not consumed yet are
+ * dropped.  Returns the number of datagrams received or -1 on error.
+ */
+static inline int totem_recv_batch_fill (
+	struct totem_recv_batch *batch,
+	int fd)
+{
+	unsigned int i;
+	int res;
+
+	batch->count = 0;
+	batch->next = 0;
+
+	for (i = 0; i < TOTEM_RECV_BATCH_MAX; i++) {
+		batch->iov[i].iov_base = batch->buffers + i * batch->buffer_size;
+		batch->iov[i].iov_len = batch->buffer_size;
+
+		memset (&batch->msgs[i], 0, sizeof (totem_mmsghdr_t));
+		batch->msgs[i].msg_hdr.msg_name = &batch->system_from[i];
+		batch->msgs[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_storage);
+		batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+#ifdef HAVE_RECVMMSG
+	res = recvmmsg (fd, batch->msgs, TOTEM_RECV_BATCH_MAX,
+		MSG_NOSIGNAL | MSG_DONTWAIT, NULL);
+#else
+	res = recvmsg (fd, &batch->msgs[0].msg_hdr, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (res != -1) {
+		batch->msgs[0].msg_len = res;
+		res = 1;
+	}
+#endif
+	if (res == -1) {
+		return (-1);
+	}
+
+	batch->count = res;
+
+	return (res);
+}
+
+/*
+ * Take the next datagram of the batch.  Returns -1 once the batch is empty.
+ */
+static inline int totem_recv_batch_next (
+	struct totem_recv_batch *batch,
+	void **msg,
+	unsigned int *msg_len,
+	struct sockaddr_storage **system_from)
+{
+	unsigned int i;
+
+	if (batch->next >= batch->count) {
+		return (-1);
+	}
+
+	i = batch->next++;
+	*msg = batch->iov[i].iov_base;
+	*msg_len = batch->msgs[i].msg_len;
+	*system_from = &batch->system_from[i];
+
+	return (0);
+}
+
+/*
+ * Drop the datagrams of the batch which were not consumed yet.
+ * Returns 1 if anything was dropped.
+ */
+static inline int totem_recv_batch_discard (struct totem_recv_batch *batch)
+{
+	int res;
+
+	res = (batch->next < batch->count);
+	batch->next = batch->count;
+
+	return (res);
+}
+
+/*
+ * Read and throw away the datagrams queued on fd, TOTEM_RECV_BATCH_MAX at
+ * a time.  Datagrams are truncated to a single byte, which discards the
+ * rest of them.  Returns the number of datagrams read or -1 on error.
+ */
+static inline int totem_recv_discard (int fd)
+{
+	char discard_buffer;
+	struct iovec iov;
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msgs[TOTEM_RECV_BATCH_MAX];
+	unsigned int i;
+
+	iov.iov_base = &discard_buffer;
+	iov.iov_len = sizeof (discard_buffer);
+
+	memset (msgs, 0, sizeof (msgs));
+	for (i = 0; i < TOTEM_RECV_BATCH_MAX; i++) {
+		msgs[i].msg_hdr.msg_iov = &iov;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	return (recvmmsg (fd, msgs, TOTEM_RECV_BATCH_MAX,
+		MSG_NOSIGNAL | MSG_DONTWAIT, NULL));
+#else
+	struct msghdr msg_hdr;
+	int res;
+
+	iov.iov_base = &discard_buffer;
+	iov.iov_len = sizeof (discard_buffer);
+
+	memset (&msg_hdr, 0, sizeof (msg_hdr));
+	msg_hdr.msg_iov = &iov;
+	msg_hdr.msg_iovlen = 1;
+
+	res = recvmsg (fd, &msg_hdr, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (res == -1) {
+		return (-1);
+	}
+	return (1);
+#endif
+}
+
+#endif /* TOTEMRECV_H_DEFINED */
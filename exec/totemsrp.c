@@ -72,6 +72,8 @@
 #include <poll.h>
 #include <sys/uio.h>
 #include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 #include <qb/qblist.h>
 #include <qb/qbdefs.h>
@@ -80,6 +82,8 @@
 
 #include <corosync/swab.h>
 #include <corosync/sq.h>
+#include <corosync/totem/totemrtr.h>
+#include <corosync/totem/totemmemb.h>
 
 #define LOGSYS_UTILS_ONLY 1
 #include <corosync/logsys.h>
@@ -100,13 +104,8 @@
 #define RETRANSMIT_ENTRIES_MAX			30
 #define TOKEN_SIZE_MAX				64000 /* bytes */
 #define LEAVE_DUMMY_NODEID                      0
-
-/*
- * SRP address.
- */
-struct srp_addr {
-	unsigned int nodeid;
-};
+#define DELIVERY_RING_ITEMS			256
+#define FCC_ADAPT_HOLDOFF			2 /* rotations without change after decrease */
 
 /*
  * Rollover handling:
@@ -157,14 +156,6 @@ enum encapsulation_type {
 	MESSAGE_NOT_ENCAPSULATED = 2
 };
 
-/*
- * New membership algorithm local variables
- */
-struct consensus_list_item {
-	struct srp_addr addr;
-	int set;
-};
-
 
 struct token_callback_instance {
 	struct qb_list_head list;
@@ -172,6 +163,8 @@ struct token_callback_instance {
 	enum totem_callback_token_type callback_type;
 	int delete;
 	void *data;
+	int running; /* callback_fn executes with token_callback_mutex dropped */
+	int cancelled; /* destroyed while running, executor frees it */
 };
 
 
@@ -190,12 +183,12 @@ struct mcast {
 	int guarantee;
 } __attribute__((packed));
 
-
-struct rtr_item  {
-	struct memb_ring_id ring_id;
-	unsigned int seq;
-}__attribute__((packed));
-
+/*
+ * Room kept free in front of every mcast stored in a frame.  When an old
+ * ring message is originated again in recovery, the encapsulating mcast
+ * header is written there instead of copying the message into a new frame.
+ */
+#define MCAST_ENCAPSULATION_HEADROOM	sizeof (struct mcast)
 
 struct orf_token {
 	struct totem_message_header header;
@@ -264,14 +257,30 @@ struct memb_commit_token {
  */
 }__attribute__((packed));
 
+/*
+ * buffer is the frame returned by totemsrp_buffer_alloc.  mcast points
+ * into it, at least MCAST_ENCAPSULATION_HEADROOM bytes after its start.
+ * A message originated again in recovery shares the frame of the old
+ * ring message, the recovery sort queue item is then the one releasing it.
+ */
 struct message_item {
 	struct mcast *mcast;
+	void *buffer;
 	unsigned int msg_len;
+	uint64_t timestamp;
+	unsigned int prio;
+	int continued;
 };
 
+/*
+ * timestamp is when a locally originated message was queued, 0 for
+ * messages received from the ring
+ */
 struct sort_queue_item {
 	struct mcast *mcast;
+	void *buffer;
 	unsigned int msg_len;
+	uint64_t timestamp;
 };
 
 enum memb_state {
@@ -295,9 +304,10 @@ struct totemsrp_instance {
 
 	int fcc_remcast_current;
 
-	struct consensus_list_item consensus_list[PROCESSOR_COUNT_MAX];
-
-	int consensus_list_entries;
+	/*
+	 * Processors which agreed on membership
+	 */
+	struct memb_nodeid_set consensus_set;
 
 	int lowest_active_if;
 
@@ -317,6 +327,8 @@ struct totemsrp_instance {
 
 	struct srp_addr my_deliver_memb_list[PROCESSOR_COUNT_MAX];
 
+	struct memb_nodeid_set my_deliver_memb_set;
+
 	struct srp_addr my_left_memb_list[PROCESSOR_COUNT_MAX];
 
 	unsigned int my_leave_memb_list[PROCESSOR_COUNT_MAX];
@@ -370,6 +382,8 @@ struct totemsrp_instance {
 	 */
 	struct cs_queue new_message_queue;
 
+	struct cs_queue new_message_queue_control;
+
 	struct cs_queue new_message_queue_trans;
 
 	struct cs_queue retrans_message_queue;
@@ -378,6 +392,11 @@ struct totemsrp_instance {
 
 	struct sq recovery_sort_queue;
 
+	/*
+	 * Seqs in retransmit list of token being processed
+	 */
+	struct rtr_bitmap rtr_bitmap;
+
 	/*
 	 * Received up to and including
 	 */
@@ -389,6 +408,11 @@ struct totemsrp_instance {
 
 	struct qb_list_head token_callback_sent_listhead;
 
+	/*
+	 * Token callbacks may be created from the delivery thread
+	 */
+	pthread_mutex_t token_callback_mutex;
+
 	char orf_token_retransmit[TOKEN_SIZE_MAX];
 
 	int orf_token_retransmit_size;
@@ -509,8 +533,35 @@ struct totemsrp_instance {
 
 	unsigned int my_cbl;
 
+	/*
+	 * Flow control limits used by fcc_calculate, adjusted at runtime
+	 * when adaptive flow control is enabled
+	 */
+	unsigned int fcc_max_messages;
+
+	unsigned int fcc_window_size;
+
+	unsigned int fcc_holdoff;
+
+	/*
+	 * Last locally originated frame sent ends in the middle of a message
+	 */
+	int mcast_chain_open;
+
+	/*
+	 * A control message was queued behind bulk ones, send all control
+	 * messages queued before it first
+	 */
+	int mcast_control_drain;
+
 	uint64_t pause_timestamp;
 
+	uint64_t recovery_timestamp;
+
+	uint64_t token_rx_timestamp;
+
+	uint64_t token_rotation_time;
+
 	struct memb_commit_token *commit_token;
 
 	totemsrp_stats_t stats;
@@ -521,6 +572,8 @@ struct totemsrp_instance {
 
 	uint32_t threaded_mode_enabled;
 
+	struct delivery_ring *delivery_ring;
+
 	uint32_t waiting_trans_ack;
 
 	int 	flushing;
@@ -530,6 +583,53 @@ struct totemsrp_instance {
 	char commit_token_storage[40000];
 };
 
+enum delivery_item_type {
+	DELIVERY_ITEM_MCAST,
+	DELIVERY_ITEM_CONFCHG,
+	DELIVERY_ITEM_WAITING_TRANS_ACK
+};
+
+/*
+ * Application callback queued for the delivery thread. Message points into
+ * frame, on which the item holds a reference. buffer holds the member lists
+ * of a configuration change and is reused (grown when needed) every time
+ * the slot is filled.
+ */
+struct delivery_item {
+	enum delivery_item_type type;
+	unsigned int nodeid;
+	void *frame;
+	const void *msg;
+	unsigned int msg_len;
+	int endian_conversion_required;
+	enum totem_configuration_type configuration_type;
+	size_t member_list_entries;
+	size_t left_list_entries;
+	size_t joined_list_entries;
+	struct memb_ring_id ring_id;
+	int waiting_trans_ack;
+	char *buffer;
+	size_t buffer_size;
+};
+
+/*
+ * Single producer (main thread) single consumer (delivery thread) ring.
+ * head is only written by the producer and tail only by the consumer,
+ * semaphores count free and filled slots and order the accesses, so
+ * neither side takes a lock to pass an item.
+ */
+struct delivery_ring {
+	struct delivery_item items[DELIVERY_RING_ITEMS];
+	unsigned int head;
+	unsigned int tail;
+	sem_t items_sem;
+	sem_t slots_sem;
+	pthread_t thread;
+	int stop;
+	void (*serialize_lock) (void);
+	void (*serialize_unlock) (void);
+};
+
 struct message_handlers {
 	int count;
 	int (*handler_functions[6]) (
@@ -625,13 +725,21 @@ static void srp_addr_to_nodeid (
 	struct srp_addr *srp_addr_in,
 	unsigned int entries);
 
-static int srp_addr_equal (const struct srp_addr *a, const struct srp_addr *b);
-
 static void memb_leave_message_send (struct totemsrp_instance *instance);
 
 static void token_callbacks_execute (struct totemsrp_instance *instance, enum totem_callback_token_type type);
 static void memb_state_gather_enter (struct totemsrp_instance *instance, enum gather_state_from gather_from);
 static void messages_deliver_to_app (struct totemsrp_instance *instance, int skip, unsigned int end_point);
+static void deliver_fn_call (struct totemsrp_instance *instance, unsigned int nodeid,
+	void *frame, const void *msg, unsigned int msg_len, int endian_conversion_required);
+static void confchg_fn_call (struct totemsrp_instance *instance,
+	enum totem_configuration_type configuration_type,
+	const unsigned int *member_list, size_t member_list_entries,
+	const unsigned int *left_list, size_t left_list_entries,
+	const unsigned int *joined_list, size_t joined_list_entries,
+	const struct memb_ring_id *ring_id);
+static void waiting_trans_ack_cb_call (struct totemsrp_instance *instance, int waiting_trans_ack);
+static void delivery_thread_stop (struct totemsrp_instance *instance);
 static int orf_token_mcast (struct totemsrp_instance *instance, struct orf_token *oken,
 	int fcc_mcasts_allowed);
 static void messages_free (struct totemsrp_instance *instance, unsigned int token_aru);
@@ -661,6 +769,7 @@ static void timer_function_token_retransmit_timeout (void *data);
 static void timer_function_token_hold_retransmit_timeout (void *data);
 static void timer_function_merge_detect_timeout (void *data);
 static void *totemsrp_buffer_alloc (struct totemsrp_instance *instance);
+static void totemsrp_buffer_ref (struct totemsrp_instance *instance, void *ptr);
 static void totemsrp_buffer_release (struct totemsrp_instance *instance, void *ptr);
 static const char* gsfrom_to_msg(enum gather_state_from gsfrom);
 
@@ -722,6 +831,8 @@ static void totemsrp_instance_initialize (struct totemsrp_instance *instance)
 
 	qb_list_init (&instance->token_callback_sent_listhead);
 
+	pthread_mutex_init (&instance->token_callback_mutex, NULL);
+
 	instance->my_received_flg = 1;
 
 	instance->my_token_seq = SEQNO_START_TOKEN - 1;
@@ -771,10 +882,20 @@ static int token_event_stats_collector (enum totem_callback_token_type type, con
 {
 	struct totemsrp_instance *instance = (struct totemsrp_instance *)void_instance;
 	uint64_t time_now;
+	uint64_t time_now_ns;
 
-	time_now = (qb_util_nano_current_get() / QB_TIME_NS_IN_MSEC);
+	time_now_ns = qb_util_nano_current_get();
+	time_now = time_now_ns / QB_TIME_NS_IN_MSEC;
 
 	if (type == TOTEM_CALLBACK_TOKEN_RECEIVED) {
+		if (instance->token_rx_timestamp != 0) {
+			instance->token_rotation_time =
+				(time_now_ns - instance->token_rx_timestamp) / QB_TIME_NS_IN_USEC;
+			totem_histogram_record (&instance->stats.token_rotation_histogram,
+				instance->token_rotation_time);
+		}
+		instance->token_rx_timestamp = time_now_ns;
+
 		/* incr latest token the index */
 		if (instance->stats.latest_token == (TOTEM_TOKEN_STATS_MAX - 1))
 			instance->stats.latest_token = 0;
@@ -797,6 +918,10 @@ static int token_event_stats_collector (enum totem_callback_token_type type, con
 		instance->stats.token[instance->stats.latest_token].tx = 0; /* in case we drop the token */
 	} else {
 		instance->stats.token[instance->stats.latest_token].tx = time_now;
+		if (instance->token_rx_timestamp != 0) {
+			totem_histogram_record (&instance->stats.token_hold_histogram,
+				(time_now_ns - instance->token_rx_timestamp) / QB_TIME_NS_IN_USEC);
+		}
 	}
 	return 0;
 }
@@ -940,6 +1065,10 @@ int totemsrp_initialize (
 	sq_init (&instance->recovery_sort_queue,
 		QUEUE_RTR_ITEMS_SIZE_MAX, sizeof (struct sort_queue_item), 0);
 
+	if (rtr_bitmap_init (&instance->rtr_bitmap, QUEUE_RTR_ITEMS_SIZE_MAX) != 0) {
+		goto error_exit;
+	}
+
 	instance->totemsrp_poll_handle = poll_handle;
 
 	instance->totemsrp_deliver_fn = deliver_fn;
@@ -1000,6 +1129,10 @@ int totemsrp_initialize (
 		MESSAGE_QUEUE_MAX,
 		sizeof (struct message_item), instance->threaded_mode_enabled);
 
+	cs_queue_init (&instance->new_message_queue_control,
+		MESSAGE_QUEUE_MAX,
+		sizeof (struct message_item), instance->threaded_mode_enabled);
+
 	cs_queue_init (&instance->new_message_queue_trans,
 		MESSAGE_QUEUE_MAX,
 		sizeof (struct message_item), instance->threaded_mode_enabled);
@@ -1029,12 +1162,16 @@ void totemsrp_finalize (
 	struct totemsrp_instance *instance = (struct totemsrp_instance *)srp_context;
 
 	memb_leave_message_send (instance);
+	delivery_thread_stop (instance);
 	totemnet_finalize (instance->totemnet_context);
 	cs_queue_free (&instance->new_message_queue);
+	cs_queue_free (&instance->new_message_queue_control);
 	cs_queue_free (&instance->new_message_queue_trans);
 	cs_queue_free (&instance->retrans_message_queue);
 	sq_free (&instance->regular_sort_queue);
 	sq_free (&instance->recovery_sort_queue);
+	rtr_bitmap_free (&instance->rtr_bitmap);
+	pthread_mutex_destroy (&instance->token_callback_mutex);
 	free (instance);
 }
 
@@ -1142,17 +1279,6 @@ int totemsrp_my_family_get (
 }
 
 
-/*
- * Set operations for use by the membership algorithm
- */
-static int srp_addr_equal (const struct srp_addr *a, const struct srp_addr *b)
-{
-	if (a->nodeid == b->nodeid) {
-		return 1;
-	}
-	return 0;
-}
-
 static void srp_addr_to_nodeid (
 	struct totemsrp_instance *instance,
 	unsigned int *nodeid_out,
@@ -1177,33 +1303,7 @@ static struct srp_addr srp_addr_endian_convert (struct srp_addr in)
 
 static void memb_consensus_reset (struct totemsrp_instance *instance)
 {
-	instance->consensus_list_entries = 0;
-}
-
-static void memb_set_subtract (
-        struct srp_addr *out_list, int *out_list_entries,
-        struct srp_addr *one_list, int one_list_entries,
-        struct srp_addr *two_list, int two_list_entries)
-{
-	int found = 0;
-	int i;
-	int j;
-
-	*out_list_entries = 0;
-
-	for (i = 0; i < one_list_entries; i++) {
-		for (j = 0; j < two_list_entries; j++) {
-			if (srp_addr_equal (&one_list[i], &two_list[j])) {
-				found = 1;
-				break;
-			}
-		}
-		if (found == 0) {
-			out_list[*out_list_entries] = one_list[i];
-			*out_list_entries = *out_list_entries + 1;
-		}
-		found = 0;
-	}
+	memb_nodeid_set_clear (&instance->consensus_set);
 }
 
 /*
@@ -1213,21 +1313,7 @@ static void memb_consensus_set (
 	struct totemsrp_instance *instance,
 	const struct srp_addr *addr)
 {
-	int found = 0;
-	int i;
-
-	for (i = 0; i < instance->consensus_list_entries; i++) {
-		if (srp_addr_equal(addr, &instance->consensus_list[i].addr)) {
-			found = 1;
-			break; /* found entry */
-		}
-	}
-	instance->consensus_list[i].addr = *addr;
-	instance->consensus_list[i].set = 1;
-	if (found == 0) {
-		instance->consensus_list_entries++;
-	}
-	return;
+	memb_nodeid_set_add (&instance->consensus_set, addr->nodeid, 0);
 }
 
 /*
@@ -1237,14 +1323,7 @@ static int memb_consensus_isset (
 	struct totemsrp_instance *instance,
 	const struct srp_addr *addr)
 {
-	int i;
-
-	for (i = 0; i < instance->consensus_list_entries; i++) {
-		if (srp_addr_equal (addr, &instance->consensus_list[i].addr)) {
-			return (instance->consensus_list[i].set);
-		}
-	}
-	return (0);
+	return (memb_nodeid_set_find (&instance->consensus_set, addr->nodeid, NULL));
 }
 
 /*
@@ -1303,121 +1382,13 @@ static void memb_consensus_notset (
 }
 
 /*
- * Is set1 equal to set2 Entries can be in different orders
+ * Deliver membership is checked for every message delivered after
+ * recovery, so keep it in a set too
  */
-static int memb_set_equal (
-	struct srp_addr *set1, int set1_entries,
-	struct srp_addr *set2, int set2_entries)
+static void my_deliver_memb_set_update (struct totemsrp_instance *instance)
 {
-	int i;
-	int j;
-
-	int found = 0;
-
-	if (set1_entries != set2_entries) {
-		return (0);
-	}
-	for (i = 0; i < set2_entries; i++) {
-		for (j = 0; j < set1_entries; j++) {
-			if (srp_addr_equal (&set1[j], &set2[i])) {
-				found = 1;
-				break;
-			}
-		}
-		if (found == 0) {
-			return (0);
-		}
-		found = 0;
-	}
-	return (1);
-}
-
-/*
- * Is subset fully contained in fullset
- */
-static int memb_set_subset (
-	const struct srp_addr *subset, int subset_entries,
-	const struct srp_addr *fullset, int fullset_entries)
-{
-	int i;
-	int j;
-	int found = 0;
-
-	if (subset_entries > fullset_entries) {
-		return (0);
-	}
-	for (i = 0; i < subset_entries; i++) {
-		for (j = 0; j < fullset_entries; j++) {
-			if (srp_addr_equal (&subset[i], &fullset[j])) {
-				found = 1;
-			}
-		}
-		if (found == 0) {
-			return (0);
-		}
-		found = 0;
-	}
-	return (1);
-}
-/*
- * merge subset into fullset taking care not to add duplicates
- */
-static void memb_set_merge (
-	const struct srp_addr *subset, int subset_entries,
-	struct srp_addr *fullset, int *fullset_entries)
-{
-	int found = 0;
-	int i;
-	int j;
-
-	for (i = 0; i < subset_entries; i++) {
-		for (j = 0; j < *fullset_entries; j++) {
-			if (srp_addr_equal (&fullset[j], &subset[i])) {
-				found = 1;
-				break;
-			}
-		}
-		if (found == 0) {
-			fullset[*fullset_entries] = subset[i];
-			*fullset_entries = *fullset_entries + 1;
-		}
-		found = 0;
-	}
-	return;
-}
-
-static void memb_set_and_with_ring_id (
-	struct srp_addr *set1,
-	struct memb_ring_id *set1_ring_ids,
-	int set1_entries,
-	struct srp_addr *set2,
-	int set2_entries,
-	struct memb_ring_id *old_ring_id,
-	struct srp_addr *and,
-	int *and_entries)
-{
-	int i;
-	int j;
-	int found = 0;
-
-	*and_entries = 0;
-
-	for (i = 0; i < set2_entries; i++) {
-		for (j = 0; j < set1_entries; j++) {
-			if (srp_addr_equal (&set1[j], &set2[i])) {
-				if (memcmp (&set1_ring_ids[j], old_ring_id, sizeof (struct memb_ring_id)) == 0) {
-					found = 1;
-				}
-				break;
-			}
-		}
-		if (found) {
-			and[*and_entries] = set1[j];
-			*and_entries = *and_entries + 1;
-		}
-		found = 0;
-	}
-	return;
+	memb_nodeid_set_fill (&instance->my_deliver_memb_set,
+		instance->my_deliver_memb_list, instance->my_deliver_memb_entries);
 }
 
 static void memb_set_log(
@@ -1502,6 +1473,12 @@ static void *totemsrp_buffer_alloc (struct totemsrp_instance *instance)
 	return totemnet_buffer_alloc (instance->totemnet_context);
 }
 
+static void totemsrp_buffer_ref (struct totemsrp_instance *instance, void *ptr)
+{
+	assert (instance != NULL);
+	totemnet_buffer_ref (instance->totemnet_context, ptr);
+}
+
 static void totemsrp_buffer_release (struct totemsrp_instance *instance, void *ptr)
 {
 	assert (instance != NULL);
@@ -1884,8 +1861,10 @@ static void deliver_messages_from_recovery_to_regular (struct totemsrp_instance
 			 */
 			regular_message_item.mcast =
 				(struct mcast *)(((char *)recovery_message_item->mcast) + sizeof (struct mcast));
+			regular_message_item.buffer = recovery_message_item->buffer;
 			regular_message_item.msg_len =
 			recovery_message_item->msg_len - sizeof (struct mcast);
+			regular_message_item.timestamp = 0;
 			mcast = regular_message_item.mcast;
 		} else {
 			/*
@@ -1984,7 +1963,7 @@ static void memb_state_operational_enter (struct totemsrp_instance *instance)
 		instance->my_left_memb_entries);
 	srp_addr_to_nodeid (instance, trans_memb_list_totemip,
 		instance->my_trans_memb_list, instance->my_trans_memb_entries);
-	instance->totemsrp_confchg_fn (TOTEM_CONFIGURATION_TRANSITIONAL,
+	confchg_fn_call (instance, TOTEM_CONFIGURATION_TRANSITIONAL,
 		trans_memb_list_totemip, instance->my_trans_memb_entries,
 		left_list, instance->my_left_memb_entries,
 		0, 0, &instance->my_ring_id);
@@ -2007,7 +1986,7 @@ static void memb_state_operational_enter (struct totemsrp_instance *instance)
 	 * So when buffers were switched and recovered messages
 	 * got delivered it was not possible to assemble them.
 	 */
-	instance->totemsrp_waiting_trans_ack_cb_fn (1);
+	waiting_trans_ack_cb_call (instance, 1);
 
 	instance->my_aru = aru_save;
 
@@ -2018,7 +1997,7 @@ static void memb_state_operational_enter (struct totemsrp_instance *instance)
 		instance->my_new_memb_list, instance->my_new_memb_entries);
 	srp_addr_to_nodeid (instance, joined_list_totemip, joined_list,
 		joined_list_entries);
-	instance->totemsrp_confchg_fn (TOTEM_CONFIGURATION_REGULAR,
+	confchg_fn_call (instance, TOTEM_CONFIGURATION_REGULAR,
 		new_memb_list_totemip, instance->my_new_memb_entries,
 		0, 0,
 		joined_list_totemip, joined_list_entries, &instance->my_ring_id);
@@ -2084,7 +2063,7 @@ static void memb_state_operational_enter (struct totemsrp_instance *instance)
 			struct sort_queue_item *regular_message;
 
 			regular_message = ptr;
-			free (regular_message->mcast);
+			totemsrp_buffer_release (instance, regular_message->buffer);
 		}
 	}
 	sq_items_release (&instance->regular_sort_queue, instance->my_high_delivered);
@@ -2147,6 +2126,15 @@ static void memb_state_operational_enter (struct totemsrp_instance *instance)
 	instance->stats.operational_entered++;
 	instance->stats.continuous_gather = 0;
 
+	if (instance->recovery_timestamp != 0) {
+		instance->stats.recovery_duration = (qb_util_nano_current_get () -
+			instance->recovery_timestamp) / QB_TIME_NS_IN_MSEC;
+		if (instance->stats.recovery_duration > instance->stats.recovery_duration_max) {
+			instance->stats.recovery_duration_max = instance->stats.recovery_duration;
+		}
+		instance->recovery_timestamp = 0;
+	}
+
 	instance->my_received_flg = 1;
 
 	reset_pause_timeout (instance);
@@ -2287,6 +2275,9 @@ static void memb_state_commit_enter (
 	instance->my_trc = 0;
 	instance->my_pbl = 0;
 	instance->my_cbl = 0;
+	instance->fcc_max_messages = 0;
+	instance->fcc_window_size = 0;
+	instance->fcc_holdoff = 0;
 	/*
 	 * commit token sent after callback that token target has been set
 	 */
@@ -2379,6 +2370,7 @@ static void memb_state_recovery_enter (
 			instance->my_deliver_memb_entries = instance->my_trans_memb_entries;
 			memcpy (instance->my_deliver_memb_list, instance->my_trans_memb_list,
 				sizeof (struct srp_addr) * instance->my_trans_memb_entries);
+			my_deliver_memb_set_update (instance);
 			local_received_flg = 0;
 			break;
 		}
@@ -2439,9 +2431,17 @@ static void memb_state_recovery_enter (
 		sort_queue_item = ptr;
 		messages_originated++;
 		memset (&message_item, 0, sizeof (struct message_item));
-	// TODO	 LEAK
-		message_item.mcast = totemsrp_buffer_alloc (instance);
-		assert (message_item.mcast);
+
+		/*
+		 * Encapsulate the old ring message in place: the new header
+		 * goes into the headroom in front of it and the frame is
+		 * shared with the regular sort queue item
+		 */
+		assert ((char *)sort_queue_item->mcast - (char *)sort_queue_item->buffer >=
+			MCAST_ENCAPSULATION_HEADROOM);
+		message_item.mcast = (struct mcast *)((char *)sort_queue_item->mcast -
+			sizeof (struct mcast));
+		message_item.buffer = sort_queue_item->buffer;
 		memset(message_item.mcast, 0, sizeof (struct mcast));
 		message_item.mcast->header.magic = TOTEM_MH_MAGIC;
 		message_item.mcast->header.version = TOTEM_MH_VERSION;
@@ -2454,9 +2454,6 @@ static void memb_state_recovery_enter (
 		memcpy (&message_item.mcast->ring_id, &instance->my_ring_id,
 			sizeof (struct memb_ring_id));
 		message_item.msg_len = sort_queue_item->msg_len + sizeof (struct mcast);
-		memcpy (((char *)message_item.mcast) + sizeof (struct mcast),
-			sort_queue_item->mcast,
-			sort_queue_item->msg_len);
 		cs_queue_item_add (&instance->retrans_message_queue, &message_item);
 	}
 	log_printf (instance->totemsrp_log_level_debug,
@@ -2480,6 +2477,7 @@ originated:
 
 	instance->memb_state = MEMB_STATE_RECOVERY;
 	instance->stats.recovery_entered++;
+	instance->recovery_timestamp = qb_util_nano_current_get ();
 	instance->stats.continuous_gather = 0;
 
 	return;
@@ -2494,21 +2492,58 @@ void totemsrp_event_signal (void *srp_context, enum totem_event_type type, int v
 	return;
 }
 
-int totemsrp_mcast (
+void *totemsrp_mcast_frame_alloc (
 	void *srp_context,
-	struct iovec *iovec,
-	unsigned int iov_len,
-	int guarantee)
+	unsigned int headroom,
+	unsigned char **payload)
+{
+	struct totemsrp_instance *instance = (struct totemsrp_instance *)srp_context;
+	char *frame;
+
+	frame = totemsrp_buffer_alloc (instance);
+	if (frame == NULL) {
+		return (NULL);
+	}
+
+	*payload = (unsigned char *)frame + MCAST_ENCAPSULATION_HEADROOM +
+		sizeof (struct mcast) + headroom;
+
+	return (frame);
+}
+
+void totemsrp_mcast_frame_release (
+	void *srp_context,
+	void *frame)
+{
+	struct totemsrp_instance *instance = (struct totemsrp_instance *)srp_context;
+
+	totemsrp_buffer_release (instance, frame);
+}
+
+int totemsrp_mcast_frame_commit (
+	void *srp_context,
+	void *frame,
+	const void *data,
+	unsigned int data_len,
+	int guarantee,
+	unsigned int prio,
+	int continued)
 {
 	struct totemsrp_instance *instance = (struct totemsrp_instance *)srp_context;
-	int i;
 	struct message_item message_item;
-	char *addr;
-	unsigned int addr_idx;
 	struct cs_queue *queue_use;
 
+	assert (prio < TOTEM_MCAST_PRIO_MAX);
+	assert (prio != TOTEM_MCAST_PRIO_CONTROL || !continued);
+
+	/*
+	 * While waiting for transitional configuration ack all messages
+	 * share one queue and are sent in order
+	 */
 	if (instance->waiting_trans_ack) {
 		queue_use = &instance->new_message_queue_trans;
+	} else if (prio == TOTEM_MCAST_PRIO_CONTROL) {
+		queue_use = &instance->new_message_queue_control;
 	} else {
 		queue_use = &instance->new_message_queue;
 	}
@@ -2521,12 +2556,14 @@ int totemsrp_mcast (
 	memset (&message_item, 0, sizeof (struct message_item));
 
 	/*
-	 * Allocate pending item
+	 * The mcast header goes directly in front of the packed data, in the
+	 * room reserved by totemsrp_mcast_frame_alloc, so the frame is queued,
+	 * sent and kept for retransmission without being copied again
 	 */
-	message_item.mcast = totemsrp_buffer_alloc (instance);
-	if (message_item.mcast == 0) {
-		goto error_mcast;
-	}
+	assert ((const char *)data - sizeof (struct mcast) >=
+		(char *)frame + MCAST_ENCAPSULATION_HEADROOM);
+	message_item.mcast = (struct mcast *)((char *)data - sizeof (struct mcast));
+	message_item.buffer = frame;
 
 	/*
 	 * Set mcast header
@@ -2543,28 +2580,75 @@ int totemsrp_mcast (
 	message_item.mcast->guarantee = guarantee;
 	message_item.mcast->system_from = instance->my_id;
 
-	addr = (char *)message_item.mcast;
-	addr_idx = sizeof (struct mcast);
-	for (i = 0; i < iov_len; i++) {
-		memcpy (&addr[addr_idx], iovec[i].iov_base, iovec[i].iov_len);
-		addr_idx += iovec[i].iov_len;
-	}
-
-	message_item.msg_len = addr_idx;
+	message_item.msg_len = sizeof (struct mcast) + data_len;
+	message_item.timestamp = qb_util_nano_current_get ();
+	message_item.prio = prio;
+	message_item.continued = continued;
 
 	log_printf (instance->totemsrp_log_level_trace, "mcasted message added to pending queue");
 	instance->stats.mcast_tx++;
 	cs_queue_item_add (queue_use, &message_item);
 
 	return (0);
+}
 
-error_mcast:
-	return (-1);
+int totemsrp_mcast (
+	void *srp_context,
+	struct iovec *iovec,
+	unsigned int iov_len,
+	int guarantee)
+{
+	struct totemsrp_instance *instance = (struct totemsrp_instance *)srp_context;
+	int i;
+	void *frame;
+	unsigned char *addr;
+	unsigned int addr_idx;
+	int res;
+
+	frame = totemsrp_mcast_frame_alloc (instance, 0, &addr);
+	if (frame == NULL) {
+		return (-1);
+	}
+
+	addr_idx = 0;
+	for (i = 0; i < iov_len; i++) {
+		memcpy (&addr[addr_idx], iovec[i].iov_base, iovec[i].iov_len);
+		addr_idx += iovec[i].iov_len;
+	}
+
+	res = totemsrp_mcast_frame_commit (instance, frame, addr, addr_idx, guarantee,
+		TOTEM_MCAST_PRIO_BULK, 0);
+	if (res == -1) {
+		totemsrp_buffer_release (instance, frame);
+	}
+
+	return (res);
 }
 
 /*
  * Determine if there is room to queue a new message
  */
+int totemsrp_mcast_lane_is_empty (void *srp_context, unsigned int prio)
+{
+	struct totemsrp_instance *instance = (struct totemsrp_instance *)srp_context;
+
+	assert (prio < TOTEM_MCAST_PRIO_MAX);
+
+	if (prio == TOTEM_MCAST_PRIO_CONTROL) {
+		return (cs_queue_is_empty (&instance->new_message_queue_control));
+	}
+
+	return (cs_queue_is_empty (&instance->new_message_queue) &&
+		cs_queue_is_empty (&instance->new_message_queue_trans));
+}
+
+void totemsrp_mcast_control_drain (void *srp_context)
+{
+	struct totemsrp_instance *instance = (struct totemsrp_instance *)srp_context;
+
+	instance->mcast_control_drain = 1;
+}
+
 int totemsrp_avail (void *srp_context)
 {
 	struct totemsrp_instance *instance = (struct totemsrp_instance *)srp_context;
@@ -2670,7 +2754,7 @@ static void messages_free (
 			instance->last_released + i, &ptr);
 		if (res == 0) {
 			regular_message = ptr;
-			totemsrp_buffer_release (instance, regular_message->mcast);
+			totemsrp_buffer_release (instance, regular_message->buffer);
 		}
 		sq_items_release (&instance->regular_sort_queue,
 			instance->last_released + i);
@@ -2688,11 +2772,8 @@ static void messages_free (
 static void update_aru (
 	struct totemsrp_instance *instance)
 {
-	unsigned int i;
-	int res;
 	struct sq *sort_queue;
 	unsigned int range;
-	unsigned int my_aru_saved = 0;
 
 	if (instance->memb_state == MEMB_STATE_RECOVERY) {
 		sort_queue = &instance->recovery_sort_queue;
@@ -2702,20 +2783,49 @@ static void update_aru (
 
 	range = instance->my_high_seq_received - instance->my_aru;
 
-	my_aru_saved = instance->my_aru;
-	for (i = 1; i <= range; i++) {
+	/*
+	 * Stop updating aru at first hole
+	 */
+	instance->my_aru += sq_next_hole (sort_queue, instance->my_aru + 1, range);
+}
 
-		void *ptr;
+/*
+ * Select queue the next new message is sent from. Control messages are
+ * preferred until control_allowed is cleared, then bulk messages are. Every
+ * control message is sent in a frame of its own, so it may only be sent
+ * when the last sent frame doesn't end in the middle of a bulk message,
+ * otherwise receivers couldn't assemble it. Control messages queued before
+ * the lanes were disabled or before a control message went to the bulk
+ * queue are always sent first, so none of them is overtaken.
+ */
+static struct cs_queue *new_message_queue_select (
+	struct totemsrp_instance *instance,
+	int control_allowed)
+{
+	struct cs_queue *control_queue = &instance->new_message_queue_control;
+	struct cs_queue *bulk_queue = &instance->new_message_queue;
 
-		res = sq_item_get (sort_queue, my_aru_saved + i, &ptr);
-		/*
-		 * If hole, stop updating aru
-		 */
-		if (res != 0) {
-			break;
+	if (instance->waiting_trans_ack) {
+		if (cs_queue_is_empty (&instance->new_message_queue_trans)) {
+			return (NULL);
 		}
+		return (&instance->new_message_queue_trans);
+	}
+
+	if (cs_queue_is_empty (control_queue)) {
+		instance->mcast_control_drain = 0;
+	} else if (!instance->mcast_chain_open &&
+	    (control_allowed || instance->mcast_control_drain ||
+	     instance->totem_config->mcast_control_share == 0 ||
+	     cs_queue_is_empty (bulk_queue))) {
+		return (control_queue);
+	}
+
+	if (!cs_queue_is_empty (bulk_queue)) {
+		return (bulk_queue);
 	}
-	instance->my_aru += i - 1;
+
+	return (NULL);
 }
 
 /*
@@ -2727,32 +2837,56 @@ static int orf_token_mcast (
 	int fcc_mcasts_allowed)
 {
 	struct message_item *message_item = 0;
-	struct cs_queue *mcast_queue;
+	struct cs_queue *mcast_queue = NULL;
 	struct sq *sort_queue;
 	struct sort_queue_item sort_queue_item;
 	struct mcast *mcast;
 	unsigned int fcc_mcast_current;
+	unsigned int control_allowed;
+	unsigned int control_sent = 0;
+	uint64_t time_now = 0;
+
+	/*
+	 * Share of this token reserved for control messages, rest is used
+	 * by control messages only when there is no bulk message to send
+	 */
+	control_allowed = (fcc_mcasts_allowed * instance->totem_config->mcast_control_share + 99) / 100;
 
 	if (instance->memb_state == MEMB_STATE_RECOVERY) {
 		mcast_queue = &instance->retrans_message_queue;
 		sort_queue = &instance->recovery_sort_queue;
 		reset_token_retransmit_timeout (instance); // REVIEWED
 	} else {
-		if (instance->waiting_trans_ack) {
-			mcast_queue = &instance->new_message_queue_trans;
-		} else {
-			mcast_queue = &instance->new_message_queue;
-		}
-
 		sort_queue = &instance->regular_sort_queue;
 	}
 
 	for (fcc_mcast_current = 0; fcc_mcast_current < fcc_mcasts_allowed; fcc_mcast_current++) {
+		if (instance->memb_state != MEMB_STATE_RECOVERY) {
+			mcast_queue = new_message_queue_select (instance, control_sent < control_allowed);
+			if (mcast_queue == NULL) {
+				break;
+			}
+		}
 		if (cs_queue_is_empty (mcast_queue)) {
 			break;
 		}
 		message_item = (struct message_item *)cs_queue_item_get (mcast_queue);
 
+		if (mcast_queue != &instance->retrans_message_queue) {
+			if (mcast_queue == &instance->new_message_queue_control) {
+				control_sent++;
+			}
+			instance->mcast_chain_open = message_item->continued;
+
+			if (time_now == 0) {
+				time_now = qb_util_nano_current_get ();
+			}
+			totem_histogram_record (message_item->prio == TOTEM_MCAST_PRIO_CONTROL ?
+				&instance->stats.mcast_queue_wait_control_histogram :
+				&instance->stats.mcast_queue_wait_bulk_histogram,
+				(time_now - message_item->timestamp) / QB_TIME_NS_IN_USEC);
+		}
+
 		message_item->mcast->seq = ++token->seq;
 		message_item->mcast->this_seqno = instance->global_seqno++;
 
@@ -2761,7 +2895,9 @@ static int orf_token_mcast (
 		 */
 		memset (&sort_queue_item, 0, sizeof (struct sort_queue_item));
 		sort_queue_item.mcast = message_item->mcast;
+		sort_queue_item.buffer = message_item->buffer;
 		sort_queue_item.msg_len = message_item->msg_len;
+		sort_queue_item.timestamp = message_item->timestamp;
 
 		mcast = sort_queue_item.mcast;
 
@@ -2788,6 +2924,10 @@ static int orf_token_mcast (
 		instance->my_high_seq_received = token->seq;
 	}
 
+	instance->stats.mcast_queue_depth_control = cs_queue_used (&instance->new_message_queue_control);
+	instance->stats.mcast_queue_depth_bulk = cs_queue_used (&instance->new_message_queue) +
+		cs_queue_used (&instance->new_message_queue_trans);
+
 	update_aru (instance);
 
 	/*
@@ -2807,12 +2947,10 @@ static int orf_token_rtr (
 {
 	unsigned int res;
 	unsigned int i, j;
-	unsigned int found;
 	struct sq *sort_queue;
 	struct rtr_item *rtr_list;
 	unsigned int range = 0;
 	char retransmit_msg[1024];
-	char value[64];
 
 	if (instance->memb_state == MEMB_STATE_RECOVERY) {
 		sort_queue = &instance->recovery_sort_queue;
@@ -2822,52 +2960,41 @@ static int orf_token_rtr (
 
 	rtr_list = &orf_token->rtr_list[0];
 
-	strcpy (retransmit_msg, "Retransmit List: ");
 	if (orf_token->rtr_list_entries) {
 		log_printf (instance->totemsrp_log_level_debug,
 			"Retransmit List %d", orf_token->rtr_list_entries);
-		for (i = 0; i < orf_token->rtr_list_entries; i++) {
-			sprintf (value, "%x ", rtr_list[i].seq);
-			strcat (retransmit_msg, value);
-		}
-		strcat (retransmit_msg, "");
 		log_printf (instance->totemsrp_log_level_notice,
-			"%s", retransmit_msg);
+			"Retransmit List: %s", rtr_list_format (retransmit_msg,
+			sizeof (retransmit_msg), rtr_list, orf_token->rtr_list_entries));
 	}
 
 	/*
-	 * Retransmit messages on orf_token's RTR list from RTR queue
+	 * Retransmit messages on orf_token's RTR list from RTR queue and
+	 * compact the entries which are left in a single pass
 	 */
-	for (instance->fcc_remcast_current = 0, i = 0;
-		instance->fcc_remcast_current < *fcc_allowed && i < orf_token->rtr_list_entries;) {
-
+	instance->fcc_remcast_current = 0;
+	for (i = 0, j = 0; i < orf_token->rtr_list_entries; i++) {
 		/*
-		 * If this retransmit request isn't from this configuration,
-		 * try next rtr entry
+		 * Only retransmit requests from this configuration are served
 		 */
- 		if (memcmp (&rtr_list[i].ring_id, &instance->my_ring_id,
-			sizeof (struct memb_ring_id)) != 0) {
-
-			i += 1;
-			continue;
-		}
-
-		res = orf_token_remcast (instance, rtr_list[i].seq);
-		if (res == 0) {
+		if (instance->fcc_remcast_current < *fcc_allowed &&
+		    memcmp (&rtr_list[i].ring_id, &instance->my_ring_id,
+			sizeof (struct memb_ring_id)) == 0 &&
+		    orf_token_remcast (instance, rtr_list[i].seq) == 0) {
 			/*
 			 * Multicasted message, so no need to copy to new retransmit list
 			 */
-			orf_token->rtr_list_entries -= 1;
-			assert (orf_token->rtr_list_entries >= 0);
-			memmove (&rtr_list[i], &rtr_list[i + 1],
-				sizeof (struct rtr_item) * (orf_token->rtr_list_entries - i));
-
 			instance->stats.mcast_retx++;
 			instance->fcc_remcast_current++;
-		} else {
-			i += 1;
+			continue;
 		}
+
+		if (i != j) {
+			memcpy (&rtr_list[j], &rtr_list[i], sizeof (struct rtr_item));
+		}
+		j++;
 	}
+	orf_token->rtr_list_entries = j;
 	*fcc_allowed = *fcc_allowed - instance->fcc_remcast_current;
 
 	/*
@@ -2878,9 +3005,20 @@ static int orf_token_rtr (
 	range = orf_token->seq - instance->my_aru;
 	assert (range < QUEUE_RTR_ITEMS_SIZE_MAX);
 
+	rtr_bitmap_fill (&instance->rtr_bitmap, instance->my_aru,
+		rtr_list, orf_token->rtr_list_entries);
+
 	for (i = 1; (orf_token->rtr_list_entries < RETRANSMIT_ENTRIES_MAX) &&
 		(i <= range); i++) {
 
+		/*
+		 * Find next message missing from this processor
+		 */
+		i += sq_next_hole (sort_queue, instance->my_aru + i, range - i + 1);
+		if (i > range) {
+			break;
+		}
+
 		/*
 		 * Ensure message is within the sort queue range
 		 */
@@ -2890,44 +3028,40 @@ static int orf_token_rtr (
 		}
 
 		/*
-		 * Find if a message is missing from this processor
+		 * Determine how many times we have missed receiving
+		 * this sequence number.  sq_item_miss_count increments
+		 * a counter for the sequence number.  The miss count
+		 * will be returned and compared.  This allows time for
+		 * delayed multicast messages to be received before
+		 * declaring the message is missing and requesting a
+		 * retransmit.
 		 */
-		res = sq_item_inuse (sort_queue, instance->my_aru + i);
-		if (res == 0) {
-			/*
-			 * Determine how many times we have missed receiving
-			 * this sequence number.  sq_item_miss_count increments
-			 * a counter for the sequence number.  The miss count
-			 * will be returned and compared.  This allows time for
-			 * delayed multicast messages to be received before
-			 * declaring the message is missing and requesting a
-			 * retransmit.
-			 */
-			res = sq_item_miss_count (sort_queue, instance->my_aru + i);
-			if (res < instance->totem_config->miss_count_const) {
-				continue;
-			}
+		res = sq_item_miss_count (sort_queue, instance->my_aru + i);
+		if (res < instance->totem_config->miss_count_const) {
+			continue;
+		}
 
+		/*
+		 * Determine if missing message is already in retransmit list
+		 */
+		if (rtr_bitmap_test (&instance->rtr_bitmap, instance->my_aru + i) == 0) {
 			/*
-			 * Determine if missing message is already in retransmit list
+			 * Missing message not found in current retransmit list so add it
 			 */
-			found = 0;
-			for (j = 0; j < orf_token->rtr_list_entries; j++) {
-				if (instance->my_aru + i == rtr_list[j].seq) {
-					found = 1;
-				}
-			}
-			if (found == 0) {
-				/*
-				 * Missing message not found in current retransmit list so add it
-				 */
-				memcpy (&rtr_list[orf_token->rtr_list_entries].ring_id,
-					&instance->my_ring_id, sizeof (struct memb_ring_id));
-				rtr_list[orf_token->rtr_list_entries].seq = instance->my_aru + i;
-				orf_token->rtr_list_entries++;
-			}
+			memcpy (&rtr_list[orf_token->rtr_list_entries].ring_id,
+				&instance->my_ring_id, sizeof (struct memb_ring_id));
+			rtr_list[orf_token->rtr_list_entries].seq = instance->my_aru + i;
+			orf_token->rtr_list_entries++;
 		}
 	}
+
+	/*
+	 * Clear the bits again, including the ones of just added entries
+	 * which were never set
+	 */
+	rtr_bitmap_reset (&instance->rtr_bitmap,
+		rtr_list, orf_token->rtr_list_entries);
+
 	return (instance->fcc_remcast_current);
 }
 
@@ -3518,6 +3652,9 @@ int totemsrp_callback_token_create (
 	callback_handle->data = (void *) data;
 	callback_handle->callback_type = type;
 	callback_handle->delete = delete;
+	callback_handle->running = 0;
+	callback_handle->cancelled = 0;
+	pthread_mutex_lock (&instance->token_callback_mutex);
 	switch (type) {
 	case TOTEM_CALLBACK_TOKEN_RECEIVED:
 		qb_list_add (&callback_handle->list, &instance->token_callback_received_listhead);
@@ -3526,19 +3663,31 @@ int totemsrp_callback_token_create (
 		qb_list_add (&callback_handle->list, &instance->token_callback_sent_listhead);
 		break;
 	}
+	pthread_mutex_unlock (&instance->token_callback_mutex);
 
 	return (0);
 }
 
+/*
+ * Callback destroyed while it is being executed (possible from the delivery
+ * thread) is only marked cancelled and freed by token_callbacks_execute
+ */
 void totemsrp_callback_token_destroy (void *srp_context, void **handle_out)
 {
+	struct totemsrp_instance *instance = (struct totemsrp_instance *)srp_context;
 	struct token_callback_instance *h;
 
 	if (*handle_out) {
  		h = (struct token_callback_instance *)*handle_out;
-		qb_list_del (&h->list);
+		pthread_mutex_lock (&instance->token_callback_mutex);
+		if (h->running) {
+			h->cancelled = 1;
+			h = NULL;
+		} else {
+			qb_list_del (&h->list);
+		}
+		pthread_mutex_unlock (&instance->token_callback_mutex);
 		free (h);
-		h = NULL;
 		*handle_out = 0;
 	}
 }
@@ -3547,8 +3696,9 @@ static void token_callbacks_execute (
 	struct totemsrp_instance *instance,
 	enum totem_callback_token_type type)
 {
-	struct qb_list_head *list, *tmp_iter;
+	struct qb_list_head *list;
 	struct qb_list_head *callback_listhead = 0;
+	struct qb_list_head pending_listhead;
 	struct token_callback_instance *token_callback_instance;
 	int res;
 	int del;
@@ -3564,25 +3714,46 @@ static void token_callbacks_execute (
 		assert (0);
 	}
 
-	qb_list_for_each_safe(list, tmp_iter, callback_listhead) {
+	/*
+	 * Callbacks are run without the lock held, because they may create
+	 * new callbacks. Those are run on the next token.
+	 */
+	qb_list_init (&pending_listhead);
+	pthread_mutex_lock (&instance->token_callback_mutex);
+	while (!qb_list_empty (callback_listhead)) {
+		list = callback_listhead->next;
+		qb_list_del (list);
+		qb_list_add_tail (list, &pending_listhead);
+	}
+
+	while (!qb_list_empty (&pending_listhead)) {
+		list = pending_listhead.next;
+		qb_list_del (list);
 		token_callback_instance = qb_list_entry (list, struct token_callback_instance, list);
 		del = token_callback_instance->delete;
-		if (del == 1) {
-			qb_list_del (list);
-		}
+		token_callback_instance->running = 1;
+		pthread_mutex_unlock (&instance->token_callback_mutex);
 
 		res = token_callback_instance->callback_fn (
 			token_callback_instance->callback_type,
 			token_callback_instance->data);
-		/*
-		 * This callback failed to execute, try it again on the next token
-		 */
-		if (res == -1 && del == 1) {
+
+		pthread_mutex_lock (&instance->token_callback_mutex);
+		token_callback_instance->running = 0;
+		if (token_callback_instance->cancelled) {
+			free (token_callback_instance);
+		} else if (del == 0) {
+			qb_list_add_tail (list, callback_listhead);
+		} else if (res == -1) {
+			/*
+			 * This callback failed to execute, try it again on the next token
+			 */
 			qb_list_add (list, callback_listhead);
-		} else	if (del) {
+		} else {
 			free (token_callback_instance);
 		}
 	}
+	pthread_mutex_unlock (&instance->token_callback_mutex);
 }
 
 /*
@@ -3598,6 +3769,7 @@ static unsigned int backlog_get (struct totemsrp_instance *instance)
 			queue_use = &instance->new_message_queue_trans;
 		} else {
 			queue_use = &instance->new_message_queue;
+			backlog = cs_queue_used (&instance->new_message_queue_control);
 		}
 	} else
 	if (instance->memb_state == MEMB_STATE_RECOVERY) {
@@ -3605,13 +3777,89 @@ static unsigned int backlog_get (struct totemsrp_instance *instance)
 	}
 
 	if (queue_use != NULL) {
-		backlog = cs_queue_used (queue_use);
+		backlog += cs_queue_used (queue_use);
 	}
 
 	instance->stats.token[instance->stats.latest_token].backlog_calc = backlog;
 	return (backlog);
 }
 
+/*
+ * Adaptive flow control: halve the limits when the ring shows congestion
+ * (retransmit requests on the token or token rotation slower than half of
+ * token retransmit timeout) and raise them again while local backlog is
+ * not shrinking. Configured max_messages and window_size are upper bounds.
+ */
+static void fcc_adapt (
+	struct totemsrp_instance *instance,
+	struct orf_token *token)
+{
+	unsigned int max_messages = instance->totem_config->max_messages;
+	unsigned int window_size = instance->totem_config->window_size;
+	unsigned int window_min;
+	int congested;
+
+	if (instance->fcc_max_messages == 0 || instance->fcc_max_messages > max_messages ||
+	    !instance->totem_config->adaptive_flow_control) {
+		instance->fcc_max_messages = max_messages;
+	}
+	if (instance->fcc_window_size == 0 || instance->fcc_window_size > window_size ||
+	    !instance->totem_config->adaptive_flow_control) {
+		instance->fcc_window_size = window_size;
+	}
+
+	/*
+	 * Nothing to adapt on idle processor, token rotation is then mostly
+	 * determined by token hold
+	 */
+	if (!instance->totem_config->adaptive_flow_control ||
+	    instance->memb_state != MEMB_STATE_OPERATIONAL ||
+	    (instance->my_cbl == 0 && instance->my_pbl == 0 && token->rtr_list_entries == 0)) {
+		goto out;
+	}
+
+	if (instance->fcc_holdoff > 0) {
+		/*
+		 * Give the ring some rotations to settle after decrease
+		 */
+		instance->fcc_holdoff--;
+		goto out;
+	}
+
+	congested = (token->rtr_list_entries > 0 ||
+	    (instance->my_pbl > 0 && instance->token_rotation_time >
+	    (uint64_t)instance->totem_config->token_retransmit_timeout * QB_TIME_US_IN_MSEC / 2));
+
+	window_min = (max_messages < window_size ? max_messages : window_size);
+
+	if (congested) {
+		instance->fcc_max_messages /= 2;
+		if (instance->fcc_max_messages < 1) {
+			instance->fcc_max_messages = 1;
+		}
+		instance->fcc_window_size /= 2;
+		if (instance->fcc_window_size < window_min) {
+			instance->fcc_window_size = window_min;
+		}
+		instance->fcc_holdoff = FCC_ADAPT_HOLDOFF;
+		instance->stats.fcc_decreases++;
+	} else if (instance->my_cbl > 0 && instance->my_cbl >= instance->my_pbl &&
+	    (instance->fcc_max_messages < max_messages || instance->fcc_window_size < window_size)) {
+		if (instance->fcc_max_messages < max_messages) {
+			instance->fcc_max_messages++;
+		}
+		instance->fcc_window_size += window_size / 16 + 1;
+		if (instance->fcc_window_size > window_size) {
+			instance->fcc_window_size = window_size;
+		}
+		instance->stats.fcc_increases++;
+	}
+
+out:
+	instance->stats.fcc_max_messages = instance->fcc_max_messages;
+	instance->stats.fcc_window_size = instance->fcc_window_size;
+}
+
 static int fcc_calculate (
 	struct totemsrp_instance *instance,
 	struct orf_token *token)
@@ -3619,20 +3867,28 @@ static int fcc_calculate (
 	unsigned int transmits_allowed;
 	unsigned int backlog_calc;
 
-	transmits_allowed = instance->totem_config->max_messages;
+	instance->my_cbl = backlog_get (instance);
 
-	if (transmits_allowed > instance->totem_config->window_size - token->fcc) {
-		transmits_allowed = instance->totem_config->window_size - token->fcc;
-	}
+	fcc_adapt (instance, token);
 
-	instance->my_cbl = backlog_get (instance);
+	transmits_allowed = instance->fcc_max_messages;
+
+	/*
+	 * Adapted window may be smaller than what other processors used
+	 */
+	if (token->fcc >= instance->fcc_window_size) {
+		transmits_allowed = 0;
+	} else
+	if (transmits_allowed > instance->fcc_window_size - token->fcc) {
+		transmits_allowed = instance->fcc_window_size - token->fcc;
+	}
 
 	/*
 	 * Only do backlog calculation if there is a backlog otherwise
 	 * we would result in div by zero
 	 */
 	if (token->backlog + instance->my_cbl - instance->my_pbl) {
-		backlog_calc = (instance->totem_config->window_size * instance->my_pbl) /
+		backlog_calc = (instance->fcc_window_size * instance->my_pbl) /
 			(token->backlog + instance->my_cbl - instance->my_pbl);
 		if (backlog_calc > 0 && transmits_allowed > backlog_calc) {
 			transmits_allowed = backlog_calc;
@@ -4034,6 +4290,12 @@ static int message_handler_orf_token (
 
 		fcc_rtr_limit (instance, token, &transmits_allowed);
 		mcasted_regular = orf_token_mcast (instance, token, transmits_allowed);
+
+		/*
+		 * Transports may batch the frames sent above and refer to them
+		 * until flushed, so flush before anything can release them
+		 */
+		totemnet_send_flush (instance->totemnet_context);
 /*
 if (mcasted_regular) {
 printf ("mcasted regular %d\n", mcasted_regular);
@@ -4042,6 +4304,8 @@ printf ("token seq %d\n", token->seq);
 */
 		fcc_token_update (instance, token, mcasted_retransmit +
 			mcasted_regular);
+		totem_histogram_record (&instance->stats.token_tx_histogram,
+			mcasted_retransmit + mcasted_regular);
 
 		if (sq_lt_compare (instance->my_aru, token->aru) ||
 			instance->my_id.nodeid == token->aru_addr ||
@@ -4122,6 +4386,7 @@ printf ("token seq %d\n", token->seq);
 					instance->my_deliver_memb_entries = instance->my_trans_memb_entries;
 					memcpy (instance->my_deliver_memb_list, instance->my_trans_memb_list,
 						sizeof (struct totem_ip_address) * instance->my_trans_memb_entries);
+					my_deliver_memb_set_update (instance);
 				}
 				if (instance->my_retrans_flg_count >= 3 &&
 					sq_lte_compare (instance->my_install_seq, token->aru)) {
@@ -4185,6 +4450,230 @@ printf ("token seq %d\n", token->seq);
 	return (0);
 }
 
+/*
+ * Take the next free slot of the delivery ring, waiting for the delivery
+ * thread if the ring is full.
+ */
+static struct delivery_item *delivery_item_get (
+	struct totemsrp_instance *instance,
+	size_t buffer_size)
+{
+	struct delivery_ring *ring = instance->delivery_ring;
+	struct delivery_item *item;
+	char *buffer;
+
+	while (sem_wait (&ring->slots_sem) != 0) {
+		assert (errno == EINTR);
+	}
+
+	item = &ring->items[ring->head];
+	if (item->buffer_size < buffer_size) {
+		buffer = realloc (item->buffer, buffer_size);
+		assert (buffer != NULL);
+		item->buffer = buffer;
+		item->buffer_size = buffer_size;
+	}
+
+	return (item);
+}
+
+static void delivery_item_put (struct totemsrp_instance *instance)
+{
+	struct delivery_ring *ring = instance->delivery_ring;
+
+	ring->head = (ring->head + 1) % DELIVERY_RING_ITEMS;
+	sem_post (&ring->items_sem);
+}
+
+static void delivery_item_dispatch (
+	struct totemsrp_instance *instance,
+	struct delivery_item *item)
+{
+	const unsigned int *member_list;
+	const unsigned int *left_list;
+	const unsigned int *joined_list;
+
+	switch (item->type) {
+	case DELIVERY_ITEM_MCAST:
+		instance->totemsrp_deliver_fn (item->nodeid,
+			item->msg, item->msg_len,
+			item->endian_conversion_required);
+		break;
+	case DELIVERY_ITEM_CONFCHG:
+		member_list = (const unsigned int *)item->buffer;
+		left_list = member_list + item->member_list_entries;
+		joined_list = left_list + item->left_list_entries;
+
+		instance->totemsrp_confchg_fn (item->configuration_type,
+			member_list, item->member_list_entries,
+			left_list, item->left_list_entries,
+			joined_list, item->joined_list_entries,
+			&item->ring_id);
+		break;
+	case DELIVERY_ITEM_WAITING_TRANS_ACK:
+		instance->totemsrp_waiting_trans_ack_cb_fn (item->waiting_trans_ack);
+		break;
+	}
+}
+
+static void delivery_item_frame_release (
+	struct totemsrp_instance *instance,
+	struct delivery_item *item)
+{
+	if (item->frame != NULL) {
+		totemsrp_buffer_release (instance, item->frame);
+		item->frame = NULL;
+	}
+}
+
+static void *delivery_thread_fn (void *context)
+{
+	struct totemsrp_instance *instance = (struct totemsrp_instance *)context;
+	struct delivery_ring *ring = instance->delivery_ring;
+
+	for (;;) {
+		if (sem_wait (&ring->items_sem) != 0) {
+			continue;
+		}
+		if (ring->stop) {
+			break;
+		}
+
+		ring->serialize_lock ();
+		delivery_item_dispatch (instance, &ring->items[ring->tail]);
+		ring->serialize_unlock ();
+		delivery_item_frame_release (instance, &ring->items[ring->tail]);
+
+		ring->tail = (ring->tail + 1) % DELIVERY_RING_ITEMS;
+		sem_post (&ring->slots_sem);
+	}
+
+	return (NULL);
+}
+
+static void delivery_thread_stop (struct totemsrp_instance *instance)
+{
+	struct delivery_ring *ring = instance->delivery_ring;
+	int i;
+
+	if (ring == NULL) {
+		return ;
+	}
+
+	/*
+	 * Callbacks still in the ring are dropped, exactly as the ones not
+	 * yet delivered from sort queue
+	 */
+	ring->stop = 1;
+	sem_post (&ring->items_sem);
+	pthread_join (ring->thread, NULL);
+
+	sem_destroy (&ring->items_sem);
+	sem_destroy (&ring->slots_sem);
+	for (i = 0; i < DELIVERY_RING_ITEMS; i++) {
+		delivery_item_frame_release (instance, &ring->items[i]);
+		free (ring->items[i].buffer);
+	}
+	free (ring);
+	instance->delivery_ring = NULL;
+}
+
+static void deliver_fn_call (
+	struct totemsrp_instance *instance,
+	unsigned int nodeid,
+	void *frame,
+	const void *msg,
+	unsigned int msg_len,
+	int endian_conversion_required)
+{
+	struct delivery_item *item;
+
+	if (instance->delivery_ring == NULL) {
+		instance->totemsrp_deliver_fn (nodeid, msg, msg_len,
+			endian_conversion_required);
+		return ;
+	}
+
+	/*
+	 * Message is released from sort queue once token aru passes it,
+	 * which may be before delivery thread gets to it, so keep the frame
+	 */
+	item = delivery_item_get (instance, 0);
+	item->type = DELIVERY_ITEM_MCAST;
+	item->nodeid = nodeid;
+	totemsrp_buffer_ref (instance, frame);
+	item->frame = frame;
+	item->msg = msg;
+	item->msg_len = msg_len;
+	item->endian_conversion_required = endian_conversion_required;
+	delivery_item_put (instance);
+}
+
+static void confchg_fn_call (
+	struct totemsrp_instance *instance,
+	enum totem_configuration_type configuration_type,
+	const unsigned int *member_list, size_t member_list_entries,
+	const unsigned int *left_list, size_t left_list_entries,
+	const unsigned int *joined_list, size_t joined_list_entries,
+	const struct memb_ring_id *ring_id)
+{
+	struct delivery_item *item;
+	unsigned int *list;
+
+	if (instance->delivery_ring == NULL) {
+		instance->totemsrp_confchg_fn (configuration_type,
+			member_list, member_list_entries,
+			left_list, left_list_entries,
+			joined_list, joined_list_entries,
+			ring_id);
+		return ;
+	}
+
+	item = delivery_item_get (instance, sizeof (unsigned int) *
+		(member_list_entries + left_list_entries + joined_list_entries));
+	item->type = DELIVERY_ITEM_CONFCHG;
+	item->configuration_type = configuration_type;
+	item->member_list_entries = member_list_entries;
+	item->left_list_entries = left_list_entries;
+	item->joined_list_entries = joined_list_entries;
+	memcpy (&item->ring_id, ring_id, sizeof (struct memb_ring_id));
+
+	list = (unsigned int *)item->buffer;
+	if (member_list_entries) {
+		memcpy (list, member_list, sizeof (unsigned int) * member_list_entries);
+	}
+	list += member_list_entries;
+	if (left_list_entries) {
+		memcpy (list, left_list, sizeof (unsigned int) * left_list_entries);
+	}
+	list += left_list_entries;
+	if (joined_list_entries) {
+		memcpy (list, joined_list, sizeof (unsigned int) * joined_list_entries);
+	}
+	delivery_item_put (instance);
+}
+
+/*
+ * Switch of totempg assembly buffers must stay ordered with the messages
+ * delivered around it
+ */
+static void waiting_trans_ack_cb_call (
+	struct totemsrp_instance *instance,
+	int waiting_trans_ack)
+{
+	struct delivery_item *item;
+
+	if (instance->delivery_ring == NULL) {
+		instance->totemsrp_waiting_trans_ack_cb_fn (waiting_trans_ack);
+		return ;
+	}
+
+	item = delivery_item_get (instance, 0);
+	item->type = DELIVERY_ITEM_WAITING_TRANS_ACK;
+	item->waiting_trans_ack = waiting_trans_ack;
+	delivery_item_put (instance);
+}
+
 static void messages_deliver_to_app (
 	struct totemsrp_instance *instance,
 	int skip,
@@ -4199,6 +4688,7 @@ static void messages_deliver_to_app (
 	int endian_conversion_required;
 	unsigned int my_high_delivered_stored = 0;
 	struct srp_addr aligned_system_from;
+	uint64_t time_now = 0;
 
 	range = end_point - instance->my_high_delivered;
 
@@ -4261,10 +4751,8 @@ static void messages_deliver_to_app (
 		 * Skip messages not originated in instance->my_deliver_memb
 		 */
 		if (skip &&
-			memb_set_subset (&aligned_system_from,
-				1,
-				instance->my_deliver_memb_list,
-				instance->my_deliver_memb_entries) == 0) {
+			memb_nodeid_set_find (&instance->my_deliver_memb_set,
+				aligned_system_from.nodeid, NULL) == 0) {
 
 			instance->my_high_delivered = my_high_delivered_stored + i;
 
@@ -4278,11 +4766,20 @@ static void messages_deliver_to_app (
 			"Delivering MCAST message with seq %x to pending delivery queue",
 			mcast_header.seq);
 
+		if (sort_queue_item_p->timestamp != 0) {
+			if (time_now == 0) {
+				time_now = qb_util_nano_current_get ();
+			}
+			totem_histogram_record (&instance->stats.mcast_latency_histogram,
+				(time_now - sort_queue_item_p->timestamp) / QB_TIME_NS_IN_USEC);
+		}
+
 		/*
 		 * Message is locally originated multicast
 		 */
-		instance->totemsrp_deliver_fn (
+		deliver_fn_call (instance,
 			mcast_header.header.nodeid,
+			sort_queue_item_p->buffer,
 			((char *)sort_queue_item_p->mcast) + sizeof (struct mcast),
 			sort_queue_item_p->msg_len - sizeof (struct mcast),
 			endian_conversion_required);
@@ -4387,13 +4884,15 @@ static int message_handler_mcast (
 		/*
 		 * Allocate new multicast memory block
 		 */
-// TODO LEAK
-		sort_queue_item.mcast = totemsrp_buffer_alloc (instance);
-		if (sort_queue_item.mcast == NULL) {
+		sort_queue_item.buffer = totemsrp_buffer_alloc (instance);
+		if (sort_queue_item.buffer == NULL) {
 			return (-1); /* error here is corrected by the algorithm */
 		}
+		sort_queue_item.mcast = (struct mcast *)((char *)sort_queue_item.buffer +
+			MCAST_ENCAPSULATION_HEADROOM);
 		memcpy (sort_queue_item.mcast, msg, msg_len);
 		sort_queue_item.msg_len = msg_len;
+		sort_queue_item.timestamp = 0;
 
 		if (sq_lt_compare (instance->my_high_seq_received,
 			mcast_header.seq)) {
@@ -5237,14 +5736,74 @@ void totemsrp_threaded_mode_enable (void *context)
 	struct totemsrp_instance *instance = (struct totemsrp_instance *)context;
 
 	instance->threaded_mode_enabled = 1;
+	/*
+	 * New messages may be queued from other threads
+	 */
+	cs_queue_threaded_mode_enable (&instance->new_message_queue);
+	cs_queue_threaded_mode_enable (&instance->new_message_queue_control);
+	cs_queue_threaded_mode_enable (&instance->new_message_queue_trans);
+	totemnet_threaded_mode_enable (instance->totemnet_context);
+}
+
+/*
+ * Hand ordered delivery (messages, configuration changes and totempg buffer
+ * switches) over to a delivery thread, so slow application callbacks don't
+ * delay token processing. Callbacks are run with serialize_lock held.
+ */
+int totemsrp_delivery_thread_start (
+	void *context,
+	void (*serialize_lock) (void),
+	void (*serialize_unlock) (void))
+{
+	struct totemsrp_instance *instance = (struct totemsrp_instance *)context;
+	struct delivery_ring *ring;
+	int res;
+
+	ring = calloc (1, sizeof (struct delivery_ring));
+	if (ring == NULL) {
+		return (-1);
+	}
+	ring->serialize_lock = serialize_lock;
+	ring->serialize_unlock = serialize_unlock;
+
+	if (sem_init (&ring->items_sem, 0, 0) != 0) {
+		goto free_ring;
+	}
+	if (sem_init (&ring->slots_sem, 0, DELIVERY_RING_ITEMS) != 0) {
+		goto destroy_items_sem;
+	}
+
+	instance->delivery_ring = ring;
+	res = pthread_create (&ring->thread, NULL, delivery_thread_fn, instance);
+	if (res != 0) {
+		instance->delivery_ring = NULL;
+		goto destroy_slots_sem;
+	}
+
+	log_printf (instance->totemsrp_log_level_notice,
+		"Delivering messages to application in delivery thread");
+
+	return (0);
+
+destroy_slots_sem:
+	sem_destroy (&ring->slots_sem);
+destroy_items_sem:
+	sem_destroy (&ring->items_sem);
+free_ring:
+	free (ring);
+	return (-1);
 }
 
+/*
+ * Must be called from the main thread, totempg buffers are switched in
+ * order with the deliveries
+ */
 void totemsrp_trans_ack (void *context)
 {
 	struct totemsrp_instance *instance = (struct totemsrp_instance *)context;
 
 	instance->waiting_trans_ack = 0;
-	instance->totemsrp_waiting_trans_ack_cb_fn (0);
+	waiting_trans_ack_cb_call (instance, 0);
 }
 
 
@@ -80,6 +80,48 @@ int totemsrp_mcast (
 	unsigned int iov_len,
 	int priority);
 
+/**
+ * Allocate a frame that the caller fills in place.  payload is set to the
+ * first byte after headroom bytes reserved behind the totemsrp header.
+ */
+void *totemsrp_mcast_frame_alloc (
+	void *srp_context,
+	unsigned int headroom,
+	unsigned char **payload);
+
+/**
+ * Release a frame that was not committed
+ */
+void totemsrp_mcast_frame_release (
+	void *srp_context,
+	void *frame);
+
+/**
+ * Queue data_len bytes starting at data, which must lie inside frame after
+ * the reserved totemsrp header, for multicast.  The frame is owned by
+ * totemsrp on success.  prio is one of TOTEM_MCAST_PRIO_*, continued is
+ * set when the last message in the frame continues in the next bulk frame.
+ * Control frames must never be continued.
+ */
+int totemsrp_mcast_frame_commit (
+	void *srp_context,
+	void *frame,
+	const void *data,
+	unsigned int data_len,
+	int guarantee,
+	unsigned int prio,
+	int continued);
+
+/**
+ * Return non zero when no frame of lane prio waits to be sent
+ */
+int totemsrp_mcast_lane_is_empty (void *srp_context, unsigned int prio);
+
+/**
+ * Send every queued control frame before the next bulk frame
+ */
+void totemsrp_mcast_control_drain (void *srp_context);
+
 /**
  * Return number of available messages that can be queued
  */
@@ -147,6 +189,11 @@ extern int totemsrp_member_remove (
 void totemsrp_threaded_mode_enable (
 	void *srp_context);
 
+int totemsrp_delivery_thread_start (
+	void *srp_context,
+	void (*serialize_lock) (void),
+	void (*serialize_unlock) (void));
+
 void totemsrp_trans_ack (
 	void *srp_context);
 
@@ -66,6 +66,7 @@
 #define LOGSYS_UTILS_ONLY 1
 #include <corosync/logsys.h>
 #include "totemudp.h"
+#include "totemrecv.h"
 
 #include "util.h"
 
@@ -151,13 +152,9 @@ struct totemudp_instance {
 
 	struct qb_list_head member_list;
 
-	char iov_buffer[UDP_RECEIVE_FRAME_SIZE_MAX + 1];
+	struct totem_recv_batch recv_batch;
 
-	char iov_buffer_flush[UDP_RECEIVE_FRAME_SIZE_MAX + 1];
-
-	struct iovec totemudp_iov_recv;
-
-	struct iovec totemudp_iov_recv_flush;
+	struct totem_recv_batch recv_batch_flush;
 
 	struct totemudp_socket totemudp_sockets;
 
@@ -213,13 +210,6 @@ static void totemudp_instance_initialize (struct totemudp_instance *instance)
 
 	instance->netif_state_report = NETIF_STATE_REPORT_UP | NETIF_STATE_REPORT_DOWN;
 
-	instance->totemudp_iov_recv.iov_base = instance->iov_buffer;
-
-	instance->totemudp_iov_recv.iov_len = UDP_RECEIVE_FRAME_SIZE_MAX + 1; //sizeof (instance->iov_buffer) + 1;
-	instance->totemudp_iov_recv_flush.iov_base = instance->iov_buffer_flush;
-
-	instance->totemudp_iov_recv_flush.iov_len = UDP_RECEIVE_FRAME_SIZE_MAX + 1; //sizeof (instance->iov_buffer) + 1;
-
 	/*
 	 * There is always atleast 1 processor
 	 */
@@ -375,72 +365,70 @@ int totemudp_finalize (
 		close (instance->totemudp_sockets.token);
 	}
 
+	totem_recv_batch_free (&instance->recv_batch);
+	totem_recv_batch_free (&instance->recv_batch_flush);
+
 	return (res);
 }
 
 /*
- * Only designed to work with a message with one iov
+ * Receives a batch of datagrams and delivers them all
  */
-
 static int net_deliver_fn (
 	int fd,
 	int revents,
 	void *data)
 {
 	struct totemudp_instance *instance = (struct totemudp_instance *)data;
-	struct msghdr msg_recv;
-	struct iovec *iovec;
-	struct sockaddr_storage system_from;
-	int bytes_received;
+	struct totem_recv_batch *batch;
+	struct sockaddr_storage *system_from;
+	void *msg;
+	unsigned int bytes_received;
 
+	/*
+	 * totemsrp flushes the receive queue while it processes the token,
+	 * which is delivered from the regular batch, so it needs its own one
+	 */
 	if (instance->flushing == 1) {
-		iovec = &instance->totemudp_iov_recv_flush;
+		batch = &instance->recv_batch_flush;
 	} else {
-		iovec = &instance->totemudp_iov_recv;
+		batch = &instance->recv_batch;
 	}
 
 	/*
-	 * Receive datagram
+	 * Receive datagrams
 	 */
-	memset(&msg_recv, 0, sizeof(msg_recv));
-	msg_recv.msg_name = &system_from;
-	msg_recv.msg_namelen = sizeof (struct sockaddr_storage);
-	msg_recv.msg_iov = iovec;
-	msg_recv.msg_iovlen = 1;
-
-	bytes_received = recvmsg (fd, &msg_recv, MSG_NOSIGNAL | MSG_DONTWAIT);
-	if (bytes_received == -1) {
+	if (totem_recv_batch_fill (batch, fd) == -1) {
 		return (0);
-	} else {
-		instance->stats_recv += bytes_received;
 	}
 
-	if (bytes_received >= UDP_RECEIVE_FRAME_SIZE_MAX + 1) {
+	while (totem_recv_batch_next (batch, &msg, &bytes_received, &system_from) == 0) {
+		instance->stats_recv += bytes_received;
+
+		if (bytes_received >= UDP_RECEIVE_FRAME_SIZE_MAX + 1) {
+			/*
+			 * Maximum packet size should be UDP_RECEIVE_FRAME_SIZE_MAX.
+			 * If received packet is UDP_RECEIVE_FRAME_SIZE_MAX + 1 it means packet was truncated
+			 * (receive buffers are intentionally UDP_RECEIVE_FRAME_SIZE_MAX + 1 long).
+			 */
+			log_printf (instance->totemudp_log_level_error,
+					"Received too big message. This may be because something bad is happening "
+					"on the network (attack?), or you tried join more nodes than corosync is "
+					"compiled with (%u) or bug in the code (bad estimation of "
+					"the UDP_RECEIVE_FRAME_SIZE_MAX). Dropping packet.", PROCESSOR_COUNT_MAX);
+			continue;
+		}
+
 		/*
-		 * Maximum packet size should be UDP_RECEIVE_FRAME_SIZE_MAX.
-		 * If received packet is UDP_RECEIVE_FRAME_SIZE_MAX + 1 it means packet was truncated
-		 * (iov_buffer size and iov_len are intentionally set to UDP_RECEIVE_FRAME_SIZE_MAX + 1).
+		 * Handle incoming message
 		 */
-		log_printf (instance->totemudp_log_level_error,
-				"Received too big message. This may be because something bad is happening "
-				"on the network (attack?), or you tried join more nodes than corosync is "
-				"compiled with (%u) or bug in the code (bad estimation of "
-				"the UDP_RECEIVE_FRAME_SIZE_MAX). Dropping packet.", PROCESSOR_COUNT_MAX);
-		return (0);
+		instance->totemudp_deliver_fn (
+			instance->context,
+			msg,
+			bytes_received,
+			system_from);
 	}
 
-	iovec->iov_len = bytes_received;
-
-	/*
-	 * Handle incoming message
-	 */
-	instance->totemudp_deliver_fn (
-		instance->context,
-		iovec->iov_base,
-		iovec->iov_len,
-		&system_from);
-
-	iovec->iov_len = UDP_RECEIVE_FRAME_SIZE_MAX + 1;
 	return (0);
 }
 
@@ -1121,6 +1109,16 @@ int totemudp_initialize (
 
 	totemudp_instance_initialize (instance);
 
+	if (totem_recv_batch_init (&instance->recv_batch,
+	    UDP_RECEIVE_FRAME_SIZE_MAX + 1) == -1 ||
+	    totem_recv_batch_init (&instance->recv_batch_flush,
+	    UDP_RECEIVE_FRAME_SIZE_MAX + 1) == -1) {
+		totem_recv_batch_free (&instance->recv_batch);
+		totem_recv_batch_free (&instance->recv_batch_flush);
+		free (instance);
+		return (-1);
+	}
+
 	instance->totem_config = totem_config;
 	instance->stats = stats;
 
@@ -1140,8 +1138,6 @@ int totemudp_initialize (
 	 */
 	instance->totem_interface = &totem_config->interfaces[0];
 	totemip_copy (&instance->mcast_address, &instance->totem_interface->mcast_addr);
-	memset (instance->iov_buffer, 0, UDP_RECEIVE_FRAME_SIZE_MAX + 1);
-	memset (instance->iov_buffer_flush, 0, UDP_RECEIVE_FRAME_SIZE_MAX + 1);
 
 	instance->totemudp_poll_handle = poll_handle;
 
@@ -1174,7 +1170,7 @@ int totemudp_initialize (
 
 void *totemudp_buffer_alloc (void)
 {
-	return malloc (FRAME_SIZE_MAX);
+	return malloc (FRAME_SIZE_MAX + FRAME_HEADROOM_MAX);
 }
 
 void totemudp_buffer_release (void *ptr)
@@ -1371,9 +1367,7 @@ extern int totemudp_recv_mcast_empty (
 	void *udp_context)
 {
 	struct totemudp_instance *instance = (struct totemudp_instance *)udp_context;
-	unsigned int res;
-	struct sockaddr_storage system_from;
-	struct msghdr msg_recv;
+	int res;
 	struct pollfd ufd;
 	int nfds;
 	int msg_processed = 0;
@@ -1381,13 +1375,15 @@ extern int totemudp_recv_mcast_empty (
 	int sock;
 
 	/*
-	 * Receive datagram
+	 * Datagrams already received in the current batches are queued
+	 * entries as well
 	 */
-	memset(&msg_recv, 0, sizeof(msg_recv));
-	msg_recv.msg_name = &system_from;
-	msg_recv.msg_namelen = sizeof (struct sockaddr_storage);
-	msg_recv.msg_iov = &instance->totemudp_iov_recv_flush;
-	msg_recv.msg_iovlen = 1;
+	if (totem_recv_batch_discard (&instance->recv_batch)) {
+		msg_processed = 1;
+	}
+	if (totem_recv_batch_discard (&instance->recv_batch_flush)) {
+		msg_processed = 1;
+	}
 
 	for (i = 0; i < 2; i++) {
 		sock = -1;
@@ -1404,7 +1400,7 @@ extern int totemudp_recv_mcast_empty (
 			ufd.events = POLLIN;
 			nfds = poll (&ufd, 1, 0);
 			if (nfds == 1 && ufd.revents & POLLIN) {
-				res = recvmsg (sock, &msg_recv, MSG_NOSIGNAL | MSG_DONTWAIT);
+				res = totem_recv_discard (sock);
 				if (res != -1) {
 					msg_processed = 1;
 				} else {
@@ -67,6 +67,7 @@
 #define LOGSYS_UTILS_ONLY 1
 #include <corosync/logsys.h>
 #include "totemudpu.h"
+#include "totemrecv.h"
 
 #include "util.h"
 
@@ -82,9 +83,23 @@
 #define BIND_STATE_REGULAR	1
 #define BIND_STATE_LOOPBACK	2
 
+/*
+ * Maximum number of frames queued by totemudpu_mcast_noflush_send() before
+ * they are sent to every member in one sendmmsg() call
+ */
+#define MCAST_BATCH_MAX		16
+
+/*
+ * Number of buckets of the member hash table, must be power of two
+ */
+#define MEMBER_HASH_SIZE	256
+
 struct totemudpu_member {
 	struct qb_list_head list;
+	struct qb_list_head hash_list;
 	struct totem_ip_address member;
+	struct sockaddr_storage sockaddr;
+	int sockaddr_len;
 	int fd;
 	int active;
 };
@@ -139,12 +154,16 @@ struct totemudpu_instance {
 
 	void *udpu_context;
 
-	char iov_buffer[UDP_RECEIVE_FRAME_SIZE_MAX + 1];
-
-	struct iovec totemudpu_iov_recv;
+	struct totem_recv_batch recv_batch;
 
 	struct qb_list_head member_list;
 
+	/*
+	 * Members hashed by address, used to look up the sender of every
+	 * received packet
+	 */
+	struct qb_list_head member_hash[MEMBER_HASH_SIZE];
+
 	int stats_sent;
 
 	int stats_recv;
@@ -180,6 +199,10 @@ struct totemudpu_instance {
 	int send_merge_detect_message;
 
 	unsigned int merge_detect_messages_sent_before_timeout;
+
+	struct iovec mcast_batch[MCAST_BATCH_MAX];
+
+	unsigned int mcast_batch_count;
 };
 
 struct work_item {
@@ -208,20 +231,22 @@ static void totemudpu_stop_merge_detect_timeout(
 
 static void totemudpu_instance_initialize (struct totemudpu_instance *instance)
 {
+	int i;
+
 	memset (instance, 0, sizeof (struct totemudpu_instance));
 
 	instance->netif_state_report = NETIF_STATE_REPORT_UP | NETIF_STATE_REPORT_DOWN;
 
-	instance->totemudpu_iov_recv.iov_base = instance->iov_buffer;
-
-	instance->totemudpu_iov_recv.iov_len = UDP_RECEIVE_FRAME_SIZE_MAX + 1; //sizeof (instance->iov_buffer) + 1;
-
 	/*
 	 * There is always atleast 1 processor
 	 */
 	instance->my_memb_entries = 1;
 
 	qb_list_init (&instance->member_list);
+
+	for (i = 0; i < MEMBER_HASH_SIZE; i++) {
+		qb_list_init (&instance->member_hash[i]);
+	}
 }
 
 #define log_printf(level, format, args...)		\
@@ -298,24 +323,66 @@ static inline void ucast_sendmsg (
 	}
 }
 
+/*
+ * Send count messages on fd with as few system calls as possible
+ */
+static void msgs_send (
+	struct totemudpu_instance *instance,
+	int fd,
+	totem_mmsghdr_t *msgs,
+	unsigned int count,
+	const char *error_msg)
+{
+	unsigned int sent = 0;
+	unsigned int syscalls = 0;
+	int res;
+
+	while (sent < count) {
+#ifdef HAVE_SENDMMSG
+		res = sendmmsg (fd, &msgs[sent], count - sent, MSG_NOSIGNAL);
+#else
+		res = sendmsg (fd, &msgs[sent].msg_hdr, MSG_NOSIGNAL);
+		if (res >= 0) {
+			res = 1;
+		}
+#endif
+		syscalls++;
+		if (res <= 0) {
+			if (res < 0) {
+				LOGSYS_PERROR (errno, instance->totemudpu_log_level_debug,
+					"%s", error_msg);
+			}
+			/*
+			 * Skip the failed message
+			 * An error here is recovered by totemsrp
+			 */
+			res = 1;
+		}
+		sent += res;
+	}
+
+	instance->stats->mcast_tx_syscalls_saved += count - syscalls;
+}
+
 static inline void mcast_sendmsg (
 	struct totemudpu_instance *instance,
-	const void *msg,
-	unsigned int msg_len,
+	struct iovec *iovec,
+	unsigned int iov_count,
 	int only_active)
 {
-	struct msghdr msg_mcast;
-	int res = 0;
-	struct iovec iovec;
-	struct sockaddr_storage sockaddr;
-	int addrlen;
+	totem_mmsghdr_t msgs[MCAST_BATCH_MAX];
 	struct qb_list_head *list;
 	struct totemudpu_member *member;
+	unsigned int i;
 
-	iovec.iov_base = (void *)msg;
-	iovec.iov_len = msg_len;
+	assert (iov_count <= MCAST_BATCH_MAX);
+
+	memset(msgs, 0, sizeof(totem_mmsghdr_t) * iov_count);
+	for (i = 0; i < iov_count; i++) {
+		msgs[i].msg_hdr.msg_iov = &iovec[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
 
-	memset(&msg_mcast, 0, sizeof(msg_mcast));
 	/*
 	 * Build multicast message
 	 */
@@ -329,23 +396,17 @@ static inline void mcast_sendmsg (
 			if (only_active && !member->active && !instance->send_merge_detect_message)
 				continue ;
 
-			totemip_totemip_to_sockaddr_convert(&member->member,
-				instance->totem_interface->ip_port, &sockaddr, &addrlen);
-			memset(&msg_mcast, 0, sizeof(msg_mcast));
-			msg_mcast.msg_name = &sockaddr;
-			msg_mcast.msg_namelen = addrlen;
-			msg_mcast.msg_iov = (void *)&iovec;
-			msg_mcast.msg_iovlen = 1;
+			for (i = 0; i < iov_count; i++) {
+				msgs[i].msg_hdr.msg_name = &member->sockaddr;
+				msgs[i].msg_hdr.msg_namelen = member->sockaddr_len;
+			}
 
 			/*
 			 * Transmit multicast message
 			 * An error here is recovered by totemsrp
 			 */
-			res = sendmsg (member->fd, &msg_mcast, MSG_NOSIGNAL);
-			if (res < 0) {
-				LOGSYS_PERROR (errno, instance->totemudpu_log_level_debug,
-					"sendmsg(mcast) failed (non-critical)");
-			}
+			msgs_send (instance, member->fd, msgs, iov_count,
+				"sendmsg(mcast) failed (non-critical)");
 		}
 
 		if (!only_active || instance->send_merge_detect_message) {
@@ -360,18 +421,24 @@ static inline void mcast_sendmsg (
 		 * Transmit multicast message to local unix mcast loop
 		 * An error here is recovered by totemsrp
 		 */
-		msg_mcast.msg_name = NULL;
-		msg_mcast.msg_namelen = 0;
-		msg_mcast.msg_iov = (void *)&iovec;
-		msg_mcast.msg_iovlen = 1;
-
-		res = sendmsg (instance->local_loop_sock[1], &msg_mcast,
-			MSG_NOSIGNAL);
-		if (res < 0) {
-			LOGSYS_PERROR (errno, instance->totemudpu_log_level_debug,
-				"sendmsg(local mcast loop) failed (non-critical)");
-		}
+		msgs_send (instance, instance->local_loop_sock[1], msgs, iov_count,
+			"sendmsg(local mcast loop) failed (non-critical)");
+	}
+}
+
+/*
+ * Send the frames queued by totemudpu_mcast_noflush_send()
+ */
+static void mcast_batch_flush (
+	struct totemudpu_instance *instance)
+{
+	if (instance->mcast_batch_count == 0) {
+		return;
 	}
+
+	mcast_sendmsg (instance, instance->mcast_batch,
+		instance->mcast_batch_count, 1);
+	instance->mcast_batch_count = 0;
 }
 
 int totemudpu_finalize (
@@ -395,9 +462,48 @@ int totemudpu_finalize (
 
 	totemudpu_stop_merge_detect_timeout(instance);
 
+	totem_recv_batch_free (&instance->recv_batch);
+
 	return (res);
 }
 
+/*
+ * FNV-1a over the raw address bytes.  Only the address is hashed, the port
+ * is ignored the same way as in totemip_sa_equal().
+ */
+static unsigned int member_hash_bucket (
+	const unsigned char *addr,
+	size_t addr_len)
+{
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < addr_len; i++) {
+		hash ^= addr[i];
+		hash *= 16777619U;
+	}
+
+	return (hash & (MEMBER_HASH_SIZE - 1));
+}
+
+static unsigned int member_hash_bucket_totemip (
+	const struct totem_ip_address *totem_ip)
+{
+	if (totem_ip->family == AF_INET) {
+		return (member_hash_bucket (totem_ip->addr, sizeof (struct in_addr)));
+	}
+
+	return (member_hash_bucket (totem_ip->addr, sizeof (struct in6_addr)));
+}
+
+static void member_hash_add (
+	struct totemudpu_instance *instance,
+	struct totemudpu_member *member)
+{
+	qb_list_add_tail (&member->hash_list,
+		&instance->member_hash[member_hash_bucket_totemip (&member->member)]);
+}
+
 static struct totemudpu_member *find_member_by_sockaddr(
 	const void *udpu_context,
 	const struct sockaddr *sa)
@@ -406,13 +512,29 @@ static struct totemudpu_member *find_member_by_sockaddr(
 	struct totemudpu_member *member;
 	struct totemudpu_member *res_member;
 	const struct totemudpu_instance *instance = (const struct totemudpu_instance *)udpu_context;
+	unsigned int bucket;
 
 	res_member = NULL;
 
-	qb_list_for_each(list, &(instance->member_list)) {
+	switch (sa->sa_family) {
+	case AF_INET:
+		bucket = member_hash_bucket (
+			(const unsigned char *)&((const struct sockaddr_in *)sa)->sin_addr,
+			sizeof (struct in_addr));
+		break;
+	case AF_INET6:
+		bucket = member_hash_bucket (
+			(const unsigned char *)&((const struct sockaddr_in6 *)sa)->sin6_addr,
+			sizeof (struct in6_addr));
+		break;
+	default:
+		return (NULL);
+	}
+
+	qb_list_for_each(list, &(instance->member_hash[bucket])) {
 		member = qb_list_entry (list,
 			struct totemudpu_member,
-			list);
+			hash_list);
 
 		if (totemip_sa_equal(&member->member, sa)) {
 			res_member = member;
@@ -424,70 +546,63 @@ static struct totemudpu_member *find_member_by_sockaddr(
 }
 
 
+/*
+ * Receives a batch of datagrams and delivers them all
+ */
 static int net_deliver_fn (
 	int fd,
 	int revents,
 	void *data)
 {
 	struct totemudpu_instance *instance = (struct totemudpu_instance *)data;
-	struct msghdr msg_recv;
-	struct iovec *iovec;
-	struct sockaddr_storage system_from;
-	int bytes_received;
-
-	iovec = &instance->totemudpu_iov_recv;
+	struct totem_recv_batch *batch = &instance->recv_batch;
+	struct sockaddr_storage *system_from;
+	void *msg;
+	unsigned int bytes_received;
 
 	/*
-	 * Receive datagram
+	 * Receive datagrams
 	 */
-	memset(&msg_recv, 0, sizeof(msg_recv));
-	msg_recv.msg_name = &system_from;
-	msg_recv.msg_namelen = sizeof (struct sockaddr_storage);
-	msg_recv.msg_iov = iovec;
-	msg_recv.msg_iovlen = 1;
-
-	bytes_received = recvmsg (fd, &msg_recv, MSG_NOSIGNAL | MSG_DONTWAIT);
-	if (bytes_received == -1) {
+	if (totem_recv_batch_fill (batch, fd) == -1) {
 		return (0);
-	} else {
-		instance->stats_recv += bytes_received;
 	}
 
-	if (bytes_received >= UDP_RECEIVE_FRAME_SIZE_MAX + 1) {
-		/*
-		 * Maximum packet size should be UDP_RECEIVE_FRAME_SIZE_MAX.
-		 * If received packet is UDP_RECEIVE_FRAME_SIZE_MAX + 1 it means packet was truncated
-		 * (iov_buffer size and iov_len are intentionally set to UDP_RECEIVE_FRAME_SIZE_MAX + 1).
-		 */
-		log_printf (instance->totemudpu_log_level_error,
-				"Received too big message. This may be because something bad is happening "
-				"on the network (attack?), or you tried join more nodes than corosync is "
-				"compiled with (%u) or bug in the code (bad estimation of "
-				"the UDP_RECEIVE_FRAME_SIZE_MAX). Dropping packet.", PROCESSOR_COUNT_MAX);
-		return (0);
-	}
+	while (totem_recv_batch_next (batch, &msg, &bytes_received, &system_from) == 0) {
+		instance->stats_recv += bytes_received;
 
-	if (instance->totem_config->block_unlisted_ips &&
-	    instance->netif_bind_state == BIND_STATE_REGULAR &&
-	    find_member_by_sockaddr(instance, (const struct sockaddr *)&system_from) == NULL) {
-		log_printf(instance->totemudpu_log_level_debug, "Packet rejected from %s",
-		    totemip_sa_print((const struct sockaddr *)&system_from));
+		if (bytes_received >= UDP_RECEIVE_FRAME_SIZE_MAX + 1) {
+			/*
+			 * Maximum packet size should be UDP_RECEIVE_FRAME_SIZE_MAX.
+			 * If received packet is UDP_RECEIVE_FRAME_SIZE_MAX + 1 it means packet was truncated
+			 * (receive buffers are intentionally UDP_RECEIVE_FRAME_SIZE_MAX + 1 long).
+			 */
+			log_printf (instance->totemudpu_log_level_error,
+					"Received too big message. This may be because something bad is happening "
+					"on the network (attack?), or you tried join more nodes than corosync is "
+					"compiled with (%u) or bug in the code (bad estimation of "
+					"the UDP_RECEIVE_FRAME_SIZE_MAX). Dropping packet.", PROCESSOR_COUNT_MAX);
+			continue;
+		}
 
-		return (0);
-	}
+		if (instance->totem_config->block_unlisted_ips &&
+		    instance->netif_bind_state == BIND_STATE_REGULAR &&
+		    find_member_by_sockaddr(instance, (const struct sockaddr *)system_from) == NULL) {
+			log_printf(instance->totemudpu_log_level_debug, "Packet rejected from %s",
+			    totemip_sa_print((const struct sockaddr *)system_from));
 
-	iovec->iov_len = bytes_received;
+			continue;
+		}
 
-	/*
-	 * Handle incoming message
-	 */
-	instance->totemudpu_deliver_fn (
-		instance->context,
-		iovec->iov_base,
-		iovec->iov_len,
-		&system_from);
+		/*
+		 * Handle incoming message
+		 */
+		instance->totemudpu_deliver_fn (
+			instance->context,
+			msg,
+			bytes_received,
+			system_from);
+	}
 
-	iovec->iov_len = UDP_RECEIVE_FRAME_SIZE_MAX + 1;
 	return (0);
 }
 
@@ -919,6 +1034,12 @@ int totemudpu_initialize (
 
 	totemudpu_instance_initialize (instance);
 
+	if (totem_recv_batch_init (&instance->recv_batch,
+	    UDP_RECEIVE_FRAME_SIZE_MAX + 1) == -1) {
+		free (instance);
+		return (-1);
+	}
+
 	instance->totem_config = totem_config;
 	instance->stats = stats;
 
@@ -937,7 +1058,6 @@ int totemudpu_initialize (
 	 * Initialize local variables for totemudpu
 	 */
 	instance->totem_interface = &totem_config->interfaces[0];
-	memset (instance->iov_buffer, 0, UDP_RECEIVE_FRAME_SIZE_MAX + 1);
 
 	instance->totemudpu_poll_handle = poll_handle;
 
@@ -983,7 +1103,7 @@ int totemudpu_initialize (
 
 void *totemudpu_buffer_alloc (void)
 {
-	return malloc (FRAME_SIZE_MAX);
+	return malloc (FRAME_SIZE_MAX + FRAME_HEADROOM_MAX);
 }
 
 void totemudpu_buffer_release (void *ptr)
@@ -1022,8 +1142,11 @@ int totemudpu_recv_flush (void *udpu_context)
 
 int totemudpu_send_flush (void *udpu_context)
 {
+	struct totemudpu_instance *instance = (struct totemudpu_instance *)udpu_context;
 	int res = 0;
 
+	mcast_batch_flush (instance);
+
 	return (res);
 }
 
@@ -1035,6 +1158,8 @@ int totemudpu_token_send (
 	struct totemudpu_instance *instance = (struct totemudpu_instance *)udpu_context;
 	int res = 0;
 
+	mcast_batch_flush (instance);
+
 	ucast_sendmsg (instance, &instance->token_target, msg, msg_len);
 
 	return (res);
@@ -1045,9 +1170,14 @@ int totemudpu_mcast_flush_send (
 	unsigned int msg_len)
 {
 	struct totemudpu_instance *instance = (struct totemudpu_instance *)udpu_context;
+	struct iovec iovec;
 	int res = 0;
 
-	mcast_sendmsg (instance, msg, msg_len, 0);
+	mcast_batch_flush (instance);
+
+	iovec.iov_base = (void *)msg;
+	iovec.iov_len = msg_len;
+	mcast_sendmsg (instance, &iovec, 1, 0);
 
 	return (res);
 }
@@ -1060,7 +1190,17 @@ int totemudpu_mcast_noflush_send (
 	struct totemudpu_instance *instance = (struct totemudpu_instance *)udpu_context;
 	int res = 0;
 
-	mcast_sendmsg (instance, msg, msg_len, 1);
+	/*
+	 * The frame stays owned by totemsrp until totemudpu_send_flush(),
+	 * so only its address is queued here
+	 */
+	instance->mcast_batch[instance->mcast_batch_count].iov_base = (void *)msg;
+	instance->mcast_batch[instance->mcast_batch_count].iov_len = msg_len;
+	instance->mcast_batch_count++;
+
+	if (instance->mcast_batch_count == MCAST_BATCH_MAX) {
+		mcast_batch_flush (instance);
+	}
 
 	return (res);
 }
@@ -1111,22 +1251,19 @@ extern int totemudpu_recv_mcast_empty (
 	void *udpu_context)
 {
 	struct totemudpu_instance *instance = (struct totemudpu_instance *)udpu_context;
-	unsigned int res;
-	struct sockaddr_storage system_from;
-	struct msghdr msg_recv;
+	int res;
 	struct pollfd ufd;
 	int nfds, i;
 	int msg_processed = 0;
 	int sock;
 
 	/*
-	 * Receive datagram
+	 * Datagrams already received in the current batch are queued
+	 * entries as well
 	 */
-	memset(&msg_recv, 0, sizeof(msg_recv));
-	msg_recv.msg_name = &system_from;
-	msg_recv.msg_namelen = sizeof (struct sockaddr_storage);
-	msg_recv.msg_iov = &instance->totemudpu_iov_recv;
-	msg_recv.msg_iovlen = 1;
+	if (totem_recv_batch_discard (&instance->recv_batch)) {
+		msg_processed = 1;
+	}
 
 	for (i = 0; i < 2; i++) {
 		sock = -1;
@@ -1147,7 +1284,7 @@ extern int totemudpu_recv_mcast_empty (
 			ufd.events = POLLIN;
 			nfds = poll (&ufd, 1, 0);
 			if (nfds == 1 && ufd.revents & POLLIN) {
-				res = recvmsg (sock, &msg_recv, MSG_NOSIGNAL | MSG_DONTWAIT);
+				res = totem_recv_discard (sock);
 				if (res != -1) {
 					msg_processed = 1;
 				} else {
@@ -1256,6 +1393,10 @@ int totemudpu_member_add (
 	qb_list_init (&new_member->list);
 	qb_list_add_tail (&new_member->list, &instance->member_list);
 	memcpy (&new_member->member, member, sizeof (struct totem_ip_address));
+	member_hash_add (instance, new_member);
+	totemip_totemip_to_sockaddr_convert(&new_member->member,
+		instance->totem_interface->ip_port, &new_member->sockaddr,
+		&new_member->sockaddr_len);
 	new_member->fd = totemudpu_create_sending_socket(udpu_context, member);
 	new_member->active = 1;
 
@@ -1304,6 +1445,7 @@ int totemudpu_member_remove (
 	 */
 	if (found) {
 		qb_list_del (list);
+		qb_list_del (&member->hash_list);
 	}
 
 	instance = NULL;
@@ -1327,6 +1469,9 @@ int totemudpu_member_list_rebind_ip (
 			close (member->fd);
 		}
 
+		totemip_totemip_to_sockaddr_convert(&member->member,
+			instance->totem_interface->ip_port, &member->sockaddr,
+			&member->sockaddr_len);
 		member->fd = totemudpu_create_sending_socket(udpu_context, &member->member);
 	}
 
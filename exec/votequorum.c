@@ -437,6 +437,7 @@ static struct corosync_service_engine votequorum_service_engine = {
 	.private_data_size		= sizeof (struct quorum_pd),
 	.allow_inquorate		= CS_LIB_ALLOW_INQUORATE,
 	.flow_control			= COROSYNC_LIB_FLOW_CONTROL_REQUIRED,
+	.mcast_prio			= CS_MCAST_PRIO_CONTROL,
 	.lib_init_fn			= quorum_lib_init_fn,
 	.lib_exit_fn			= quorum_lib_exit_fn,
 	.lib_engine			= quorum_lib_service,
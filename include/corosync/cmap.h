@@ -63,6 +63,11 @@ typedef uint64_t cmap_iter_handle_t;
  */
 typedef uint64_t cmap_track_handle_t;
 
+/*
+ * Handle for mapped stats shared memory
+ */
+typedef uint64_t cmap_stats_handle_t;
+
 /*
  * Maximum length of key in cmap
  */
@@ -340,6 +345,64 @@ extern cs_error_t cmap_iter_next(
  */
 extern cs_error_t cmap_iter_finalize(cmap_handle_t handle, cmap_iter_handle_t iter_handle);
 
+/**
+ * @brief Key together with its value returned by cmap_iter_next_batch
+ */
+struct cmap_batch_item {
+	const char *key_name;
+	cmap_value_types_t type;
+	size_t value_len;
+	const void *value;
+};
+
+/**
+ * @brief Return next items in iterator iter together with their values.
+ *
+ * Up to *items_len keys are returned in one request. key_name and value
+ * point to a buffer owned by the cmap handle, which stays valid until next
+ * call of cmap_iter_next_batch or cmap_get_prefix on the same handle or until
+ * cmap_finalize. value is NULL (and value_len set) for values too big to be
+ * returned in a batch, cmap_get has to be used to get them.
+ *
+ * @param handle cmap handle
+ * @param iter_handle handle of iteration returned by cmap_iter_init
+ * @param items array of items to fill
+ * @param items_len number of items in array on input, number of filled items on output
+ * @return CS_NO_SECTION if there are no more sections to iterate
+ */
+extern cs_error_t cmap_iter_next_batch(
+		cmap_handle_t handle,
+		cmap_iter_handle_t iter_handle,
+		struct cmap_batch_item *items,
+		size_t *items_len);
+
+/**
+ * @brief Prototype for cmap_get_prefix callback
+ * @param cmap_handle cmap handle
+ * @param item key, type and value. Same rules as for cmap_iter_next_batch apply.
+ * @param user_data user data passed to cmap_get_prefix
+ */
+typedef void (*cmap_prefix_fn_t) (
+	cmap_handle_t cmap_handle,
+	const struct cmap_batch_item *item,
+	void *user_data);
+
+/**
+ * @brief Call prefix_fn for every key starting with prefix
+ *
+ * Keys and values are fetched in batches by cmap_iter_next_batch.
+ *
+ * @param handle cmap handle
+ * @param prefix prefix to iterate on
+ * @param prefix_fn function called for every key
+ * @param user_data given pointer is unchanged passed to prefix_fn
+ */
+extern cs_error_t cmap_get_prefix(
+		cmap_handle_t handle,
+		const char *prefix,
+		cmap_prefix_fn_t prefix_fn,
+		void *user_data);
+
 /**
  * @brief Add tracking function for given key_name.
  *
@@ -369,6 +432,41 @@ extern cs_error_t cmap_track_add(
  */
 extern cs_error_t cmap_track_delete(cmap_handle_t handle, cmap_track_handle_t track_handle);
 
+/**
+ * @brief Map stats shared memory published by corosync (system.stats_shm) read-only
+ *
+ * No connection to corosync is needed and reading of stats never sends a request.
+ *
+ * @param handle handle used by cmap_stats_read and cmap_stats_close
+ * @return CS_ERR_NOT_EXIST if corosync doesn't publish stats
+ */
+extern cs_error_t cmap_stats_open(cmap_stats_handle_t *handle);
+
+/**
+ * @brief Get consistent copy of stats.* keys and values
+ *
+ * key_name and value of items point to a buffer owned by the handle, which stays
+ * valid until next call of cmap_stats_read or cmap_stats_close. value is NULL if
+ * corosync couldn't get the value.
+ *
+ * @param handle stats handle
+ * @param items array of items, one per key
+ * @param items_len number of items
+ * @param update_time CLOCK_MONOTONIC time of the update in nanoseconds (can be NULL)
+ * @return CS_ERR_LIBRARY if corosync has exited and stats have to be opened again
+ */
+extern cs_error_t cmap_stats_read(
+	cmap_stats_handle_t handle,
+	const struct cmap_batch_item **items,
+	size_t *items_len,
+	uint64_t *update_time);
+
+/**
+ * @brief Unmap stats shared memory
+ * @param handle stats handle
+ */
+extern cs_error_t cmap_stats_close(cmap_stats_handle_t handle);
+
 /** @} */
 
 #ifdef __cplusplus
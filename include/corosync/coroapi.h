@@ -41,6 +41,7 @@
 #include <sys/uio.h>
 #endif
 #include <corosync/hdb.h>
+#include <corosync/corotypes.h>
 #include <qb/qbloop.h>
 #include <corosync/swab.h>
 
@@ -164,6 +165,17 @@ enum cs_lib_allow_inquorate {
 	CS_LIB_ALLOW_INQUORATE = 1
 };
 
+/**
+ * @brief The cs_mcast_prio enum
+ *
+ * Control messages of a service may be sent before bulk messages of other
+ * services queued earlier. Order of messages of one service is kept.
+ */
+enum cs_mcast_prio {
+	CS_MCAST_PRIO_BULK = 0, /* default */
+	CS_MCAST_PRIO_CONTROL = 1
+};
+
 #if !defined (COROSYNC_FLOW_CONTROL_STATE)
 /**
  * @brief The cs_flow_control_state enum
@@ -453,6 +465,19 @@ struct corosync_api_v1 {
 		qb_loop_t * handle,
 		int fd);
 
+	/*
+	 * Dispatch one message to many connections. *payload starts NULL,
+	 * a message which has to be queued is copied once and shared by the
+	 * queues. Release it with ipc_dispatch_payload_put when done.
+	 */
+	int (*ipc_dispatch_iov_send_shared) (void *conn,
+		const struct iovec *iov, unsigned int iov_len, void **payload);
+
+	void (*ipc_dispatch_payload_put) (void *payload);
+
+	void (*ipc_credentials_get) (void *conn,
+		pid_t *pid, uid_t *euid, gid_t *egid);
+
 };
 
 #define SERVICE_ID_MAKE(a,b) ( ((a)<<16) | (b) )
@@ -467,6 +492,12 @@ struct corosync_api_v1 {
 struct corosync_lib_handler {
 	void (*lib_handler_fn) (void *conn, const void *msg);
 	enum cs_lib_flow_control flow_control;
+	/*
+	 * Optional. Called instead of lib_handler_fn when the request can't
+	 * be processed (flow control or invalid request). The handler must
+	 * reply itself, generic error response is not sent.
+	 */
+	void (*lib_reject_fn) (void *conn, const void *msg, cs_error_t error);
 };
 
 /**
@@ -496,6 +527,7 @@ struct corosync_service_engine {
 	size_t private_data_size;
 	enum cs_lib_flow_control flow_control;
 	enum cs_lib_allow_inquorate allow_inquorate;
+	enum cs_mcast_prio mcast_prio;
 	char *(*exec_init_fn) (struct corosync_api_v1 *);
 	int (*exec_exit_fn) (void);
 	void (*exec_dump_fn) (void);
@@ -103,6 +103,7 @@ typedef enum {
  */
 typedef enum {
 	CPG_MODEL_V1 = 1,
+	CPG_MODEL_V2 = 2,
 } cpg_model_t;
 
 /**
@@ -176,6 +177,32 @@ typedef void (*cpg_totem_confchg_fn_t) (
 	uint32_t member_list_entries,
 	const uint32_t *member_list);
 
+/**
+ * Flags passed to cpg_deliver_fragment_fn_t
+ */
+#define CPG_FRAGMENT_FIRST	0x01
+#define CPG_FRAGMENT_LAST	0x02
+#define CPG_FRAGMENT_ABORT	0x04
+
+/**
+ * @brief The cpg_deliver_fragment_fn_t callback
+ *
+ * Called for every fragment of a large message, in order. offset is position
+ * of fragment in the message of msg_len bytes. With CPG_FRAGMENT_ABORT (fragment
+ * is NULL) the message will not be completed and what was received should be
+ * thrown away.
+ */
+typedef void (*cpg_deliver_fragment_fn_t) (
+	cpg_handle_t handle,
+	const struct cpg_name *group_name,
+	uint32_t nodeid,
+	uint32_t pid,
+	const void *fragment,
+	size_t fragment_len,
+	size_t offset,
+	size_t msg_len,
+	unsigned int flags);
+
 /**
  * @brief The cpg_callbacks_t struct
  */
@@ -192,6 +219,7 @@ typedef struct {
 } cpg_model_data_t;
 
 #define CPG_MODEL_V1_DELIVER_INITIAL_TOTEM_CONF 0x01
+#define CPG_MODEL_V1_DELIVER_COALESCE 0x02
 
 /**
  * @brief The cpg_model_v1_data_t struct
@@ -204,6 +232,21 @@ typedef struct {
 	unsigned int flags;
 } cpg_model_v1_data_t;
 
+/**
+ * @brief The cpg_model_v2_data_t struct
+ *
+ * Same as cpg_model_v1_data_t (including flags) plus callback getting
+ * large messages fragment by fragment instead of assembled.
+ */
+typedef struct {
+	cpg_model_t model;
+	cpg_deliver_fn_t cpg_deliver_fn;
+	cpg_confchg_fn_t cpg_confchg_fn;
+	cpg_totem_confchg_fn_t cpg_totem_confchg_fn;
+	unsigned int flags;
+	cpg_deliver_fragment_fn_t cpg_deliver_fragment_fn;
+} cpg_model_v2_data_t;
+
 
 /** @} */
 
@@ -372,8 +415,12 @@ cs_error_t cpg_flow_control_state_get (
  * @param buffer
  * @return
  *
- * This is left here for backward compatibility only
- * it just calls malloc()
+ * Allocates buffer of size bytes in memory shared with corosync.
+ * Message stored in such buffer can be sent by cpg_zcb_mcast_joined
+ * without being copied into IPC request ring. Shared memory is a sealed
+ * memfd; corosync maps only a limited number of buffers per handle.
+ * Buffers above that limit (or on systems without memfd_create) are
+ * allocated in local memory and sent as by cpg_mcast_joined.
  */
 cs_error_t cpg_zcb_alloc (
 	cpg_handle_t handle,
@@ -386,8 +433,7 @@ cs_error_t cpg_zcb_alloc (
  * @param buffer
  * @return
  *
- * This is left here for backward compatibility only
- * it just calls free()
+ * Releases buffer previously allocated by cpg_zcb_alloc.
  */
 cs_error_t cpg_zcb_free (
 	cpg_handle_t handle,
@@ -401,8 +447,9 @@ cs_error_t cpg_zcb_free (
  * @param msg_len
  * @return
  *
- * This is left here for backward compatibility only
- * it just calls cpg_mcast_joined()
+ * Multicasts first msg_len bytes of buffer allocated by cpg_zcb_alloc.
+ * Buffer may be reused as soon as function returns. Messages bigger than
+ * cpg_max_atomic_msgsize_get are sent (and copied) by cpg_mcast_joined.
  */
 cs_error_t cpg_zcb_mcast_joined (
 	cpg_handle_t handle,
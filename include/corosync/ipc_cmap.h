@@ -53,6 +53,7 @@ enum req_cmap_types {
 	MESSAGE_REQ_CMAP_TRACK_ADD = 7,
 	MESSAGE_REQ_CMAP_TRACK_DELETE = 8,
 	MESSAGE_REQ_CMAP_SET_CURRENT_MAP = 9,
+	MESSAGE_REQ_CMAP_ITER_NEXT_BATCH = 10,
 };
 
 /**
@@ -70,6 +71,7 @@ enum res_cmap_types {
 	MESSAGE_RES_CMAP_TRACK_DELETE = 8,
 	MESSAGE_RES_CMAP_NOTIFY_CALLBACK = 9,
 	MESSAGE_RES_CMAP_SET_CURRENT_MAP = 10,
+	MESSAGE_RES_CMAP_ITER_NEXT_BATCH = 11,
 };
 
 enum {
@@ -179,6 +181,49 @@ struct res_lib_cmap_iter_next {
 	mar_uint8_t type __attribute__((aligned(8)));
 };
 
+/**
+ * @brief The req_lib_cmap_iter_next_batch struct
+ *
+ * max_size is the size of the buffer the response is received into
+ */
+struct req_lib_cmap_iter_next_batch {
+	struct qb_ipc_request_header header __attribute__((aligned(8)));
+	mar_uint64_t iter_handle __attribute__((aligned(8)));
+	mar_uint32_t max_entries __attribute__((aligned(8)));
+	mar_size_t max_size __attribute__((aligned(8)));
+};
+
+/**
+ * @brief The res_lib_cmap_iter_next_batch struct
+ *
+ * data holds entries struct res_lib_cmap_batch_entry
+ */
+struct res_lib_cmap_iter_next_batch {
+	struct qb_ipc_response_header header __attribute__((aligned(8)));
+	mar_uint32_t entries __attribute__((aligned(8)));
+	mar_uint8_t data[] __attribute__((aligned(8)));
+};
+
+#define CMAP_BATCH_ENTRY_VALUE_INCLUDED	0x01
+
+/**
+ * @brief One key of res_lib_cmap_iter_next_batch
+ *
+ * Followed by the key name (key_len bytes and a trailing zero) and, if
+ * CMAP_BATCH_ENTRY_VALUE_INCLUDED is set in flags, by value_len bytes of
+ * value. Key name and value each start on a CMAP_BATCH_ALIGN boundary.
+ * The value is left out when it doesn't fit into the response on its own.
+ */
+struct res_lib_cmap_batch_entry {
+	mar_uint16_t key_len;
+	mar_uint8_t type;
+	mar_uint8_t flags;
+	mar_uint32_t value_len;
+} __attribute__((aligned(8)));
+
+#define CMAP_BATCH_ALIGN		8
+#define CMAP_BATCH_ALIGNED(len)		(((len) + CMAP_BATCH_ALIGN - 1) & ~(CMAP_BATCH_ALIGN - 1))
+
 /**
  * @brief The req_lib_cmap_iter_finalize struct
  */
@@ -259,5 +304,50 @@ struct req_lib_cmap_set_current_map {
 	mar_int32_t map __attribute__((aligned(8)));
 };
 
+/*
+ * Read-only stats segment published by corosync in /dev/shm (or in
+ * LOCALSTATEDIR/run if /dev/shm is not available) when system.stats_shm
+ * is enabled. It holds the values of (a subset of) the stats map keys,
+ * refreshed every time corosync updates its statistics.
+ *
+ * Writer increments seq before and after every update, so it is odd while
+ * the segment is being written. Readers copy the entries and retry if seq
+ * was odd or has changed meanwhile. Set of keys (and so key_name of each
+ * entry) changes only together with generation. Segment never shrinks,
+ * entries_max may grow and then the file has to be mapped again.
+ */
+#define CMAP_STATS_SHM_FILE		"corosync-stats"
+#define CMAP_STATS_SHM_MAGIC		0x53534d43
+#define CMAP_STATS_SHM_VERSION		1
+#define CMAP_STATS_SHM_KEY_LEN		112
+#define CMAP_STATS_SHM_VALUE_LEN	32
+
+/**
+ * @brief The cmap_stats_shm_entry struct
+ */
+struct cmap_stats_shm_entry {
+	char key_name[CMAP_STATS_SHM_KEY_LEN] __attribute__((aligned(8)));
+	mar_uint32_t type;
+	mar_uint32_t value_len;
+	mar_uint8_t value[CMAP_STATS_SHM_VALUE_LEN] __attribute__((aligned(8)));
+};
+
+/**
+ * @brief The cmap_stats_shm_header struct
+ */
+struct cmap_stats_shm_header {
+	mar_uint32_t magic __attribute__((aligned(8)));
+	mar_uint32_t version;
+	mar_uint32_t seq;
+	mar_uint32_t entries;
+	mar_uint32_t entries_max;
+	mar_uint32_t pid;
+	mar_uint64_t generation __attribute__((aligned(8)));
+	mar_uint64_t update_time __attribute__((aligned(8)));
+	struct cmap_stats_shm_entry entry[];
+};
+
+#define CMAP_STATS_SHM_SIZE(entries_max) (sizeof(struct cmap_stats_shm_header) + \
+	(size_t)(entries_max) * sizeof(struct cmap_stats_shm_entry))
 
 #endif /* IPC_CMAP_H_DEFINED */
@@ -53,10 +53,11 @@ enum req_cpg_types {
 	MESSAGE_REQ_CPG_ITERATIONNEXT = 6,
 	MESSAGE_REQ_CPG_ITERATIONFINALIZE = 7,
 	MESSAGE_REQ_CPG_FINALIZE = 8,
-	MESSAGE_REQ_CPG_NULL = 9,
-	MESSAGE_REQ_CPG_PAD1 = 10,
-	MESSAGE_REQ_CPG_PAD2 = 11,
+	MESSAGE_REQ_CPG_ZC_ALLOC = 9,
+	MESSAGE_REQ_CPG_ZC_FREE = 10,
+	MESSAGE_REQ_CPG_ZC_EXECUTE = 11,
 	MESSAGE_REQ_CPG_PARTIAL_MCAST = 12,
+	MESSAGE_REQ_CPG_PARTIAL_MCAST_WINDOWED = 13,
 };
 
 /**
@@ -77,11 +78,12 @@ enum res_cpg_types {
 	MESSAGE_RES_CPG_ITERATIONFINALIZE = 11,
 	MESSAGE_RES_CPG_FINALIZE = 12,
 	MESSAGE_RES_CPG_TOTEM_CONFCHG_CALLBACK = 13,
-	MESSAGE_RES_CPG_NULL = 14,
-	MESSAGE_RES_CPG_PAD1 = 15,
-	MESSAGE_RES_CPG_PAD2 = 16,
+	MESSAGE_RES_CPG_ZC_ALLOC = 14,
+	MESSAGE_RES_CPG_ZC_FREE = 15,
+	MESSAGE_RES_CPG_ZC_EXECUTE = 16,
 	MESSAGE_RES_CPG_PARTIAL_DELIVER_CALLBACK = 17,
 	MESSAGE_RES_CPG_PARTIAL_SEND = 18,
+	MESSAGE_RES_CPG_DELIVER_BATCH_CALLBACK = 19,
 };
 
 /**
@@ -99,11 +101,28 @@ enum lib_cpg_confchg_reason {
  * @brief The lib_cpg_partial_types enum
  */
 enum lib_cpg_partial_types {
+	LIBCPG_PARTIAL_PROBE = 0,
 	LIBCPG_PARTIAL_FIRST = 1,
 	LIBCPG_PARTIAL_CONTINUED = 2,
 	LIBCPG_PARTIAL_LAST = 3,
 };
 
+/**
+ * Fragments sent with MESSAGE_REQ_CPG_PARTIAL_MCAST_WINDOWED are not
+ * acknowledged one by one. Server sends res_lib_cpg_partial_send after every
+ * CPG_PARTIAL_MCAST_ACK_WINDOW fragments of a message and after the last one,
+ * carrying the first error seen since the start of the message.
+ * A request of type LIBCPG_PARTIAL_PROBE carries no data and is acknowledged
+ * at once with CS_OK, libcpg sends it to find out whether corosync supports
+ * windowed send. Older corosync replies with CS_ERR_INVALID_PARAM.
+ */
+#define CPG_PARTIAL_MCAST_ACK_WINDOW	8
+
+/**
+ * Maximum number of zero copy buffers mapped by corosync for one connection
+ */
+#define CPG_ZC_MAPPINGS_MAX			64
+
 /**
  * @brief mar_cpg_name_t struct
  */
@@ -288,6 +307,67 @@ struct res_lib_cpg_null {
 	struct qb_ipc_response_header header __attribute__((aligned(8)));
 };
 
+/**
+ * @brief The req_lib_cpg_zc_alloc struct
+ */
+struct req_lib_cpg_zc_alloc {
+	struct qb_ipc_request_header header __attribute__((aligned(8)));
+	mar_uint64_t map_size __attribute__((aligned(8)));
+	/*
+	 * Sealed memfd of the buffer, open in the client process. corosync
+	 * opens it through /proc of the connected process.
+	 */
+	mar_uint32_t fd __attribute__((aligned(8)));
+};
+
+/**
+ * @brief The res_lib_cpg_zc_alloc struct
+ */
+struct res_lib_cpg_zc_alloc {
+	struct qb_ipc_response_header header __attribute__((aligned(8)));
+	mar_uint64_t server_address __attribute__((aligned(8)));
+};
+
+/**
+ * @brief The req_lib_cpg_zc_free struct
+ */
+struct req_lib_cpg_zc_free {
+	struct qb_ipc_request_header header __attribute__((aligned(8)));
+	mar_uint64_t map_size __attribute__((aligned(8)));
+	mar_uint64_t server_address __attribute__((aligned(8)));
+};
+
+/**
+ * @brief The res_lib_cpg_zc_free struct
+ */
+struct res_lib_cpg_zc_free {
+	struct qb_ipc_response_header header __attribute__((aligned(8)));
+};
+
+/**
+ * @brief The req_lib_cpg_zc_execute struct
+ */
+struct req_lib_cpg_zc_execute {
+	struct qb_ipc_request_header header __attribute__((aligned(8)));
+	mar_uint64_t server_address __attribute__((aligned(8)));
+};
+
+/**
+ * @brief The res_lib_cpg_zc_execute struct
+ */
+struct res_lib_cpg_zc_execute {
+	struct qb_ipc_response_header header __attribute__((aligned(8)));
+};
+
+/**
+ * Header placed at the start of every zero copy buffer. It is followed by
+ * struct req_lib_cpg_mcast and then by the message itself.
+ */
+struct cpg_zc_header {
+	mar_uint64_t map_size __attribute__((aligned(8)));
+	mar_uint64_t server_address __attribute__((aligned(8)));
+};
+
 /**
  * @brief The res_lib_cpg_local_get struct
  */
@@ -344,6 +424,21 @@ struct res_lib_cpg_deliver_callback {
 	mar_uint8_t message[] __attribute__((aligned(8)));
 };
 
+/**
+ * @brief The res_lib_cpg_deliver_batch_callback struct
+ *
+ * Sent to clients joined with CPG_MODEL_V1_DELIVER_COALESCE. Header is followed
+ * by entries records, each a complete res_lib_cpg_deliver_callback with its
+ * header.size set to the record length padded to CPG_DELIVER_BATCH_ALIGN.
+ */
+struct res_lib_cpg_deliver_batch_callback {
+	struct qb_ipc_response_header header __attribute__((aligned(8)));
+	mar_uint32_t entries __attribute__((aligned(8)));
+	mar_uint8_t records[] __attribute__((aligned(8)));
+};
+
+#define CPG_DELIVER_BATCH_ALIGN(len)	(((len) + 7) & ~((size_t)7))
+
 /**
  * @brief The res_lib_cpg_partial_deliver_callback struct
  */
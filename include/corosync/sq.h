@@ -36,22 +36,32 @@
 
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 
 /**
  * @brief The sq struct
+ *
+ * Ring of size_per_item sized items indexed by sequence number. The size is
+ * a power of two, so positions are computed with a mask and stay consistent
+ * across sequence number rollover. Which positions hold an item is kept in
+ * a packed bitmap, which is scanned a word at a time to find holes.
  */
 struct sq {
 	unsigned int head;
 	unsigned int size;
+	unsigned int mask;
 	void *items;
-	unsigned int *items_inuse;
+	unsigned long *items_inuse;
 	unsigned int *items_miss_count;
 	unsigned int size_per_item;
 	unsigned int head_seqid;
 	unsigned int item_count;
 	unsigned int pos_max;
+	unsigned int miss_pos_max;
 };
 
+#define SQ_BITS_PER_WORD	(sizeof (unsigned long) * CHAR_BIT)
+
 /*
  * Compare a unsigned rollover-safe value to an unsigned rollover-safe value
  */
@@ -107,10 +117,162 @@ static inline int sq_lte_compare (unsigned int a, unsigned int b) {
 	return (0);
 }
 
+/**
+ * @brief sq_words
+ * @param pos_max
+ * @return number of bitmap words covering positions 0 to pos_max
+ */
+static inline unsigned int sq_words (unsigned int pos_max)
+{
+	return (pos_max / SQ_BITS_PER_WORD + 1);
+}
+
+/**
+ * @brief sq_pos_get
+ * @param sq
+ * @param seq_id
+ * @return
+ */
+static inline unsigned int sq_pos_get (
+	const struct sq *sq,
+	unsigned int seq_id)
+{
+	return ((sq->head - sq->head_seqid + seq_id) & sq->mask);
+}
+
+/**
+ * @brief sq_bit_test
+ * @param sq
+ * @param pos
+ * @return
+ */
+static inline int sq_bit_test (const struct sq *sq, unsigned int pos)
+{
+	return ((sq->items_inuse[pos / SQ_BITS_PER_WORD] >>
+		(pos % SQ_BITS_PER_WORD)) & 1);
+}
+
+/**
+ * @brief Clear count bits starting at position pos, wrapping at the end
+ * @param sq
+ * @param pos
+ * @param count
+ */
+static inline void sq_bits_clear (
+	struct sq *sq,
+	unsigned int pos,
+	unsigned int count)
+{
+	unsigned int bit;
+	unsigned int chunk;
+	unsigned long bits;
+
+	while (count > 0) {
+		bit = pos % SQ_BITS_PER_WORD;
+		chunk = SQ_BITS_PER_WORD - bit;
+		if (chunk > sq->size - pos) {
+			chunk = sq->size - pos;
+		}
+		if (chunk > count) {
+			chunk = count;
+		}
+		if (chunk == SQ_BITS_PER_WORD) {
+			sq->items_inuse[pos / SQ_BITS_PER_WORD] = 0;
+		} else {
+			bits = ((1UL << chunk) - 1) << bit;
+			sq->items_inuse[pos / SQ_BITS_PER_WORD] &= ~bits;
+		}
+		count -= chunk;
+		pos = (pos + chunk) & sq->mask;
+	}
+}
+
+/**
+ * @brief Find first of count seqs starting at seq_id with in use bit
+ *	equal to inuse
+ * @param sq
+ * @param seq_id
+ * @param count
+ * @param inuse
+ * @return offset from seq_id or count if there is no such seq
+ */
+static inline unsigned int sq_scan (
+	const struct sq *sq,
+	unsigned int seq_id,
+	unsigned int count,
+	int inuse)
+{
+	unsigned int pos;
+	unsigned int bit;
+	unsigned int chunk;
+	unsigned int offset = 0;
+	unsigned long bits;
+
+	pos = sq_pos_get (sq, seq_id);
+	while (offset < count) {
+		bit = pos % SQ_BITS_PER_WORD;
+		chunk = SQ_BITS_PER_WORD - bit;
+		if (chunk > sq->size - pos) {
+			chunk = sq->size - pos;
+		}
+		if (chunk > count - offset) {
+			chunk = count - offset;
+		}
+
+		bits = sq->items_inuse[pos / SQ_BITS_PER_WORD];
+		if (inuse == 0) {
+			bits = ~bits;
+		}
+		bits >>= bit;
+		if (chunk < SQ_BITS_PER_WORD) {
+			bits &= (1UL << chunk) - 1;
+		}
+		if (bits != 0) {
+			return (offset + __builtin_ctzl (bits));
+		}
+
+		offset += chunk;
+		pos = (pos + chunk) & sq->mask;
+	}
+	return (count);
+}
+
+/**
+ * @brief sq_next_hole
+ * @param sq
+ * @param seq_id
+ * @param count
+ * @return offset from seq_id of first missing item within count seqs,
+ *	count if there is none
+ */
+static inline unsigned int sq_next_hole (
+	const struct sq *sq,
+	unsigned int seq_id,
+	unsigned int count)
+{
+	return (sq_scan (sq, seq_id, count, 0));
+}
+
+/**
+ * @brief sq_next_present
+ * @param sq
+ * @param seq_id
+ * @param count
+ * @return offset from seq_id of first present item within count seqs,
+ *	count if there is none
+ */
+static inline unsigned int sq_next_present (
+	const struct sq *sq,
+	unsigned int seq_id,
+	unsigned int count)
+{
+	return (sq_scan (sq, seq_id, count, 1));
+}
+
 /**
  * @brief sq_init
  * @param sq
- * @param item_count
+ * @param item_count rounded up to power of two
  * @param size_per_item
  * @param head_seqid
  * @return
@@ -121,46 +283,57 @@ static inline int sq_init (
 	int size_per_item,
 	int head_seqid)
 {
+	unsigned int size = 1;
+
+	while (size < (unsigned int)item_count) {
+		size <<= 1;
+	}
+
 	sq->head = 0;
-	sq->size = item_count;
+	sq->size = size;
+	sq->mask = size - 1;
 	sq->size_per_item = size_per_item;
 	sq->head_seqid = head_seqid;
-	sq->item_count = item_count;
+	sq->item_count = size;
 	sq->pos_max = 0;
+	sq->miss_pos_max = 0;
 
-	sq->items = malloc (item_count * size_per_item);
+	sq->items = calloc (size, size_per_item);
 	if (sq->items == NULL) {
 		return (-ENOMEM);
 	}
-	memset (sq->items, 0, item_count * size_per_item);
 
-	if ((sq->items_inuse = malloc (item_count * sizeof (unsigned int)))
+	if ((sq->items_inuse = calloc (sq_words (size - 1), sizeof (unsigned long)))
 	    == NULL) {
 		return (-ENOMEM);
 	}
-	if ((sq->items_miss_count = malloc (item_count * sizeof (unsigned int)))
+	if ((sq->items_miss_count = calloc (size, sizeof (unsigned int)))
 	    == NULL) {
 		return (-ENOMEM);
 	}
-	memset (sq->items_inuse, 0, item_count * sizeof (unsigned int));
-	memset (sq->items_miss_count, 0, item_count * sizeof (unsigned int));
 	return (0);
 }
 
 /**
  * @brief sq_reinit
+ *
+ * Only the positions used since last reinit are cleared. Items themselves
+ * are not, they are valid only while their in use bit is set.
+ *
  * @param sq
  * @param head_seqid
  */
 static inline void sq_reinit (struct sq *sq, unsigned int head_seqid)
 {
+	memset (sq->items_inuse, 0,
+		sq_words (sq->pos_max) * sizeof (unsigned long));
+	memset (sq->items_miss_count, 0,
+		(sq->miss_pos_max + 1) * sizeof (unsigned int));
+
 	sq->head = 0;
 	sq->head_seqid = head_seqid;
 	sq->pos_max = 0;
-
-	memset (sq->items, 0, sq->item_count * sq->size_per_item);
-	memset (sq->items_inuse, 0, sq->item_count * sizeof (unsigned int));
-	memset (sq->items_miss_count, 0, sq->item_count * sizeof (unsigned int));
+	sq->miss_pos_max = 0;
 }
 
 /**
@@ -172,33 +345,50 @@ static inline void sq_assert (const struct sq *sq, unsigned int pos)
 {
 	unsigned int i;
 
-//	printf ("Instrument[%d] Asserting from %d to %d\n",
-//		pos, sq->pos_max, sq->size);
 	for (i = sq->pos_max + 1; i < sq->size; i++) {
-		assert (sq->items_inuse[i] == 0);
+		assert (sq_bit_test (sq, i) == 0);
 	}
 }
 
 /**
  * @brief sq_copy
+ *
+ * Only positions used in either of queues are copied or cleared.
+ *
  * @param sq_dest
  * @param sq_src
  */
 static inline void sq_copy (struct sq *sq_dest, const struct sq *sq_src)
 {
+	unsigned int words_src, words_dest;
+
 	sq_assert (sq_src, 20);
+	words_src = sq_words (sq_src->pos_max);
+	words_dest = sq_words (sq_dest->pos_max);
+
+	memcpy (sq_dest->items, sq_src->items,
+		(sq_src->pos_max + 1) * sq_src->size_per_item);
+	memcpy (sq_dest->items_inuse, sq_src->items_inuse,
+		words_src * sizeof (unsigned long));
+	if (words_dest > words_src) {
+		memset (&sq_dest->items_inuse[words_src], 0,
+			(words_dest - words_src) * sizeof (unsigned long));
+	}
+	memcpy (sq_dest->items_miss_count, sq_src->items_miss_count,
+		(sq_src->miss_pos_max + 1) * sizeof (unsigned int));
+	if (sq_dest->miss_pos_max > sq_src->miss_pos_max) {
+		memset (&sq_dest->items_miss_count[sq_src->miss_pos_max + 1], 0,
+			(sq_dest->miss_pos_max - sq_src->miss_pos_max) * sizeof (unsigned int));
+	}
+
 	sq_dest->head = sq_src->head;
 	sq_dest->size = sq_src->item_count;
+	sq_dest->mask = sq_src->mask;
 	sq_dest->size_per_item = sq_src->size_per_item;
 	sq_dest->head_seqid = sq_src->head_seqid;
 	sq_dest->item_count = sq_src->item_count;
 	sq_dest->pos_max = sq_src->pos_max;
-	memcpy (sq_dest->items, sq_src->items,
-		sq_src->item_count * sq_src->size_per_item);
-	memcpy (sq_dest->items_inuse, sq_src->items_inuse,
-		sq_src->item_count * sizeof (unsigned int));
-	memcpy (sq_dest->items_miss_count, sq_src->items_miss_count,
-		sq_src->item_count * sizeof (unsigned int));
+	sq_dest->miss_pos_max = sq_src->miss_pos_max;
 }
 
 /**
@@ -226,20 +416,17 @@ static inline void *sq_item_add (
 	char *sq_item;
 	unsigned int sq_position;
 
-	sq_position = (sq->head + seqid - sq->head_seqid) % sq->size;
+	sq_position = sq_pos_get (sq, seqid);
 	if (sq_position > sq->pos_max) {
 		sq->pos_max = sq_position;
 	}
 
 	sq_item = sq->items;
 	sq_item += sq_position * sq->size_per_item;
-	assert(sq->items_inuse[sq_position] == 0);
+	assert(sq_bit_test (sq, sq_position) == 0);
 	memcpy (sq_item, item, sq->size_per_item);
-	if (seqid == 0) {
-		sq->items_inuse[sq_position] = 1;
-	} else {
-		sq->items_inuse[sq_position] = seqid;
-	}
+	sq->items_inuse[sq_position / SQ_BITS_PER_WORD] |=
+		1UL << (sq_position % SQ_BITS_PER_WORD);
 	sq->items_miss_count[sq_position] = 0;
 
 	return (sq_item);
@@ -255,22 +442,7 @@ static inline unsigned int sq_item_inuse (
 	const struct sq *sq,
 	unsigned int seq_id) {
 
-	unsigned int sq_position;
-
-	/*
-	 * We need to say that the seqid is in use if it shouldn't
-	 * be here in the first place.
-	 * To keep old messages from being inserted.
-	 */
-#ifdef COMPILE_OUT
-	if (seq_id < sq->head_seqid) {
-		fprintf(stderr, "sq_item_inuse: seqid %d, head %d\n",
-						seq_id, sq->head_seqid);
-		return 1;
-	}
-#endif
-	sq_position = (sq->head - sq->head_seqid + seq_id) % sq->size;
-	return (sq->items_inuse[sq_position] != 0);
+	return (sq_bit_test (sq, sq_pos_get (sq, seq_id)));
 }
 
 /**
@@ -280,12 +452,15 @@ static inline unsigned int sq_item_inuse (
  * @return
  */
 static inline unsigned int sq_item_miss_count (
-	const struct sq *sq,
+	struct sq *sq,
 	unsigned int seq_id)
 {
 	unsigned int sq_position;
 
-	sq_position = (sq->head - sq->head_seqid + seq_id) % sq->size;
+	sq_position = sq_pos_get (sq, seq_id);
+	if (sq_position > sq->miss_pos_max) {
+		sq->miss_pos_max = sq_position;
+	}
 	sq->items_miss_count[sq_position]++;
 	return (sq->items_miss_count[sq_position]);
 }
@@ -354,18 +529,11 @@ static inline unsigned int sq_item_get (
 	if (seq_id > ADJUST_ROLLOVER_POINT) {
 		assert ((seq_id - ADJUST_ROLLOVER_POINT) <
 			((sq->head_seqid - ADJUST_ROLLOVER_POINT) + sq->size));
-
-		sq_position = ((sq->head - ADJUST_ROLLOVER_VALUE) -
-			(sq->head_seqid - ADJUST_ROLLOVER_VALUE) + seq_id) % sq->size;
 	} else {
 		assert (seq_id < (sq->head_seqid + sq->size));
-		sq_position = (sq->head - sq->head_seqid + seq_id) % sq->size;
 	}
-//printf ("seqid %x head %x head %x pos %x\n", seq_id, sq->head, sq->head_seqid, sq_position);
-//	sq_position = (sq->head - sq->head_seqid + seq_id) % sq->size;
-//printf ("sq_position = %x\n", sq_position);
-//printf ("ITEMGET %d %d %d %d\n", sq_position, sq->head, sq->head_seqid, seq_id);
-	if (sq->items_inuse[sq_position] == 0) {
+	sq_position = sq_pos_get (sq, seq_id);
+	if (sq_bit_test (sq, sq_position) == 0) {
 		return (ENOENT);
 	}
 	sq_item = sq->items;
@@ -382,21 +550,24 @@ static inline unsigned int sq_item_get (
 static inline void sq_items_release (struct sq *sq, unsigned int seqid)
 {
 	unsigned int oldhead;
+	unsigned int count;
 
 	oldhead = sq->head;
+	count = seqid - sq->head_seqid + 1;
 
-	sq->head = (sq->head + seqid - sq->head_seqid + 1) % sq->size;
-	if ((oldhead + seqid - sq->head_seqid + 1) > sq->size) {
-//		printf ("releasing %d for %d\n", oldhead, sq->size - oldhead);
-//		printf ("releasing %d for %d\n", 0, sq->head);
-		memset (&sq->items_inuse[oldhead], 0, (sq->size - oldhead) * sizeof (unsigned int));
-		memset (sq->items_inuse, 0, sq->head * sizeof (unsigned int));
+	sq->head = (sq->head + count) & sq->mask;
+	if (count > sq->size) {
+		count = sq->size;
+	}
+	sq_bits_clear (sq, oldhead, count);
+	if (oldhead + count > sq->size) {
+		memset (&sq->items_miss_count[oldhead], 0,
+			(sq->size - oldhead) * sizeof (unsigned int));
+		memset (sq->items_miss_count, 0,
+			(oldhead + count - sq->size) * sizeof (unsigned int));
 	} else {
-//		printf ("releasing %d for %d\n", oldhead, seqid - sq->head_seqid + 1);
-		memset (&sq->items_inuse[oldhead], 0,
-			(seqid - sq->head_seqid + 1) * sizeof (unsigned int));
 		memset (&sq->items_miss_count[oldhead], 0,
-			(seqid - sq->head_seqid + 1) * sizeof (unsigned int));
+			count * sizeof (unsigned int));
 	}
 	sq->head_seqid = seqid + 1;
 }
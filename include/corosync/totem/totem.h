@@ -51,6 +51,21 @@
 
 #define FRAME_SIZE_MAX		KNET_MAX_PACKET_SIZE
 
+/*
+ * Extra space every transport frame buffer has on top of FRAME_SIZE_MAX.
+ * totempg packs messages directly into the frame and keeps the table of
+ * packed message lengths in this room until the frame is sent.
+ */
+#define FRAME_HEADROOM_MAX	512
+
+/*
+ * Classes of multicast messages.  Control messages are queued separately
+ * from bulk ones and may be sent before bulk messages queued earlier.
+ */
+#define TOTEM_MCAST_PRIO_BULK		0
+#define TOTEM_MCAST_PRIO_CONTROL	1
+#define TOTEM_MCAST_PRIO_MAX		2
+
 #define CONFIG_STRING_LEN_MAX   128
 /*
  * Estimation of required buffer size for totemudp and totemudpu - it should be at least
@@ -253,6 +268,10 @@ struct totem_config {
 
 	unsigned int cancel_token_hold_on_retransmit;
 
+	unsigned int adaptive_flow_control;
+
+	unsigned int mcast_control_share;
+
 	unsigned char ip_dscp;
 
 	void (*totem_memb_ring_id_create_or_load) (
@@ -0,0 +1,418 @@
+/*
+ * Copyright (c) 2026 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * This software licensed under BSD license, the text of which follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * - Neither the name of the MontaVista Software, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived from this
+ *   software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TOTEMMEMB_H_DEFINED
+#define TOTEMMEMB_H_DEFINED
+
+#include <string.h>
+#include <limits.h>
+
+#include <corosync/totem/totem.h>
+
+/**
+ * @brief Processor address as used by the membership algorithm
+ */
+struct srp_addr {
+	unsigned int nodeid;
+};
+
+/**
+ * @brief srp_addr_equal
+ * @param a
+ * @param b
+ * @return
+ */
+static inline int srp_addr_equal (const struct srp_addr *a, const struct srp_addr *b)
+{
+	if (a->nodeid == b->nodeid) {
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Set of nodeids, open addressing hash table with linear probing. It is
+ * sized for twice PROCESSOR_COUNT_MAX so probe sequences stay short and
+ * clearing it is just clearing the bitmap of used slots.
+ */
+#define MEMB_NODEID_SET_SIZE		1024
+#define MEMB_NODEID_SET_MASK		(MEMB_NODEID_SET_SIZE - 1)
+#define MEMB_NODEID_SET_WORD_BITS	(sizeof (unsigned long) * CHAR_BIT)
+
+#if PROCESSOR_COUNT_MAX * 2 > MEMB_NODEID_SET_SIZE
+#error MEMB_NODEID_SET_SIZE too small for PROCESSOR_COUNT_MAX
+#endif
+
+/*
+ * Below this number of compared pairs plain nested loops are cheaper than
+ * building a set
+ */
+#define MEMB_SET_LINEAR_MAX		64
+
+/**
+ * @brief The memb_nodeid_set struct
+ */
+struct memb_nodeid_set {
+	unsigned long used[MEMB_NODEID_SET_SIZE / MEMB_NODEID_SET_WORD_BITS];
+	unsigned int nodeid[MEMB_NODEID_SET_SIZE];
+	unsigned int index[MEMB_NODEID_SET_SIZE];
+};
+
+/**
+ * @brief memb_nodeid_set_clear
+ * @param set
+ */
+static inline void memb_nodeid_set_clear (struct memb_nodeid_set *set)
+{
+	memset (set->used, 0, sizeof (set->used));
+}
+
+static inline unsigned int memb_nodeid_set_slot_used (
+	const struct memb_nodeid_set *set,
+	unsigned int slot)
+{
+	return ((set->used[slot / MEMB_NODEID_SET_WORD_BITS] >>
+		(slot % MEMB_NODEID_SET_WORD_BITS)) & 1);
+}
+
+/**
+ * @brief Find slot holding nodeid or the free slot where it belongs
+ * @param set
+ * @param nodeid
+ * @return
+ */
+static inline unsigned int memb_nodeid_set_slot (
+	const struct memb_nodeid_set *set,
+	unsigned int nodeid)
+{
+	unsigned int slot;
+
+	slot = (nodeid * 2654435761U) & MEMB_NODEID_SET_MASK;
+	while (memb_nodeid_set_slot_used (set, slot) &&
+	    set->nodeid[slot] != nodeid) {
+		slot = (slot + 1) & MEMB_NODEID_SET_MASK;
+	}
+	return (slot);
+}
+
+/**
+ * @brief Add nodeid to set
+ * @param set
+ * @param nodeid
+ * @param index stored with nodeid when it is added
+ * @return 1 if nodeid was added, 0 if it was already in the set
+ */
+static inline int memb_nodeid_set_add (
+	struct memb_nodeid_set *set,
+	unsigned int nodeid,
+	unsigned int index)
+{
+	unsigned int slot;
+
+	slot = memb_nodeid_set_slot (set, nodeid);
+	if (memb_nodeid_set_slot_used (set, slot)) {
+		return (0);
+	}
+	set->used[slot / MEMB_NODEID_SET_WORD_BITS] |=
+		1UL << (slot % MEMB_NODEID_SET_WORD_BITS);
+	set->nodeid[slot] = nodeid;
+	set->index[slot] = index;
+	return (1);
+}
+
+/**
+ * @brief memb_nodeid_set_find
+ * @param set
+ * @param nodeid
+ * @param index set to index given when nodeid was added, if not NULL
+ * @return 1 if nodeid is in set
+ */
+static inline int memb_nodeid_set_find (
+	const struct memb_nodeid_set *set,
+	unsigned int nodeid,
+	unsigned int *index)
+{
+	unsigned int slot;
+
+	slot = memb_nodeid_set_slot (set, nodeid);
+	if (memb_nodeid_set_slot_used (set, slot) == 0) {
+		return (0);
+	}
+	if (index != NULL) {
+		*index = set->index[slot];
+	}
+	return (1);
+}
+
+/**
+ * @brief Replace set content with addresses of list, first occurrence wins
+ * @param set
+ * @param list
+ * @param list_entries
+ */
+static inline void memb_nodeid_set_fill (
+	struct memb_nodeid_set *set,
+	const struct srp_addr *list,
+	int list_entries)
+{
+	int i;
+
+	memb_nodeid_set_clear (set);
+	for (i = 0; i < list_entries; i++) {
+		memb_nodeid_set_add (set, list[i].nodeid, i);
+	}
+}
+
+/*
+ * Set operations for use by the membership algorithm
+ *
+ * Sets are arrays of srp_addr as carried on the wire. Small sets are
+ * compared with nested loops, larger ones through a memb_nodeid_set so
+ * the cost is linear in the number of entries.
+ */
+
+/**
+ * @brief out_list = one_list - two_list, order of one_list is kept
+ */
+static inline void memb_set_subtract (
+        struct srp_addr *out_list, int *out_list_entries,
+        const struct srp_addr *one_list, int one_list_entries,
+        const struct srp_addr *two_list, int two_list_entries)
+{
+	struct memb_nodeid_set set;
+	int found = 0;
+	int i;
+	int j;
+
+	*out_list_entries = 0;
+
+	if (one_list_entries * two_list_entries > MEMB_SET_LINEAR_MAX) {
+		memb_nodeid_set_fill (&set, two_list, two_list_entries);
+		for (i = 0; i < one_list_entries; i++) {
+			if (memb_nodeid_set_find (&set, one_list[i].nodeid, NULL) == 0) {
+				out_list[*out_list_entries] = one_list[i];
+				*out_list_entries = *out_list_entries + 1;
+			}
+		}
+		return;
+	}
+
+	for (i = 0; i < one_list_entries; i++) {
+		for (j = 0; j < two_list_entries; j++) {
+			if (srp_addr_equal (&one_list[i], &two_list[j])) {
+				found = 1;
+				break;
+			}
+		}
+		if (found == 0) {
+			out_list[*out_list_entries] = one_list[i];
+			*out_list_entries = *out_list_entries + 1;
+		}
+		found = 0;
+	}
+}
+
+/**
+ * @brief Is set1 equal to set2 Entries can be in different orders
+ */
+static inline int memb_set_equal (
+	const struct srp_addr *set1, int set1_entries,
+	const struct srp_addr *set2, int set2_entries)
+{
+	struct memb_nodeid_set set;
+	int i;
+	int j;
+
+	int found = 0;
+
+	if (set1_entries != set2_entries) {
+		return (0);
+	}
+
+	if (set1_entries * set2_entries > MEMB_SET_LINEAR_MAX) {
+		memb_nodeid_set_fill (&set, set1, set1_entries);
+		for (i = 0; i < set2_entries; i++) {
+			if (memb_nodeid_set_find (&set, set2[i].nodeid, NULL) == 0) {
+				return (0);
+			}
+		}
+		return (1);
+	}
+
+	for (i = 0; i < set2_entries; i++) {
+		for (j = 0; j < set1_entries; j++) {
+			if (srp_addr_equal (&set1[j], &set2[i])) {
+				found = 1;
+				break;
+			}
+		}
+		if (found == 0) {
+			return (0);
+		}
+		found = 0;
+	}
+	return (1);
+}
+
+/**
+ * @brief Is subset fully contained in fullset
+ */
+static inline int memb_set_subset (
+	const struct srp_addr *subset, int subset_entries,
+	const struct srp_addr *fullset, int fullset_entries)
+{
+	struct memb_nodeid_set set;
+	int i;
+	int j;
+	int found = 0;
+
+	if (subset_entries > fullset_entries) {
+		return (0);
+	}
+
+	if (subset_entries * fullset_entries > MEMB_SET_LINEAR_MAX) {
+		memb_nodeid_set_fill (&set, fullset, fullset_entries);
+		for (i = 0; i < subset_entries; i++) {
+			if (memb_nodeid_set_find (&set, subset[i].nodeid, NULL) == 0) {
+				return (0);
+			}
+		}
+		return (1);
+	}
+
+	for (i = 0; i < subset_entries; i++) {
+		for (j = 0; j < fullset_entries; j++) {
+			if (srp_addr_equal (&subset[i], &fullset[j])) {
+				found = 1;
+				break;
+			}
+		}
+		if (found == 0) {
+			return (0);
+		}
+		found = 0;
+	}
+	return (1);
+}
+
+/**
+ * @brief merge subset into fullset taking care not to add duplicates
+ */
+static inline void memb_set_merge (
+	const struct srp_addr *subset, int subset_entries,
+	struct srp_addr *fullset, int *fullset_entries)
+{
+	struct memb_nodeid_set set;
+	int found = 0;
+	int i;
+	int j;
+
+	if (subset_entries * (*fullset_entries + subset_entries) > MEMB_SET_LINEAR_MAX) {
+		memb_nodeid_set_fill (&set, fullset, *fullset_entries);
+		for (i = 0; i < subset_entries; i++) {
+			if (memb_nodeid_set_add (&set, subset[i].nodeid, *fullset_entries)) {
+				fullset[*fullset_entries] = subset[i];
+				*fullset_entries = *fullset_entries + 1;
+			}
+		}
+		return;
+	}
+
+	for (i = 0; i < subset_entries; i++) {
+		for (j = 0; j < *fullset_entries; j++) {
+			if (srp_addr_equal (&fullset[j], &subset[i])) {
+				found = 1;
+				break;
+			}
+		}
+		if (found == 0) {
+			fullset[*fullset_entries] = subset[i];
+			*fullset_entries = *fullset_entries + 1;
+		}
+		found = 0;
+	}
+	return;
+}
+
+/**
+ * @brief and = members of set2 found in set1 with ring id old_ring_id
+ */
+static inline void memb_set_and_with_ring_id (
+	const struct srp_addr *set1,
+	const struct memb_ring_id *set1_ring_ids,
+	int set1_entries,
+	const struct srp_addr *set2,
+	int set2_entries,
+	const struct memb_ring_id *old_ring_id,
+	struct srp_addr *and,
+	int *and_entries)
+{
+	struct memb_nodeid_set set;
+	unsigned int index;
+	int i;
+	int j;
+	int found = 0;
+
+	*and_entries = 0;
+
+	if (set1_entries * set2_entries > MEMB_SET_LINEAR_MAX) {
+		memb_nodeid_set_fill (&set, set1, set1_entries);
+		for (i = 0; i < set2_entries; i++) {
+			if (memb_nodeid_set_find (&set, set2[i].nodeid, &index) &&
+			    memcmp (&set1_ring_ids[index], old_ring_id,
+				sizeof (struct memb_ring_id)) == 0) {
+
+				and[*and_entries] = set1[index];
+				*and_entries = *and_entries + 1;
+			}
+		}
+		return;
+	}
+
+	for (i = 0; i < set2_entries; i++) {
+		for (j = 0; j < set1_entries; j++) {
+			if (srp_addr_equal (&set1[j], &set2[i])) {
+				if (memcmp (&set1_ring_ids[j], old_ring_id, sizeof (struct memb_ring_id)) == 0) {
+					found = 1;
+				}
+				break;
+			}
+		}
+		if (found) {
+			and[*and_entries] = set1[j];
+			*and_entries = *and_entries + 1;
+		}
+		found = 0;
+	}
+	return;
+}
+
+#endif /* TOTEMMEMB_H_DEFINED */
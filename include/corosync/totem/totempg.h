@@ -115,6 +115,16 @@ extern int totempg_groups_mcast_joined (
 	unsigned int iov_len,
 	int guarantee);
 
+/**
+ * Same as totempg_groups_mcast_joined, prio is one of TOTEM_MCAST_PRIO_*
+ */
+extern int totempg_groups_mcast_joined_prio (
+	void *instance,
+	const struct iovec *iovec,
+	unsigned int iov_len,
+	int guarantee,
+	unsigned int prio);
+
 extern int totempg_groups_joined_reserve (
 	void *instance,
 	const struct iovec *iovec,
@@ -151,6 +161,11 @@ extern int totempg_nodestatus_get (unsigned int nodeid,
 
 extern void* totempg_get_stats (void);
 
+/**
+ * Number of messages which can be queued for sending now
+ */
+extern int totempg_queue_avail_get (void);
+
 void totempg_event_signal (enum totem_event_type type, int value);
 
 extern const char *totempg_ifaces_print (unsigned int nodeid);
@@ -191,6 +206,10 @@ extern void totempg_queue_level_register_callback (totem_queue_level_changed_fn)
 
 extern void totempg_threaded_mode_enable (void);
 
+extern int totempg_delivery_thread_start (
+	void (*serialize_lock) (void),
+	void (*serialize_unlock) (void));
+
 extern void totempg_trans_ack (void);
 
 extern int totempg_reconfigure (void);
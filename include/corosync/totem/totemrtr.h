@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2026 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * This software licensed under BSD license, the text of which follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * - Neither the name of the MontaVista Software, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived from this
+ *   software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TOTEMRTR_H_DEFINED
+#define TOTEMRTR_H_DEFINED
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <corosync/totem/totem.h>
+
+/**
+ * @brief Retransmit request carried in the orf token
+ */
+struct rtr_item  {
+	struct memb_ring_id ring_id;
+	unsigned int seq;
+}__attribute__((packed));
+
+#define RTR_BITMAP_WORD_BITS	(sizeof (unsigned long) * CHAR_BIT)
+
+/**
+ * @brief Sequence numbers present in the token retransmit list
+ *
+ * Bit n stands for sequence number base + n, so the bitmap covers the
+ * whole sort queue window above my_aru. Only the bits of list entries are
+ * ever set, so they are cleared again in O(list) instead of O(window).
+ */
+struct rtr_bitmap {
+	unsigned int base;
+	unsigned int bits;
+	unsigned long *map;
+};
+
+/**
+ * @brief rtr_bitmap_init
+ * @param bitmap
+ * @param bits
+ * @return
+ */
+static inline int rtr_bitmap_init (struct rtr_bitmap *bitmap, unsigned int bits)
+{
+	bitmap->base = 0;
+	bitmap->bits = bits;
+	bitmap->map = calloc ((bits + RTR_BITMAP_WORD_BITS - 1) / RTR_BITMAP_WORD_BITS,
+		sizeof (unsigned long));
+	if (bitmap->map == NULL) {
+		return (-1);
+	}
+	return (0);
+}
+
+/**
+ * @brief rtr_bitmap_free
+ * @param bitmap
+ */
+static inline void rtr_bitmap_free (struct rtr_bitmap *bitmap)
+{
+	free (bitmap->map);
+	bitmap->map = NULL;
+}
+
+/**
+ * @brief rtr_bitmap_set
+ * @param bitmap
+ * @param seq
+ */
+static inline void rtr_bitmap_set (struct rtr_bitmap *bitmap, unsigned int seq)
+{
+	unsigned int offset = seq - bitmap->base;
+
+	if (offset < bitmap->bits) {
+		bitmap->map[offset / RTR_BITMAP_WORD_BITS] |=
+			1UL << (offset % RTR_BITMAP_WORD_BITS);
+	}
+}
+
+/**
+ * @brief rtr_bitmap_clear
+ * @param bitmap
+ * @param seq
+ */
+static inline void rtr_bitmap_clear (struct rtr_bitmap *bitmap, unsigned int seq)
+{
+	unsigned int offset = seq - bitmap->base;
+
+	if (offset < bitmap->bits) {
+		bitmap->map[offset / RTR_BITMAP_WORD_BITS] &=
+			~(1UL << (offset % RTR_BITMAP_WORD_BITS));
+	}
+}
+
+/**
+ * @brief rtr_bitmap_test
+ * @param bitmap
+ * @param seq
+ * @return
+ */
+static inline int rtr_bitmap_test (const struct rtr_bitmap *bitmap, unsigned int seq)
+{
+	unsigned int offset = seq - bitmap->base;
+
+	if (offset >= bitmap->bits) {
+		return (0);
+	}
+	return ((bitmap->map[offset / RTR_BITMAP_WORD_BITS] >>
+		(offset % RTR_BITMAP_WORD_BITS)) & 1);
+}
+
+/**
+ * @brief Mark all sequence numbers of retransmit list, relative to base
+ * @param bitmap
+ * @param base
+ * @param rtr_list
+ * @param entries
+ */
+static inline void rtr_bitmap_fill (
+	struct rtr_bitmap *bitmap,
+	unsigned int base,
+	const struct rtr_item *rtr_list,
+	unsigned int entries)
+{
+	unsigned int i;
+
+	bitmap->base = base;
+	for (i = 0; i < entries; i++) {
+		rtr_bitmap_set (bitmap, rtr_list[i].seq);
+	}
+}
+
+/**
+ * @brief Clear bits set by rtr_bitmap_fill and rtr_bitmap_set
+ * @param bitmap
+ * @param rtr_list
+ * @param entries
+ */
+static inline void rtr_bitmap_reset (
+	struct rtr_bitmap *bitmap,
+	const struct rtr_item *rtr_list,
+	unsigned int entries)
+{
+	unsigned int i;
+
+	for (i = 0; i < entries; i++) {
+		rtr_bitmap_clear (bitmap, rtr_list[i].seq);
+	}
+}
+
+/**
+ * @brief Format sequence numbers of retransmit list in one pass
+ * @param buf
+ * @param buf_len
+ * @param rtr_list
+ * @param entries
+ * @return buf
+ */
+static inline const char *rtr_list_format (
+	char *buf,
+	size_t buf_len,
+	const struct rtr_item *rtr_list,
+	unsigned int entries)
+{
+	size_t pos = 0;
+	unsigned int i;
+	int res;
+
+	buf[0] = '\0';
+	for (i = 0; i < entries; i++) {
+		res = snprintf (buf + pos, buf_len - pos, "%x ", rtr_list[i].seq);
+		if (res < 0 || (size_t)res >= buf_len - pos) {
+			break;
+		}
+		pos += res;
+	}
+	return (buf);
+}
+
+#endif /* TOTEMRTR_H_DEFINED */
@@ -50,6 +50,102 @@ typedef struct {
 	int backlog_calc;
 } totemsrp_token_stats_t;
 
+/*
+ * Log bucketed histogram.  Values below TOTEM_HISTOGRAM_SUB_BUCKETS have
+ * a bucket each, every following power of two range is split into
+ * TOTEM_HISTOGRAM_SUB_BUCKETS buckets, so a bucket is never wider than
+ * 1/TOTEM_HISTOGRAM_SUB_BUCKETS of its lower bound.  Values above
+ * UINT32_MAX are counted in the last bucket.
+ */
+#define TOTEM_HISTOGRAM_SUB_BUCKET_BITS	3
+#define TOTEM_HISTOGRAM_SUB_BUCKETS	(1 << TOTEM_HISTOGRAM_SUB_BUCKET_BITS)
+#define TOTEM_HISTOGRAM_BUCKETS		((32 - TOTEM_HISTOGRAM_SUB_BUCKET_BITS + 1) * \
+	TOTEM_HISTOGRAM_SUB_BUCKETS)
+
+typedef struct {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t bucket[TOTEM_HISTOGRAM_BUCKETS];
+} totem_histogram_t;
+
+static inline unsigned int totem_histogram_bucket (uint64_t value)
+{
+	unsigned int shift;
+
+	if (value > UINT32_MAX) {
+		value = UINT32_MAX;
+	}
+	if (value < TOTEM_HISTOGRAM_SUB_BUCKETS) {
+		return ((unsigned int)value);
+	}
+	shift = 63 - __builtin_clzll (value) - TOTEM_HISTOGRAM_SUB_BUCKET_BITS;
+
+	return ((shift + 1) * TOTEM_HISTOGRAM_SUB_BUCKETS +
+		((value >> shift) & (TOTEM_HISTOGRAM_SUB_BUCKETS - 1)));
+}
+
+/*
+ * Highest value counted in bucket
+ */
+static inline uint64_t totem_histogram_bucket_high (unsigned int bucket)
+{
+	unsigned int shift;
+
+	if (bucket < TOTEM_HISTOGRAM_SUB_BUCKETS) {
+		return (bucket);
+	}
+	shift = bucket / TOTEM_HISTOGRAM_SUB_BUCKETS - 1;
+
+	return ((((uint64_t)TOTEM_HISTOGRAM_SUB_BUCKETS +
+		bucket % TOTEM_HISTOGRAM_SUB_BUCKETS + 1) << shift) - 1);
+}
+
+static inline void totem_histogram_record (totem_histogram_t *histogram, uint64_t value)
+{
+	if (histogram->count == 0 || value < histogram->min) {
+		histogram->min = value;
+	}
+	if (value > histogram->max) {
+		histogram->max = value;
+	}
+	histogram->count++;
+	histogram->sum += value;
+	histogram->bucket[totem_histogram_bucket (value)]++;
+}
+
+/*
+ * Value below which permille of the recorded values are, with the
+ * precision of the bucket it falls in (but never above max)
+ */
+static inline uint64_t totem_histogram_permille (
+	const totem_histogram_t *histogram,
+	unsigned int permille)
+{
+	uint64_t rank;
+	uint64_t seen = 0;
+	uint64_t value;
+	unsigned int i;
+
+	if (histogram->count == 0) {
+		return (0);
+	}
+	rank = (histogram->count * permille + 999) / 1000;
+	if (rank == 0) {
+		rank = 1;
+	}
+	for (i = 0; i < TOTEM_HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->bucket[i];
+		if (seen >= rank) {
+			break;
+		}
+	}
+	value = totem_histogram_bucket_high (i);
+
+	return (value < histogram->max ? value : histogram->max);
+}
+
 typedef struct {
 	totem_stats_header_t hdr;
 	uint64_t orf_token_tx;
@@ -75,6 +171,9 @@ typedef struct {
 	uint64_t recovery_token_lost;
 	uint64_t consensus_timeouts;
 	uint64_t rx_msg_dropped;
+	uint64_t frame_pool_hit;
+	uint64_t frame_pool_miss;
+	uint64_t mcast_tx_syscalls_saved;
 	uint32_t continuous_gather;
 	uint32_t continuous_sendmsg_failures;
 	uint64_t time_since_token_last_received; // relative time
@@ -83,6 +182,40 @@ typedef struct {
 	uint32_t mtt_rx_token;
 	uint32_t avg_token_workload;
 	uint32_t avg_backlog_calc;
+	uint32_t recovery_duration;
+	uint32_t recovery_duration_max;
+
+	/*
+	 * Flow control limits used for the last token and how many times
+	 * adaptive flow control decreased/increased them
+	 */
+	uint32_t fcc_max_messages;
+	uint32_t fcc_window_size;
+	uint64_t fcc_decreases;
+	uint64_t fcc_increases;
+
+	/*
+	 * Control and bulk messages still queued after the last token
+	 */
+	uint32_t mcast_queue_depth_control;
+	uint32_t mcast_queue_depth_bulk;
+
+	/*
+	 * Token rotation and hold time and mcast to delivery latency of
+	 * locally originated messages in microseconds, messages sent
+	 * (including retransmits) per token
+	 */
+	totem_histogram_t token_rotation_histogram;
+	totem_histogram_t token_hold_histogram;
+	totem_histogram_t mcast_latency_histogram;
+	totem_histogram_t token_tx_histogram;
+
+	/*
+	 * Time in microseconds locally originated control and bulk messages
+	 * spent queued before being sent
+	 */
+	totem_histogram_t mcast_queue_wait_control_histogram;
+	totem_histogram_t mcast_queue_wait_bulk_histogram;
 
 	int earliest_token;
 	int latest_token;
@@ -98,6 +231,15 @@ typedef struct {
 	uint32_t msg_queue_avail;
 } totempg_stats_t;
 
+/*
+ * Per sending node, bytes of received messages which had to be staged in
+ * the assembly buffer versus bytes delivered straight from the frame
+ */
+typedef struct {
+	uint64_t assembly_bytes_copied;
+	uint64_t assembly_bytes_in_place;
+} totempg_node_stats_t;
+
 
 extern int totemknet_link_get_status (
 	knet_node_id_t node, uint8_t link,
@@ -112,6 +254,14 @@ void stats_knet_del_member(knet_node_id_t nodeid, uint8_t link);
 
 void stats_knet_add_handle(void);
 
+int totempg_get_node_stats (
+	unsigned int nodeid,
+	totempg_node_stats_t *stats);
+
+void stats_pg_add_node(unsigned int nodeid);
+
+void stats_pg_del_node(unsigned int nodeid);
+
 #define TOTEMPG_STATS_CLEAR_TOTEM     1
 #define TOTEMPG_STATS_CLEAR_TRANSPORT 2
 
@@ -38,8 +38,12 @@
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <errno.h>
 
 #include <corosync/corotypes.h>
@@ -53,12 +57,20 @@
 #include "util.h"
 #include <stdio.h>
 
+/*
+ * batch_buf holds the last cmap_iter_next_batch response, returned
+ * items point into it
+ */
 struct cmap_inst {
 	int finalize;
 	qb_ipcc_connection_t *c;
 	const void *context;
+	void *batch_buf;
 };
 
+#define CMAP_BATCH_BUF_SIZE	(64 * 1024)
+#define CMAP_PREFIX_BATCH_ITEMS	64
+
 struct cmap_track_inst {
 	void *user_data;
 	cmap_notify_fn_t notify_fn;
@@ -66,10 +78,27 @@ struct cmap_track_inst {
 	cmap_track_handle_t track_handle;
 };
 
+/*
+ * entries and items hold the copy of stats shared memory returned by
+ * the last cmap_stats_read
+ */
+struct cmap_stats_inst {
+	int fd;
+	const struct cmap_stats_shm_header *shm;
+	size_t shm_size;
+	struct cmap_stats_shm_entry *entries;
+	struct cmap_batch_item *items;
+	uint32_t entries_max;
+};
+
+#define CMAP_STATS_READ_TRIES	1000
+
 static void cmap_inst_free (void *inst);
+static void cmap_stats_inst_free (void *inst);
 
 DECLARE_HDB_DATABASE(cmap_handle_t_db, cmap_inst_free);
 DECLARE_HDB_DATABASE(cmap_track_handle_t_db,NULL);
+DECLARE_HDB_DATABASE(cmap_stats_handle_t_db, cmap_stats_inst_free);
 
 /*
  * Function prototypes
@@ -103,6 +132,7 @@ cs_error_t cmap_initialize (cmap_handle_t *handle)
 
 	error = CS_OK;
 	cmap_inst->finalize = 0;
+	cmap_inst->batch_buf = NULL;
 	cmap_inst->c = qb_ipcc_connect("cmap", IPC_REQUEST_SIZE);
 	if (cmap_inst->c == NULL) {
 		error = qb_to_cs_error(-errno);
@@ -168,6 +198,7 @@ static void cmap_inst_free (void *inst)
 {
 	struct cmap_inst *cmap_inst = (struct cmap_inst *)inst;
 	qb_ipcc_disconnect(cmap_inst->c);
+	free(cmap_inst->batch_buf);
 }
 
 cs_error_t cmap_finalize(cmap_handle_t handle)
@@ -935,6 +966,132 @@ cs_error_t cmap_iter_next(
 	return (error);
 }
 
+cs_error_t cmap_iter_next_batch(
+		cmap_handle_t handle,
+		cmap_iter_handle_t iter_handle,
+		struct cmap_batch_item *items,
+		size_t *items_len)
+{
+	cs_error_t error;
+	struct iovec iov;
+	struct cmap_inst *cmap_inst;
+	struct req_lib_cmap_iter_next_batch req_lib_cmap_iter_next_batch;
+	struct res_lib_cmap_iter_next_batch *res_lib_cmap_iter_next_batch;
+	const struct res_lib_cmap_batch_entry *entry;
+	size_t pos;
+	size_t entry_size;
+	uint32_t i;
+
+	if (items == NULL || items_len == NULL || *items_len == 0) {
+		return (CS_ERR_INVALID_PARAM);
+	}
+
+	error = hdb_error_to_cs(hdb_handle_get (&cmap_handle_t_db, handle, (void *)&cmap_inst));
+	if (error != CS_OK) {
+		return (error);
+	}
+
+	if (cmap_inst->batch_buf == NULL) {
+		cmap_inst->batch_buf = malloc(CMAP_BATCH_BUF_SIZE);
+		if (cmap_inst->batch_buf == NULL) {
+			error = CS_ERR_NO_MEMORY;
+			goto error_put;
+		}
+	}
+	res_lib_cmap_iter_next_batch = cmap_inst->batch_buf;
+
+	memset(&req_lib_cmap_iter_next_batch, 0, sizeof(req_lib_cmap_iter_next_batch));
+	req_lib_cmap_iter_next_batch.header.size = sizeof(req_lib_cmap_iter_next_batch);
+	req_lib_cmap_iter_next_batch.header.id = MESSAGE_REQ_CMAP_ITER_NEXT_BATCH;
+	req_lib_cmap_iter_next_batch.iter_handle = iter_handle;
+	req_lib_cmap_iter_next_batch.max_entries = (*items_len > UINT32_MAX ? UINT32_MAX : *items_len);
+	req_lib_cmap_iter_next_batch.max_size = CMAP_BATCH_BUF_SIZE;
+
+	iov.iov_base = (char *)&req_lib_cmap_iter_next_batch;
+	iov.iov_len = sizeof(req_lib_cmap_iter_next_batch);
+
+	error = qb_to_cs_error(qb_ipcc_sendv_recv(
+		cmap_inst->c,
+		&iov,
+		1,
+		res_lib_cmap_iter_next_batch,
+		CMAP_BATCH_BUF_SIZE, CS_IPC_TIMEOUT_MS));
+
+	if (error == CS_OK) {
+		error = res_lib_cmap_iter_next_batch->header.error;
+	}
+
+	if (error != CS_OK) {
+		goto error_put;
+	}
+
+	pos = sizeof(*res_lib_cmap_iter_next_batch);
+	for (i = 0; i < res_lib_cmap_iter_next_batch->entries && i < *items_len; i++) {
+		entry = (const struct res_lib_cmap_batch_entry *)((const char *)res_lib_cmap_iter_next_batch + pos);
+		entry_size = sizeof(*entry) + CMAP_BATCH_ALIGNED(entry->key_len + 1);
+
+		items[i].key_name = (const char *)entry + sizeof(*entry);
+		items[i].type = entry->type;
+		items[i].value_len = entry->value_len;
+		if (entry->flags & CMAP_BATCH_ENTRY_VALUE_INCLUDED) {
+			items[i].value = (const char *)entry + entry_size;
+			entry_size += CMAP_BATCH_ALIGNED(entry->value_len);
+		} else {
+			items[i].value = NULL;
+		}
+
+		pos += entry_size;
+	}
+	*items_len = i;
+
+error_put:
+	(void)hdb_handle_put (&cmap_handle_t_db, handle);
+
+	return (error);
+}
+
+cs_error_t cmap_get_prefix(
+		cmap_handle_t handle,
+		const char *prefix,
+		cmap_prefix_fn_t prefix_fn,
+		void *user_data)
+{
+	cs_error_t error;
+	cmap_iter_handle_t iter_handle;
+	struct cmap_batch_item items[CMAP_PREFIX_BATCH_ITEMS];
+	size_t items_len;
+	size_t i;
+
+	if (prefix_fn == NULL) {
+		return (CS_ERR_INVALID_PARAM);
+	}
+
+	error = cmap_iter_init(handle, prefix, &iter_handle);
+	if (error != CS_OK) {
+		return (error);
+	}
+
+	while (1) {
+		items_len = CMAP_PREFIX_BATCH_ITEMS;
+		error = cmap_iter_next_batch(handle, iter_handle, items, &items_len);
+		if (error != CS_OK) {
+			break;
+		}
+
+		for (i = 0; i < items_len; i++) {
+			prefix_fn(handle, &items[i], user_data);
+		}
+	}
+
+	(void)cmap_iter_finalize(handle, iter_handle);
+
+	if (error == CS_ERR_NO_SECTIONS) {
+		error = CS_OK;
+	}
+
+	return (error);
+}
+
 cs_error_t cmap_iter_finalize(
 		cmap_handle_t handle,
 		cmap_iter_handle_t iter_handle)
@@ -1117,3 +1274,222 @@ error_put:
 
 	return (error);
 }
+
+static void cmap_stats_inst_free (void *inst)
+{
+	struct cmap_stats_inst *cmap_stats_inst = (struct cmap_stats_inst *)inst;
+
+	if (cmap_stats_inst->shm != NULL) {
+		munmap((void *)cmap_stats_inst->shm, cmap_stats_inst->shm_size);
+	}
+	if (cmap_stats_inst->fd != -1) {
+		close(cmap_stats_inst->fd);
+	}
+	free(cmap_stats_inst->entries);
+	free(cmap_stats_inst->items);
+}
+
+/*
+ * Map whole stats file, it only grows when corosync needs more entries
+ */
+static cs_error_t cmap_stats_map(struct cmap_stats_inst *cmap_stats_inst)
+{
+	struct stat st;
+	void *addr;
+
+	if (fstat(cmap_stats_inst->fd, &st) == -1) {
+		return (qb_to_cs_error(-errno));
+	}
+	if (st.st_size < (off_t)sizeof(struct cmap_stats_shm_header)) {
+		return (CS_ERR_TRY_AGAIN);
+	}
+	if ((size_t)st.st_size == cmap_stats_inst->shm_size) {
+		return (CS_OK);
+	}
+
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, cmap_stats_inst->fd, 0);
+	if (addr == MAP_FAILED) {
+		return (qb_to_cs_error(-errno));
+	}
+
+	if (cmap_stats_inst->shm != NULL) {
+		munmap((void *)cmap_stats_inst->shm, cmap_stats_inst->shm_size);
+	}
+	cmap_stats_inst->shm = addr;
+	cmap_stats_inst->shm_size = st.st_size;
+
+	return (CS_OK);
+}
+
+cs_error_t cmap_stats_open(cmap_stats_handle_t *handle)
+{
+	cs_error_t error;
+	struct cmap_stats_inst *cmap_stats_inst;
+
+	error = hdb_error_to_cs(hdb_handle_create(&cmap_stats_handle_t_db, sizeof(*cmap_stats_inst), handle));
+	if (error != CS_OK) {
+		goto error_no_destroy;
+	}
+
+	error = hdb_error_to_cs(hdb_handle_get(&cmap_stats_handle_t_db, *handle, (void *)&cmap_stats_inst));
+	if (error != CS_OK) {
+		goto error_destroy;
+	}
+
+	memset(cmap_stats_inst, 0, sizeof(*cmap_stats_inst));
+	cmap_stats_inst->fd = open("/dev/shm/" CMAP_STATS_SHM_FILE, O_RDONLY | O_NOFOLLOW);
+	if (cmap_stats_inst->fd == -1 && errno == ENOENT) {
+		cmap_stats_inst->fd = open(LOCALSTATEDIR "/run/" CMAP_STATS_SHM_FILE, O_RDONLY | O_NOFOLLOW);
+	}
+	if (cmap_stats_inst->fd == -1) {
+		error = (errno == ENOENT ? CS_ERR_NOT_EXIST : qb_to_cs_error(-errno));
+		goto error_put_destroy;
+	}
+
+	error = cmap_stats_map(cmap_stats_inst);
+	if (error != CS_OK) {
+		goto error_put_destroy;
+	}
+
+	if (__atomic_load_n(&cmap_stats_inst->shm->magic, __ATOMIC_ACQUIRE) != CMAP_STATS_SHM_MAGIC) {
+		error = CS_ERR_TRY_AGAIN;
+		goto error_put_destroy;
+	}
+	if (cmap_stats_inst->shm->version != CMAP_STATS_SHM_VERSION) {
+		error = CS_ERR_NOT_SUPPORTED;
+		goto error_put_destroy;
+	}
+
+	(void)hdb_handle_put(&cmap_stats_handle_t_db, *handle);
+
+	return (CS_OK);
+
+error_put_destroy:
+	(void)hdb_handle_put(&cmap_stats_handle_t_db, *handle);
+error_destroy:
+	(void)hdb_handle_destroy(&cmap_stats_handle_t_db, *handle);
+error_no_destroy:
+	return (error);
+}
+
+cs_error_t cmap_stats_read(
+	cmap_stats_handle_t handle,
+	const struct cmap_batch_item **items,
+	size_t *items_len,
+	uint64_t *update_time)
+{
+	cs_error_t error;
+	struct cmap_stats_inst *cmap_stats_inst;
+	const struct cmap_stats_shm_header *shm;
+	struct cmap_stats_shm_entry *entry;
+	uint32_t seq;
+	uint32_t entries;
+	uint64_t shm_update_time;
+	void *buf;
+	uint32_t i;
+	int tries;
+
+	if (items == NULL || items_len == NULL) {
+		return (CS_ERR_INVALID_PARAM);
+	}
+
+	error = hdb_error_to_cs(hdb_handle_get(&cmap_stats_handle_t_db, handle, (void *)&cmap_stats_inst));
+	if (error != CS_OK) {
+		return (error);
+	}
+
+	/*
+	 * Seqlock read side, corosync never waits for readers
+	 */
+	error = CS_ERR_TRY_AGAIN;
+	for (tries = 0; tries < CMAP_STATS_READ_TRIES; tries++) {
+		shm = cmap_stats_inst->shm;
+		seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+
+		if (shm->magic != CMAP_STATS_SHM_MAGIC) {
+			error = CS_ERR_LIBRARY;
+			break;
+		}
+
+		entries = shm->entries;
+		shm_update_time = shm->update_time;
+		if (CMAP_STATS_SHM_SIZE(entries) > cmap_stats_inst->shm_size) {
+			/* Either segment has grown or entries is torn, retry in both cases */
+			error = cmap_stats_map(cmap_stats_inst);
+			if (error != CS_OK) {
+				break;
+			}
+			error = CS_ERR_TRY_AGAIN;
+			continue;
+		}
+
+		if (entries > cmap_stats_inst->entries_max) {
+			buf = realloc(cmap_stats_inst->entries, entries * sizeof(struct cmap_stats_shm_entry));
+			if (buf == NULL) {
+				error = CS_ERR_NO_MEMORY;
+				break;
+			}
+			cmap_stats_inst->entries = buf;
+			buf = realloc(cmap_stats_inst->items, entries * sizeof(struct cmap_batch_item));
+			if (buf == NULL) {
+				error = CS_ERR_NO_MEMORY;
+				break;
+			}
+			cmap_stats_inst->items = buf;
+			cmap_stats_inst->entries_max = entries;
+		}
+
+		memcpy(cmap_stats_inst->entries, shm->entry, entries * sizeof(struct cmap_stats_shm_entry));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq) {
+			error = CS_OK;
+			break;
+		}
+	}
+
+	if (error == CS_OK) {
+		for (i = 0; i < entries; i++) {
+			entry = &cmap_stats_inst->entries[i];
+			entry->key_name[CMAP_STATS_SHM_KEY_LEN - 1] = '\0';
+			if (entry->value_len > CMAP_STATS_SHM_VALUE_LEN) {
+				entry->value_len = 0;
+			}
+
+			cmap_stats_inst->items[i].key_name = entry->key_name;
+			cmap_stats_inst->items[i].type = entry->type;
+			cmap_stats_inst->items[i].value_len = entry->value_len;
+			cmap_stats_inst->items[i].value = (entry->value_len ? entry->value : NULL);
+		}
+
+		*items = cmap_stats_inst->items;
+		*items_len = entries;
+		if (update_time != NULL) {
+			*update_time = shm_update_time;
+		}
+	}
+
+	(void)hdb_handle_put(&cmap_stats_handle_t_db, handle);
+
+	return (error);
+}
+
+cs_error_t cmap_stats_close(cmap_stats_handle_t handle)
+{
+	cs_error_t error;
+	struct cmap_stats_inst *cmap_stats_inst;
+
+	error = hdb_error_to_cs(hdb_handle_get(&cmap_stats_handle_t_db, handle, (void *)&cmap_stats_inst));
+	if (error != CS_OK) {
+		return (error);
+	}
+
+	(void)hdb_handle_destroy(&cmap_stats_handle_t_db, handle);
+	(void)hdb_handle_put(&cmap_stats_handle_t_db, handle);
+
+	return (CS_OK);
+}
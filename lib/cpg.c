@@ -49,6 +49,7 @@
 #include <sys/mman.h>
 #include <sys/uio.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
 
@@ -75,11 +76,47 @@
  */
 #define MAX_RETRIES 100
 
+/*
+ * Seals of zero copy buffer memfd. corosync maps it too, so it must not
+ * change size while mapped.
+ */
+#define CPG_MEMORY_MAP_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+/*
+ * Number of buckets of hash of messages being assembled
+ */
+#define CPG_ASSEMBLY_HASH_SIZE 64
+
+struct cpg_zcb_mapping
+{
+	struct qb_list_head list;
+	void *addr;
+	size_t map_size;
+};
+
+/*
+ * Buffer not shared with corosync (no memfd support) has zero server_address
+ */
+static void cpg_zcb_mapping_free (struct cpg_zcb_mapping *zcb_mapping)
+{
+	struct cpg_zc_header *hdr = zcb_mapping->addr;
+
+	qb_list_del (&zcb_mapping->list);
+	if (hdr->server_address == 0) {
+		free (zcb_mapping->addr);
+	} else {
+		munmap (zcb_mapping->addr, zcb_mapping->map_size);
+	}
+	free (zcb_mapping);
+}
+
 struct cpg_assembly_data
 {
 	struct qb_list_head list;
 	uint32_t nodeid;
 	uint32_t pid;
+	uint32_t msglen;
+	int streaming; /* passed to cpg_deliver_fragment_fn, assembly_buf is NULL */
 	char *assembly_buf;
 	uint32_t assembly_buf_ptr;
 };
@@ -89,12 +126,22 @@ struct cpg_inst {
 	int finalize;
 	void *context;
 	cpg_model_t model;
+	/*
+	 * V2 data starts with the V1 fields, so model_v1_data is valid for both
+	 */
 	union {
 		cpg_model_v1_data_t model_v1_data;
+		cpg_model_v2_data_t model_v2_data;
 	};
 	struct qb_list_head iteration_list_head;
 	uint32_t max_msg_size;
-	struct qb_list_head assembly_list_head;
+	/*
+	 * 0 - not known yet, 1 - corosync supports windowed fragmented send,
+	 * -1 - it doesn't, fragments are sent one by one
+	 */
+	int partial_windowed;
+	struct qb_list_head assembly_hash[CPG_ASSEMBLY_HASH_SIZE];
+	struct qb_list_head zcb_mapping_list_head;
 };
 static void cpg_inst_free (void *inst);
 
@@ -126,6 +173,60 @@ coroipcc_msg_send_reply_receive (
 				CS_IPC_TIMEOUT_MS));
 }
 
+static unsigned int cpg_assembly_hash_bucket (uint32_t nodeid, uint32_t pid)
+{
+	return ((nodeid * 31 + pid) % CPG_ASSEMBLY_HASH_SIZE);
+}
+
+static struct cpg_assembly_data *cpg_assembly_find (
+	struct cpg_inst *cpg_inst,
+	uint32_t nodeid,
+	uint32_t pid)
+{
+	struct qb_list_head *iter;
+	struct cpg_assembly_data *assembly_data;
+
+	qb_list_for_each(iter, &cpg_inst->assembly_hash[cpg_assembly_hash_bucket (nodeid, pid)]) {
+		assembly_data = qb_list_entry (iter, struct cpg_assembly_data, list);
+		if (assembly_data->nodeid == nodeid && assembly_data->pid == pid) {
+			return (assembly_data);
+		}
+	}
+
+	return (NULL);
+}
+
+static void cpg_assembly_free (struct cpg_assembly_data *assembly_data)
+{
+	qb_list_del (&assembly_data->list);
+	free (assembly_data->assembly_buf);
+	free (assembly_data);
+}
+
+/*
+ * Drop incomplete message, application streaming it is told so
+ */
+static void cpg_assembly_abort (
+	cpg_handle_t handle,
+	const struct cpg_inst *cpg_inst,
+	const struct cpg_name *group_name,
+	struct cpg_assembly_data *assembly_data)
+{
+	if (assembly_data->streaming && cpg_inst->model_v2_data.cpg_deliver_fragment_fn != NULL) {
+		cpg_inst->model_v2_data.cpg_deliver_fragment_fn (handle,
+			group_name,
+			assembly_data->nodeid,
+			assembly_data->pid,
+			NULL,
+			0,
+			assembly_data->assembly_buf_ptr,
+			assembly_data->msglen,
+			CPG_FRAGMENT_ABORT);
+	}
+
+	cpg_assembly_free (assembly_data);
+}
+
 static void cpg_iteration_instance_finalize (struct cpg_iteration_instance_t *cpg_iteration_instance)
 {
 	qb_list_del (&cpg_iteration_instance->list);
@@ -135,7 +236,26 @@ static void cpg_iteration_instance_finalize (struct cpg_iteration_instance_t *cp
 static void cpg_inst_free (void *inst)
 {
 	struct cpg_inst *cpg_inst = (struct cpg_inst *)inst;
+	struct qb_list_head *iter, *tmp_iter;
+	struct cpg_zcb_mapping *zcb_mapping;
+	int i;
+
 	qb_ipcc_disconnect(cpg_inst->c);
+
+	for (i = 0; i < CPG_ASSEMBLY_HASH_SIZE; i++) {
+		qb_list_for_each_safe(iter, tmp_iter, &(cpg_inst->assembly_hash[i])) {
+			cpg_assembly_free (qb_list_entry (iter, struct cpg_assembly_data, list));
+		}
+	}
+
+	/*
+	 * Server side mappings are released together with connection
+	 */
+	qb_list_for_each_safe(iter, tmp_iter, &(cpg_inst->zcb_mapping_list_head)) {
+		zcb_mapping = qb_list_entry (iter, struct cpg_zcb_mapping, list);
+
+		cpg_zcb_mapping_free (zcb_mapping);
+	}
 }
 
 static void cpg_inst_finalize (struct cpg_inst *cpg_inst, hdb_handle_t handle)
@@ -185,8 +305,9 @@ cs_error_t cpg_model_initialize (
 {
 	cs_error_t error;
 	struct cpg_inst *cpg_inst;
+	int i;
 
-	if (model != CPG_MODEL_V1) {
+	if (model != CPG_MODEL_V1 && model != CPG_MODEL_V2) {
 		error = CS_ERR_INVALID_PARAM;
 		goto error_no_destroy;
 	}
@@ -211,23 +332,32 @@ cs_error_t cpg_model_initialize (
 		switch (model) {
 		case CPG_MODEL_V1:
 			memcpy (&cpg_inst->model_v1_data, model_data, sizeof (cpg_model_v1_data_t));
-			if ((cpg_inst->model_v1_data.flags & ~(CPG_MODEL_V1_DELIVER_INITIAL_TOTEM_CONF)) != 0) {
-				error = CS_ERR_INVALID_PARAM;
-
-				goto error_destroy;
-			}
 			break;
+		case CPG_MODEL_V2:
+			memcpy (&cpg_inst->model_v2_data, model_data, sizeof (cpg_model_v2_data_t));
+			break;
+		}
+		if ((cpg_inst->model_v1_data.flags & ~(CPG_MODEL_V1_DELIVER_INITIAL_TOTEM_CONF |
+		    CPG_MODEL_V1_DELIVER_COALESCE)) != 0) {
+			error = CS_ERR_INVALID_PARAM;
+
+			goto error_destroy;
 		}
 	}
 
 	/* Allow space for corosync internal headers */
 	cpg_inst->max_msg_size = IPC_REQUEST_SIZE - 1024;
+	cpg_inst->partial_windowed = 0;
 	cpg_inst->model = model;
 	cpg_inst->context = context;
 
 	qb_list_init(&cpg_inst->iteration_list_head);
 
-	qb_list_init(&cpg_inst->assembly_list_head);
+	for (i = 0; i < CPG_ASSEMBLY_HASH_SIZE; i++) {
+		qb_list_init(&cpg_inst->assembly_hash[i]);
+	}
+
+	qb_list_init(&cpg_inst->zcb_mapping_list_head);
 
 	hdb_handle_put (&cpg_handle_t_db, *handle);
 
@@ -372,6 +502,7 @@ cs_error_t cpg_dispatch (
 	struct cpg_inst *cpg_inst;
 	struct res_lib_cpg_confchg_callback *res_cpg_confchg_callback;
 	struct res_lib_cpg_deliver_callback *res_cpg_deliver_callback;
+	struct res_lib_cpg_deliver_batch_callback *res_cpg_deliver_batch_callback;
 	struct res_lib_cpg_partial_deliver_callback *res_cpg_partial_deliver_callback;
 	struct res_lib_cpg_totem_confchg_callback *res_cpg_totem_confchg_callback;
 	struct cpg_inst cpg_inst_copy;
@@ -381,10 +512,11 @@ cs_error_t cpg_dispatch (
 	struct cpg_address joined_list[CPG_MEMBERS_MAX];
 	struct cpg_name group_name;
 	struct cpg_assembly_data *assembly_data;
-	struct qb_list_head *iter, *tmp_iter;
+	unsigned int fragment_flags;
 	mar_cpg_address_t *left_list_start;
 	mar_cpg_address_t *joined_list_start;
 	unsigned int i;
+	size_t batch_offset;
 	struct cpg_ring_id ring_id;
 	uint32_t totem_member_list[CPG_MEMBERS_MAX];
 	int32_t errno_res;
@@ -440,6 +572,7 @@ cs_error_t cpg_dispatch (
 		 */
 		memcpy (&cpg_inst_copy, cpg_inst, sizeof (struct cpg_inst));
 		switch (cpg_inst_copy.model) {
+		case CPG_MODEL_V2:
 		case CPG_MODEL_V1:
 			/*
 			 * Dispatch incoming message
@@ -464,6 +597,49 @@ cs_error_t cpg_dispatch (
 					res_cpg_deliver_callback->msglen);
 				break;
 
+			case MESSAGE_RES_CPG_DELIVER_BATCH_CALLBACK:
+				if (cpg_inst_copy.model_v1_data.cpg_deliver_fn == NULL) {
+					break;
+				}
+
+				/*
+				 * Several deliveries coalesced into one event, each one is
+				 * still handed to the application by its own callback
+				 */
+				res_cpg_deliver_batch_callback = (struct res_lib_cpg_deliver_batch_callback *)dispatch_data;
+				batch_offset = sizeof (struct res_lib_cpg_deliver_batch_callback);
+
+				for (i = 0; i < res_cpg_deliver_batch_callback->entries; i++) {
+					res_cpg_deliver_callback = (struct res_lib_cpg_deliver_callback *)
+					    ((char *)dispatch_data + batch_offset);
+
+					if (batch_offset + sizeof (struct res_lib_cpg_deliver_callback) > dispatch_data->size ||
+					    res_cpg_deliver_callback->header.size < sizeof (struct res_lib_cpg_deliver_callback) +
+					    res_cpg_deliver_callback->msglen ||
+					    batch_offset + res_cpg_deliver_callback->header.size > dispatch_data->size) {
+						error = CS_ERR_LIBRARY;
+						goto error_put;
+					}
+
+					marshall_from_mar_cpg_name_t (
+						&group_name,
+						&res_cpg_deliver_callback->group_name);
+
+					cpg_inst_copy.model_v1_data.cpg_deliver_fn (handle,
+						&group_name,
+						res_cpg_deliver_callback->nodeid,
+						res_cpg_deliver_callback->pid,
+						&res_cpg_deliver_callback->message,
+						res_cpg_deliver_callback->msglen);
+
+					if (cpg_inst->finalize) {
+						break;
+					}
+
+					batch_offset += res_cpg_deliver_callback->header.size;
+				}
+				break;
+
 			case MESSAGE_RES_CPG_PARTIAL_DELIVER_CALLBACK:
 				res_cpg_partial_deliver_callback = (struct res_lib_cpg_partial_deliver_callback *)dispatch_data;
 
@@ -471,17 +647,9 @@ cs_error_t cpg_dispatch (
 					&group_name,
 					&res_cpg_partial_deliver_callback->group_name);
 
-				/*
-				 * Search for assembly data for current messages (nodeid, pid) pair in list of assemblies
-				 */
-				assembly_data = NULL;
-				qb_list_for_each(iter, &(cpg_inst->assembly_list_head)) {
-					struct cpg_assembly_data *current_assembly_data = qb_list_entry (iter, struct cpg_assembly_data, list);
-					if (current_assembly_data->nodeid == res_cpg_partial_deliver_callback->nodeid && current_assembly_data->pid == res_cpg_partial_deliver_callback->pid) {
-						assembly_data = current_assembly_data;
-						break;
-					}
-				}
+				assembly_data = cpg_assembly_find (cpg_inst,
+					res_cpg_partial_deliver_callback->nodeid,
+					res_cpg_partial_deliver_callback->pid);
 
 				if (res_cpg_partial_deliver_callback->type == LIBCPG_PARTIAL_FIRST) {
 
@@ -491,9 +659,7 @@ cs_error_t cpg_dispatch (
 					 * been reported to sending client. Therefore here last assembly will be dropped.
 					 */
 					if (assembly_data) {
-						qb_list_del (&assembly_data->list);
-						free(assembly_data->assembly_buf);
-						free(assembly_data);
+						cpg_assembly_abort (handle, &cpg_inst_copy, &group_name, assembly_data);
 						// coverity[UNUSED_VALUE:SUPPRESS] defensive programming
 						assembly_data = NULL;
 					}
@@ -506,24 +672,68 @@ cs_error_t cpg_dispatch (
 
 					assembly_data->nodeid = res_cpg_partial_deliver_callback->nodeid;
 					assembly_data->pid = res_cpg_partial_deliver_callback->pid;
-					assembly_data->assembly_buf = malloc(res_cpg_partial_deliver_callback->msglen);
-					if (!assembly_data->assembly_buf) {
-						free(assembly_data);
-						error = CS_ERR_NO_MEMORY;
-						goto error_put;
+					assembly_data->msglen = res_cpg_partial_deliver_callback->msglen;
+					assembly_data->assembly_buf = NULL;
+					assembly_data->streaming =
+						(cpg_inst_copy.model == CPG_MODEL_V2 &&
+						 cpg_inst_copy.model_v2_data.cpg_deliver_fragment_fn != NULL);
+
+					/*
+					 * Streaming application gets fragments as they arrive,
+					 * so whole message is never kept
+					 */
+					if (!assembly_data->streaming) {
+						assembly_data->assembly_buf = malloc(res_cpg_partial_deliver_callback->msglen);
+						if (!assembly_data->assembly_buf) {
+							free(assembly_data);
+							error = CS_ERR_NO_MEMORY;
+							goto error_put;
+						}
 					}
 					assembly_data->assembly_buf_ptr = 0;
 					qb_list_init (&assembly_data->list);
 
-					qb_list_add (&assembly_data->list, &cpg_inst->assembly_list_head);
+					qb_list_add (&assembly_data->list,
+						&cpg_inst->assembly_hash[cpg_assembly_hash_bucket (assembly_data->nodeid,
+						assembly_data->pid)]);
 				}
 				if (assembly_data) {
-					memcpy(assembly_data->assembly_buf + assembly_data->assembly_buf_ptr,
-						res_cpg_partial_deliver_callback->message, res_cpg_partial_deliver_callback->fraglen);
+					if (res_cpg_partial_deliver_callback->fraglen >
+					    assembly_data->msglen - assembly_data->assembly_buf_ptr) {
+						/*
+						 * Fragments don't match announced message length
+						 */
+						cpg_assembly_abort (handle, &cpg_inst_copy, &group_name, assembly_data);
+						break;
+					}
+
+					if (assembly_data->streaming) {
+						fragment_flags = 0;
+						if (assembly_data->assembly_buf_ptr == 0) {
+							fragment_flags |= CPG_FRAGMENT_FIRST;
+						}
+						if (res_cpg_partial_deliver_callback->type == LIBCPG_PARTIAL_LAST) {
+							fragment_flags |= CPG_FRAGMENT_LAST;
+						}
+
+						cpg_inst_copy.model_v2_data.cpg_deliver_fragment_fn (handle,
+							&group_name,
+							res_cpg_partial_deliver_callback->nodeid,
+							res_cpg_partial_deliver_callback->pid,
+							res_cpg_partial_deliver_callback->message,
+							res_cpg_partial_deliver_callback->fraglen,
+							assembly_data->assembly_buf_ptr,
+							assembly_data->msglen,
+							fragment_flags);
+					} else {
+						memcpy(assembly_data->assembly_buf + assembly_data->assembly_buf_ptr,
+							res_cpg_partial_deliver_callback->message, res_cpg_partial_deliver_callback->fraglen);
+					}
 					assembly_data->assembly_buf_ptr += res_cpg_partial_deliver_callback->fraglen;
 
 					if (res_cpg_partial_deliver_callback->type == LIBCPG_PARTIAL_LAST) {
-						if (cpg_inst_copy.model_v1_data.cpg_deliver_fn != NULL) {
+						if (!assembly_data->streaming &&
+						    cpg_inst_copy.model_v1_data.cpg_deliver_fn != NULL) {
 							cpg_inst_copy.model_v1_data.cpg_deliver_fn (handle,
 								&group_name,
 								res_cpg_partial_deliver_callback->nodeid,
@@ -532,9 +742,7 @@ cs_error_t cpg_dispatch (
 								res_cpg_partial_deliver_callback->msglen);
 						}
 
-						qb_list_del (&assembly_data->list);
-						free(assembly_data->assembly_buf);
-						free(assembly_data);
+						cpg_assembly_free (assembly_data);
 					}
 				}
 				break;
@@ -580,14 +788,9 @@ cs_error_t cpg_dispatch (
 				 * If member left while his partial packet was being assembled, assembly data must be removed from list
 				 */
 				for (i = 0; i < res_cpg_confchg_callback->left_list_entries; i++) {
-					qb_list_for_each_safe(iter, tmp_iter, &(cpg_inst->assembly_list_head)) {
-						struct cpg_assembly_data *current_assembly_data = qb_list_entry (iter, struct cpg_assembly_data, list);
-						if (current_assembly_data->nodeid != left_list[i].nodeid || current_assembly_data->pid != left_list[i].pid)
-							continue;
-
-						qb_list_del (&current_assembly_data->list);
-						free(current_assembly_data->assembly_buf);
-						free(current_assembly_data);
+					assembly_data = cpg_assembly_find (cpg_inst, left_list[i].nodeid, left_list[i].pid);
+					if (assembly_data) {
+						cpg_assembly_abort (handle, &cpg_inst_copy, &group_name, assembly_data);
 					}
 				}
 
@@ -614,7 +817,7 @@ cs_error_t cpg_dispatch (
 				goto error_put;
 				break;
 			} /* - switch (dispatch_data->id) */
-			break; /* case CPG_MODEL_V1 */
+			break; /* case CPG_MODEL_V1, CPG_MODEL_V2 */
 		} /* - switch (cpg_inst_copy.model) */
 
 		if (cpg_inst_copy.finalize || cpg_inst->finalize) {
@@ -666,6 +869,7 @@ cs_error_t cpg_join (
 
 	switch (cpg_inst->model) {
 	case CPG_MODEL_V1:
+	case CPG_MODEL_V2:
 		req_lib_cpg_join.flags = cpg_inst->model_v1_data.flags;
 		break;
 	}
@@ -858,21 +1062,175 @@ cs_error_t cpg_flow_control_state_get (
 	return (error);
 }
 
+#ifdef HAVE_MEMFD_CREATE
+/*
+ * Create sealed anonymous memory of given size and map it. Returned fd is
+ * kept open until corosync maps the memory too.
+ */
+static int
+memory_map (const char *name, void **buf, size_t bytes)
+{
+	int32_t fd;
+	void *addr;
+	int32_t res;
+
+	fd = memfd_create (name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd == -1) {
+		return (-1);
+	}
+
+	res = ftruncate (fd, bytes);
+	if (res == -1) {
+		goto error_close;
+	}
+
+	res = fcntl (fd, F_ADD_SEALS, CPG_MEMORY_MAP_SEALS);
+	if (res == -1) {
+		goto error_close;
+	}
+
+	addr = mmap (NULL, bytes, PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+
+	if (addr == MAP_FAILED) {
+		goto error_close;
+	}
+#ifdef MADV_NOSYNC
+	madvise(addr, bytes, MADV_NOSYNC);
+#endif
+
+	*buf = addr;
+
+	return (fd);
+
+error_close:
+	close (fd);
+	return -1;
+}
+#endif
+
+static struct cpg_zc_header *cpg_zcb_header_get (void *buffer)
+{
+	return ((struct cpg_zc_header *)((char *)buffer -
+	    sizeof (struct req_lib_cpg_mcast) - sizeof (struct cpg_zc_header)));
+}
+
 /*
- * Dummy-ish function that just allocates some memory for the user
+ * Allocate buffer backed by memory shared with corosync. Message stored in it
+ * is passed to totem directly from this mapping, without copying it into the
+ * IPC request ring. Without memfd support buffer is plain memory and
+ * message is sent by cpg_mcast_joined.
  */
 cs_error_t cpg_zcb_alloc (
 	cpg_handle_t handle,
 	size_t size,
 	void **buffer)
 {
-	int error = CS_OK;
+	void *buf = NULL;
+	int fd = -1;
+	struct req_lib_cpg_zc_alloc req_lib_cpg_zc_alloc;
+	struct res_lib_cpg_zc_alloc res_lib_cpg_zc_alloc;
+	struct cpg_zcb_mapping *zcb_mapping;
+	size_t map_size;
+	struct iovec iovec;
+	struct cpg_zc_header *hdr;
+	cs_error_t error;
+	struct cpg_inst *cpg_inst;
+
+	if (buffer == NULL) {
+		return (CS_ERR_INVALID_PARAM);
+	}
+
+	error = hdb_error_to_cs (hdb_handle_get (&cpg_handle_t_db, handle, (void *)&cpg_inst));
+	if (error != CS_OK) {
+		return (error);
+	}
+
+	zcb_mapping = malloc (sizeof (struct cpg_zcb_mapping));
+	if (zcb_mapping == NULL) {
+		error = CS_ERR_NO_MEMORY;
+		goto error_put;
+	}
+
+	map_size = size + sizeof (struct req_lib_cpg_mcast) + sizeof (struct cpg_zc_header);
+
+#ifdef HAVE_MEMFD_CREATE
+	fd = memory_map ("corosync_zerocopy", &buf, map_size);
+#endif
+	if (fd == -1) {
+		goto local;
+	}
+
+	memset (&req_lib_cpg_zc_alloc, 0, sizeof (req_lib_cpg_zc_alloc));
+	req_lib_cpg_zc_alloc.header.size = sizeof (struct req_lib_cpg_zc_alloc);
+	req_lib_cpg_zc_alloc.header.id = MESSAGE_REQ_CPG_ZC_ALLOC;
+	req_lib_cpg_zc_alloc.map_size = map_size;
+	req_lib_cpg_zc_alloc.fd = fd;
+
+	iovec.iov_base = (void *)&req_lib_cpg_zc_alloc;
+	iovec.iov_len = sizeof (struct req_lib_cpg_zc_alloc);
+
+	error = coroipcc_msg_send_reply_receive (
+		cpg_inst->c,
+		&iovec,
+		1,
+		&res_lib_cpg_zc_alloc,
+		sizeof (struct res_lib_cpg_zc_alloc));
+
+	if (error == CS_OK) {
+		error = res_lib_cpg_zc_alloc.header.error;
+	}
+
+	/*
+	 * corosync holds its own reference to the memory now
+	 */
+	close (fd);
+
+	if (error == CS_ERR_NO_RESOURCES) {
+		/*
+		 * corosync already maps CPG_ZC_MAPPINGS_MAX buffers for us
+		 */
+		munmap (buf, map_size);
+		goto local;
+	}
+	if (error != CS_OK) {
+		goto error_unmap;
+	}
+	goto mapped;
 
-	*buffer = malloc(size);
-	if (*buffer == NULL) {
+local:
+	/*
+	 * No memory to share, buffer is only local
+	 */
+	buf = malloc (map_size);
+	if (buf == NULL) {
 		error = CS_ERR_NO_MEMORY;
+		goto error_free;
 	}
+	res_lib_cpg_zc_alloc.server_address = 0;
 
+mapped:
+	hdr = (struct cpg_zc_header *)buf;
+	hdr->map_size = map_size;
+	hdr->server_address = res_lib_cpg_zc_alloc.server_address;
+
+	zcb_mapping->addr = buf;
+	zcb_mapping->map_size = map_size;
+	qb_list_init (&zcb_mapping->list);
+	qb_list_add (&zcb_mapping->list, &cpg_inst->zcb_mapping_list_head);
+
+	*buffer = ((char *)buf) + sizeof (struct cpg_zc_header) + sizeof (struct req_lib_cpg_mcast);
+
+	hdb_handle_put (&cpg_handle_t_db, handle);
+
+	return (CS_OK);
+
+error_unmap:
+	munmap (buf, map_size);
+error_free:
+	free (zcb_mapping);
+error_put:
+	hdb_handle_put (&cpg_handle_t_db, handle);
 	return (error);
 }
 
@@ -880,8 +1238,69 @@ cs_error_t cpg_zcb_free (
 	cpg_handle_t handle,
 	void *buffer)
 {
-	free(buffer);
-	return (CS_OK);
+	cs_error_t error;
+	struct cpg_inst *cpg_inst;
+	struct req_lib_cpg_zc_free req_lib_cpg_zc_free;
+	struct res_lib_cpg_zc_free res_lib_cpg_zc_free;
+	struct cpg_zcb_mapping *zcb_mapping;
+	struct qb_list_head *iter;
+	struct cpg_zc_header *header;
+	struct iovec iovec;
+
+	error = hdb_error_to_cs (hdb_handle_get (&cpg_handle_t_db, handle, (void *)&cpg_inst));
+	if (error != CS_OK) {
+		return (error);
+	}
+
+	header = cpg_zcb_header_get (buffer);
+
+	zcb_mapping = NULL;
+	qb_list_for_each(iter, &(cpg_inst->zcb_mapping_list_head)) {
+		struct cpg_zcb_mapping *current_zcb_mapping = qb_list_entry (iter, struct cpg_zcb_mapping, list);
+
+		if (current_zcb_mapping->addr == (void *)header) {
+			zcb_mapping = current_zcb_mapping;
+			break;
+		}
+	}
+
+	if (zcb_mapping == NULL) {
+		error = CS_ERR_INVALID_PARAM;
+		goto error_put;
+	}
+
+	if (header->server_address == 0) {
+		cpg_zcb_mapping_free (zcb_mapping);
+		goto error_put;
+	}
+
+	req_lib_cpg_zc_free.header.size = sizeof (struct req_lib_cpg_zc_free);
+	req_lib_cpg_zc_free.header.id = MESSAGE_REQ_CPG_ZC_FREE;
+	req_lib_cpg_zc_free.map_size = zcb_mapping->map_size;
+	req_lib_cpg_zc_free.server_address = header->server_address;
+
+	iovec.iov_base = (void *)&req_lib_cpg_zc_free;
+	iovec.iov_len = sizeof (struct req_lib_cpg_zc_free);
+
+	error = coroipcc_msg_send_reply_receive (cpg_inst->c,
+		&iovec,
+		1,
+		&res_lib_cpg_zc_free,
+		sizeof (struct res_lib_cpg_zc_free));
+
+	if (error == CS_OK) {
+		error = res_lib_cpg_zc_free.header.error;
+	}
+
+	/*
+	 * Local mapping is released even if server failed, buffer is unusable anyway
+	 */
+	cpg_zcb_mapping_free (zcb_mapping);
+
+error_put:
+	hdb_handle_put (&cpg_handle_t_db, handle);
+
+	return (error);
 }
 
 cs_error_t cpg_zcb_mcast_joined (
@@ -890,15 +1309,242 @@ cs_error_t cpg_zcb_mcast_joined (
 	void *msg,
 	size_t msg_len)
 {
-	struct iovec iov[1];
+	cs_error_t error;
+	struct cpg_inst *cpg_inst;
+	struct req_lib_cpg_mcast *req_lib_cpg_mcast;
+	struct req_lib_cpg_zc_execute req_lib_cpg_zc_execute;
+	struct res_lib_cpg_zc_execute res_lib_cpg_zc_execute;
+	struct cpg_zc_header *hdr;
+	struct iovec iovec;
+
+	error = hdb_error_to_cs (hdb_handle_get (&cpg_handle_t_db, handle, (void *)&cpg_inst));
+	if (error != CS_OK) {
+		return (error);
+	}
+
+	hdr = cpg_zcb_header_get (msg);
+
+	if (msg_len > hdr->map_size - sizeof (struct cpg_zc_header) - sizeof (struct req_lib_cpg_mcast)) {
+		error = CS_ERR_INVALID_PARAM;
+		goto error_exit;
+	}
+
+	if (msg_len > cpg_inst->max_msg_size || hdr->server_address == 0) {
+		/*
+		 * Message is too big to be delivered as one piece, let regular
+		 * path fragment it. Buffer not shared with corosync is sent
+		 * the regular way too.
+		 */
+		hdb_handle_put (&cpg_handle_t_db, handle);
 
-	iov[0].iov_base = msg;
-	iov[0].iov_len = msg_len;
+		iovec.iov_base = msg;
+		iovec.iov_len = msg_len;
 
-	return cpg_mcast_joined(handle, guarantee, iov, 1);
+		return (cpg_mcast_joined (handle, guarantee, &iovec, 1));
+	}
+
+	req_lib_cpg_mcast = (struct req_lib_cpg_mcast *)((char *)hdr + sizeof (struct cpg_zc_header));
+	req_lib_cpg_mcast->header.size = sizeof (struct req_lib_cpg_mcast) + msg_len;
+	req_lib_cpg_mcast->header.id = MESSAGE_REQ_CPG_MCAST;
+	req_lib_cpg_mcast->guarantee = guarantee;
+	req_lib_cpg_mcast->msglen = msg_len;
+
+	req_lib_cpg_zc_execute.header.size = sizeof (struct req_lib_cpg_zc_execute);
+	req_lib_cpg_zc_execute.header.id = MESSAGE_REQ_CPG_ZC_EXECUTE;
+	req_lib_cpg_zc_execute.server_address = hdr->server_address;
+
+	iovec.iov_base = (void *)&req_lib_cpg_zc_execute;
+	iovec.iov_len = sizeof (struct req_lib_cpg_zc_execute);
+
+	/*
+	 * Reply is needed so caller knows buffer may be reused
+	 */
+	qb_ipcc_fc_enable_max_set(cpg_inst->c,  2);
+	error = coroipcc_msg_send_reply_receive (cpg_inst->c,
+		&iovec,
+		1,
+		&res_lib_cpg_zc_execute,
+		sizeof (struct res_lib_cpg_zc_execute));
+	qb_ipcc_fc_enable_max_set(cpg_inst->c,  1);
+
+	if (error == CS_OK) {
+		error = res_lib_cpg_zc_execute.header.error;
+	}
+
+error_exit:
+	hdb_handle_put (&cpg_handle_t_db, handle);
+
+	return (error);
 }
 
-static cs_error_t send_fragments (
+/*
+ * Receive one acknowledgement of windowed fragmented send
+ */
+static cs_error_t partial_send_ack_recv (struct cpg_inst *cpg_inst)
+{
+	struct res_lib_cpg_partial_send res_lib_cpg_partial_send;
+	ssize_t res;
+
+	res = qb_ipcc_recv (cpg_inst->c, &res_lib_cpg_partial_send,
+			    sizeof (res_lib_cpg_partial_send), CS_IPC_TIMEOUT_MS);
+	if (res < 0) {
+		return (qb_to_cs_error (res));
+	}
+	if (res != sizeof (res_lib_cpg_partial_send) ||
+	    res_lib_cpg_partial_send.header.id != MESSAGE_RES_CPG_PARTIAL_SEND) {
+		return (CS_ERR_LIBRARY);
+	}
+
+	return (res_lib_cpg_partial_send.header.error);
+}
+
+/*
+ * Fragments are streamed without waiting for reply, corosync acknowledges
+ * every CPG_PARTIAL_MCAST_ACK_WINDOW fragments. At most two windows are in
+ * flight, and waiting for acknowledgement is also how flow control is
+ * waited out. When corosync has to reject a fragment (flow control), the
+ * acknowledgement carries CS_ERR_TRY_AGAIN and the whole message is sent
+ * again from the first fragment.
+ */
+static cs_error_t send_fragments_windowed (
+	struct cpg_inst *cpg_inst,
+	cpg_guarantee_t guarantee,
+	size_t msg_len,
+	const struct iovec *iovec,
+	unsigned int iov_len)
+{
+	int i;
+	cs_error_t error = CS_OK;
+	cs_error_t ack_error;
+	struct iovec iov[2];
+	struct req_lib_cpg_partial_mcast req_lib_cpg_mcast;
+	size_t sent = 0;
+	size_t iov_sent = 0;
+	int retry_count;
+	int restart_count = 0;
+	int rejected;
+	unsigned int frag_count;
+	unsigned int acks_pending;
+
+	req_lib_cpg_mcast.header.id = MESSAGE_REQ_CPG_PARTIAL_MCAST_WINDOWED;
+	req_lib_cpg_mcast.guarantee = guarantee;
+	req_lib_cpg_mcast.msglen = msg_len;
+
+	iov[0].iov_base = (void *)&req_lib_cpg_mcast;
+	iov[0].iov_len = sizeof (struct req_lib_cpg_partial_mcast);
+
+	qb_ipcc_fc_enable_max_set(cpg_inst->c,  2);
+
+restart:
+	i=0;
+	iov_sent = 0 ;
+	sent = 0;
+	frag_count = 0;
+	acks_pending = 0;
+	rejected = 0;
+	error = CS_OK;
+
+	while (error == CS_OK && sent < msg_len) {
+
+		retry_count = 0;
+		if ( (iovec[i].iov_len - iov_sent) > cpg_inst->max_msg_size) {
+			iov[1].iov_len = cpg_inst->max_msg_size;
+		}
+		else {
+			iov[1].iov_len = iovec[i].iov_len - iov_sent;
+		}
+
+		if (sent == 0) {
+			req_lib_cpg_mcast.type = LIBCPG_PARTIAL_FIRST;
+		}
+		else if ((sent + iov[1].iov_len) == msg_len) {
+			req_lib_cpg_mcast.type = LIBCPG_PARTIAL_LAST;
+		}
+		else {
+			req_lib_cpg_mcast.type = LIBCPG_PARTIAL_CONTINUED;
+		}
+
+		req_lib_cpg_mcast.fraglen = iov[1].iov_len;
+		req_lib_cpg_mcast.header.size = sizeof (struct req_lib_cpg_partial_mcast) + iov[1].iov_len;
+		iov[1].iov_base = (char *)iovec[i].iov_base + iov_sent;
+
+	resend:
+		error = qb_to_cs_error (qb_ipcc_sendv (cpg_inst->c, iov, 2));
+
+		if (error == CS_ERR_TRY_AGAIN) {
+			if (acks_pending > 0) {
+				/*
+				 * Wait until corosync processes what was already sent
+				 */
+				acks_pending--;
+				error = partial_send_ack_recv (cpg_inst);
+				if (error != CS_OK) {
+					rejected = (error == CS_ERR_TRY_AGAIN);
+					break;
+				}
+				goto resend;
+			}
+			if (++retry_count > MAX_RETRIES) {
+				break;
+			}
+			usleep(10000);
+			goto resend;
+		}
+		if (error != CS_OK) {
+			break;
+		}
+
+		iov_sent += iov[1].iov_len;
+		sent += iov[1].iov_len;
+
+		/* Next iovec */
+		if (iov_sent >= iovec[i].iov_len) {
+			i++;
+			iov_sent = 0;
+		}
+
+		frag_count++;
+		if (frag_count % CPG_PARTIAL_MCAST_ACK_WINDOW == 0 ||
+		    req_lib_cpg_mcast.type == LIBCPG_PARTIAL_LAST) {
+			acks_pending++;
+		}
+
+		if (acks_pending > 1) {
+			acks_pending--;
+			error = partial_send_ack_recv (cpg_inst);
+			rejected = (error == CS_ERR_TRY_AGAIN);
+		}
+	}
+
+	/*
+	 * Collect acknowledgements of fragments already sent, also after error
+	 * so they don't get mixed with replies to following requests
+	 */
+	while (acks_pending > 0) {
+		acks_pending--;
+		ack_error = partial_send_ack_recv (cpg_inst);
+		if (error == CS_OK) {
+			error = ack_error;
+			rejected = (error == CS_ERR_TRY_AGAIN);
+		}
+	}
+
+	if (rejected && ++restart_count <= MAX_RETRIES) {
+		usleep(10000);
+		goto restart;
+	}
+
+	qb_ipcc_fc_enable_max_set(cpg_inst->c,  1);
+
+	return error;
+}
+
+
+/*
+ * Each fragment waits for its reply, used with corosync which doesn't
+ * support windowed send
+ */
+static cs_error_t send_fragments_acked (
 	struct cpg_inst *cpg_inst,
 	cpg_guarantee_t guarantee,
 	size_t msg_len,
@@ -955,13 +1601,15 @@ static cs_error_t send_fragments (
 							 sizeof (res_lib_cpg_partial_send));
 
 		if (error == CS_ERR_TRY_AGAIN) {
-			fprintf(stderr, "sleep. counter=%d\n", retry_count);
 			if (++retry_count > MAX_RETRIES) {
 				goto error_exit;
 			}
 			usleep(10000);
 			goto resend;
 		}
+		if (error != CS_OK) {
+			goto error_exit;
+		}
 
 		iov_sent += iov[1].iov_len;
 		sent += iov[1].iov_len;
@@ -979,6 +1627,66 @@ error_exit:
 	return error;
 }
 
+/*
+ * Ask corosync whether it supports windowed fragmented send. Older corosync
+ * doesn't know the request and replies with a bare error header.
+ */
+static cs_error_t partial_windowed_probe (struct cpg_inst *cpg_inst)
+{
+	struct iovec iov;
+	struct req_lib_cpg_partial_mcast req_lib_cpg_mcast;
+	struct res_lib_cpg_partial_send res_lib_cpg_partial_send;
+	cs_error_t error;
+
+	memset (&req_lib_cpg_mcast, 0, sizeof (req_lib_cpg_mcast));
+	req_lib_cpg_mcast.header.size = sizeof (struct req_lib_cpg_partial_mcast);
+	req_lib_cpg_mcast.header.id = MESSAGE_REQ_CPG_PARTIAL_MCAST_WINDOWED;
+	req_lib_cpg_mcast.type = LIBCPG_PARTIAL_PROBE;
+
+	iov.iov_base = (void *)&req_lib_cpg_mcast;
+	iov.iov_len = sizeof (struct req_lib_cpg_partial_mcast);
+
+	memset (&res_lib_cpg_partial_send, 0, sizeof (res_lib_cpg_partial_send));
+	error = coroipcc_msg_send_reply_receive (cpg_inst->c, &iov, 1,
+						 &res_lib_cpg_partial_send,
+						 sizeof (res_lib_cpg_partial_send));
+	if (error != CS_OK) {
+		return (error);
+	}
+
+	if (res_lib_cpg_partial_send.header.id == MESSAGE_RES_CPG_PARTIAL_SEND &&
+	    res_lib_cpg_partial_send.header.error == CS_OK) {
+		cpg_inst->partial_windowed = 1;
+	} else {
+		cpg_inst->partial_windowed = -1;
+	}
+
+	return (CS_OK);
+}
+
+static cs_error_t send_fragments (
+	struct cpg_inst *cpg_inst,
+	cpg_guarantee_t guarantee,
+	size_t msg_len,
+	const struct iovec *iovec,
+	unsigned int iov_len)
+{
+	cs_error_t error;
+
+	if (cpg_inst->partial_windowed == 0) {
+		error = partial_windowed_probe (cpg_inst);
+		if (error != CS_OK) {
+			return (error);
+		}
+	}
+
+	if (cpg_inst->partial_windowed > 0) {
+		return (send_fragments_windowed (cpg_inst, guarantee, msg_len, iovec, iov_len));
+	}
+
+	return (send_fragments_acked (cpg_inst, guarantee, msg_len, iovec, iov_len));
+}
+
 
 cs_error_t cpg_mcast_joined (
 	cpg_handle_t handle,
@@ -97,9 +97,11 @@ static void cpg_bm_deliver_fn (
 	write_count++;
 }
 
-static cpg_callbacks_t callbacks = {
+static cpg_model_v1_data_t model_data = {
+	.model			= CPG_MODEL_V1,
 	.cpg_deliver_fn 	= cpg_bm_deliver_fn,
-	.cpg_confchg_fn		= cpg_bm_confchg_fn
+	.cpg_confchg_fn		= cpg_bm_confchg_fn,
+	.flags			= 0,
 };
 
 #define ONE_MEG 1048576
@@ -153,22 +155,52 @@ static void* dispatch_thread (void *arg)
 	return NULL;
 }
 
-int main (void) {
+static void usage (const char *cmd)
+{
+	printf ("%s [-s] [-c]\n", cmd);
+	printf ("  -s  small message mode (16 bytes doubling up to 1024 bytes)\n");
+	printf ("  -c  request coalesced delivery (CPG_MODEL_V1_DELIVER_COALESCE)\n");
+}
+
+int main (int argc, char *argv[]) {
 	unsigned int size;
+	unsigned int size_mult;
+	unsigned int size_max;
 	int i;
+	int opt;
 	unsigned int res;
 
+	size = 64;
+	size_mult = 5;
+	size_max = ONE_MEG - 100;
+
+	while ((opt = getopt (argc, argv, "sch")) != -1) {
+		switch (opt) {
+		case 's':
+			size = 16;
+			size_mult = 2;
+			size_max = 1024;
+			break;
+		case 'c':
+			model_data.flags |= CPG_MODEL_V1_DELIVER_COALESCE;
+			break;
+		case 'h':
+		default:
+			usage (argv[0]);
+			exit (1);
+		}
+	}
+
 	qb_log_init("cpgbench", LOG_USER, LOG_EMERG);
 	qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
 	qb_log_filter_ctl(QB_LOG_STDERR, QB_LOG_FILTER_ADD,
 			  QB_LOG_FILTER_FILE, "*", LOG_DEBUG);
 	qb_log_ctl(QB_LOG_STDERR, QB_LOG_CONF_ENABLED, QB_TRUE);
 
-	size = 64;
 	signal (SIGALRM, sigalrm_handler);
-	res = cpg_initialize (&handle, &callbacks);
+	res = cpg_model_initialize (&handle, CPG_MODEL_V1, (cpg_model_data_t *)&model_data, NULL);
 	if (res != CS_OK) {
-		printf ("cpg_initialize failed with result %d\n", res);
+		printf ("cpg_model_initialize failed with result %d\n", res);
 		exit (1);
 	}
 	pthread_create (&thread, NULL, dispatch_thread, NULL);
@@ -182,8 +214,8 @@ int main (void) {
 	for (i = 0; i < 10; i++) { /* number of repetitions - up to 50k */
 		cpg_benchmark (handle, size);
 		signal (SIGALRM, sigalrm_handler);
-		size *= 5;
-		if (size >= (ONE_MEG - 100)) {
+		size *= size_mult;
+		if (size > size_max) {
 			break;
 		}
 	}
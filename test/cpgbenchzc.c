@@ -41,6 +41,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
+#include <getopt.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -97,6 +98,12 @@ static cpg_callbacks_t callbacks = {
 
 void *data;
 
+/*
+ * Send data by regular cpg_mcast_joined, so copy and zero copy paths can
+ * be compared
+ */
+static int copy_mode = 0;
+
 static void cpg_benchmark (
 	cpg_handle_t handle,
 	int write_size)
@@ -118,7 +125,15 @@ static void cpg_benchmark (
 		cpg_flow_control_state_get (handle, &flow_control_state);
 		if (flow_control_state == CPG_FLOW_CONTROL_DISABLED) {
 retry:
-			res = cpg_zcb_mcast_joined (handle, CPG_TYPE_AGREED, data, write_size);
+			if (copy_mode) {
+				struct iovec iov;
+
+				iov.iov_base = data;
+				iov.iov_len = write_size;
+				res = cpg_mcast_joined (handle, CPG_TYPE_AGREED, &iov, 1);
+			} else {
+				res = cpg_zcb_mcast_joined (handle, CPG_TYPE_AGREED, data, write_size);
+			}
 			if (res == CS_ERR_TRY_AGAIN) {
 				goto retry;
 			}
@@ -152,13 +167,32 @@ static struct cpg_name group_name = {
 	.length = 6
 };
 
-int main (void) {
+static void usage (const char *cmd)
+{
+	printf ("%s [-c]\n", cmd);
+	printf ("\n");
+	printf (" -c    send using regular (copying) cpg_mcast_joined\n");
+	printf ("       instead of cpg_zcb_mcast_joined\n");
+}
+
+int main (int argc, char *argv[]) {
 	cpg_handle_t handle;
 	unsigned int size;
 	int i;
 	unsigned int res;
-
-
+	int opt;
+
+	while ((opt = getopt (argc, argv, "ch")) != -1) {
+		switch (opt) {
+		case 'c':
+			copy_mode = 1;
+			break;
+		case 'h':
+		default:
+			usage (argv[0]);
+			exit (opt == 'h' ? 0 : 1);
+		}
+	}
 
 	size = 1000;
 	signal (SIGALRM, sigalrm_handler);
@@ -167,7 +201,7 @@ int main (void) {
 		printf ("cpg_initialize failed with result %d\n", res);
 		exit (1);
 	}
-	cpg_zcb_alloc (handle, 500000, &data);
+	res = cpg_zcb_alloc (handle, 500000, &data);
 	if (res != CS_OK) {
 		printf ("cpg_zcb_alloc couldn't allocate zero copy buffer %d\n", res);
 		exit (1);
@@ -184,6 +218,12 @@ int main (void) {
 		size += 1000;
 	}
 
+	res = cpg_zcb_free (handle, data);
+	if (res != CS_OK) {
+		printf ("cpg_zcb_free failed with result %s\n", cs_strerror(res));
+		exit (1);
+	}
+
 	res = cpg_finalize (handle);
 	if (res != CS_OK) {
 		printf ("cpg_finalize failed with result %s\n", cs_strerror(res));
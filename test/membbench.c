@@ -0,0 +1,457 @@
+/*
+ * Copyright (c) 2026 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * This software licensed under BSD license, the text of which follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * - Neither the name of the MontaVista Software, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived from this
+ *   software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Join storm benchmark for the membership set operations of totemsrp.
+ *
+ * A cluster of nodes re-forms after a partition: every node keeps sending
+ * join messages with its growing proc list and a few failed nodes, and
+ * the local node runs the set operations memb_join_process() does for
+ * each of them (equal, subset, merge, subtract and consensus) until all
+ * nodes agree. The same storm is replayed with the nested loop helpers
+ * totemsrp used before and with the ones from corosync/totem/totemmemb.h,
+ * results of both runs are compared.
+ */
+
+#include <config.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <corosync/totem/totemmemb.h>
+
+/*
+ * Previous set operations
+ */
+static void old_memb_set_subtract (
+        struct srp_addr *out_list, int *out_list_entries,
+        const struct srp_addr *one_list, int one_list_entries,
+        const struct srp_addr *two_list, int two_list_entries)
+{
+	int found;
+	int i, j;
+
+	*out_list_entries = 0;
+	for (i = 0; i < one_list_entries; i++) {
+		found = 0;
+		for (j = 0; j < two_list_entries; j++) {
+			if (srp_addr_equal (&one_list[i], &two_list[j])) {
+				found = 1;
+				break;
+			}
+		}
+		if (found == 0) {
+			out_list[(*out_list_entries)++] = one_list[i];
+		}
+	}
+}
+
+static int old_memb_set_equal (
+	const struct srp_addr *set1, int set1_entries,
+	const struct srp_addr *set2, int set2_entries)
+{
+	int found;
+	int i, j;
+
+	if (set1_entries != set2_entries) {
+		return (0);
+	}
+	for (i = 0; i < set2_entries; i++) {
+		found = 0;
+		for (j = 0; j < set1_entries; j++) {
+			if (srp_addr_equal (&set1[j], &set2[i])) {
+				found = 1;
+				break;
+			}
+		}
+		if (found == 0) {
+			return (0);
+		}
+	}
+	return (1);
+}
+
+static int old_memb_set_subset (
+	const struct srp_addr *subset, int subset_entries,
+	const struct srp_addr *fullset, int fullset_entries)
+{
+	int found;
+	int i, j;
+
+	if (subset_entries > fullset_entries) {
+		return (0);
+	}
+	for (i = 0; i < subset_entries; i++) {
+		found = 0;
+		for (j = 0; j < fullset_entries; j++) {
+			if (srp_addr_equal (&subset[i], &fullset[j])) {
+				found = 1;
+			}
+		}
+		if (found == 0) {
+			return (0);
+		}
+	}
+	return (1);
+}
+
+static void old_memb_set_merge (
+	const struct srp_addr *subset, int subset_entries,
+	struct srp_addr *fullset, int *fullset_entries)
+{
+	int found;
+	int i, j;
+
+	for (i = 0; i < subset_entries; i++) {
+		found = 0;
+		for (j = 0; j < *fullset_entries; j++) {
+			if (srp_addr_equal (&fullset[j], &subset[i])) {
+				found = 1;
+				break;
+			}
+		}
+		if (found == 0) {
+			fullset[(*fullset_entries)++] = subset[i];
+		}
+	}
+}
+
+struct old_consensus {
+	struct srp_addr addr[PROCESSOR_COUNT_MAX];
+	int entries;
+};
+
+struct memb_state {
+	struct srp_addr my_id;
+	struct srp_addr my_proc_list[PROCESSOR_COUNT_MAX];
+	int my_proc_list_entries;
+	struct srp_addr my_failed_list[PROCESSOR_COUNT_MAX];
+	int my_failed_list_entries;
+	struct old_consensus old_consensus;
+	struct memb_nodeid_set consensus_set;
+};
+
+struct memb_join_msg {
+	struct srp_addr system_from;
+	struct srp_addr proc_list[PROCESSOR_COUNT_MAX];
+	int proc_list_entries;
+	struct srp_addr failed_list[PROCESSOR_COUNT_MAX];
+	int failed_list_entries;
+};
+
+static int nodes = PROCESSOR_COUNT_MAX;
+static int failed = 4;
+static int rounds = 20;
+
+static unsigned int node_order[PROCESSOR_COUNT_MAX];
+
+/*
+ * Consensus is agreed when every processor of proc list minus failed
+ * list has sent a join with the same lists as ours
+ */
+static int old_consensus_agreed (struct memb_state *state)
+{
+	struct srp_addr token_memb[PROCESSOR_COUNT_MAX];
+	int token_memb_entries;
+	int i, j, found;
+
+	old_memb_set_subtract (token_memb, &token_memb_entries,
+		state->my_proc_list, state->my_proc_list_entries,
+		state->my_failed_list, state->my_failed_list_entries);
+
+	for (i = 0; i < token_memb_entries; i++) {
+		found = 0;
+		for (j = 0; j < state->old_consensus.entries; j++) {
+			if (srp_addr_equal (&token_memb[i], &state->old_consensus.addr[j])) {
+				found = 1;
+				break;
+			}
+		}
+		if (found == 0) {
+			return (0);
+		}
+	}
+	return (1);
+}
+
+static void old_consensus_set (struct memb_state *state, const struct srp_addr *addr)
+{
+	int i;
+
+	for (i = 0; i < state->old_consensus.entries; i++) {
+		if (srp_addr_equal (addr, &state->old_consensus.addr[i])) {
+			return;
+		}
+	}
+	state->old_consensus.addr[state->old_consensus.entries++] = *addr;
+}
+
+static int new_consensus_agreed (struct memb_state *state)
+{
+	struct srp_addr token_memb[PROCESSOR_COUNT_MAX];
+	int token_memb_entries;
+	int i;
+
+	memb_set_subtract (token_memb, &token_memb_entries,
+		state->my_proc_list, state->my_proc_list_entries,
+		state->my_failed_list, state->my_failed_list_entries);
+
+	for (i = 0; i < token_memb_entries; i++) {
+		if (memb_nodeid_set_find (&state->consensus_set,
+		    token_memb[i].nodeid, NULL) == 0) {
+			return (0);
+		}
+	}
+	return (1);
+}
+
+/*
+ * Set operations of memb_join_process(), returns 1 once consensus is agreed
+ */
+static int old_join_process (struct memb_state *state, const struct memb_join_msg *join)
+{
+	if (old_memb_set_equal (join->proc_list, join->proc_list_entries,
+		state->my_proc_list, state->my_proc_list_entries) &&
+	    old_memb_set_equal (join->failed_list, join->failed_list_entries,
+		state->my_failed_list, state->my_failed_list_entries)) {
+
+		old_consensus_set (state, &join->system_from);
+		return (old_consensus_agreed (state));
+	}
+	if (old_memb_set_subset (join->proc_list, join->proc_list_entries,
+		state->my_proc_list, state->my_proc_list_entries) &&
+	    old_memb_set_subset (join->failed_list, join->failed_list_entries,
+		state->my_failed_list, state->my_failed_list_entries)) {
+		return (0);
+	}
+	if (old_memb_set_subset (&join->system_from, 1,
+		state->my_failed_list, state->my_failed_list_entries)) {
+		return (0);
+	}
+	old_memb_set_merge (join->proc_list, join->proc_list_entries,
+		state->my_proc_list, &state->my_proc_list_entries);
+	old_memb_set_merge (join->failed_list, join->failed_list_entries,
+		state->my_failed_list, &state->my_failed_list_entries);
+	state->old_consensus.entries = 0;
+	old_consensus_set (state, &state->my_id);
+	return (0);
+}
+
+static int new_join_process (struct memb_state *state, const struct memb_join_msg *join)
+{
+	if (memb_set_equal (join->proc_list, join->proc_list_entries,
+		state->my_proc_list, state->my_proc_list_entries) &&
+	    memb_set_equal (join->failed_list, join->failed_list_entries,
+		state->my_failed_list, state->my_failed_list_entries)) {
+
+		memb_nodeid_set_add (&state->consensus_set, join->system_from.nodeid, 0);
+		return (new_consensus_agreed (state));
+	}
+	if (memb_set_subset (join->proc_list, join->proc_list_entries,
+		state->my_proc_list, state->my_proc_list_entries) &&
+	    memb_set_subset (join->failed_list, join->failed_list_entries,
+		state->my_failed_list, state->my_failed_list_entries)) {
+		return (0);
+	}
+	if (memb_set_subset (&join->system_from, 1,
+		state->my_failed_list, state->my_failed_list_entries)) {
+		return (0);
+	}
+	memb_set_merge (join->proc_list, join->proc_list_entries,
+		state->my_proc_list, &state->my_proc_list_entries);
+	memb_set_merge (join->failed_list, join->failed_list_entries,
+		state->my_failed_list, &state->my_failed_list_entries);
+	memb_nodeid_set_clear (&state->consensus_set);
+	memb_nodeid_set_add (&state->consensus_set, state->my_id.nodeid, 0);
+	return (0);
+}
+
+static void shuffle (unsigned int *seed)
+{
+	int i, j;
+	unsigned int tmp;
+
+	for (i = nodes - 1; i > 0; i--) {
+		j = rand_r (seed) % (i + 1);
+		tmp = node_order[i];
+		node_order[i] = node_order[j];
+		node_order[j] = tmp;
+	}
+}
+
+/*
+ * Node at position sender of node_order knows about the first "known"
+ * nodes of node_order in its own order, and sees the last "failed" ones
+ * as failed
+ */
+static void join_build (struct memb_join_msg *join, int sender, int known,
+	unsigned int *seed)
+{
+	int i, j;
+	struct srp_addr tmp;
+
+	join->system_from.nodeid = node_order[sender];
+	join->proc_list_entries = 0;
+	for (i = 0; i < known; i++) {
+		join->proc_list[join->proc_list_entries++].nodeid = node_order[i];
+	}
+	for (i = join->proc_list_entries - 1; i > 0; i--) {
+		j = rand_r (seed) % (i + 1);
+		tmp = join->proc_list[i];
+		join->proc_list[i] = join->proc_list[j];
+		join->proc_list[j] = tmp;
+	}
+	join->failed_list_entries = 0;
+	for (i = nodes - failed; i < nodes && i < known; i++) {
+		join->failed_list[join->failed_list_entries++].nodeid = node_order[i];
+	}
+}
+
+static double storm (int (*join_process) (struct memb_state *, const struct memb_join_msg *),
+	unsigned long long *checksum)
+{
+	static struct memb_state state;
+	static struct memb_join_msg join;
+	struct timespec start, end;
+	unsigned long long joins = 0;
+	unsigned int seed = 1;
+	int r, known, sender, agreed;
+
+	*checksum = 0;
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	for (r = 0; r < rounds; r++) {
+		shuffle (&seed);
+
+		memset (&state, 0, sizeof (state));
+		state.my_id.nodeid = node_order[0];
+		state.my_proc_list[0] = state.my_id;
+		state.my_proc_list_entries = 1;
+		state.old_consensus.addr[0] = state.my_id;
+		state.old_consensus.entries = 1;
+		memb_nodeid_set_add (&state.consensus_set, state.my_id.nodeid, 0);
+
+		/*
+		 * Nodes learn about each other in steps, everybody multicasts
+		 * its join on each step
+		 */
+		agreed = 0;
+		for (known = 2; agreed == 0 && known <= nodes * 2; known *= 2) {
+			if (known > nodes) {
+				known = nodes;
+			}
+			for (sender = 1; sender < nodes && agreed == 0; sender++) {
+				join_build (&join, sender, known, &seed);
+				agreed = join_process (&state, &join);
+				joins++;
+			}
+		}
+		/*
+		 * Everybody has the full lists now, collect consensus
+		 */
+		for (sender = 1; sender < nodes - failed && agreed == 0; sender++) {
+			join_build (&join, sender, nodes, &seed);
+			agreed = join_process (&state, &join);
+			joins++;
+		}
+		*checksum += joins * 1000003 + state.my_proc_list_entries * 131 +
+			state.my_failed_list_entries * 7 + agreed;
+	}
+	clock_gettime (CLOCK_MONOTONIC, &end);
+
+	return (((end.tv_sec - start.tv_sec) * 1000000000.0 +
+		(end.tv_nsec - start.tv_nsec)) / joins);
+}
+
+static void usage (const char *name)
+{
+	printf ("usage: %s [-n nodes] [-f failed] [-r rounds]\n", name);
+	printf ("\n");
+	printf ("  -n    cluster size, up to %d (default %d)\n", PROCESSOR_COUNT_MAX, PROCESSOR_COUNT_MAX);
+	printf ("  -f    failed nodes (default 4)\n");
+	printf ("  -r    number of re-formations (default 20)\n");
+}
+
+int main (int argc, char *argv[])
+{
+	unsigned long long checksum_old, checksum_new;
+	double ns_old, ns_new;
+	int opt;
+	int i;
+
+	while ((opt = getopt (argc, argv, "n:f:r:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			nodes = atoi (optarg);
+			break;
+		case 'f':
+			failed = atoi (optarg);
+			break;
+		case 'r':
+			rounds = atoi (optarg);
+			break;
+		case 'h':
+		default:
+			usage (argv[0]);
+			exit (1);
+		}
+	}
+	if (nodes < 2 || nodes > PROCESSOR_COUNT_MAX ||
+	    failed < 0 || failed >= nodes - 1 || rounds <= 0) {
+		usage (argv[0]);
+		exit (1);
+	}
+
+	for (i = 0; i < nodes; i++) {
+		node_order[i] = i + 1;
+	}
+
+	printf ("%d nodes, %d failed, %d rounds\n", nodes, failed, rounds);
+
+	ns_old = storm (old_join_process, &checksum_old);
+	ns_new = storm (new_join_process, &checksum_new);
+
+	printf ("old    %10.1f ns/join\n", ns_old);
+	printf ("set    %10.1f ns/join\n", ns_new);
+	printf ("speedup %9.2fx\n", ns_old / ns_new);
+
+	if (checksum_old != checksum_new) {
+		printf ("Join processing results differ (%llu != %llu)\n",
+			checksum_old, checksum_new);
+		exit (1);
+	}
+
+	return (0);
+}
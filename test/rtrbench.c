@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2026 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * This software licensed under BSD license, the text of which follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * - Neither the name of the MontaVista Software, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived from this
+ *   software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Replays orf tokens carrying retransmit lists against a sort queue with
+ * lost messages and compares the old retransmit list bookkeeping (memmove
+ * per served entry, linear duplicate scan, strcat formatting) with the
+ * bitmap based one used by totemsrp.
+ */
+
+#include <config.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <corosync/sq.h>
+#include <corosync/totem/totemrtr.h>
+
+#define QUEUE_RTR_ITEMS_SIZE_MAX	16384
+#define MISS_COUNT_CONST		5
+
+static struct sq sort_queue;
+static struct rtr_bitmap rtr_bitmap;
+static struct memb_ring_id my_ring_id;
+static unsigned int my_aru;
+static unsigned int token_seq;
+
+static unsigned int entries_max = 30;
+static unsigned int loss_every = 4;
+
+/*
+ * Pretend every other request can be served from our sort queue
+ */
+static int remcast (unsigned int seq)
+{
+	return ((seq & 1) == 0 ? 0 : -1);
+}
+
+static unsigned int rtr_old (struct rtr_item *rtr_list, unsigned int entries)
+{
+	char retransmit_msg[16384];
+	char value[64];
+	unsigned int i, j;
+	unsigned int found;
+
+	strcpy (retransmit_msg, "Retransmit List: ");
+	for (i = 0; i < entries; i++) {
+		sprintf (value, "%x ", rtr_list[i].seq);
+		strcat (retransmit_msg, value);
+	}
+
+	for (i = 0; i < entries;) {
+		if (remcast (rtr_list[i].seq) == 0) {
+			entries -= 1;
+			memmove (&rtr_list[i], &rtr_list[i + 1],
+				sizeof (struct rtr_item) * (entries - i));
+		} else {
+			i += 1;
+		}
+	}
+
+	for (i = 1; entries < entries_max && i <= token_seq - my_aru; i++) {
+		if (sq_item_inuse (&sort_queue, my_aru + i) ||
+		    sq_item_miss_count (&sort_queue, my_aru + i) < MISS_COUNT_CONST) {
+			continue;
+		}
+		found = 0;
+		for (j = 0; j < entries; j++) {
+			if (my_aru + i == rtr_list[j].seq) {
+				found = 1;
+			}
+		}
+		if (found == 0) {
+			memcpy (&rtr_list[entries].ring_id, &my_ring_id,
+				sizeof (struct memb_ring_id));
+			rtr_list[entries].seq = my_aru + i;
+			entries++;
+		}
+	}
+	return (entries);
+}
+
+static unsigned int rtr_new (struct rtr_item *rtr_list, unsigned int entries)
+{
+	char retransmit_msg[16384];
+	unsigned int i, j;
+
+	rtr_list_format (retransmit_msg, sizeof (retransmit_msg), rtr_list, entries);
+
+	for (i = 0, j = 0; i < entries; i++) {
+		if (remcast (rtr_list[i].seq) == 0) {
+			continue;
+		}
+		if (i != j) {
+			memcpy (&rtr_list[j], &rtr_list[i], sizeof (struct rtr_item));
+		}
+		j++;
+	}
+	entries = j;
+
+	rtr_bitmap_fill (&rtr_bitmap, my_aru, rtr_list, entries);
+	for (i = 1; entries < entries_max && i <= token_seq - my_aru; i++) {
+		i += sq_next_hole (&sort_queue, my_aru + i, token_seq - my_aru - i + 1);
+		if (i > token_seq - my_aru) {
+			break;
+		}
+		if (sq_item_miss_count (&sort_queue, my_aru + i) < MISS_COUNT_CONST) {
+			continue;
+		}
+		if (rtr_bitmap_test (&rtr_bitmap, my_aru + i) == 0) {
+			memcpy (&rtr_list[entries].ring_id, &my_ring_id,
+				sizeof (struct memb_ring_id));
+			rtr_list[entries].seq = my_aru + i;
+			entries++;
+		}
+	}
+	rtr_bitmap_reset (&rtr_bitmap, rtr_list, entries);
+
+	return (entries);
+}
+
+/*
+ * Token arrives with a list requested by other nodes: the seqs near the
+ * end of the window, so the duplicate check has to look through all of it
+ */
+static unsigned int token_fill (struct rtr_item *rtr_list)
+{
+	unsigned int i;
+
+	for (i = 0; i < entries_max / 2; i++) {
+		memcpy (&rtr_list[i].ring_id, &my_ring_id, sizeof (struct memb_ring_id));
+		rtr_list[i].seq = token_seq - i;
+	}
+	return (i);
+}
+
+static void sort_queue_fill (void)
+{
+	unsigned int seq;
+	int item = 0;
+
+	sq_reinit (&sort_queue, 0);
+	for (seq = 1; seq <= token_seq; seq++) {
+		if (seq % loss_every != 0) {
+			sq_item_add (&sort_queue, &item, seq);
+		}
+	}
+}
+
+static double run (const char *name,
+	unsigned int (*rtr_fn) (struct rtr_item *, unsigned int),
+	unsigned int tokens)
+{
+	struct rtr_item *rtr_list;
+	struct timespec start, end;
+	unsigned int entries = 0;
+	unsigned int i;
+	double ns;
+
+	rtr_list = malloc (sizeof (struct rtr_item) * (entries_max + 1));
+	assert (rtr_list != NULL);
+
+	sort_queue_fill ();
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	for (i = 0; i < tokens; i++) {
+		entries = rtr_fn (rtr_list, token_fill (rtr_list));
+	}
+	clock_gettime (CLOCK_MONOTONIC, &end);
+
+	ns = ((end.tv_sec - start.tv_sec) * 1000000000.0 +
+		(end.tv_nsec - start.tv_nsec)) / tokens;
+	printf ("%-8s %10.1f ns/token (%u entries left in list)\n",
+		name, ns, entries);
+
+	free (rtr_list);
+	return (ns);
+}
+
+static void usage (const char *name)
+{
+	printf ("usage: %s [-r range] [-l loss_every] [-e entries_max] [-t tokens]\n", name);
+	printf ("\n");
+	printf ("  -r    token seq - my_aru, up to %d (default 8000)\n", QUEUE_RTR_ITEMS_SIZE_MAX - 1);
+	printf ("  -l    every n-th message of the window is lost (default 4)\n");
+	printf ("  -e    maximum retransmit list entries, up to 1024 (default 30)\n");
+	printf ("  -t    number of tokens to replay (default 10000)\n");
+}
+
+int main (int argc, char *argv[])
+{
+	unsigned int range = 8000;
+	unsigned int tokens = 10000;
+	double ns_old, ns_new;
+	int opt;
+
+	while ((opt = getopt (argc, argv, "r:l:e:t:h")) != -1) {
+		switch (opt) {
+		case 'r':
+			range = atoi (optarg);
+			break;
+		case 'l':
+			loss_every = atoi (optarg);
+			break;
+		case 'e':
+			entries_max = atoi (optarg);
+			break;
+		case 't':
+			tokens = atoi (optarg);
+			break;
+		case 'h':
+		default:
+			usage (argv[0]);
+			exit (1);
+		}
+	}
+	if (range == 0 || range >= QUEUE_RTR_ITEMS_SIZE_MAX ||
+	    loss_every < 2 || entries_max < 2 || entries_max > 1024 || tokens == 0) {
+		usage (argv[0]);
+		exit (1);
+	}
+
+	if (sq_init (&sort_queue, QUEUE_RTR_ITEMS_SIZE_MAX, sizeof (int), 0) != 0 ||
+	    rtr_bitmap_init (&rtr_bitmap, QUEUE_RTR_ITEMS_SIZE_MAX) != 0) {
+		printf ("Can't allocate sort queue\n");
+		exit (1);
+	}
+
+	my_aru = 0;
+	token_seq = range;
+	memset (&my_ring_id, 0, sizeof (my_ring_id));
+
+	printf ("range %u, 1/%u lost, %u list entries, %u tokens\n",
+		range, loss_every, entries_max, tokens);
+
+	ns_old = run ("old", rtr_old, tokens);
+	ns_new = run ("bitmap", rtr_new, tokens);
+	printf ("speedup  %10.2fx\n", ns_old / ns_new);
+
+	rtr_bitmap_free (&rtr_bitmap);
+	sq_free (&sort_queue);
+
+	return (0);
+}
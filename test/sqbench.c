@@ -0,0 +1,423 @@
+/*
+ * Copyright (c) 2026 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * This software licensed under BSD license, the text of which follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * - Neither the name of the MontaVista Software, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived from this
+ *   software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Compares the sort queue in corosync/sq.h with the previous implementation
+ * (parallel items, in use and miss count arrays indexed by modulo, full
+ * memset on reinit) using the access pattern of totemsrp: messages of a
+ * window are added with some of them lost, aru is moved up to the first
+ * hole, delivered messages are fetched and released and the queue is
+ * reinitialized and copied on membership change.
+ *
+ * Both queues are driven with the same operations and their results are
+ * compared, so the benchmark doubles as a consistency check.
+ */
+
+#include <config.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <corosync/sq.h>
+
+#define QUEUE_ITEMS		16384
+
+struct item {
+	void *mcast;
+	void *buffer;
+	unsigned int msg_len;
+};
+
+/*
+ * Previous sort queue implementation
+ */
+struct old_sq {
+	unsigned int head;
+	unsigned int size;
+	void *items;
+	unsigned int *items_inuse;
+	unsigned int *items_miss_count;
+	unsigned int size_per_item;
+	unsigned int head_seqid;
+	unsigned int item_count;
+	unsigned int pos_max;
+};
+
+static int old_sq_init (struct old_sq *sq, int item_count, int size_per_item,
+	int head_seqid)
+{
+	sq->head = 0;
+	sq->size = item_count;
+	sq->size_per_item = size_per_item;
+	sq->head_seqid = head_seqid;
+	sq->item_count = item_count;
+	sq->pos_max = 0;
+
+	sq->items = calloc (item_count, size_per_item);
+	sq->items_inuse = calloc (item_count, sizeof (unsigned int));
+	sq->items_miss_count = calloc (item_count, sizeof (unsigned int));
+	if (sq->items == NULL || sq->items_inuse == NULL ||
+	    sq->items_miss_count == NULL) {
+		return (-ENOMEM);
+	}
+	return (0);
+}
+
+static void old_sq_reinit (struct old_sq *sq, unsigned int head_seqid)
+{
+	sq->head = 0;
+	sq->head_seqid = head_seqid;
+	sq->pos_max = 0;
+
+	memset (sq->items, 0, sq->item_count * sq->size_per_item);
+	memset (sq->items_inuse, 0, sq->item_count * sizeof (unsigned int));
+	memset (sq->items_miss_count, 0, sq->item_count * sizeof (unsigned int));
+}
+
+static void old_sq_copy (struct old_sq *sq_dest, const struct old_sq *sq_src)
+{
+	unsigned int i;
+
+	for (i = sq_src->pos_max + 1; i < sq_src->size; i++) {
+		assert (sq_src->items_inuse[i] == 0);
+	}
+	sq_dest->head = sq_src->head;
+	sq_dest->size = sq_src->item_count;
+	sq_dest->size_per_item = sq_src->size_per_item;
+	sq_dest->head_seqid = sq_src->head_seqid;
+	sq_dest->item_count = sq_src->item_count;
+	sq_dest->pos_max = sq_src->pos_max;
+	memcpy (sq_dest->items, sq_src->items,
+		sq_src->item_count * sq_src->size_per_item);
+	memcpy (sq_dest->items_inuse, sq_src->items_inuse,
+		sq_src->item_count * sizeof (unsigned int));
+	memcpy (sq_dest->items_miss_count, sq_src->items_miss_count,
+		sq_src->item_count * sizeof (unsigned int));
+}
+
+static void old_sq_free (struct old_sq *sq)
+{
+	free (sq->items);
+	free (sq->items_inuse);
+	free (sq->items_miss_count);
+}
+
+static void old_sq_item_add (struct old_sq *sq, void *item, unsigned int seqid)
+{
+	unsigned int sq_position;
+
+	sq_position = (sq->head + seqid - sq->head_seqid) % sq->size;
+	if (sq_position > sq->pos_max) {
+		sq->pos_max = sq_position;
+	}
+	assert (sq->items_inuse[sq_position] == 0);
+	memcpy ((char *)sq->items + sq_position * sq->size_per_item, item,
+		sq->size_per_item);
+	sq->items_inuse[sq_position] = (seqid == 0) ? 1 : seqid;
+	sq->items_miss_count[sq_position] = 0;
+}
+
+static unsigned int old_sq_item_get (const struct old_sq *sq,
+	unsigned int seq_id, void **sq_item_out)
+{
+	unsigned int sq_position;
+
+	sq_position = (sq->head - sq->head_seqid + seq_id) % sq->size;
+	if (sq->items_inuse[sq_position] == 0) {
+		return (ENOENT);
+	}
+	*sq_item_out = (char *)sq->items + sq_position * sq->size_per_item;
+	return (0);
+}
+
+static void old_sq_items_release (struct old_sq *sq, unsigned int seqid)
+{
+	unsigned int oldhead;
+
+	oldhead = sq->head;
+
+	sq->head = (sq->head + seqid - sq->head_seqid + 1) % sq->size;
+	if ((oldhead + seqid - sq->head_seqid + 1) > sq->size) {
+		memset (&sq->items_inuse[oldhead], 0, (sq->size - oldhead) * sizeof (unsigned int));
+		memset (sq->items_inuse, 0, sq->head * sizeof (unsigned int));
+	} else {
+		memset (&sq->items_inuse[oldhead], 0,
+			(seqid - sq->head_seqid + 1) * sizeof (unsigned int));
+		memset (&sq->items_miss_count[oldhead], 0,
+			(seqid - sq->head_seqid + 1) * sizeof (unsigned int));
+	}
+	sq->head_seqid = seqid + 1;
+}
+
+static unsigned int window;
+static unsigned int loss_every = 50;
+static unsigned int rounds = 2000;
+static unsigned int reinit_every = 100;
+
+/*
+ * Messages of a round which are lost at first and received again
+ * (retransmitted) before aru can move past them
+ */
+static int lost (unsigned int seq)
+{
+	return ((seq * 2654435761U) % loss_every == 0);
+}
+
+/*
+ * Returns number of seqs after aru received without a hole
+ */
+static unsigned int old_aru_advance (struct old_sq *sq, unsigned int aru,
+	unsigned int range)
+{
+	unsigned int i;
+	void *ptr;
+
+	for (i = 1; i <= range; i++) {
+		if (old_sq_item_get (sq, aru + i, &ptr) != 0) {
+			break;
+		}
+	}
+	return (i - 1);
+}
+
+static unsigned int new_aru_advance (struct sq *sq, unsigned int aru,
+	unsigned int range)
+{
+	return (sq_next_hole (sq, aru + 1, range));
+}
+
+static double run_old (unsigned long long *checksum)
+{
+	struct old_sq regular, recovery;
+	struct timespec start, end;
+	struct item item, *item_p;
+	unsigned int seq, aru, high, r, i;
+	void *ptr;
+
+	if (old_sq_init (&regular, QUEUE_ITEMS, sizeof (struct item), 0) != 0 ||
+	    old_sq_init (&recovery, QUEUE_ITEMS, sizeof (struct item), 0) != 0) {
+		printf ("Can't allocate sort queue\n");
+		exit (1);
+	}
+
+	*checksum = 0;
+	aru = 0;
+	high = 0;
+	memset (&item, 0, sizeof (item));
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	for (r = 0; r < rounds; r++) {
+		for (seq = high + 1; seq <= high + window; seq++) {
+			if (!lost (seq)) {
+				item.msg_len = seq;
+				old_sq_item_add (&regular, &item, seq);
+			}
+		}
+		high += window;
+
+		aru += old_aru_advance (&regular, aru, high - aru);
+		*checksum += aru;
+
+		for (seq = aru + 1; seq <= high; seq++) {
+			if (lost (seq)) {
+				item.msg_len = seq;
+				old_sq_item_add (&regular, &item, seq);
+			}
+		}
+		aru += old_aru_advance (&regular, aru, high - aru);
+		*checksum += aru;
+
+		for (i = regular.head_seqid; i <= aru; i++) {
+			if (old_sq_item_get (&regular, i, &ptr) == 0) {
+				item_p = ptr;
+				*checksum += item_p->msg_len;
+			}
+		}
+		old_sq_items_release (&regular, aru);
+
+		if (r % reinit_every == reinit_every - 1) {
+			old_sq_reinit (&recovery, aru + 1);
+			old_sq_copy (&regular, &recovery);
+		}
+	}
+	clock_gettime (CLOCK_MONOTONIC, &end);
+
+	old_sq_free (&regular);
+	old_sq_free (&recovery);
+
+	return (((end.tv_sec - start.tv_sec) * 1000000000.0 +
+		(end.tv_nsec - start.tv_nsec)) / rounds);
+}
+
+static double run_new (unsigned long long *checksum)
+{
+	struct sq regular, recovery;
+	struct timespec start, end;
+	struct item item, *item_p;
+	unsigned int seq, aru, high, r, i;
+	void *ptr;
+
+	if (sq_init (&regular, QUEUE_ITEMS, sizeof (struct item), 0) != 0 ||
+	    sq_init (&recovery, QUEUE_ITEMS, sizeof (struct item), 0) != 0) {
+		printf ("Can't allocate sort queue\n");
+		exit (1);
+	}
+
+	*checksum = 0;
+	aru = 0;
+	high = 0;
+	memset (&item, 0, sizeof (item));
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	for (r = 0; r < rounds; r++) {
+		for (seq = high + 1; seq <= high + window; seq++) {
+			if (!lost (seq)) {
+				item.msg_len = seq;
+				sq_item_add (&regular, &item, seq);
+			}
+		}
+		high += window;
+
+		aru += new_aru_advance (&regular, aru, high - aru);
+		*checksum += aru;
+
+		for (seq = aru + 1; seq <= high;) {
+			seq += sq_next_hole (&regular, seq, high - seq + 1);
+			if (seq > high) {
+				break;
+			}
+			item.msg_len = seq;
+			sq_item_add (&regular, &item, seq);
+		}
+		aru += new_aru_advance (&regular, aru, high - aru);
+		*checksum += aru;
+
+		for (i = regular.head_seqid; i <= aru; i++) {
+			if (sq_item_get (&regular, i, &ptr) == 0) {
+				item_p = ptr;
+				*checksum += item_p->msg_len;
+			}
+		}
+		sq_items_release (&regular, aru);
+
+		if (r % reinit_every == reinit_every - 1) {
+			sq_reinit (&recovery, aru + 1);
+			sq_copy (&regular, &recovery);
+		}
+	}
+	clock_gettime (CLOCK_MONOTONIC, &end);
+
+	sq_free (&regular);
+	sq_free (&recovery);
+
+	return (((end.tv_sec - start.tv_sec) * 1000000000.0 +
+		(end.tv_nsec - start.tv_nsec)) / rounds);
+}
+
+static void usage (const char *name)
+{
+	printf ("usage: %s [-w window] [-l loss_every] [-r rounds] [-m reinit_every]\n", name);
+	printf ("\n");
+	printf ("  -w    messages added per round, up to %d (default runs 50, 500 and 5000)\n", QUEUE_ITEMS / 2);
+	printf ("  -l    about every n-th message is received late (default 50)\n");
+	printf ("  -r    number of rounds (default 2000)\n");
+	printf ("  -m    membership change every n rounds (default 100)\n");
+}
+
+static void bench (void)
+{
+	unsigned long long checksum_old, checksum_new;
+	double ns_old, ns_new;
+
+	ns_old = run_old (&checksum_old);
+	ns_new = run_new (&checksum_new);
+
+	printf ("window %5u: old %10.1f ns/round, new %10.1f ns/round, speedup %5.2fx\n",
+		window, ns_old, ns_new, ns_old / ns_new);
+
+	if (checksum_old != checksum_new) {
+		printf ("Sort queue results differ (%llu != %llu)\n",
+			checksum_old, checksum_new);
+		exit (1);
+	}
+}
+
+int main (int argc, char *argv[])
+{
+	unsigned int windows[] = { 50, 500, 5000 };
+	int all_windows = 1;
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt (argc, argv, "w:l:r:m:h")) != -1) {
+		switch (opt) {
+		case 'w':
+			window = atoi (optarg);
+			all_windows = 0;
+			break;
+		case 'l':
+			loss_every = atoi (optarg);
+			break;
+		case 'r':
+			rounds = atoi (optarg);
+			break;
+		case 'm':
+			reinit_every = atoi (optarg);
+			break;
+		case 'h':
+		default:
+			usage (argv[0]);
+			exit (1);
+		}
+	}
+	if ((!all_windows && (window == 0 || window > QUEUE_ITEMS / 2)) ||
+	    loss_every < 2 || rounds == 0 || reinit_every == 0) {
+		usage (argv[0]);
+		exit (1);
+	}
+
+	if (!all_windows) {
+		bench ();
+		return (0);
+	}
+
+	for (i = 0; i < sizeof (windows) / sizeof (windows[0]); i++) {
+		window = windows[i];
+		bench ();
+	}
+
+	return (0);
+}
@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2026 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * This software licensed under BSD license, the text of which follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * - Neither the name of the MontaVista Software, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived from this
+ *   software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Send large (fragmented) messages while a second process keeps the totem
+ * send queue full with small ones, so corosync has to reject fragments in
+ * the middle of a stream. Every large message must be delivered back
+ * complete and in order.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <corosync/corotypes.h>
+#include <corosync/cpg.h>
+
+#define LARGE_MSG_MAGIC		0x4c524745
+#define SMALL_MSG_SIZE		1024
+#define LARGE_MSG_SIZE_MAX	(4 * 1024 * 1024)
+
+struct large_msg {
+	uint32_t magic;
+	uint32_t pid;
+	uint32_t seq;
+	uint32_t size;
+	uint32_t checksum;
+	unsigned char buffer[];
+};
+
+static struct cpg_name group_name = {
+	.value = "stress_cpgpartial",
+	.length = 17
+};
+
+static uint32_t my_pid;
+static uint32_t next_seq;
+static int errors;
+
+static uint32_t checksum_get (const unsigned char *buf, size_t len)
+{
+	uint32_t a = 1, b = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		a = (a + buf[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+
+	return ((b << 16) | a);
+}
+
+static void cpg_deliver_fn (
+	cpg_handle_t handle,
+	const struct cpg_name *group,
+	uint32_t nodeid,
+	uint32_t pid,
+	void *m,
+	size_t msg_len)
+{
+	const struct large_msg *msg = m;
+
+	if (msg_len < sizeof (struct large_msg) || msg->magic != LARGE_MSG_MAGIC ||
+	    msg->pid != my_pid) {
+		return;
+	}
+
+	if (msg_len != sizeof (struct large_msg) + msg->size) {
+		printf ("message %u: length %zu, expected %zu\n", msg->seq, msg_len,
+			sizeof (struct large_msg) + msg->size);
+		errors++;
+	} else if (checksum_get (msg->buffer, msg->size) != msg->checksum) {
+		printf ("message %u: checksum mismatch\n", msg->seq);
+		errors++;
+	}
+	if (msg->seq != next_seq) {
+		printf ("message %u: expected %u\n", msg->seq, next_seq);
+		errors++;
+	}
+	next_seq = msg->seq + 1;
+}
+
+static void cpg_confchg_fn (
+	cpg_handle_t handle,
+	const struct cpg_name *group,
+	const struct cpg_address *member_list, size_t member_list_entries,
+	const struct cpg_address *left_list, size_t left_list_entries,
+	const struct cpg_address *joined_list, size_t joined_list_entries)
+{
+}
+
+static cpg_callbacks_t callbacks = {
+	cpg_deliver_fn,
+	cpg_confchg_fn
+};
+
+/*
+ * Runs in child process until killed
+ */
+static void flood (void)
+{
+	cpg_handle_t handle;
+	unsigned char buffer[SMALL_MSG_SIZE];
+	struct iovec iov;
+	cs_error_t res;
+
+	if (cpg_initialize (&handle, &callbacks) != CS_OK ||
+	    cpg_join (handle, &group_name) != CS_OK) {
+		printf ("flooder can't join group\n");
+		exit (1);
+	}
+
+	memset (buffer, 0, sizeof (buffer));
+	iov.iov_base = buffer;
+	iov.iov_len = sizeof (buffer);
+
+	for (;;) {
+		res = cpg_mcast_joined (handle, CPG_TYPE_AGREED, &iov, 1);
+		if (res != CS_OK && res != CS_ERR_TRY_AGAIN) {
+			printf ("flooder cpg_mcast_joined failed %d\n", res);
+			exit (1);
+		}
+		cpg_dispatch (handle, CS_DISPATCH_ALL);
+	}
+}
+
+int main (int argc, char *argv[])
+{
+	cpg_handle_t handle;
+	struct large_msg *msg;
+	struct iovec iov;
+	cs_error_t res;
+	pid_t flooder;
+	int iterations = 100;
+	int try_agains = 0;
+	int status;
+	int opt;
+	uint32_t i, j;
+
+	while ((opt = getopt (argc, argv, "i:")) != -1) {
+		switch (opt) {
+		case 'i':
+			iterations = atoi (optarg);
+			break;
+		default:
+			printf ("usage: %s [-i iterations]\n", argv[0]);
+			exit (1);
+		}
+	}
+
+	msg = malloc (sizeof (struct large_msg) + LARGE_MSG_SIZE_MAX);
+	if (msg == NULL) {
+		printf ("FAIL can't allocate message\n");
+		exit (1);
+	}
+
+	flooder = fork ();
+	if (flooder == -1) {
+		printf ("FAIL can't fork\n");
+		exit (1);
+	}
+	if (flooder == 0) {
+		flood ();
+	}
+
+	my_pid = getpid ();
+	res = cpg_initialize (&handle, &callbacks);
+	if (res == CS_OK) {
+		res = cpg_join (handle, &group_name);
+	}
+	if (res != CS_OK) {
+		printf ("FAIL %d\n", res);
+		kill (flooder, SIGTERM);
+		exit (1);
+	}
+
+	printf ("stress cpgpartial sending %d large messages\n", iterations);
+
+	for (i = 0; i < iterations && errors == 0; i++) {
+		// coverity[DC.WEAK_CRYPTO:SUPPRESS] random is not used in a security context
+		msg->size = LARGE_MSG_SIZE_MAX / 2 + random () % (LARGE_MSG_SIZE_MAX / 2);
+		for (j = 0; j < msg->size; j++) {
+			msg->buffer[j] = (unsigned char)(i + j);
+		}
+		msg->magic = LARGE_MSG_MAGIC;
+		msg->pid = my_pid;
+		msg->seq = i;
+		msg->checksum = checksum_get (msg->buffer, msg->size);
+
+		iov.iov_base = msg;
+		iov.iov_len = sizeof (struct large_msg) + msg->size;
+
+		while ((res = cpg_mcast_joined (handle, CPG_TYPE_AGREED, &iov, 1)) == CS_ERR_TRY_AGAIN) {
+			try_agains++;
+			cpg_dispatch (handle, CS_DISPATCH_ALL);
+		}
+		if (res != CS_OK) {
+			printf ("message %u: cpg_mcast_joined failed %d\n", i, res);
+			errors++;
+		}
+		cpg_dispatch (handle, CS_DISPATCH_ALL);
+	}
+
+	/*
+	 * Wait for the rest of own messages
+	 */
+	for (j = 0; j < 1000 && next_seq < i && errors == 0; j++) {
+		cpg_dispatch (handle, CS_DISPATCH_ALL);
+		usleep (10000);
+	}
+	if (next_seq != i) {
+		printf ("delivered %u of %u messages\n", next_seq, i);
+		errors++;
+	}
+
+	kill (flooder, SIGTERM);
+	waitpid (flooder, &status, 0);
+	cpg_finalize (handle);
+
+	printf ("%d cpg_mcast_joined calls returned CS_ERR_TRY_AGAIN\n", try_agains);
+	if (errors) {
+		printf ("FAIL\n");
+		exit (1);
+	}
+	printf ("PASS\n");
+	exit (0);
+}
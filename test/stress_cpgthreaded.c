@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2026 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * This software licensed under BSD license, the text of which follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * - Neither the name of the MontaVista Software, Inc. nor the names of its
+ *   contributors may be used to endorse or promote products derived from this
+ *   software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Exercise corosync running with system.delivery_thread: yes. Several
+ * senders multicast checksummed messages while another process keeps
+ * joining and leaving the group, so deliveries, configuration changes and
+ * token callbacks all go through the delivery thread at once. Messages are
+ * delivered from frames shared with the sort queue, so every message must
+ * arrive intact and in order of its sender.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <corosync/corotypes.h>
+#include <corosync/cpg.h>
+#include <corosync/cmap.h>
+
+#define MSG_MAGIC		0x54485244
+#define MSG_SIZE_MAX		(64 * 1024)
+#define SENDERS			4
+#define SENDER_PIDS_MAX		64
+
+struct thr_msg {
+	uint32_t magic;
+	uint32_t pid;
+	uint32_t seq;
+	uint32_t size;
+	uint32_t checksum;
+	unsigned char buffer[];
+};
+
+struct sender_state {
+	uint32_t pid;
+	uint32_t next_seq;
+};
+
+static struct cpg_name group_name = {
+	.value = "stress_cpgthreaded",
+	.length = 18
+};
+
+static struct sender_state senders[SENDER_PIDS_MAX];
+static uint32_t my_pid;
+static uint32_t my_delivered;
+static int errors;
+
+static uint32_t checksum_get (const unsigned char *buf, size_t len)
+{
+	uint32_t a = 1, b = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		a = (a + buf[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+
+	return ((b << 16) | a);
+}
+
+static struct sender_state *sender_get (uint32_t pid)
+{
+	int i;
+
+	for (i = 0; i < SENDER_PIDS_MAX; i++) {
+		if (senders[i].pid == pid) {
+			return (&senders[i]);
+		}
+		if (senders[i].pid == 0) {
+			senders[i].pid = pid;
+			return (&senders[i]);
+		}
+	}
+
+	return (NULL);
+}
+
+static void cpg_deliver_fn (
+	cpg_handle_t handle,
+	const struct cpg_name *group,
+	uint32_t nodeid,
+	uint32_t pid,
+	void *m,
+	size_t msg_len)
+{
+	const struct thr_msg *msg = m;
+	struct sender_state *sender;
+
+	if (msg_len < sizeof (struct thr_msg) || msg->magic != MSG_MAGIC) {
+		return;
+	}
+
+	if (msg_len != sizeof (struct thr_msg) + msg->size) {
+		printf ("message %u of %u: length %zu, expected %zu\n", msg->seq, msg->pid,
+			msg_len, sizeof (struct thr_msg) + msg->size);
+		errors++;
+		return;
+	}
+	if (checksum_get (msg->buffer, msg->size) != msg->checksum) {
+		printf ("message %u of %u: checksum mismatch\n", msg->seq, msg->pid);
+		errors++;
+	}
+
+	sender = sender_get (msg->pid);
+	if (sender == NULL) {
+		return;
+	}
+	if (msg->seq != sender->next_seq) {
+		printf ("message %u of %u: expected %u\n", msg->seq, msg->pid,
+			sender->next_seq);
+		errors++;
+	}
+	sender->next_seq = msg->seq + 1;
+
+	if (msg->pid == my_pid) {
+		my_delivered++;
+	}
+}
+
+static void cpg_confchg_fn (
+	cpg_handle_t handle,
+	const struct cpg_name *group,
+	const struct cpg_address *member_list, size_t member_list_entries,
+	const struct cpg_address *left_list, size_t left_list_entries,
+	const struct cpg_address *joined_list, size_t joined_list_entries)
+{
+}
+
+static cpg_callbacks_t callbacks = {
+	cpg_deliver_fn,
+	cpg_confchg_fn
+};
+
+static int delivery_thread_is_enabled (void)
+{
+	cmap_handle_t cmap_handle;
+	char *str = NULL;
+	int enabled = 0;
+
+	if (cmap_initialize (&cmap_handle) != CS_OK) {
+		return (-1);
+	}
+	if (cmap_get_string (cmap_handle, "system.delivery_thread", &str) == CS_OK) {
+		enabled = (strcmp (str, "yes") == 0);
+		free (str);
+	}
+	cmap_finalize (cmap_handle);
+
+	return (enabled);
+}
+
+/*
+ * Runs in child process until killed
+ */
+static void churn (void)
+{
+	cpg_handle_t handle;
+
+	for (;;) {
+		if (cpg_initialize (&handle, &callbacks) != CS_OK) {
+			usleep (10000);
+			continue;
+		}
+		if (cpg_join (handle, &group_name) == CS_OK) {
+			cpg_dispatch (handle, CS_DISPATCH_ALL);
+			usleep (1000);
+			cpg_leave (handle, &group_name);
+		}
+		cpg_finalize (handle);
+	}
+}
+
+static int send_messages (int iterations)
+{
+	cpg_handle_t handle;
+	struct thr_msg *msg;
+	struct iovec iov;
+	cs_error_t res;
+	uint32_t i, j;
+
+	msg = malloc (sizeof (struct thr_msg) + MSG_SIZE_MAX);
+	if (msg == NULL) {
+		printf ("can't allocate message\n");
+		return (1);
+	}
+
+	my_pid = getpid ();
+	// coverity[DC.WEAK_CRYPTO:SUPPRESS] random is not used in a security context
+	srandom (my_pid);
+
+	res = cpg_initialize (&handle, &callbacks);
+	if (res == CS_OK) {
+		res = cpg_join (handle, &group_name);
+	}
+	if (res != CS_OK) {
+		printf ("%u: can't join group %d\n", my_pid, res);
+		free (msg);
+		return (1);
+	}
+
+	for (i = 0; i < iterations && errors == 0; i++) {
+		// coverity[DC.WEAK_CRYPTO:SUPPRESS] random is not used in a security context
+		msg->size = random () % MSG_SIZE_MAX;
+		for (j = 0; j < msg->size; j++) {
+			msg->buffer[j] = (unsigned char)(my_pid + i + j);
+		}
+		msg->magic = MSG_MAGIC;
+		msg->pid = my_pid;
+		msg->seq = i;
+		msg->checksum = checksum_get (msg->buffer, msg->size);
+
+		iov.iov_base = msg;
+		iov.iov_len = sizeof (struct thr_msg) + msg->size;
+
+		while ((res = cpg_mcast_joined (handle, CPG_TYPE_AGREED, &iov, 1)) == CS_ERR_TRY_AGAIN) {
+			cpg_dispatch (handle, CS_DISPATCH_ALL);
+		}
+		if (res != CS_OK) {
+			printf ("%u: message %u: cpg_mcast_joined failed %d\n", my_pid, i, res);
+			errors++;
+		}
+		cpg_dispatch (handle, CS_DISPATCH_ALL);
+	}
+
+	/*
+	 * Wait for the rest of own messages
+	 */
+	for (j = 0; j < 1000 && my_delivered < i && errors == 0; j++) {
+		cpg_dispatch (handle, CS_DISPATCH_ALL);
+		usleep (10000);
+	}
+	if (my_delivered != i) {
+		printf ("%u: delivered %u of %u messages\n", my_pid, my_delivered, i);
+		errors++;
+	}
+
+	cpg_finalize (handle);
+	free (msg);
+
+	return (errors ? 1 : 0);
+}
+
+int main (int argc, char *argv[])
+{
+	pid_t churner;
+	pid_t sender_pids[SENDERS];
+	int iterations = 1000;
+	int failed = 0;
+	int status;
+	int opt;
+	int i;
+
+	while ((opt = getopt (argc, argv, "i:")) != -1) {
+		switch (opt) {
+		case 'i':
+			iterations = atoi (optarg);
+			break;
+		default:
+			printf ("usage: %s [-i iterations]\n", argv[0]);
+			exit (1);
+		}
+	}
+
+	switch (delivery_thread_is_enabled ()) {
+	case -1:
+		printf ("FAIL can't connect to corosync\n");
+		exit (1);
+	case 0:
+		printf ("SKIP corosync is not running with system.delivery_thread: yes\n");
+		exit (77);
+	}
+
+	churner = fork ();
+	if (churner == -1) {
+		printf ("FAIL can't fork\n");
+		exit (1);
+	}
+	if (churner == 0) {
+		churn ();
+	}
+
+	printf ("stress cpgthreaded: %d senders sending %d messages each\n",
+		SENDERS, iterations);
+
+	for (i = 0; i < SENDERS; i++) {
+		sender_pids[i] = fork ();
+		if (sender_pids[i] == -1) {
+			printf ("FAIL can't fork\n");
+			failed = 1;
+			break;
+		}
+		if (sender_pids[i] == 0) {
+			exit (send_messages (iterations));
+		}
+	}
+
+	while (--i >= 0) {
+		if (waitpid (sender_pids[i], &status, 0) == -1 ||
+		    !WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+			failed = 1;
+		}
+	}
+
+	kill (churner, SIGTERM);
+	waitpid (churner, &status, 0);
+
+	if (failed) {
+		printf ("FAIL\n");
+		exit (1);
+	}
+	printf ("PASS\n");
+	exit (0);
+}
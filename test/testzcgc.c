@@ -154,10 +154,14 @@ static cpg_callbacks_t callbacks = {
 
 static struct cpg_name group_name;
 
+/*
+ * Allocates many zero copy buffers and frees only half of them. Rest must be
+ * released by corosync (and library) when connection goes away.
+ */
 int main (int argc, char *argv[]) {
 	cpg_handle_t handle;
 	int result;
-	void *buffer;
+	void *buffer[100];
 	unsigned int i;
 
 	strcpy(group_name.value, "GROUP");
@@ -169,7 +173,24 @@ int main (int argc, char *argv[]) {
 		exit (1);
 	}
 	for (i = 0; i < 100; i++) {
-		cpg_zcb_alloc (handle, 1024*1024, &buffer);
+		result = cpg_zcb_alloc (handle, 1024*1024, &buffer[i]);
+		if (result != CS_OK) {
+			printf ("cpg_zcb_alloc failed with result %d\n", result);
+			exit (1);
+		}
+		memset (buffer[i], i, 1024*1024);
+	}
+	for (i = 0; i < 100; i += 2) {
+		result = cpg_zcb_free (handle, buffer[i]);
+		if (result != CS_OK) {
+			printf ("cpg_zcb_free failed with result %d\n", result);
+			exit (1);
+		}
+	}
+	result = cpg_finalize (handle);
+	if (result != CS_OK) {
+		printf ("cpg_finalize failed with result %d\n", result);
+		exit (1);
 	}
 	return (0);
 }
@@ -48,6 +48,8 @@
 
 #define MAX_TRY_AGAIN 10
 
+#define PRINT_ITER_BATCH_ITEMS 64
+
 enum user_action {
 	ACTION_GET,
 	ACTION_SET,
@@ -420,9 +422,9 @@ static void print_key(cmap_handle_t handle,
 static int print_iter(cmap_handle_t handle, const char *prefix)
 {
 	cmap_iter_handle_t iter_handle;
-	char key_name[CMAP_KEYNAME_MAXLEN + 1];
-	size_t value_len;
-	cmap_value_types_t type;
+	struct cmap_batch_item items[PRINT_ITER_BATCH_ITEMS];
+	size_t items_len;
+	size_t i;
 	cs_error_t err;
 	int no_result = 1;
 
@@ -432,9 +434,17 @@ static int print_iter(cmap_handle_t handle, const char *prefix)
 		exit (EXIT_FAILURE);
 	}
 
-	while ((err = cmap_iter_next(handle, iter_handle, key_name, &value_len, &type)) == CS_OK) {
-		no_result = 0;
-		print_key(handle, key_name, value_len, NULL, type);
+	/*
+	 * Values too big for batch are returned as NULL and print_key gets them
+	 */
+	items_len = PRINT_ITER_BATCH_ITEMS;
+	while ((err = cmap_iter_next_batch(handle, iter_handle, items, &items_len)) == CS_OK) {
+		for (i = 0; i < items_len; i++) {
+			no_result = 0;
+			print_key(handle, items[i].key_name, items[i].value_len, items[i].value,
+			    items[i].type);
+		}
+		items_len = PRINT_ITER_BATCH_ITEMS;
 	}
 
 	cmap_iter_finalize(handle, iter_handle);